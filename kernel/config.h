@@ -7,3 +7,7 @@
 
 // CONFIG_DEBUG_MM: Enable particularly expensive MM-related bugchecks.
 //#define CONFIG_DEBUG_MM
+
+// CONFIG_LOCKSTAT: Record how often each spinlock acquisition site waits, and
+// how long it spins and then holds the lock for, in /dev/lockstat.
+//#define CONFIG_LOCKSTAT
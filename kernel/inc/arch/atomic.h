@@ -4,12 +4,26 @@
 #include "common/types.h"
 
 static inline void set_bit(volatile uint32_t *addr, uint32_t nr) {
-     asm volatile("lock; bts %1,%0" : "+m" (*(volatile long *) (addr)) : "Ir" (nr) : "memory");
+     asm volatile("lock; btsl %1,%0" : "+m" (*(volatile long *) (addr)) : "Ir" (nr) : "memory");
+}
+
+static inline void clear_bit(volatile uint32_t *addr, uint32_t nr) {
+     asm volatile("lock; btrl %1,%0" : "+m" (*(volatile long *) (addr)) : "Ir" (nr) : "memory");
+}
+
+//Returns the old value of the bit.
+static inline bool test_and_set_bit(volatile uint32_t *addr, uint32_t nr) {
+    int bit;
+    asm volatile("lock; btsl %2,%1\n\t"
+                 "sbb %0,%0"   :
+                 "=r" (bit), "+m" (*(volatile long *) (addr)) :
+                 "Ir" (nr) : "memory");
+    return bit;
 }
 
 static inline bool test_bit(volatile uint32_t *addr, uint32_t nr) {
     int bit;
-    asm volatile("bt %2,%1\n\t"
+    asm volatile("btl %2,%1\n\t"
                  "sbb %0,%0"   :
                  "=r" (bit) :
                   "m" (*(unsigned long *)addr), "Ir" (nr));
@@ -5,10 +5,28 @@ typedef struct cpu_state cpu_state_t;
 typedef struct cpu_launchpad cpu_launchpad_t;
 
 typedef struct arch_thread_data arch_thread_data_t;
+typedef struct fpu_state fpu_state_t;
 
 #include "common/types.h"
 #include "common/compiler.h"
 
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c,
+        uint32_t *d) {
+    asm volatile("cpuid" : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+        : "a" (leaf));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+    return (((uint64_t) hi) << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    asm volatile("wrmsr" :: "c" (msr), "a" ((uint32_t) val),
+        "d" ((uint32_t) (val >> 32)));
+}
+
 static inline void * get_sp() {
     void *esp;
     asm("mov %%esp, %0" : "=r" (esp));
@@ -53,6 +71,12 @@ typedef struct arch_thread_data {
 
     phys_addr_t cr3;
     void *dir;
+
+    //FPU/SSE save area, allocated the first time the thread uses the FPU.
+    fpu_state_t *fpu;
+    //The thread's FPU state is loaded in the FPU of the processor it is
+    //running on, and so fpu is stale.
+    bool fpu_live;
 } arch_thread_data_t;
 
 void flush_segment_registers();
@@ -0,0 +1,23 @@
+#ifndef KERNEL_ARCH_FPU_H
+#define KERNEL_ARCH_FPU_H
+
+#include "common/types.h"
+#include "sched/task.h"
+
+//Big enough for both FXSAVE and FNSAVE.
+#define FPU_STATE_LEN   512
+#define FPU_STATE_ALIGN 16
+
+struct fpu_state {
+    uint8_t raw[FPU_STATE_LEN + FPU_STATE_ALIGN - 1];
+};
+
+void fpu_init_proc();
+
+void fpu_switch(thread_t *old, thread_t *next);
+void fpu_handle_unavailable();
+
+void fpu_fork(thread_t *child, thread_t *parent);
+void fpu_destroy(thread_t *t);
+
+#endif
@@ -11,12 +11,15 @@
 #define CPL_KRNL (0x0 << 5)
 #define CPL_USER (0x3 << 5)
 
+//SYSENTER/SYSEXIT require the kernel code, kernel data, user code and user data
+//selectors to be consecutive, in that order. The assembly sources hardcode
+//these values.
 #define SEL_KRNL_CODE 0x08
 #define SEL_KRNL_DATA 0x10
-#define SEL_KRNL_PCPU 0x18
-#define SEL_USER_CODE 0x20
-#define SEL_USER_DATA 0x28
-#define SEL_USER_TLS  0x30
+#define SEL_USER_CODE 0x18
+#define SEL_USER_DATA 0x20
+#define SEL_USER_TLS  0x28
+#define SEL_KRNL_PCPU 0x30
 #define SEL_TSS       0x38
 
 #define SEL_MAX       SEL_TSS
@@ -53,6 +56,8 @@ typedef struct tss {
    uint16_t iomap_base;
 } PACKED tss_t;
 
+DECLARE_PER_CPU(tss_t, tss);
+
 void tss_set_stack(void *sp);
 
 void gdt_init(processor_t *proc);
@@ -8,6 +8,14 @@
 #define MMUFLAG_WRITABLE    (1 << 1)
 #define MMUFLAG_USER        (1 << 2)
 
+//The last user page, mapped read-only into every address space.
+#define VDSO_ADDR (VIRTUAL_BASE - PAGE_SIZE)
+
+//Every address space shares the page table holding the vdso page, so the
+//whole of the 4MiB it covers is off limits to user mappings. Userspace may only
+//map pages below this.
+#define USER_MAP_END (VDSO_ADDR & ~((NUM_ENTRIES * PAGE_SIZE) - 1))
+
 #include "common/types.h"
 
 typedef struct pdir_ent pdir_entry_t;
@@ -159,10 +167,16 @@ static inline void loadcr3(uint32_t phys) {
 
 #define resolve_virt(t, p) ({dir_lookup_addr(t->arch.dir, p);})
 
+//Whether userspace may map pages over [start, start + len).
+static inline bool user_map_range_valid(uint32_t start, uint32_t len) {
+    return start < USER_MAP_END && len <= USER_MAP_END - start;
+}
+
 #include "sched/task.h"
 
 void build_page_dir(pdir_t *dir);
 void copy_mem(thread_t *to, thread_t *from);
+void map_vdso_page(void *page);
 
 void * map_page(phys_addr_t phys);
 void * map_pages(phys_addr_t phys, uint32_t pages);
@@ -23,6 +23,7 @@ void * arch_replace_mem(thread_t *t, void *newdir);
 void arch_free_mem(void *dir);
 
 void arch_thread_build(thread_t *t);
+void arch_thread_destroy(thread_t *t);
 void arch_ret_from_fork(void *arg);
 void * arch_prepare_fork(cpu_state_t *state);
 
@@ -15,22 +15,53 @@ typedef struct ticket_pair {
     ticket_t tail;
 } PACKED ticket_pair_t;
 
+//A plain ticket lock. Every waiter spins on head, and so every unlock pulls
+//its cache line away from all of them. Kept for comparison with qspinlock_t.
+typedef union ticketlock {
+    ticket_pair_t tickets;
+    uint32_t raw;
+} ticketlock_t;
+
+//A queued (MCS) lock. The first waiter spins on locked, and every other waiter
+//queues up behind it, spinning on a flag in its own per-processor node. The
+//tail of the queue is identified by processor number plus one, so that the
+//whole lock still fits in a DWORD.
+typedef union qspinlock {
+    struct {
+        uint8_t locked;
+        uint8_t pad;
+        uint16_t tail;
+    } PACKED;
+    uint32_t raw;
+} qspinlock_t;
+
 typedef struct spinlock_arch  {
-    union {
-        ticket_pair_t tickets;
-        uint32_t raw;
-    };
+    qspinlock_t q;
     uint32_t holder;
+#ifdef CONFIG_LOCKSTAT
+    //where, and when (in TSC cycles), the holder took the lock
+    uint32_t site;
+    uint64_t acquired;
+#endif
 } PACKED spinlock_arch_t;
 
-#define SPINLOCK_ARCH_LOCKED   {.tickets.head = 0, .tickets.tail = 1, .holder = 0xFFFF}
-#define SPINLOCK_ARCH_UNLOCKED {.tickets.head = 0, .tickets.tail = 0, .holder = 0xFFFF}
+#define SPINLOCK_ARCH_LOCKED   {.q.locked = 1, .holder = 0xFFFF}
+#define SPINLOCK_ARCH_UNLOCKED {.q.locked = 0, .holder = 0xFFFF}
+
+#ifdef CONFIG_LOCKSTAT
+//The address of the code taking a lock, by which the lock statistics are kept.
+//It is taken in the macros below rather than in _spin_lock(), so that a lock
+//taken through some non-inlined wrapper is still attributed to its caller.
+#define SPIN_SITE ({ __label__ __here; __here: (uint32_t) &&__here; })
+#else
+#define SPIN_SITE 0
+#endif
 
 #define spin_lock(x) \
     {                                \
         check_irqs_disabled();       \
         barrier();                   \
-        _spin_lock(x);               \
+        _spin_lock(x, SPIN_SITE);    \
         barrier();                   \
     }
 
@@ -38,7 +69,7 @@ typedef struct spinlock_arch  {
     ({                               \
         check_irqs_disabled();       \
         barrier();                   \
-        bool ret = _spin_trylock(x); \
+        bool ret = _spin_trylock(x, SPIN_SITE); \
         barrier();                   \
         ret;                         \
     })
@@ -51,8 +82,19 @@ typedef struct spinlock_arch  {
         _spin_unlock(x);       \
     }
 
-void _spin_lock(volatile spinlock_t *lock);
+void _spin_lock(volatile spinlock_t *lock, uint32_t site);
 void _spin_unlock(volatile spinlock_t *lock);
-bool _spin_trylock(volatile spinlock_t *lock);
+bool _spin_trylock(volatile spinlock_t *lock, uint32_t site);
+
+//The raw locks, without any of the debugging checks or the lock tracking of
+//spin_lock(). Interrupts must still be disabled. The *_lock() functions return
+//true if they had to wait.
+bool ticket_spin_lock(volatile ticketlock_t *lock);
+void ticket_spin_unlock(volatile ticketlock_t *lock);
+bool ticket_spin_trylock(volatile ticketlock_t *lock);
+
+bool queued_spin_lock(volatile qspinlock_t *lock);
+void queued_spin_unlock(volatile qspinlock_t *lock);
+bool queued_spin_trylock(volatile qspinlock_t *lock);
 
 #endif
@@ -21,4 +21,6 @@ typedef uint64_t (*syscall_t)(void* state, uint32_t ecx, uint32_t edx, uint32_t
 
 #define SYSCALL_ENTRY(num, name) [num] = (syscall_t) (void *) SYSCALL(name)
 
+void sysenter_init_proc(processor_t *proc);
+
 #endif
@@ -47,6 +47,16 @@
 
 #define ACCESS_ONCE(x) (*((volatile typeof(x) *) &(x)))
 
+//Publishes v through p to lockless (RCU) readers, who pick it up with
+//rcu_dereference(). x86 never reorders stores with other stores, or loads with
+//the dependent loads which follow them, so only the compiler needs restraining.
+#define rcu_assign_pointer(p, v)                 \
+    do {                                         \
+        asm volatile("" ::: "memory");           \
+        ACCESS_ONCE(p) = (v);                    \
+    } while(0)
+#define rcu_dereference(p) ACCESS_ONCE(p)
+
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 #define likely(x)   (__builtin_constant_p(x) ? !!(x) : __builtin_expect(!!(x), 1))
@@ -24,6 +24,12 @@ static inline void hashtable_init_size(chain_head_t *hashtable, uint32_t size) {
 #define hashtable_rm(node)                                                      \
     chain_rm(node)
 
+#define hashtable_add_rcu(key, node, hashtable)                                 \
+    chain_add_head_rcu(node, &hashtable[hash(key, HASHTABLE_BITS(hashtable))])
+
+#define hashtable_rm_rcu(node)                                                  \
+    chain_rm_rcu(node)
+
 #define HASHTABLE_INIT(bits)                                                    \
     { [0 ... ((1 << ((bits) - 1)) - 1)] = CHAIN_HEAD }
 
@@ -39,4 +45,7 @@ static inline void hashtable_init_size(chain_head_t *hashtable, uint32_t size) {
 #define HASHTABLE_FOR_EACH_COLLISION(key, pos, hashtable, member)               \
     CHAIN_FOR_EACH_ENTRY(pos, &((hashtable)[hash(key, HASHTABLE_BITS(hashtable))]), member)
 
+#define HASHTABLE_FOR_EACH_COLLISION_RCU(key, pos, hashtable, member)           \
+    CHAIN_FOR_EACH_ENTRY_RCU(pos, &((hashtable)[hash(key, HASHTABLE_BITS(hashtable))]), member)
+
 #endif
@@ -92,6 +92,38 @@ static inline void list_rotate_left(list_head_t *head) {
         !list_is_last(pos, head, member);              \
         pos = list_next_unsafe(pos, head, member))
 
+//RCU variants (see sync/rcu.h), for lists which are walked by readers holding
+//no lock. Writers must still be serialised against each other, and an entry
+//may only be freed or reused a grace period after it was removed. Only the
+//forward links are safe for readers to follow.
+
+static inline void list_add_rcu(list_head_t *new, list_head_t *old) {
+    list_head_t *next = old->next;
+    new->next = next;
+    new->prev = old;
+    rcu_assign_pointer(old->next, new);
+    next->prev = new;
+}
+
+static inline void list_add_before_rcu(list_head_t *new, list_head_t *old) {
+    list_head_t *prev = old->prev;
+    new->next = old;
+    new->prev = prev;
+    rcu_assign_pointer(prev->next, new);
+    old->prev = new;
+}
+
+//Leaves entry->next intact, for any reader still standing on entry.
+static inline void list_rm_rcu(list_head_t *entry) {
+    entry->next->prev = entry->prev;
+    ACCESS_ONCE(entry->prev->next) = entry->next;
+}
+
+#define LIST_FOR_EACH_ENTRY_RCU(pos, head, member)                              \
+    for (pos = list_entry(rcu_dereference((head)->next), typeof(*pos), member); \
+        !list_is_last(pos, head, member);                                       \
+        pos = list_entry(rcu_dereference((pos)->member.next), typeof(*pos), member))
+
 typedef struct chain_node chain_node_t;
 
 struct chain_node {
@@ -183,4 +215,31 @@ static inline void chain_move_list(chain_head_t *old, chain_head_t *new) {
          pos;                                                                \
          pos = chain_entry_safe((pos)->member.next, typeof(*(pos)), member))
 
+//RCU variants, with the same rules as the list ones above.
+
+static inline void chain_add_head_rcu(chain_node_t *n, chain_head_t *h) {
+    chain_node_t *first = h->first;
+    n->next = first;
+    n->pprev = &h->first;
+    rcu_assign_pointer(h->first, n);
+    if(first) {
+        first->pprev = &n->next;
+    }
+}
+
+//Leaves n->next intact, for any reader still standing on n.
+static inline void chain_rm_rcu(chain_node_t *n) {
+    chain_node_t *next = n->next;
+    ACCESS_ONCE(*(n->pprev)) = next;
+    if(next) {
+        next->pprev = n->pprev;
+    }
+    n->pprev = NULL;
+}
+
+#define CHAIN_FOR_EACH_ENTRY_RCU(pos, head, member)                                         \
+    for (pos = chain_entry_safe(rcu_dereference((head)->first), typeof(*(pos)), member);   \
+         pos;                                                                               \
+         pos = chain_entry_safe(rcu_dereference((pos)->member.next), typeof(*(pos)), member))
+
 #endif
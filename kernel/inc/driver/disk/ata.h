@@ -12,6 +12,9 @@
 #define ATA_CMD_DMA_READ_EXT    0x25
 #define ATA_CMD_DMA_WRITE       0xCA
 #define ATA_CMD_DMA_WRITE_EXT   0x35
+#define ATA_CMD_FPDMA_READ      0x60
+#define ATA_CMD_FPDMA_WRITE     0x61
+#define ATA_CMD_READ_LOG_EXT    0x2F
 #define ATA_CMD_CACHE_FLUSH     0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT 0xEA
 #define ATA_CMD_PACKET          0xA0
@@ -35,7 +38,18 @@
 #define ATA_IDENT_FEATURES      98
 #define ATA_IDENT_FIELDVALID    106
 #define ATA_IDENT_MAX_LBA       120
+#define ATA_IDENT_QUEUE_DEPTH   150
+#define ATA_IDENT_SATA_CAPS     152
 #define ATA_IDENT_COMMANDSETS   164
 #define ATA_IDENT_MAX_LBA_EXT   200
 
+//bit of the ATA_IDENT_SATA_CAPS word
+#define ATA_SATA_CAP_NCQ        (1 << 8)
+
+//the NCQ Command Error log, read with ATA_CMD_READ_LOG_EXT
+#define ATA_LOG_NCQ_ERROR       0x10
+//bits of its first byte
+#define ATA_NCQ_LOG_TAG_MASK    0x1F
+#define ATA_NCQ_LOG_NQ          (1 << 7)
+
 #endif
@@ -0,0 +1,110 @@
+#ifndef KERNEL_FS_BIO_H
+#define KERNEL_FS_BIO_H
+
+typedef struct bio_vec bio_vec_t;
+typedef struct bio bio_t;
+typedef struct request request_t;
+typedef struct request_queue request_queue_t;
+
+#include "common/types.h"
+#include "common/list.h"
+#include "common/math.h"
+#include "mm/mm.h"
+#include "fs/block.h"
+
+#define BIO_READ  0
+#define BIO_WRITE 1
+
+//A piece of memory taking part in a transfer. It never crosses a page boundary,
+//so it is always physically contiguous.
+struct bio_vec {
+    page_t *page;
+    uint32_t offset;
+    uint32_t len;
+};
+
+//An asynchronous transfer of whole blocks between a block device and a list
+//of pieces of memory. The bio is handed to end_io() once it is done, possibly
+//in interrupt context, with error set to 0 or a negative errno.
+struct bio {
+    block_device_t *device;
+    size_t block;
+    uint8_t dir;
+
+    //in bytes, always a multiple of the block size once submitted
+    uint32_t size;
+
+    uint32_t num_vecs;
+    uint32_t max_vecs;
+    bio_vec_t *vecs;
+
+    int32_t error;
+    void (*end_io)(bio_t *bio);
+    void *private;
+
+    //the next bio of the request this one has been merged into
+    bio_t *next;
+};
+
+//A contiguous run of blocks on the underlying device, made of one or more
+//bios which the queue has merged together. This is what drivers are given.
+struct request {
+    block_device_t *device;
+    //absolute, and in blocks
+    size_t block;
+    size_t count;
+    uint8_t dir;
+
+    bio_t *first;
+    bio_t *last;
+    //the total number of bio_vec_ts
+    uint32_t segments;
+
+    //for the driver
+    void *private;
+
+    //everything below is for the queue
+    uint64_t deadline;
+    list_head_t sorted;
+    list_head_t fifo;
+};
+
+//Iterates over every bio_vec_t of every bio making up the request.
+#define REQUEST_FOR_EACH_VEC(req, b, v)                             \
+    for(b = (req)->first; b; b = b->next)                           \
+        for(v = b->vecs; v < b->vecs + b->num_vecs; v++)
+
+//Returns a bio with room for max_vecs pieces of memory.
+bio_t * bio_alloc(block_device_t *device, size_t block, uint8_t dir,
+    uint32_t max_vecs);
+void bio_free(bio_t *bio);
+
+//The most pieces which a buffer of len bytes could be split into.
+static inline uint32_t bio_max_vecs(uint32_t len) {
+    return DIV_UP(len, PAGE_SIZE) + 1;
+}
+
+//These return false if the bio has no room left.
+bool bio_add_page(bio_t *bio, page_t *page, uint32_t offset, uint32_t len);
+bool bio_add_buff(bio_t *bio, void *buff, uint32_t len);
+
+//Queues the bio on its device. The bio (and the memory it points to) must not
+//be touched again until end_io() has been called.
+void bio_submit(bio_t *bio);
+//Submits the bio and sleeps until it completes, returning bio->error. Any
+//end_io() is replaced.
+int32_t bio_submit_wait(bio_t *bio);
+
+//While a device is plugged, bios submitted to it are only queued, so that a
+//batch of them can be sorted and merged before any of them are dispatched.
+void block_plug(block_device_t *device);
+void block_unplug(block_device_t *device);
+
+//Called by drivers which implement block_device_ops_t.submit() once they are
+//done with a request. May be called in interrupt context, and may hand the
+//driver its next request before returning.
+void request_complete(request_t *req, int32_t error);
+
+request_queue_t * request_queue_create(block_device_t *device);
+
+#endif
@@ -3,6 +3,8 @@
 
 typedef struct block_device block_device_t;
 typedef struct block_device_ops block_device_ops_t;
+typedef struct request request_t;
+typedef struct request_queue request_queue_t;
 
 #include "common/types.h"
 #include "sync/spinlock.h"
@@ -11,19 +13,53 @@ typedef struct block_device_ops block_device_ops_t;
 struct block_device {
     void *private;
 
+    //in blocks
     size_t size;
     size_t block_size;
     block_device_ops_t *ops;
 
+    //If this is a partition, the device it lies on and where it starts there.
+    //Partitions are cached as part of their parent, so that the same block is
+    //never cached twice.
+    block_device_t *parent;
+    size_t start;
+
+    //Set up by register_block_device(), and unused by partitions, whose bios
+    //are queued on the device they lie on.
+    request_queue_t *queue;
+    //how many requests the driver can have outstanding at once (0 means 1)
+    uint32_t queue_depth;
+    //the most pieces of memory a request may be made of (0 means no limit)
+    uint32_t max_segments;
+
     spinlock_t lock;
 };
 
+//These go straight to the device. Everyone other than the request queue
+//should use bios (see fs/bio.h), or block_read() and block_write() instead.
+//
+//If submit() is implemented the queue uses it instead, and the driver must
+//call request_complete() once the request is done, while read() and write()
+//may be left unimplemented. The queue calls submit() from request_complete()
+//to hand over the next request, so it must be safe to call in interrupt
+//context, and request_complete() must not be called with any lock held which
+//submit() takes. Otherwise the queue performs requests one at a time with
+//read() and write().
 struct block_device_ops {
     ssize_t (*read)(block_device_t *device, void *buff, size_t block, size_t count);
     ssize_t (*write)(block_device_t *device, void *buff, size_t block, size_t count);
+    void (*submit)(block_device_t *device, request_t *req);
 };
 
 block_device_t * block_device_alloc();
 void register_block_device(block_device_t *device, char *name);
 
+//Read and write whole blocks through the buffer cache, returning the number of
+//blocks transferred, or -1 if there was an error before the first.
+ssize_t block_read(block_device_t *device, void *buff, size_t block, size_t count);
+ssize_t block_write(block_device_t *device, const void *buff, size_t block, size_t count);
+//Writes back the dirty blocks of the device (all of its parent, if it is a
+//partition), or of every device if NULL.
+int32_t block_sync(block_device_t *device);
+
 #endif
@@ -0,0 +1,45 @@
+#ifndef KERNEL_FS_BUFFER_H
+#define KERNEL_FS_BUFFER_H
+
+typedef struct buffer buffer_t;
+
+#include "common/types.h"
+#include "common/list.h"
+#include "common/hashtable.h"
+#include "sync/mutex.h"
+#include "fs/block.h"
+
+//bits of buffer->flags
+#define BUFFER_UPTODATE 0
+#define BUFFER_DIRTY    1
+
+//A cached copy of a single block of a block device. See fs/buffer.c.
+struct buffer {
+    block_device_t *device;
+    size_t block;
+    volatile uint32_t flags;
+
+    //held while the data is being accessed
+    mutex_t lock;
+    void *data;
+
+    //protected by buffer_lock
+    uint32_t refs;
+    hashtable_node_t node;
+    //empty unless the buffer is unused
+    list_head_t lru;
+    //empty unless the buffer is waiting to be written back
+    list_head_t dirty;
+};
+
+//Returns a reference to the buffer for block, reading it in if it is not
+//cached, or NULL if the read failed. The buffer must be released with
+//buffer_put().
+buffer_t * buffer_read(block_device_t *device, size_t block);
+void buffer_put(buffer_t *buffer);
+
+//Schedules the buffer to be written back. Must be invoked with buffer->lock
+//held, after modifying the data.
+void buffer_mark_dirty(buffer_t *buffer);
+
+#endif
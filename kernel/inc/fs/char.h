@@ -7,6 +7,7 @@ typedef struct char_device_ops char_device_ops_t;
 #include "common/types.h"
 #include "sync/spinlock.h"
 #include "fs/vfs.h"
+#include "fs/poll.h"
 
 struct char_device_ops {
     ssize_t (*read)(char_device_t *device, char *buff, size_t len);
@@ -20,6 +21,9 @@ struct char_device {
     char_device_ops_t *ops;
 
     spinlock_t lock;
+
+    //devices whose readiness can change notify this (see fs/poll.h)
+    poll_head_t poll_head;
 };
 
 char_device_t * char_device_alloc();
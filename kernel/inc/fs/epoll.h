@@ -0,0 +1,18 @@
+#ifndef KERNEL_FS_EPOLL_H
+#define KERNEL_FS_EPOLL_H
+
+#include "common/types.h"
+#include "fs/vfs.h"
+#include "user/epoll.h"
+
+file_t * epoll_create();
+int32_t epoll_ctl(file_t *ep_file, int op, file_t *file, struct epoll_event *event);
+//timeout is in milliseconds, and if negative we wait indefinitely.
+int32_t epoll_wait(file_t *ep_file, struct epoll_event *events,
+    int32_t maxevents, int32_t timeout);
+
+//Removes file from every epoll instance which is watching it. Invoked when the
+//file loses its last ref.
+void epoll_release(file_t *file);
+
+#endif
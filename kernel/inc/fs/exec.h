@@ -6,6 +6,7 @@
 uint32_t strtab_len(char *const tab[]);
 char ** copy_strtab(char *const raw[]);
 
+//Consumes the caller's reference to path.
 bool execute_path(path_t *path, char **argv, char **envp);
 
 #endif
@@ -9,6 +9,8 @@
 file_t * gfdt_obtain();
 
 void gfdt_get(file_t *gfd);
+//Returns false if gfd has already lost its last ref.
+bool gfdt_tryget(file_t *gfd);
 void gfdt_put(file_t *gfd);
 
 #endif
@@ -0,0 +1,47 @@
+#ifndef KERNEL_FS_POLL_H
+#define KERNEL_FS_POLL_H
+
+typedef struct poll_head poll_head_t;
+typedef struct poll_entry poll_entry_t;
+
+#include "common/types.h"
+#include "common/list.h"
+#include "sync/spinlock.h"
+
+//Anything whose poll() result can change by itself (a socket, a tty, ...) owns
+//a poll_head_t, and calls poll_notify() on it whenever that may have happened.
+//Those interested in the changes hook a poll_entry_t onto the head, and its
+//callback is then invoked under the head's lock, possibly from interrupt
+//context, so it must not sleep.
+
+typedef void (*poll_callback_t)(poll_entry_t *entry);
+
+struct poll_entry {
+    list_head_t list;
+
+    poll_head_t *head;
+    poll_callback_t callback;
+};
+
+struct poll_head {
+    spinlock_t lock;
+    list_head_t entries;
+};
+
+#define POLL_HEAD_INIT(name) {              \
+    .lock = SPINLOCK_UNLOCKED,              \
+    .entries = LIST_HEAD((name).entries),   \
+}
+
+static inline void poll_head_init(poll_head_t *head) {
+    spinlock_init(&head->lock);
+    list_init(&head->entries);
+}
+
+void poll_add(poll_head_t *head, poll_entry_t *entry, poll_callback_t callback);
+//Once this returns the callback is not running, and will not be invoked again.
+void poll_rm(poll_entry_t *entry);
+
+void poll_notify(poll_head_t *head);
+
+#endif
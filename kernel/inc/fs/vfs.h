@@ -12,6 +12,13 @@
 #define INODE_FLAG_DIRECTORY  (1 << 0)
 #define INODE_FLAG_MOUNTPOINT (1 << 1)
 
+//bits of dentry->flags
+#define DENTRY_UNHASHED   0
+#define DENTRY_REFERENCED 1
+
+//the refs of a dentry which has been reclaimed
+#define DENTRY_DEAD (-1)
+
 #define MNT_ROOT(mnt) ((path_t) {.mount = mnt, .dentry = mnt->fs->root})
 
 #define SEEK_SET 0	/* set file offset to offset */
@@ -101,7 +108,11 @@ extern mount_t *root_mount;
 #include "common/types.h"
 #include "common/list.h"
 #include "common/hashtable.h"
+#include "sync/atomic.h"
+#include "sync/mutex.h"
+#include "sync/rcu.h"
 #include "fs/fd.h"
+#include "fs/poll.h"
 #include "fs/block.h"
 
 #define DENTRY_HASH_BITS 5
@@ -143,10 +154,15 @@ struct file {
     path_t path;
     file_ops_t *ops;
 
-    uint32_t refs;
+    atomic_t refs;
+    //freed under RCU, see gfdt_tryget()
+    rcu_head_t rcu;
 
     uint32_t offset;
     void *private;
+
+    //the epoll instances watching this file, see fs/epoll.c
+    list_head_t epitems;
 };
 
 #define ENTRY_TYPE_FILE 0
@@ -168,6 +184,9 @@ struct file_ops {
 
     uint32_t (*iterate)(file_t *file, dir_entry_dat_t *buff, uint32_t num);
     int32_t (*poll)(file_t *file, fpoll_data_t *fp);
+    //Returns the poll_head_t which is notified whenever the result of poll()
+    //may have changed. Files whose readiness never changes need not have one.
+    poll_head_t * (*poll_head)(file_t *file);
 };
 
 struct inode {
@@ -192,6 +211,10 @@ struct inode {
     int32_t blkshift;
     int32_t blocks;
 
+    //serialises creation of children for directories, and (for filesystems
+    //which use it) access to file data
+    mutex_t lock;
+
     void *private;
 };
 
@@ -204,13 +227,20 @@ struct inode_ops {
 
     int32_t (*create)(inode_t *inode, dentry_t *d, uint32_t mode);
     void (*getattr)(dentry_t *dentry, stat_t *stat);
+    //Optional, frees the private data of an inode which is being discarded.
+    void (*release)(inode_t *inode);
 };
 
+//A dentry with no inode is negative, and records that its parent has no such
+//child. See fs/vfs.c for how dentries are cached and reclaimed.
 struct dentry {
     fs_t *fs;
     const char *name;
     uint32_t flags;
 
+    //DENTRY_DEAD once the dentry has been reclaimed
+    atomic_t refs;
+
     inode_t *inode;
 
     dentry_t *parent;
@@ -221,6 +251,10 @@ struct dentry {
 
     hashtable_node_t node;
     list_head_t list;
+
+    //empty unless the dentry is on the LRU of unused dentries
+    list_head_t lru;
+    rcu_head_t rcu;
 };
 
 struct stat {
@@ -249,10 +283,35 @@ struct fpoll_data {
 
 dentry_t * dentry_alloc(const char *name);
 inode_t * inode_alloc(fs_t *fs, inode_ops_t *ops);
+void inode_free(inode_t *inode);
 file_t * file_alloc(file_ops_t *ops);
 
+//Takes a reference to a dentry. The caller must already hold one, or
+//otherwise know that the dentry cannot be reclaimed (e.g. it holds one of its
+//children).
+static inline dentry_t * dget(dentry_t *dentry) {
+    atomic_inc(&dentry->refs);
+    return dentry;
+}
+
+void dput(dentry_t *dentry);
+
+static inline void path_get(const path_t *path) {
+    dget(path->dentry);
+}
+
+static inline void path_put(const path_t *path) {
+    dput(path->dentry);
+}
+
+//Makes child a permanent child of parent, consuming the reference returned by
+//dentry_alloc(). This is how filesystems which live in the dcache (like ramfs
+//and devfs) add their contents.
 void dentry_activate(dentry_t *child, dentry_t *parent);
 
+//Reclaims up to nr unused dentries, returning how many were reclaimed.
+uint32_t dcache_shrink(uint32_t nr);
+
 void register_fs_type(fs_type_t *fs_type);
 
 mount_t * vfs_mount(const char *raw_type, const char *device, path_t *mountpoint);
@@ -267,7 +326,8 @@ bool vfs_umount(path_t *mountpoint);
 
 //Semantics: the path pointer is filled on success, or identification of
 //file which we were asked to create (in which case we return -EEXIST) only.
-//Incidentally, this is different to POSIX's O_CREAT.
+//Incidentally, this is different to POSIX's O_CREAT. As for vfs_lookup(), a
+//filled path must be path_put().
 int32_t vfs_create(const path_t *start, const char *pathname, uint32_t mode, path_t *path);
 
 uint32_t simple_file_iterate(file_t *file, dir_entry_dat_t *buff, uint32_t num);
@@ -280,7 +340,9 @@ dentry_t * fs_create_single(fs_type_t *type, void (*fill)(fs_t *fs));
 void vfs_getattr(dentry_t *dentry, stat_t *stat);
 void generic_getattr(inode_t *inode, stat_t *stat);
 
+//On success, out holds a reference which the caller must path_put().
 int32_t vfs_lookup(const path_t *start, const char *path, path_t *out);
+//The file takes its own reference to path.
 file_t * vfs_open_file(path_t *path);
 int32_t vfs_close_file(file_t *file);
 
@@ -289,5 +351,6 @@ ssize_t vfs_read(file_t *file, void *buff, size_t bytes);
 ssize_t vfs_write(file_t *file, const void *buff, size_t bytes);
 uint32_t vfs_iterate(file_t *file, dir_entry_dat_t *buff, uint32_t num);
 int32_t vfs_poll(file_t *file, fpoll_data_t *fp);
+poll_head_t * vfs_poll_head(file_t *file);
 
 #endif
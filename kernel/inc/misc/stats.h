@@ -2,10 +2,12 @@
 #define KERNEL_MISC_STATS_H
 
 #include "common/types.h"
+#include "sync/atomic.h"
 
 extern uint32_t thread_count;
-extern uint32_t gfdt_entries_in_use;
+extern atomic_t gfdt_entries_in_use;
 extern uint32_t pages_in_use;
 extern uint32_t pages_avaliable;
+extern uint32_t dentries_unused;
 
 #endif
@@ -15,6 +15,8 @@ typedef struct cache cache_t;
 cache_t * cache_create(uint32_t size);
 void * cache_alloc(cache_t *cache);
 void cache_free(cache_t *cache, void *mem);
+//Returns the pages of every cache which have nothing allocated from them.
+void cache_reap();
 
 void * kalloc_cache_alloc(uint32_t size);
 void kalloc_cache_free(void *mem);
@@ -0,0 +1,23 @@
+#ifndef KERNEL_MM_RECLAIM_H
+#define KERNEL_MM_RECLAIM_H
+
+#include "common/types.h"
+#include "common/list.h"
+
+//A shrinker frees objects which are only being cached, and so can be rebuilt
+//on demand. Shrinkers are run in process context whenever free memory runs
+//low.
+typedef struct shrinker {
+    //Frees up to nr objects, returning how many were freed.
+    uint32_t (*shrink)(uint32_t nr);
+
+    list_head_t list;
+} shrinker_t;
+
+void register_shrinker(shrinker_t *shrinker);
+
+//Invoked by the page allocator when free memory runs low. Safe to call from
+//any context.
+void reclaim_wakeup();
+
+#endif
@@ -6,6 +6,8 @@
 #include "common/types.h"
 #include "common/list.h"
 #include "common/hashtable.h"
+#include "fs/poll.h"
+#include "sync/rcu.h"
 
 #define SOMAXCONN 128
 
@@ -87,6 +89,13 @@ struct sock {
 
     list_head_t list;
     hashtable_node_t node;
+
+    //notified by the protocol whenever the sock may have become ready
+    poll_head_t poll_head;
+
+    //protocols look socks up under RCU, so the sock and its private data are
+    //only freed once a grace period has elapsed, see sock_free()
+    rcu_head_t rcu;
 };
 
 #include "common/types.h"
@@ -105,6 +114,8 @@ struct sock_protocol {
     bool (*shutdown)(sock_t *, int);
     uint32_t (*send)(sock_t *, void *buff, uint32_t len, uint32_t flags);
     uint32_t (*recv)(sock_t *, void *buff, uint32_t len, uint32_t flags);
+    //optional, protocols without it are never readable
+    void (*poll)(sock_t *, fpoll_data_t *fp);
 
     /*
     void (*bind)(sock_t *, sock_addr_t *);
@@ -119,7 +130,6 @@ struct sock_protocol {
     void (*write)(sock_t *);
 
     void (*select)(sock_t *);
-    void (*poll)(sock_t *);
     */
 };
 
@@ -2,6 +2,7 @@
 #define KERNEL_SCHED_PROC_H
 
 typedef struct processor processor_t;
+typedef uint32_t cpu_mask_t;
 
 #include "common/types.h"
 #include "common/list.h"
@@ -11,6 +12,13 @@ typedef struct processor processor_t;
 
 #define BSP_ID 0
 
+#define MAX_NUM_PROCS (sizeof(cpu_mask_t) * 8)
+
+#define CPU_MASK_NONE ((cpu_mask_t) 0)
+#define CPU_MASK_ALL  ((cpu_mask_t) -1)
+
+#define cpu_mask_of(num) (((cpu_mask_t) 1) << (num))
+
 struct processor {
     uint32_t num;
 
@@ -21,6 +29,7 @@ struct processor {
 };
 
 extern processor_t *bsp;
+extern volatile cpu_mask_t procs_online;
 
 DECLARE_PER_CPU(processor_t *, this_proc);
 
@@ -28,5 +37,6 @@ void send_management_interrupt(processor_t *dest);
 void dispatch_management_interrupts();
 
 processor_t * register_proc(uint32_t num);
+processor_t * proc_get(uint32_t num);
 
 #endif
@@ -17,9 +17,11 @@ void task_send_signal(task_node_t *t, uint32_t sig);
 void thread_schedule(thread_t *task);
 void thread_sleep_prepare();
 void thread_wake(thread_t *task);
+void thread_poke(thread_t *t);
 void thread_send_signal(thread_t *t, uint32_t sig);
 
 void sched_switch();
+void sched_pin_current(uint32_t num);
 void sched_try_resched(bool is_user);
 
 #define wait_for_condition(C)                                            \
@@ -0,0 +1,49 @@
+#ifndef KERNEL_SCHED_SOFTIRQ_H
+#define KERNEL_SCHED_SOFTIRQ_H
+
+#include "common/types.h"
+
+//Softirqs are run with interrupts enabled on the way out of an interrupt (or
+//by ksoftirqd if they keep being raised), on the processor which raised them.
+//Softirq handlers must not sleep, and the current thread will not be switched
+//away from while they run.
+#define SOFTIRQ_TASKLET 0
+#define SOFTIRQ_RCU     1
+
+#define NUM_SOFTIRQS    8
+
+//tasklet is queued to run
+#define TASKLET_SCHEDULED 0
+//tasklet is running on some processor
+#define TASKLET_RUNNING   1
+
+typedef struct tasklet tasklet_t;
+
+//A tasklet never runs concurrently with itself, and if scheduled again while
+//running it will be run once more after it finishes.
+struct tasklet {
+    tasklet_t *next;
+    volatile uint32_t state;
+
+    void (*func)(void *arg);
+    void *arg;
+};
+
+#define TASKLET_INIT(f, a) { .next = NULL, .state = 0, .func = (f), .arg = (a) }
+
+static inline void tasklet_init(tasklet_t *t, void (*func)(void *arg), void *arg) {
+    *t = (tasklet_t) TASKLET_INIT(func, arg);
+}
+
+void tasklet_schedule(tasklet_t *t);
+
+void register_softirq(uint32_t nr, void (*handler)());
+void raise_softirq(uint32_t nr);
+
+bool in_softirq();
+void do_softirq();
+
+void softirq_proc_init();
+void ksoftirqd_init();
+
+#endif
@@ -4,6 +4,8 @@
 #include "arch/syscall.h"
 #include "user/signal.h"
 #include "user/time.h"
+#include "user/uring.h"
+#include "user/epoll.h"
 
 #include "shared/syscall_decls.h"
 
@@ -1,7 +1,6 @@
 #ifndef KERNEL_SCHED_TASK_H
 #define KERNEL_SCHED_TASK_H
 
-#define UFDT_PAGES          1
 #define UFD_LIST_PAGES      1
 #define KERNEL_STACK_PAGES  16
 
@@ -24,6 +23,8 @@
 #define THREAD_FLAG_FORKED (1 << 1)
 //thread is waiting in a semaphore
 #define THREAD_FLAG_INSEM  (1 << 2)
+//thread was the last in its task node to exit, and so zombifies it when reaped
+#define THREAD_FLAG_LAST   (1 << 3)
 
 typedef struct task_node task_node_t;
 typedef struct thread thread_t;
@@ -38,22 +39,44 @@ typedef struct pgroup pgroup_t;
 #include "sched/proc.h"
 #include "sync/atomic.h"
 #include "sync/semaphore.h"
+#include "sync/rcu.h"
 #include "fs/fd.h"
 #include "fs/vfs.h"
 #include "user/signal.h"
 
 typedef uint32_t ufd_idx_t;
 
+#define UFD_INVALID ((ufd_idx_t) -1)
+
+//closed by a successful exec
+#define UFD_FLAG_CLOEXEC (1 << 0)
+
 typedef struct ufd {
     uint32_t flags;
     file_t *gfd;
 } ufd_t;
 
+//The fds of a ufd_context_t. Lookups read the table without any lock, so when
+//it needs to grow a bigger copy is swapped in and the old one freed under RCU.
+typedef struct ufd_table {
+    rcu_head_t rcu;
+
+    uint32_t size;
+    ufd_t *fds;
+    //a bit set for each fd which is open
+    uint32_t *open_bits;
+    //a bit set for each word of open_bits which is full
+    uint32_t *full_bits;
+} ufd_table_t;
+
 typedef struct ufd_context {
-    spinlock_t lock;
-    uint32_t refs;
+    //held to modify the table
+    mutex_t lock;
+    atomic_t refs;
 
-    ufd_t *table;
+    ufd_table_t *table;
+    //no fd below this is free
+    ufd_idx_t next_fd;
 } ufd_context_t;
 
 typedef struct fs_context {
@@ -141,6 +164,8 @@ typedef struct thread {
     //Thread-specific data:
     bool active;
     uint32_t flags;
+    //processors this thread may be scheduled on (modified under sched_lock)
+    cpu_mask_t affinity;
     void *kernel_stack_top;
     void *kernel_stack_bottom;
 
@@ -148,6 +173,8 @@ typedef struct thread {
     int32_t state;
     sigset_t sig_pending;
     bool should_die;
+    //nesting depth of rcu_read_lock(), we are not preempted while nonzero
+    uint32_t rcu_read_depth;
 
     //architecture-specific execution state
     arch_thread_data_t arch;
@@ -162,6 +189,9 @@ typedef struct thread {
     list_head_t sleep_list;
     //used in wait_for_condition()
     list_head_t poll_list;
+
+    //the struct itself is freed under RCU, see mutex_spin_on_owner()
+    rcu_head_t rcu;
 } thread_t;
 
 //FIXME delete the obtain_* functions because they aren't remotely thread safe
@@ -182,10 +212,26 @@ static inline fs_context_t * obtain_fs_context(thread_t *t) {
     return fs;
 }
 
+//Fills pwd with a reference to the working directory of t, which the caller
+//must path_put().
+static inline void get_fs_pwd(thread_t *t, path_t *pwd) {
+    fs_context_t *fs = obtain_fs_context(t);
+
+    uint32_t flags;
+    spin_lock_irqsave(&fs->lock, &flags);
+    *pwd = fs->pwd;
+    path_get(pwd);
+    spin_unlock_irqstore(&fs->lock, flags);
+}
+
 #include "mm/mm.h"
 
 thread_t * create_idle_task();
 void spawn_kernel_task(char *name, void (*main)(void *arg), void *arg);
+void reaperd_init();
+
+//child may run on any processor, instead of inheriting the affinity of t
+#define FORK_FLAG_ANY_PROC (1 << 0)
 
 thread_t * thread_fork(thread_t *t, uint32_t flags, void (*setup)(void *arg), void *arg);
 
@@ -193,6 +239,8 @@ void task_node_get(task_node_t *node);
 void task_node_put(task_node_t *node);
 task_node_t * task_node_find(pid_t pid);
 void task_node_exit(uint32_t code, uint8_t exit_cause);
+int32_t task_node_set_affinity(task_node_t *node, cpu_mask_t mask);
+cpu_mask_t task_node_get_affinity(task_node_t *node);
 
 void session_create(task_node_t *t);
 void session_add(task_node_t *new, psession_t *session);
@@ -205,12 +253,18 @@ void pgroup_rm(task_node_t *new);
 pgroup_t * pgroup_find(pid_t pid);
 
 bool ufdt_valid(ufd_idx_t ufd);
+//These return UFD_INVALID if the table is full.
 ufd_idx_t ufdt_add(file_t *gfd);
+ufd_idx_t ufdt_add_flags(file_t *gfd, uint32_t flags);
 int32_t ufdt_replace(ufd_idx_t ufd, file_t *fd);
 int32_t ufdt_close(ufd_idx_t ufd);
 
+//Returns the file open as ufd with a ref held, which must be dropped with
+//ufdt_put(), or NULL if there is none.
 file_t * ufdt_get(ufd_idx_t ufd);
-void ufdt_put(ufd_idx_t ufd);
+void ufdt_put(file_t *gfd);
+//Closes every fd marked UFD_FLAG_CLOEXEC, once an exec can no longer fail.
+void ufdt_close_on_exec();
 
 void __init root_task_init(void *umain);
 
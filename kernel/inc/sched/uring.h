@@ -0,0 +1,13 @@
+#ifndef KERNEL_SCHED_URING_H
+#define KERNEL_SCHED_URING_H
+
+#include "common/types.h"
+#include "arch/cpu.h"
+#include "fs/vfs.h"
+#include "user/uring.h"
+
+file_t * uring_create(struct uring_params *params);
+int32_t uring_enter(cpu_state_t *state, file_t *file, uint32_t to_submit,
+    uint32_t min_complete, uint32_t flags);
+
+#endif
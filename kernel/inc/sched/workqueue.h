@@ -0,0 +1,63 @@
+#ifndef KERNEL_SCHED_WORKQUEUE_H
+#define KERNEL_SCHED_WORKQUEUE_H
+
+#include "common/types.h"
+#include "common/list.h"
+#include "time/timer.h"
+
+typedef struct worker_pool worker_pool_t;
+
+//work is queued (or its delay timer is running)
+#define WORK_PENDING 0
+
+//Work items are run in process context by the worker belonging to the
+//processor they were queued on, and so unlike tasklets are allowed to sleep.
+//A work item is never queued twice, but may be queued again once it has
+//started running.
+typedef struct work {
+    list_head_t list;
+    volatile uint32_t state;
+    worker_pool_t *pool;
+
+    void (*func)(void *arg);
+    void *arg;
+} work_t;
+
+typedef struct delayed_work {
+    work_t work;
+    timer_t timer;
+} delayed_work_t;
+
+static inline void work_init(work_t *work, void (*func)(void *arg), void *arg) {
+    list_init(&work->list);
+    work->state = 0;
+    work->pool = NULL;
+    work->func = func;
+    work->arg = arg;
+}
+
+static inline void delayed_work_init(delayed_work_t *dwork,
+        void (*func)(void *arg), void *arg) {
+    work_init(&dwork->work, func, arg);
+    timer_init(&dwork->timer, NULL, dwork);
+}
+
+//These return false if the work was already pending.
+bool queue_work(work_t *work);
+bool queue_work_on(uint32_t cpu, work_t *work);
+bool queue_delayed_work(delayed_work_t *dwork, uint32_t millis);
+
+//Waits until the work is neither pending nor running. Must not be called from
+//the work item itself.
+void flush_work(work_t *work);
+
+//These return true if the work was pending and has now been dequeued. The
+//_sync variants additionally wait for a running instance to finish.
+bool cancel_work(work_t *work);
+bool cancel_work_sync(work_t *work);
+bool cancel_delayed_work(delayed_work_t *dwork);
+bool cancel_delayed_work_sync(delayed_work_t *dwork);
+
+void workqueue_init();
+
+#endif
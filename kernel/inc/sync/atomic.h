@@ -14,7 +14,13 @@ void atomic_set(atomic_t *a, int32_t v);
 void atomic_inc(atomic_t *a);
 void atomic_dec(atomic_t *a);
 
+//Return true if the new value is zero.
+bool atomic_inc_and_test(atomic_t *a);
+bool atomic_dec_and_test(atomic_t *a);
+
 int32_t atomic_xchg(atomic_t *a, int32_t v);
+//Returns the old value, which is old if the exchange happened.
+int32_t atomic_cmpxchg(atomic_t *a, int32_t old, int32_t new);
 
 void atomic_add(atomic_t *a, int32_t v);
 int32_t atomic_add_and_return(atomic_t *a, int32_t v);
@@ -0,0 +1,9 @@
+#ifndef KERNEL_SYNC_LOCKBENCH_H
+#define KERNEL_SYNC_LOCKBENCH_H
+
+//With "lockbench=y" on the command line, hammers a ticket lock and then a
+//queued lock from every processor, and logs the cost of each. Must be called
+//once the scheduler is up.
+void lockbench_run();
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef KERNEL_SYNC_LOCKSTAT_H
+#define KERNEL_SYNC_LOCKSTAT_H
+
+#include "common/types.h"
+
+#ifdef CONFIG_LOCKSTAT
+
+//Both must be invoked with interrupts disabled, and only once we have a
+//processor. Times are in TSC cycles.
+void lockstat_acquired(uint32_t site, void *lock, bool contended,
+    uint64_t waited);
+void lockstat_released(uint32_t site, uint64_t held);
+
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef KERNEL_SYNC_MUTEX_H
+#define KERNEL_SYNC_MUTEX_H
+
+typedef struct mutex mutex_t;
+
+#include "common/types.h"
+#include "common/list.h"
+#include "sync/atomic.h"
+#include "sync/spinlock.h"
+
+//A sleeping lock, for critical sections which are long or may themselves
+//sleep, and so must run with interrupts enabled. A contended locker spins for
+//as long as the owner is running on another processor, since it will probably
+//be done soon, and otherwise sleeps until the lock is handed back.
+//
+//Mutexes may only be taken from process context, and only released by the
+//thread which took them.
+struct mutex {
+    //1 if unlocked, 0 if locked, negative if locked and there may be waiters
+    atomic_t count;
+    spinlock_t wait_lock;
+    list_head_t waiters;
+
+    struct thread *volatile owner;
+};
+
+#define MUTEX_UNLOCKED(name) {      \
+    .count = {1},                   \
+    .wait_lock = SPINLOCK_UNLOCKED, \
+    .waiters = LIST_HEAD((name).waiters), \
+    .owner = NULL,                  \
+}
+
+#define DEFINE_MUTEX(name) mutex_t name = MUTEX_UNLOCKED(name)
+
+static inline void mutex_init(mutex_t *lock) {
+    *lock = (mutex_t) MUTEX_UNLOCKED(*lock);
+}
+
+static inline bool mutex_is_locked(mutex_t *lock) {
+    return atomic_read(&lock->count) != 1;
+}
+
+void mutex_lock(mutex_t *lock);
+//Returns true if the lock was taken.
+bool mutex_trylock(mutex_t *lock);
+void mutex_unlock(mutex_t *lock);
+
+#endif
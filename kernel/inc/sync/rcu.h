@@ -0,0 +1,51 @@
+#ifndef KERNEL_SYNC_RCU_H
+#define KERNEL_SYNC_RCU_H
+
+typedef struct rcu_head rcu_head_t;
+
+#include "common/types.h"
+#include "common/compiler.h"
+
+//Read-copy-update. Readers walk a structure with no lock at all, inside an
+//rcu_read_lock() section, and fetch every pointer they follow with
+//rcu_dereference(). Writers serialise amongst themselves however they like,
+//publish new objects with rcu_assign_pointer(), and defer freeing anything they
+//unlink with call_rcu() (or wait with synchronize_rcu()) until every reader
+//which could still be looking at it has finished.
+//
+//A read section pins the current thread to its processor (the thread is not
+//preempted), so it must not sleep. A processor which context switches, idles
+//or is interrupted in usermode is therefore outside any read section, and
+//once every processor has done so a grace period has elapsed.
+
+typedef void (*rcu_callback_t)(rcu_head_t *head);
+
+struct rcu_head {
+    rcu_head_t *next;
+    rcu_callback_t func;
+};
+
+void rcu_read_lock();
+void rcu_read_unlock();
+
+//Invokes func(head) from softirq context once a grace period has elapsed.
+void call_rcu(rcu_head_t *head, rcu_callback_t func);
+//Sleeps until a grace period has elapsed.
+void synchronize_rcu();
+
+//Frees ptr once a grace period has elapsed, where member is the rcu_head_t in
+//*ptr (and must lie within its first page). The offset of the member is passed
+//in place of a callback, which is recognisable since no function lives in the
+//first page.
+#define kfree_rcu(ptr, member)                                              \
+    call_rcu(&(ptr)->member, (rcu_callback_t) offsetof(typeof(*(ptr)), member))
+
+//Invoked with interrupts disabled by the scheduler whenever this processor
+//passes through a quiescent state.
+void rcu_note_qs();
+//Invoked with interrupts disabled on receipt of a management interrupt.
+void rcu_check_callbacks();
+
+void rcu_proc_init();
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef KERNEL_SYNC_RWLOCK_H
+#define KERNEL_SYNC_RWLOCK_H
+
+typedef struct rwlock rwlock_t;
+
+#include "common/types.h"
+#include "sync/atomic.h"
+#include "sync/spinlock.h"
+
+//A reader-writer spinlock. Any number of readers may hold the lock at once, or
+//else one writer. Once a writer is waiting new readers queue up behind it, so
+//a stream of readers cannot starve writers out.
+//
+//cnts holds the writer state in its low byte, and the number of readers above
+//that. Contended lockers queue on wait_lock.
+struct rwlock {
+    atomic_t cnts;
+    spinlock_t wait_lock;
+};
+
+#define RWLOCK_UNLOCKED {.cnts = {0}, .wait_lock = SPINLOCK_UNLOCKED}
+
+#define DEFINE_RWLOCK(name) rwlock_t name = RWLOCK_UNLOCKED
+
+static inline void rwlock_init(rwlock_t *lock) {
+    atomic_set(&lock->cnts, 0);
+    spinlock_init(&lock->wait_lock);
+}
+
+//All of these must be invoked with interrupts disabled.
+void read_lock(rwlock_t *lock);
+void read_unlock(rwlock_t *lock);
+void write_lock(rwlock_t *lock);
+void write_unlock(rwlock_t *lock);
+
+#include "arch/interrupt.h"
+
+static inline void read_lock_irqsave(rwlock_t *lock, uint32_t *flags) {
+    irqsave(flags);
+    read_lock(lock);
+}
+
+static inline void read_unlock_irqstore(rwlock_t *lock, uint32_t flags) {
+    read_unlock(lock);
+    irqstore(flags);
+}
+
+static inline void write_lock_irqsave(rwlock_t *lock, uint32_t *flags) {
+    irqsave(flags);
+    write_lock(lock);
+}
+
+static inline void write_unlock_irqstore(rwlock_t *lock, uint32_t flags) {
+    write_unlock(lock);
+    irqstore(flags);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef KERNEL_SYNC_SEQCOUNT_H
+#define KERNEL_SYNC_SEQCOUNT_H
+
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/asm.h"
+
+//A seqcount is the reader half of a seqlock, for data whose writers are
+//already serialised by some other lock. Readers take no lock at all, and
+//instead retry if a write overlapped their read:
+//
+//    uint32_t seq;
+//    do {
+//        seq = read_seqcount_begin(&count);
+//        ...copy out the protected data...
+//    } while(read_seqcount_retry(&count, seq));
+//
+//Like a seqlock, a writer must not be interruptible by a reader on the same
+//CPU, or else the reader will spin forever.
+
+typedef struct seqcount {
+    volatile uint32_t seq; //odd while a write is in progress
+} seqcount_t;
+
+#define SEQCOUNT_INIT {.seq = 0}
+
+static inline void seqcount_init(seqcount_t *s) {
+    s->seq = 0;
+}
+
+static inline uint32_t read_seqcount_begin(seqcount_t *s) {
+    uint32_t seq;
+    while((seq = s->seq) & 1) {
+        relax();
+    }
+    barrier();
+
+    return seq;
+}
+
+static inline bool read_seqcount_retry(seqcount_t *s, uint32_t seq) {
+    barrier();
+    return s->seq != seq;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s) {
+    s->seq++;
+    barrier();
+}
+
+static inline void write_seqcount_end(seqcount_t *s) {
+    barrier();
+    s->seq++;
+}
+
+#endif
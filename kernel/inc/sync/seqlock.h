@@ -0,0 +1,56 @@
+#ifndef KERNEL_SYNC_SEQLOCK_H
+#define KERNEL_SYNC_SEQLOCK_H
+
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/asm.h"
+#include "sync/spinlock.h"
+#include "sync/seqcount.h"
+
+//A seqlock serialises writers with a spinlock, but readers take no lock at
+//all. Instead they snapshot the data they want and retry if a writer was
+//active in the meantime, so data protected by a seqlock must be safe to read
+//while it is being torn.
+//
+//    uint32_t seq;
+//    do {
+//        seq = read_seqbegin(&lock);
+//        ...copy out the protected data...
+//    } while(read_seqretry(&lock, seq));
+//
+//Note that a reader must not run on the same CPU as a writer which it has
+//interrupted, or else it will spin forever, so writers always disable IRQs.
+
+typedef struct seqlock {
+    seqcount_t seqcount;
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_UNLOCKED {.seqcount = SEQCOUNT_INIT, .lock = SPINLOCK_UNLOCKED}
+
+#define DEFINE_SEQLOCK(name) seqlock_t name = SEQLOCK_UNLOCKED
+
+static inline void seqlock_init(seqlock_t *lock) {
+    seqcount_init(&lock->seqcount);
+    spinlock_init(&lock->lock);
+}
+
+static inline uint32_t read_seqbegin(seqlock_t *lock) {
+    return read_seqcount_begin(&lock->seqcount);
+}
+
+static inline bool read_seqretry(seqlock_t *lock, uint32_t seq) {
+    return read_seqcount_retry(&lock->seqcount, seq);
+}
+
+static inline void write_seqlock_irqsave(seqlock_t *lock, uint32_t *flags) {
+    spin_lock_irqsave(&lock->lock, flags);
+    write_seqcount_begin(&lock->seqcount);
+}
+
+static inline void write_sequnlock_irqstore(seqlock_t *lock, uint32_t flags) {
+    write_seqcount_end(&lock->seqcount);
+    spin_unlock_irqstore(&lock->lock, flags);
+}
+
+#endif
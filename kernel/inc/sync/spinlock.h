@@ -23,32 +23,33 @@ static inline void spinlock_init(spinlock_t *spinlock) {
     list_init(&spinlock->list);
 }
 
-static void spin_lock_irq(volatile spinlock_t *lock);
-static void spin_unlock_irq(volatile spinlock_t *lock);
-
-static void spin_lock_irqsave(volatile spinlock_t *lock, uint32_t *flags);
-static void spin_unlock_irqstore(volatile spinlock_t *lock, uint32_t flags);
-
 #include "arch/interrupt.h"
 
-static void spin_lock_irq(volatile spinlock_t *lock) {
-    irqdisable();
-    spin_lock(lock);
-}
-
-static void spin_unlock_irq(volatile spinlock_t *lock) {
-    spin_unlock(lock);
-    irqenable();
-}
-
-static void spin_lock_irqsave(volatile spinlock_t *lock, uint32_t *flags) {
-    irqsave(flags);
-    spin_lock(lock);
-}
-
-static void spin_unlock_irqstore(volatile spinlock_t *lock, uint32_t flags) {
-    spin_unlock(lock);
-    irqstore(flags);
-}
+//These are macros, like spin_lock(), so that the lock statistics see where
+//they were used.
+
+#define spin_lock_irq(lock) \
+    do {                    \
+        irqdisable();       \
+        spin_lock(lock);    \
+    } while(0)
+
+#define spin_unlock_irq(lock) \
+    do {                      \
+        spin_unlock(lock);    \
+        irqenable();          \
+    } while(0)
+
+#define spin_lock_irqsave(lock, flags) \
+    do {                               \
+        irqsave(flags);                \
+        spin_lock(lock);               \
+    } while(0)
+
+#define spin_unlock_irqstore(lock, flags) \
+    do {                                  \
+        spin_unlock(lock);                \
+        irqstore(flags);                  \
+    } while(0)
 
 #endif
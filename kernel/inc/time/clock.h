@@ -6,6 +6,8 @@
 
 #define MILLIS_PER_SEC 1000
 #define MICROS_PER_MILLI 1000
+#define MICROS_PER_SEC 1000000
+#define NANOS_PER_MICRO 1000
 #define FEMPTOS_PER_SEC 1000000000000000ULL
 
 typedef struct clock {
@@ -16,6 +18,11 @@ typedef struct clock {
     uint32_t freq;
 
     uint64_t (*read)(void);
+
+    //How userspace can read this clock through the vdso page, and the raw
+    //counter value at which read() returns 0.
+    uint32_t vdso_mode;
+    uint64_t vdso_offset;
 } clock_t;
 
 typedef struct clock_event_source clock_event_source_t;
@@ -37,11 +44,29 @@ typedef struct clock_event_listener {
     void (*handle)(clock_event_source_t *);
 } clock_event_listener_t;
 
+//A one-shot timer present on every processor, which each processor programs
+//independently. Its interrupt must invoke hrtimer_interrupt().
+typedef struct clock_event_device {
+    char *name;
+    uint32_t rating;
+
+    //Arms the current processor's timer to fire in (at most) micros
+    //microseconds, replacing any earlier deadline.
+    void (*program)(uint64_t micros);
+} clock_event_device_t;
+
 void register_clock(clock_t *clock);
 void register_clock_event_source(clock_event_source_t *clock_event_source);
 void register_clock_event_listener(clock_event_listener_t *clock_event_listener);
+void register_clock_event_device(clock_event_device_t *clock_event_device);
+
+//Returns false if there is no clock event device.
+bool clock_event_program(uint64_t micros);
 
 uint64_t uptime(); //In miliseconds
-void sleep(uint32_t millis);
+uint64_t uptime_us(); //In microseconds
+
+//Busy-waits, so only for short device waits. Use usleep() to sleep.
+void udelay(uint32_t micros);
 
 #endif
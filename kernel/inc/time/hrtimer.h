@@ -0,0 +1,51 @@
+#ifndef KERNEL_TIME_HRTIMER_H
+#define KERNEL_TIME_HRTIMER_H
+
+#include "common/types.h"
+#include "common/list.h"
+#include "time/timer.h"
+
+typedef struct hrtimer_base hrtimer_base_t;
+
+//High resolution timers, which expire with microsecond precision from a
+//per-processor one-shot interrupt. They are kept in a sorted list per
+//processor, and so are meant for the (few) things which need precision, like
+//sleeps. Everything else should use the timer wheel in time/timer.h.
+typedef struct hrtimer {
+    list_head_t list;
+
+    //in microseconds since boot
+    uint64_t expires;
+    hrtimer_base_t *base;
+
+    timer_callback_t callback;
+    void *data;
+} hrtimer_t;
+
+static inline void hrtimer_init(hrtimer_t *timer, timer_callback_t callback,
+        void *data) {
+    list_init(&timer->list);
+    timer->base = NULL;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+static inline bool hrtimer_pending(hrtimer_t *timer) {
+    return !list_empty(&timer->list);
+}
+
+//(Re)arms timer to fire in micros microseconds.
+void hrtimer_start(hrtimer_t *timer, uint64_t micros);
+//Returns true if the timer was pending and has now been removed, and waits for
+//a running callback to finish (so must not be called from the callback).
+bool hrtimer_cancel(hrtimer_t *timer);
+
+//Invoked by the clock event device on the processor whose interrupt fired.
+void hrtimer_interrupt();
+
+//Sleep the current thread for micros microseconds. The interruptible variant
+//returns -EINTR early if a signal arrives, storing the time left in remaining.
+void usleep(uint64_t micros);
+int32_t usleep_interruptible(uint64_t micros, uint64_t *remaining);
+
+#endif
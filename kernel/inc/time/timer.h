@@ -2,9 +2,49 @@
 #define KERNEL_TIMER_H
 
 #include "common/types.h"
+#include "common/list.h"
 
 typedef void (*timer_callback_t)(void *);
 
+typedef struct timer_base timer_base_t;
+
+//Timers are kept in a per-processor timing wheel, and their callbacks are run
+//from the timer interrupt.
+typedef struct timer {
+    list_head_t list;
+
+    uint32_t expires;
+    uint32_t flags;
+    timer_base_t *base;
+
+    timer_callback_t callback;
+    void *data;
+} timer_t;
+
+static inline void timer_init(timer_t *timer, timer_callback_t callback,
+        void *data) {
+    list_init(&timer->list);
+    timer->flags = 0;
+    timer->base = NULL;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+static inline bool timer_pending(timer_t *timer) {
+    return !list_empty(&timer->list);
+}
+
+//(Re)arms timer to fire in millis milliseconds. Callers must serialise
+//timer_add() and timer_cancel() on the same timer.
+void timer_add(timer_t *timer, uint32_t millis);
+
+//These return true if the timer was pending and has now been removed.
+//timer_cancel_sync() additionally waits for a running callback to finish, and
+//so must not be called from the callback itself.
+bool timer_cancel(timer_t *timer);
+bool timer_cancel_sync(timer_t *timer);
+
+//Fire-and-forget timer, which cannot be cancelled.
 void timer_create(uint32_t millis, timer_callback_t callback, void *data);
 
 #endif
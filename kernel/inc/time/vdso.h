@@ -0,0 +1,23 @@
+#ifndef KERNEL_TIME_VDSO_H
+#define KERNEL_TIME_VDSO_H
+
+#include "common/types.h"
+#include "time/clock.h"
+
+//The layout of the page at VDSO_ADDR, which must match libk's k/vdso.h.
+
+#define VDSO_CLOCK_NONE 0
+#define VDSO_CLOCK_TSC  1
+
+typedef struct vdso_data {
+    //odd while the fields below are being updated
+    volatile uint32_t seq;
+
+    uint32_t clock_mode;
+    uint32_t clock_freq;
+    uint64_t clock_offset;
+} vdso_data_t;
+
+void vdso_update_clock(clock_t *clock);
+
+#endif
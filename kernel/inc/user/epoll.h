@@ -0,0 +1,34 @@
+#ifndef KERNEL_USER_EPOLL_H
+#define KERNEL_USER_EPOLL_H
+
+#include "common/types.h"
+#include "common/compiler.h"
+
+//These must match libk's sys/epoll.h.
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLLIN      (1 << 0)
+#define EPOLLOUT     (1 << 2)
+#define EPOLLERR     (1 << 3)
+
+//report readiness once, after which the fd is disabled until EPOLL_CTL_MOD
+#define EPOLLONESHOT (1 << 30)
+//report only changes in readiness, rather than for as long as the fd is ready
+#define EPOLLET      (1U << 31)
+
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+    uint32_t events;
+    epoll_data_t data;
+} PACKED;
+
+#endif
@@ -11,4 +11,9 @@ struct timeval {
 		suseconds_t	tv_usec;
 };
 
+struct timespec {
+		time_t tv_sec;
+		int32_t tv_nsec;
+};
+
 #endif
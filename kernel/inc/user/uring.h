@@ -0,0 +1,69 @@
+#ifndef KERNEL_USER_URING_H
+#define KERNEL_USER_URING_H
+
+#include "common/types.h"
+#include "common/compiler.h"
+
+//Submission/completion rings, which live in userspace memory and must match
+//libk's k/uring.h.
+
+#define URING_MAX_ENTRIES 4096
+
+#define URING_OP_NOP    0
+#define URING_OP_READ   1
+#define URING_OP_WRITE  2
+#define URING_OP_SEND   3
+#define URING_OP_RECV   4
+#define URING_OP_ACCEPT 5
+#define URING_OP_POLL   6
+
+#define URING_POLL_IN  (1 << 0)
+#define URING_POLL_OUT (1 << 1)
+#define URING_POLL_ERR (1 << 2)
+
+//wait until min_complete completions have been posted
+#define URING_ENTER_GETEVENTS (1 << 0)
+
+typedef struct uring_sqe {
+    uint8_t op;
+    uint8_t pad[3];
+
+    uint32_t fd;
+    //the buffer, or the struct sockaddr * for an accept
+    uint32_t addr;
+    //the buffer length, the socklen_t * for an accept, or the poll mask
+    uint32_t len;
+    //send/recv flags
+    uint32_t flags;
+
+    uint64_t user_data;
+} PACKED uring_sqe_t;
+
+typedef struct uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+} PACKED uring_cqe_t;
+
+//Userspace produces at sq_tail and the kernel consumes at sq_head, and the
+//kernel produces at cq_tail and userspace consumes at cq_head. Completions
+//which do not fit in the cq are counted in cq_overflow and dropped.
+typedef struct uring_ctrl {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    volatile uint32_t cq_overflow;
+} PACKED uring_ctrl_t;
+
+struct uring_params {
+    //both must be powers of two
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+
+    uring_ctrl_t *ctrl;
+    uring_sqe_t *sqes;
+    uring_cqe_t *cqes;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "common/types.h"
 #include "common/mmio.h"
+#include "arch/cpu.h"
 #include "arch/gdt.h"
 #include "arch/idt.h"
 #include "arch/pic.h"
@@ -8,7 +9,9 @@
 #include "arch/pit.h"
 #include "mm/mm.h"
 #include "sched/sched.h"
+#include "common/math.h"
 #include "time/clock.h"
+#include "time/hrtimer.h"
 #include "log/log.h"
 
 #define TIMER_VECTOR    0x7E
@@ -35,7 +38,11 @@
 #define DIVIDE_FACTOR_FOUR      0x1
 #define DIVIDE_FACTOR_SIXTYFOUR 0x7
 
-#define TIMER_MODE_PERIODIC (1 << 17)
+#define TIMER_MODE_PERIODIC     (1 << 17)
+#define TIMER_MODE_TSC_DEADLINE (2 << 17)
+
+#define CPUID_ECX_TSC_DEADLINE  (1 << 24)
+#define MSR_TSC_DEADLINE        0x6E0
 
 #define APIC_MASTER_ENABLE  (1 << 8)
 #define APIC_DISABLE        (1 << 16)
@@ -62,12 +69,11 @@ void apic_issue_command(uint8_t target_id, uint16_t type, uint32_t flags, uint8_
     while(readl(apic_base, REG_ICR_LOW) & CMD_FLAG_PENDING);
 }
 
-static clock_event_source_t apic_clock_event_source = {
-    .name = "apic",
-    .rating = 5,
-
-    .freq = 0, //FIXME
-};
+//ticks per second, with DIVIDE_FACTOR_ONE
+static uint32_t timer_freq;
+//The timer fires when the TSC passes MSR_TSC_DEADLINE, instead of counting
+//down REG_TIMER_INITIAL.
+static bool tsc_deadline;
 
 static bool apic_is_spurious(uint32_t vector) {
     return vector == 0xFF;
@@ -80,11 +86,33 @@ static void apic_eoi() {
 }
 
 static void handle_timer() {
-    if(!get_percpu(this_proc)->num) {
-        apic_clock_event_source.event(&apic_clock_event_source);
-    }
+    hrtimer_interrupt();
 }
 
+static void apic_timer_program(uint64_t micros) {
+    uint64_t count = (micros * timer_freq) / MICROS_PER_SEC;
+    writel(apic_base, REG_TIMER_INITIAL, MIN(MAX(count, 1), 0xFFFFFFFF));
+}
+
+static void tsc_deadline_program(uint64_t micros) {
+    wrmsr(MSR_TSC_DEADLINE,
+        rdtsc() + (micros * tsc_clock.freq) / MICROS_PER_SEC + 1);
+}
+
+static clock_event_device_t apic_clock_event_device = {
+    .name = "apic",
+    .rating = 5,
+
+    .program = apic_timer_program,
+};
+
+static clock_event_device_t tsc_deadline_clock_event_device = {
+    .name = "tsc-deadline",
+    .rating = 7,
+
+    .program = tsc_deadline_program,
+};
+
 #define CALIBRATE_INITIAL 0xC0000000
 
 static void calibrate_timer() {
@@ -97,15 +125,16 @@ static void calibrate_timer() {
     uint32_t ticks = readl(apic_base, REG_TIMER_CURRENT);
     barrier();
 
-    apic_clock_event_source.freq = (CALIBRATE_INITIAL - ticks) * 10;
+    timer_freq = (CALIBRATE_INITIAL - ticks) * 10;
 
-    kprintf("apic - timer tsc calibrated (%uHz)", apic_clock_event_source.freq);
+    kprintf("apic - timer tsc calibrated (%uHz)", timer_freq);
 }
 
 void __init apic_enable() {
     writel(apic_base, REG_DFR, 0xFFFFFFFF);
     writel(apic_base, REG_LDR, (readl(apic_base, REG_LDR) & 0x00FFFFFF) | 1);
-    writel(apic_base, REG_LVT_TIMER, TIMER_MODE_PERIODIC | TIMER_VECTOR);
+    writel(apic_base, REG_LVT_TIMER, TIMER_VECTOR
+        | (tsc_deadline ? TIMER_MODE_TSC_DEADLINE : 0));
     writel(apic_base, REG_LVT_LINT0, APIC_DISABLE);
     writel(apic_base, REG_LVT_LINT1, APIC_DISABLE);
     writel(apic_base, REG_TASK_PRIO, 0);
@@ -115,12 +144,21 @@ void __init apic_enable() {
 
     writel(apic_base, REG_SPURIOUS, APIC_MASTER_ENABLE | 0xFF);
 
-    if(!apic_clock_event_source.freq) {
-        calibrate_timer();
+    //The timer is one-shot, and is rearmed by hrtimer_interrupt() each time it
+    //fires, which we make happen straight away.
+    if(tsc_deadline) {
+        //Order the LVT write before the MSR write. Every processor with
+        //TSC-deadline mode has SSE2, and so mfence.
+        asm volatile("mfence" ::: "memory");
+        tsc_deadline_program(0);
+    } else {
+        if(!timer_freq) {
+            calibrate_timer();
+        }
+
+        writel(apic_base, REG_TIMER_DIVIDE, DIVIDE_FACTOR_ONE);
+        apic_timer_program(0);
     }
-
-    writel(apic_base, REG_TIMER_DIVIDE, DIVIDE_FACTOR_ONE);
-    writel(apic_base, REG_TIMER_INITIAL, apic_clock_event_source.freq);
 }
 
 void __init apic_init(phys_addr_t base) {
@@ -130,10 +168,15 @@ void __init apic_init(phys_addr_t base) {
 
     pic_configure(0xFF, 0xFF);
 
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    tsc_deadline = (c & CPUID_ECX_TSC_DEADLINE) && tsc_clock.freq;
+
     apic_enable();
 
     register_isr(TIMER_VECTOR, CPL_KRNL, handle_timer, NULL);
-    register_clock_event_source(&apic_clock_event_source);
+    register_clock_event_device(tsc_deadline ? &tsc_deadline_clock_event_device
+        : &apic_clock_event_device);
 
     sti();
 }
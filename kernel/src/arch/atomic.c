@@ -39,6 +39,10 @@ int32_t atomic_xchg(atomic_t *a, int32_t v) {
     return val;
 }
 
+int32_t atomic_cmpxchg(atomic_t *a, int32_t old, int32_t new) {
+    return cmpxchg(&a->value, old, new);
+}
+
 void atomic_add(atomic_t *a, int32_t v) {
     register int val = v;
     asm volatile("lock add %1, %0" : "=m" (a->value), "=r" (val) : "1" (v));
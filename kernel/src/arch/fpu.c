@@ -0,0 +1,186 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "init/initcall.h"
+#include "lib/string.h"
+#include "bug/debug.h"
+#include "bug/panic.h"
+#include "arch/cpu.h"
+#include "arch/fpu.h"
+#include "mm/cache.h"
+#include "sched/task.h"
+#include "log/log.h"
+
+//Threads only get their FPU state loaded when they first touch the FPU after
+//being switched to (CR0.TS is set on every switch away from a thread which has
+//its state loaded, so touching the FPU raises #NM). Threads which never use the
+//FPU therefore never pay for a save or restore.
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+
+#define CR4_OSFXSR     (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+#define CPUID_EDX_FPU  (1 << 0)
+#define CPUID_EDX_FXSR (1 << 24)
+#define CPUID_EDX_SSE  (1 << 25)
+
+#define MXCSR_DEFAULT 0x1F80
+
+static cache_t *fpu_cache;
+static bool has_fxsr;
+static bool has_sse;
+
+static inline uint32_t read_cr0() {
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0) {
+    asm volatile("mov %0, %%cr0" :: "r" (cr0));
+}
+
+static inline uint32_t read_cr4() {
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+    asm volatile("mov %0, %%cr4" :: "r" (cr4));
+}
+
+static inline void clts() {
+    asm volatile("clts");
+}
+
+static inline void stts() {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static inline void * fpu_area(fpu_state_t *fpu) {
+    return (void *) ((((uint32_t) fpu->raw) + FPU_STATE_ALIGN - 1)
+        & ~(FPU_STATE_ALIGN - 1));
+}
+
+static void fpu_save(fpu_state_t *fpu) {
+    if(has_fxsr) {
+        asm volatile("fxsave (%0)" :: "r" (fpu_area(fpu)) : "memory");
+    } else {
+        //fnsave reinitialises the FPU, but we are about to give it up anyway.
+        asm volatile("fnsave (%0)\n"
+                     "fwait" :: "r" (fpu_area(fpu)) : "memory");
+    }
+}
+
+static void fpu_restore(fpu_state_t *fpu) {
+    if(has_fxsr) {
+        asm volatile("fxrstor (%0)" :: "r" (fpu_area(fpu)));
+    } else {
+        asm volatile("frstor (%0)" :: "r" (fpu_area(fpu)));
+    }
+}
+
+static void fpu_reset() {
+    asm volatile("fninit");
+
+    if(has_sse) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        asm volatile("ldmxcsr %0" :: "m" (mxcsr));
+    }
+}
+
+void fpu_init_proc() {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+
+    if(!(d & CPUID_EDX_FPU)) {
+        panic("fpu - no x87 FPU present");
+    }
+
+    has_fxsr = d & CPUID_EDX_FXSR;
+    has_sse = has_fxsr && (d & CPUID_EDX_SSE);
+
+    if(has_sse) {
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    }
+
+    //Report FPU errors natively through #MF, and have wait/fwait respect TS.
+    //Nobody owns the FPU to begin with.
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+}
+
+//Invoked during a context switch, with interrupts disabled.
+void fpu_switch(thread_t *old, thread_t *next) {
+    check_irqs_disabled();
+
+    if(old == next || !old->arch.fpu_live) {
+        return;
+    }
+
+    fpu_save(old->arch.fpu);
+    old->arch.fpu_live = false;
+
+    stts();
+}
+
+//#NM handler, invoked with interrupts disabled.
+void fpu_handle_unavailable() {
+    check_irqs_disabled();
+
+    thread_t *me = current;
+    BUG_ON(me->arch.fpu_live);
+
+    clts();
+
+    if(me->arch.fpu) {
+        fpu_restore(me->arch.fpu);
+    } else {
+        me->arch.fpu = cache_alloc(fpu_cache);
+        fpu_reset();
+    }
+
+    me->arch.fpu_live = true;
+}
+
+void fpu_fork(thread_t *child, thread_t *parent) {
+    child->arch.fpu = NULL;
+    child->arch.fpu_live = false;
+
+    uint32_t flags;
+    irqsave(&flags);
+
+    if(parent->arch.fpu_live) {
+        fpu_save(parent->arch.fpu);
+
+        //fnsave reinitialises the FPU, so put the live state back.
+        if(!has_fxsr) {
+            fpu_restore(parent->arch.fpu);
+        }
+    }
+
+    if(parent->arch.fpu) {
+        child->arch.fpu = cache_alloc(fpu_cache);
+        memcpy(fpu_area(child->arch.fpu), fpu_area(parent->arch.fpu),
+            FPU_STATE_LEN);
+    }
+
+    irqstore(flags);
+}
+
+void fpu_destroy(thread_t *t) {
+    if(t->arch.fpu) {
+        cache_free(fpu_cache, t->arch.fpu);
+    }
+}
+
+static INITCALL fpu_init() {
+    fpu_cache = cache_create(sizeof(fpu_state_t));
+
+    return 0;
+}
+
+core_initcall(fpu_init);
@@ -7,8 +7,10 @@
 #include "arch/idt.h"
 #include "arch/gdt.h"
 #include "arch/pl.h"
+#include "arch/fpu.h"
 #include "mm/cache.h"
 #include "sched/sched.h"
+#include "sched/softirq.h"
 #include "log/log.h"
 
 #define NUM_VECTORS 256
@@ -59,6 +61,7 @@ void idt_set_isr(uint32_t gate, uint32_t isr) {
     idt[gate].type |= 0x80 /* present */ | 0xe /* 32 bit interrupt gate */;
 }
 
+#define EX_DEVICE_NOT_AVAILABLE 7
 #define EX_PAGE_FAULT 14
 
 static char* exceptions[32] = {
@@ -69,7 +72,7 @@ static char* exceptions[32] = {
      [ 4] = "Overflow",
      [ 5] = "Bound Range Exceeded",
      [ 6] = "Invalid Opcode",
-     [ 7] = "Device Not Available",
+     [EX_DEVICE_NOT_AVAILABLE] = "Device Not Available",
      [ 8] = "Double Fault",
      [ 9] = "Coprocessor Segment Overrun",
      [10] = "Invalid TSS",
@@ -90,6 +93,10 @@ static void handle_exception(interrupt_t *interrupt) {
     }
 
 	switch(interrupt->vector) {
+		case EX_DEVICE_NOT_AVAILABLE: {
+			fpu_handle_unavailable();
+			break;
+		}
 		case EX_PAGE_FAULT: {
 			uint32_t cr2;
 			__asm__ __volatile__ ("mov %%cr2, %0" : "=r" (cr2));
@@ -114,6 +121,7 @@ void interrupt_dispatch(interrupt_t *interrupt) {
 
     if(interrupt->vector < IRQ_OFFSET) {
         handle_exception(interrupt);
+        return;
     }
 
 		if(!is_spurious(interrupt->vector)
@@ -129,6 +137,9 @@ void interrupt_dispatch(interrupt_t *interrupt) {
 
     eoi_handler(interrupt->vector);
 
+    //Run any work deferred by the handlers above, with interrupts enabled.
+    do_softirq();
+
 		bool is_user = pl_is_usermode(&interrupt->cpu);
 
 		//Only dispatch signals if we are returning to the user process! (We could
@@ -8,13 +8,13 @@
 isr_common:
     pushl %esp
 
-    mov $0x18, %ax
+    mov $0x30, %ax
     mov %ax, %gs
 
     call interrupt_dispatch
     addl $12, %esp
 
-    mov $0x18, %ax
+    mov $0x30, %ax
     mov %ax, %gs
 
     popa
@@ -10,6 +10,9 @@
 pdir_t init_page_directory ALIGN(PAGE_SIZE);
 ptab_t kptab[KERNEL_NUM_TABLES] ALIGN(PAGE_SIZE);
 
+//shared by every page directory, and only ever maps the vdso page
+static ptab_t vdso_ptab ALIGN(PAGE_SIZE);
+
 //page which will next be mapped to kernel addr space on alloc
 static uint32_t kernel_next_page;
 static DEFINE_SPINLOCK(map_lock);
@@ -25,6 +28,8 @@ page_t * user_get_page(thread_t *task, void *virt) {
 }
 
 static inline void do_user_map_page(thread_t *task, uint32_t diridx, uint32_t tabidx, phys_addr_t phys) {
+    BUG_ON(diridx >= addr_to_diridx((void *) USER_MAP_END));
+
     pdir_t *dir = task->arch.dir;
     ptab_t *tab = dir_get_tab(dir, diridx);
     if(!tab) {
@@ -61,6 +66,9 @@ page_t * user_alloc_page(thread_t *task, void *virt, uint32_t flags) {
 
 void copy_mem(thread_t *to, thread_t *from) {
     for (uint32_t i = 0; i < NUM_ENTRIES - KERNEL_NUM_TABLES; i++) {
+        //the vdso table is shared, not copied
+        if(i == addr_to_diridx((void *) VDSO_ADDR)) continue;
+
         ptab_t *tab = dir_get_tab(from->arch.dir, i);
         if(tab) {
             for (uint32_t j = 0; j < NUM_ENTRIES; j++) {
@@ -122,6 +130,9 @@ void build_page_dir(pdir_t *dir) {
         direntry_clear(dir, i);
     }
 
+    direntry_set(dir, addr_to_diridx((void *) VDSO_ADDR),
+        kvirt_to_phys(&vdso_ptab), MMUFLAG_PRESENT | MMUFLAG_USER);
+
     uint32_t baseoff = VIRTUAL_BASE / PAGE_SIZE / NUM_ENTRIES;
     for (uint32_t i = 0; i < KERNEL_NUM_TABLES; i++) {
         phys_addr_t phys = kvirt_to_phys(&kptab[i]);
@@ -129,6 +140,11 @@ void build_page_dir(pdir_t *dir) {
     }
 }
 
+void map_vdso_page(void *page) {
+    tabentry_set(&vdso_ptab, addr_to_tabidx((void *) VDSO_ADDR),
+        kvirt_to_phys(page), MMUFLAG_PRESENT | MMUFLAG_USER);
+}
+
 void * __init mmu_init(phys_addr_t kernel_end, phys_addr_t malloc_start) {
     kernel_next_page = 0;
 
@@ -3,6 +3,7 @@
 #include "arch/gdt.h"
 #include "arch/cpu.h"
 #include "arch/proc.h"
+#include "arch/fpu.h"
 #include "bug/debug.h"
 #include "log/log.h"
 #include "sched/task.h"
@@ -202,9 +203,17 @@ void arch_free_mem(void *dir) {
 }
 
 void arch_thread_build(thread_t *t) {
+    t->arch.fpu = NULL;
+    t->arch.fpu_live = false;
+
     arch_replace_mem(t, NULL);
 }
 
+void arch_thread_destroy(thread_t *t) {
+    fpu_destroy(t);
+    arch_free_mem(t->arch.dir);
+}
+
 typedef struct fork_data {
     cpu_state_t resume_state;
 } fork_data_t;
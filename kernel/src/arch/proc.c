@@ -3,6 +3,8 @@
 #include "arch/idt.h"
 #include "sched/proc.h"
 #include "arch/apic.h"
+#include "arch/fpu.h"
+#include "arch/syscall.h"
 #include "arch/proc.h"
 #include "sched/task.h"
 #include "log/log.h"
@@ -14,6 +16,8 @@ DEFINE_PER_CPU(thread_t *, current_task);
 void arch_setup_proc(processor_t *proc) {
     gdt_init(proc);
     idt_init();
+    fpu_init_proc();
+    sysenter_init_proc(proc);
 }
 
 thread_t * get_current() {
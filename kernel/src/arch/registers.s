@@ -18,7 +18,7 @@ flush_data_segments:
     movw %ax, %es
     movw %ax, %fs
     movw %ax, %ss
-    movl $0x18, %eax
+    movl $0x30, %eax
     movw %ax, %gs
     ret
 .size flush_data_segments, .-flush_data_segments
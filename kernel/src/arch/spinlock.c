@@ -7,6 +7,8 @@
 #include "arch/idt.h"
 #include "arch/proc.h"
 #include "arch/cpu.h"
+#include "arch/tsc.h"
+#include "sync/lockstat.h"
 #include "time/clock.h"
 
 #include "atomic_ops.h"
@@ -16,66 +18,186 @@ DEFINE_PER_CPU(list_head_t, lock_list);
 
 #define TICKET_SHIFT 16
 
-bool _spin_trylock(volatile spinlock_t *lock) {
-    check_irqs_disabled();
-    BUG_ON(!lock);
-
-    spinlock_arch_t old, new;
+bool ticket_spin_trylock(volatile ticketlock_t *lock) {
+    ticketlock_t old, new;
 
-    old.tickets = ACCESS_ONCE(lock->arch.tickets);
+    old.tickets = ACCESS_ONCE(lock->tickets);
     if (old.tickets.head != old.tickets.tail) {
-        return 0;
+        return false;
     }
     new.raw = old.raw + (1 << TICKET_SHIFT);
 
     barrier();
     /* cmpxchg is a full barrier, so nothing can move before it */
-    uint32_t res = cmpxchg(&lock->arch.raw, old.raw, new.raw);
+    uint32_t res = cmpxchg(&lock->raw, old.raw, new.raw);
     barrier();
 
-    bool ret = res == old.raw;
+    return res == old.raw;
+}
 
-    if(ret && percpu_up) {
-        if(lock->arch.holder != 0xFFFF){
-            panicf("spinlock lock violation %X vs %X", lock->arch.holder, get_percpu(this_proc)->num);
-        }
-        lock->arch.holder = get_percpu(this_proc)->num;
-        list_add(&((spinlock_t *) lock)->list, &get_percpu(lock_list));
-        get_percpu(locks_held)++;
+bool ticket_spin_lock(volatile ticketlock_t *lock) {
+    register ticket_pair_t local = {.tail = 1};
+
+    local = xchg_op(add, &lock->tickets, local);
+    if(likely(local.head == local.tail)) {
+        return false;
     }
 
-    return ret;
+    while(ACCESS_ONCE(lock->tickets.head) != local.tail) {
+        relax();
+    }
+
+    return true;
 }
 
-void _spin_lock(volatile spinlock_t *lock) {
-    check_irqs_disabled();
-    BUG_ON(!lock);
+void ticket_spin_unlock(volatile ticketlock_t *lock) {
+    barrier();
+    add(&lock->tickets.head, 1);
+    barrier();
+}
 
-    register ticket_pair_t local = {.tail = 1};
+typedef struct qnode qnode_t;
 
-    local = xchg_op(add, &lock->arch.tickets, local);
-    if(likely(local.head == local.tail)) {
-        goto lock_out;
+//Each node gets a cache line to itself, so that waiters don't disturb each
+//other.
+struct qnode {
+    qnode_t * volatile next;
+    volatile bool locked;
+} ALIGN(64);
+
+//Spinlocks are only ever taken with interrupts disabled, so a processor waits
+//on at most one lock at a time, and needs just the one node.
+static qnode_t qnodes[MAX_NUM_PROCS];
+
+bool queued_spin_trylock(volatile qspinlock_t *lock) {
+    return !ACCESS_ONCE(lock->raw) && !cmpxchg(&lock->raw, 0, 1);
+}
+
+//Before the percpu areas are up we don't know which node is ours, so just spin
+//on the whole lock. Nobody can take the lock from under the queue this way,
+//since that needs the tail to be empty.
+static void queued_spin_lock_early(volatile qspinlock_t *lock) {
+    while(!queued_spin_trylock(lock)) {
+        relax();
+    }
+}
+
+bool queued_spin_lock(volatile qspinlock_t *lock) {
+    if(likely(queued_spin_trylock(lock))) {
+        return false;
+    }
+
+    if(!percpu_up) {
+        queued_spin_lock_early(lock);
+        return true;
+    }
+
+    uint16_t tail = get_percpu(this_proc)->num + 1;
+    qnode_t *node = &qnodes[tail - 1];
+    node->next = NULL;
+    node->locked = false;
+
+    barrier();
+    uint16_t prev = xchg_op(chg, &lock->tail, tail);
+    barrier();
+
+    //Wait in line, until our predecessor makes us the head of the queue.
+    if(prev) {
+        ACCESS_ONCE(qnodes[prev - 1].next) = node;
+
+        while(!ACCESS_ONCE(node->locked)) {
+            relax();
+        }
     }
 
+    //As the head, wait for the holder to let go.
     while(true) {
-        BUG_ON(!lock);
-        if(ACCESS_ONCE(lock->arch.tickets.head) == local.tail) {
-            goto lock_out;
+        qspinlock_t val;
+        val.raw = ACCESS_ONCE(lock->raw);
+        if(val.locked) {
+            relax();
+            continue;
         }
+
+        //If we are last in line, take the lock and empty the queue at once.
+        if(val.tail == tail) {
+            if(cmpxchg(&lock->raw, val.raw, 1) == val.raw) {
+                return true;
+            }
+
+            continue;
+        }
+
+        break;
+    }
+
+    //Someone is queued up behind us, and so the tail is not empty and nobody
+    //else can be trying to set locked.
+    ACCESS_ONCE(lock->locked) = 1;
+    barrier();
+
+    qnode_t *next;
+    while(!(next = ACCESS_ONCE(node->next))) {
         relax();
     }
+    ACCESS_ONCE(next->locked) = true;
+
+    return true;
+}
 
-lock_out:
+void queued_spin_unlock(volatile qspinlock_t *lock) {
+    barrier();
+    ACCESS_ONCE(lock->locked) = 0;
+    barrier();
+}
+
+static inline void lock_acquired(volatile spinlock_t *lock, uint32_t site,
+        bool contended, uint64_t start) {
+    if(lock->arch.holder != 0xFFFF){
+        panicf("spinlock lock violation %X vs %X", lock->arch.holder, get_percpu(this_proc)->num);
+    }
+    lock->arch.holder = get_percpu(this_proc)->num;
+    list_add(&((spinlock_t *) lock)->list, &get_percpu(lock_list));
+    get_percpu(locks_held)++;
+
+#ifdef CONFIG_LOCKSTAT
+    uint64_t now = rdtsc();
+    lock->arch.site = site;
+    lock->arch.acquired = now;
+    lockstat_acquired(site, (void *) lock, contended,
+        contended ? now - start : 0);
+#endif
+}
+
+bool _spin_trylock(volatile spinlock_t *lock, uint32_t site) {
+    check_irqs_disabled();
+    BUG_ON(!lock);
+
+    barrier();
+    bool ret = queued_spin_trylock(&lock->arch.q);
+    barrier();
+
+    if(ret && percpu_up) {
+        lock_acquired(lock, site, false, 0);
+    }
+
+    return ret;
+}
+
+void _spin_lock(volatile spinlock_t *lock, uint32_t site) {
+    check_irqs_disabled();
+    BUG_ON(!lock);
+
+    uint64_t start = 0;
+#ifdef CONFIG_LOCKSTAT
+    start = rdtsc();
+#endif
+
+    bool contended = queued_spin_lock(&lock->arch.q);
     barrier();
 
     if(percpu_up) {
-        if(lock->arch.holder != 0xFFFF){
-            panicf("spinlock lock violation %X vs %X", lock->arch.holder, get_percpu(this_proc)->num);
-        }
-        lock->arch.holder = get_percpu(this_proc)->num;
-        list_add(&((spinlock_t *) lock)->list, &get_percpu(lock_list));
-        get_percpu(locks_held)++;
+        lock_acquired(lock, site, contended, start);
     }
 }
 
@@ -90,9 +212,11 @@ void _spin_unlock(volatile spinlock_t *lock) {
         lock->arch.holder = 0xFFFF;
         list_rm(&((spinlock_t *) lock)->list);
         get_percpu(locks_held)--;
+
+#ifdef CONFIG_LOCKSTAT
+        lockstat_released(lock->arch.site, rdtsc() - lock->arch.acquired);
+#endif
     }
 
-    barrier();
-    add(&lock->arch.tickets.head, 1);
-    barrier();
+    queued_spin_unlock(&lock->arch.q);
 }
@@ -1,7 +1,20 @@
 #include "arch/gdt.h"
+#include "arch/cpu.h"
+#include "arch/pl.h"
+#include "arch/mmu.h"
 #include "sched/syscall.h"
 #include "sched/sched.h"
+#include "sched/softirq.h"
 #include "init/initcall.h"
+#include "log/log.h"
+
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+#define CPUID_EDX_SEP (1 << 11)
+
+extern void sysenter_entry();
 
 static void syscall_handler(interrupt_t *interrupt, void *data) {
     enter_syscall();
@@ -26,6 +39,94 @@ static void syscall_handler(interrupt_t *interrupt, void *data) {
     leave_syscall();
 }
 
+//Whether the syscall returns a value which does not fit in %eax, and so cannot
+//go back to userspace through sysexit (which needs %edx for the user %eip).
+static inline bool syscall_uses_edx(uint32_t num) {
+    return num == NSYS_UPTIME;
+}
+
+static bool user_page_present(void *addr) {
+    ptab_t *tab = dir_get_tab(current->arch.dir, addr_to_diridx(addr));
+    uint32_t flags = MMUFLAG_PRESENT | MMUFLAG_USER;
+
+    return tab && (tabentry_get_flags(tab, addr_to_tabidx(addr)) & flags) == flags;
+}
+
+//Whether the user stack pointer points at a word of the caller's own memory.
+static bool user_esp_valid(uint32_t esp) {
+    if(esp > VIRTUAL_BASE - sizeof(uint32_t)) {
+        return false;
+    }
+
+    return user_page_present((void *) esp)
+        && user_page_present((void *) (esp + sizeof(uint32_t) - 1));
+}
+
+//Invoked by sysenter_entry with interrupts disabled. Returns true if we can
+//return to userspace using sysexit, which clobbers %ecx and %edx. Otherwise
+//the full iret path is used.
+bool sysenter_dispatch(interrupt_t *interrupt) {
+    check_irqs_disabled();
+
+    cpu_state_t *state = &interrupt->cpu;
+    uint32_t num = state->reg.eax;
+
+    //The libk stub was call'ed, so perform its ret on the way out. Userspace
+    //chose %esp, so it may point anywhere, including into the kernel.
+    if(!user_esp_valid(state->stack.esp)) {
+        task_node_exit(SIGSEGV, ECAUSE_SIG);
+
+        //This does not return, as we are now marked to die.
+        sched_try_resched(true);
+        BUG();
+    }
+
+    state->exec.eip = *((uint32_t *) state->stack.esp);
+    state->stack.esp += sizeof(uint32_t);
+
+    syscall_handler(interrupt, NULL);
+
+    //As in interrupt_dispatch(), a syscall counts as an interrupt for the
+    //threads polling for one.
+    sched_interrupt_notify();
+
+    do_softirq();
+
+    uint32_t eip = state->exec.eip;
+
+    //This might not return, e.g. in the case of should_die being marked.
+    sched_deliver_signals(state);
+    sched_try_resched(true);
+
+    //sys__sigreturn() restores the whole register state, and signal delivery
+    //redirects us to the handler with arguments in registers.
+    return num != NSYS__SIGRETURN && !syscall_uses_edx(num)
+        && state->exec.eip == eip;
+}
+
+static bool has_sysenter() {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+
+    uint32_t family = (a >> 8) & 0xF;
+    uint32_t model = (a >> 4) & 0xF;
+    uint32_t stepping = a & 0xF;
+
+    //The Pentium Pro reports SEP, but doesn't actually support it.
+    return (d & CPUID_EDX_SEP)
+        && !(family == 6 && model < 3 && stepping < 3);
+}
+
+void sysenter_init_proc(processor_t *proc) {
+    if(!has_sysenter()) {
+        return;
+    }
+
+    wrmsr(MSR_SYSENTER_CS, SEL_KRNL_CODE);
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t) &get_percpu_raw(proc->percpu_data, tss));
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_entry);
+}
+
 static INITCALL syscall_init() {
     register_isr(SYSCALL_INT, CPL_USER, syscall_handler, NULL);
 
@@ -0,0 +1,64 @@
+.global sysenter_entry
+
+.extern sysenter_dispatch
+
+# Userspace enters with the syscall number and arguments in the same registers
+# as for "int $0x80", having called a stub which loaded %ebp with %esp and then
+# executed sysenter. The CPU leaves us with interrupts disabled and %esp
+# pointing at this processor's TSS (see sysenter_init_proc()).
+#
+# We build the same interrupt_t which isr_common would have, so that the rest
+# of the kernel (signal delivery, context switches, etc.) can't tell the
+# difference. The user %eip is filled in by sysenter_dispatch().
+
+.type sysenter_entry, @function
+sysenter_entry:
+    # Switch to this thread's kernel stack (TSS esp0)
+    mov 4(%esp), %esp
+
+    pushl $0x23 # user ss
+    pushl %ebp  # user esp
+    pushfl
+    orl $0x200, (%esp) # IF was cleared by sysenter
+    pushl $0x1B # user cs
+    pushl $0    # user eip
+
+    pusha
+    pushl $0    # error
+    pushl $0x80 # vector
+    pushl %esp
+
+    mov $0x30, %ax
+    mov %ax, %gs
+
+    call sysenter_dispatch
+    addl $12, %esp
+
+    # %ecx is restored by popa, so use it as scratch.
+    mov %eax, %ecx
+
+    mov $0x30, %ax
+    mov %ax, %gs
+
+    test %cl, %cl
+    jz .slow
+
+    popa
+
+    # sysexit loads %eip from %edx and %esp from %ecx. We must restore the
+    # flags without IF, and then only reenable interrupts in the shadow of sti
+    # so that we can't be interrupted on the kernel stack after this point.
+    mov 12(%esp), %ecx
+    mov 8(%esp), %edx
+    andl $0xFFFFFDFF, %edx
+    push %edx
+    popfl
+    mov (%esp), %edx
+
+    sti
+    sysexit
+
+.slow:
+    popa
+    iret
+.size sysenter_entry, .-sysenter_entry
@@ -2,6 +2,7 @@
 #include "bug/debug.h"
 #include "arch/pit.h"
 #include "arch/tsc.h"
+#include "time/vdso.h"
 #include "log/log.h"
 
 static uint64_t initial;
@@ -16,6 +17,8 @@ clock_t tsc_clock = {
 
     .freq = 0,
     .read = tsc_read,
+
+    .vdso_mode = VDSO_CLOCK_TSC,
 };
 
 void tsc_busywait_100ms() {
@@ -57,6 +60,7 @@ void __init tsc_init() {
     }
 
     initial = rdtsc();
+    tsc_clock.vdso_offset = initial;
 
     register_clock(&tsc_clock);
 }
@@ -113,6 +113,7 @@ typedef struct tty {
     bool keystate[128];
 
     file_t *console;
+    char_device_t *cdev;
     ringbuff_head_t rb;
     spinlock_t lock;
 
@@ -297,7 +298,7 @@ static ssize_t tty_char_poll(char_device_t *cdev, fpoll_data_t *fp) {
 
     uint32_t flags;
     spin_lock_irqsave(&tty->lock, &flags);
-    fp->readable = ringbuff_is_empty(&tty->rb, char);
+    fp->readable = !ringbuff_is_empty(&tty->rb, char);
     spin_unlock_irqstore(&tty->lock, flags);
 
     fp->writable = true;
@@ -330,6 +331,8 @@ void tty_notify() {
         semaphore_up(&master->wait_semaphore);
     }
 
+    poll_notify(&master->cdev->poll_head);
+
     spin_unlock_irqstore(&master->lock, flags);
 }
 
@@ -344,6 +347,7 @@ void tty_create(char *name) {
 
     tty_t *tty = kmalloc(sizeof(tty_t));
     tty->console = vfs_open_file(&out);
+    path_put(&out);
     memset(tty->keystate, 0, sizeof(tty->keystate));
     ringbuff_init(&tty->rb, BUFFLEN, char);
     spinlock_init(&tty->lock);
@@ -351,11 +355,12 @@ void tty_create(char *name) {
     tty->read_waiting = 0;
     semaphore_init(&tty->wait_semaphore, 0);
 
-    master = tty;
-
     char_device_t *cdev = char_device_alloc();
     cdev->private = tty;
     cdev->ops = &tty_ops;
+    tty->cdev = cdev;
+
+    master = tty;
 
     register_char_device(cdev, "tty");
 
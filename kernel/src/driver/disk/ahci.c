@@ -3,12 +3,16 @@
 #include "lib/string.h"
 #include "lib/printf.h"
 #include "common/mmio.h"
+#include "common/math.h"
+#include "common/asm.h"
+#include "sync/spinlock.h"
 #include "arch/gdt.h"
 #include "arch/idt.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
 #include "time/clock.h"
 #include "fs/disk.h"
+#include "fs/bio.h"
 #include "driver/bus/pci.h"
 #include "driver/disk/ata.h"
 #include "log/log.h"
@@ -16,12 +20,53 @@
 #define AHCI_DEVICE_PREFIX "sd"
 
 #define AHCI_NUM_PORTS 32
-#define AHCI_NUM_PRDT_ENTRIES 16
+#define AHCI_NUM_SLOTS 32
+//chosen so that a command table fills exactly 1KB
+#define AHCI_NUM_PRDT_ENTRIES 56
 
+//PCI Command Register bits
+#define PCI_CMD_MAE     (1 << 1)  //Memory Access Enable
+#define PCI_CMD_BME     (1 << 2)  //Bus Mastering Enable
+
+#define AHCI_ABAR_CAP        0x00
+#define AHCI_ABAR_GHC        0x04
+#define AHCI_ABAR_IS         0x08
 #define AHCI_ABAR_PORTS_IMPL 0x0C
 
-#define PORT_CMD_ST (1 << 0)
-#define PORT_CMD_FR (1 << 4)
+#define AHCI_CAP_SNCQ (1 << 30)
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+
+#define AHCI_GHC_IE (1 << 1)
+#define AHCI_GHC_AE (1 << 31)
+
+#define PORT_CMD_ST  (1 << 0)
+#define PORT_CMD_FRE (1 << 4)
+#define PORT_CMD_FR  (1 << 14)
+#define PORT_CMD_CR  (1 << 15)
+
+#define PORT_TFD_DRQ (1 << 3)
+#define PORT_TFD_BSY (1 << 7)
+
+#define PORT_SCTL_DET_MASK  0xF
+#define PORT_SCTL_DET_RESET 0x1
+
+//in milliseconds, the longest the HBA is allowed to take to start or stop a
+//port
+#define AHCI_PORT_TIMEOUT 500
+//in microseconds
+#define AHCI_POLL_INTERVAL 10
+
+#define PORT_INT_DHRS (1 << 0)
+#define PORT_INT_SDBS (1 << 3)
+#define PORT_INT_IFS  (1 << 27)
+#define PORT_INT_HBDS (1 << 28)
+#define PORT_INT_HBFS (1 << 29)
+#define PORT_INT_TFES (1 << 30)
+
+#define PORT_INT_ERROR (PORT_INT_IFS | PORT_INT_HBDS | PORT_INT_HBFS | PORT_INT_TFES)
+
+//the interrupts the port raises once it is taking requests
+#define PORT_INT_ENABLED (PORT_INT_DHRS | PORT_INT_SDBS | PORT_INT_ERROR)
 
 #define PORT_REG_PxCLB  0x00
 #define PORT_REG_PxCLBU 0x04
@@ -64,8 +109,11 @@ typedef enum ahci_port_type {
     PORT_TYPE_SATAPI,
 } ahci_port_type_t;
 
+typedef struct ahci_port ahci_port_t;
+
 typedef struct ahci_controller {
     void *base;
+    ahci_port_t *ports[AHCI_NUM_PORTS];
 } ahci_controller_t;
 
 typedef struct ahci_cmd_fis {
@@ -132,11 +180,12 @@ typedef volatile struct ahci_port_cmdtable {
     prd_t prdt[AHCI_NUM_PRDT_ENTRIES];
 } PACKED ahci_cmdtable_t;
 
-typedef struct ahci_port {
+struct ahci_port {
     ahci_port_type_t type;
     uint32_t num;
     ahci_controller_t *cont;
 
+    //one header and one table for each command slot
     ahci_cmdlist_t *cmdlist;
     uint32_t cmdlist_phys;
 
@@ -146,144 +195,430 @@ typedef struct ahci_port {
     ahci_cmdtable_t *cmdtable;
     uint32_t cmdtable_phys;
 
+    //whether requests are issued as NCQ commands, in which case there can be
+    //as many outstanding as there are slots
+    bool ncq;
+    //where the NCQ Command Error log is read to after an error, if ncq
+    uint8_t *ncq_log;
+
+    //protects dead, active and slots, and the issuing of commands
+    spinlock_t lock;
+    //set once the port could not be restarted, after which every request fails
+    bool dead;
+    uint32_t active;
+    request_t *slots[AHCI_NUM_SLOTS];
+
     block_device_t *blockdev;
-} ahci_port_t;
+};
 
 #define AHCI_PORT_BASE 0x100
 #define AHCI_PORT_SIZE 0x080
 
+#define AHCI_ABAR_SIZE (AHCI_PORT_BASE + (AHCI_NUM_PORTS * AHCI_PORT_SIZE))
+
 static inline void * port_to_base(ahci_port_t *port) {
     return (void *) (((uint32_t) port->cont->base) + AHCI_PORT_BASE + (port->num * AHCI_PORT_SIZE));
 }
 
-static ssize_t sata_access(bool write, ahci_port_t *port, void *buff, size_t lba, size_t count) {
+//The port is started once it has been found to have a disk attached, and stays
+//started. Requests are each given a command slot, which is issued and then
+//completed from the port interrupt, so that if the disk supports NCQ it can
+//have as many requests outstanding as there are slots, and reorder them
+//itself.
+
+//Waits for the bits of reg in mask to equal val, for at most AHCI_PORT_TIMEOUT.
+//Returns false if they never did.
+static bool port_wait(void *port_base, uint32_t reg, uint32_t mask, uint32_t val) {
+    for(uint32_t i = 0; i < (AHCI_PORT_TIMEOUT * MICROS_PER_MILLI) / AHCI_POLL_INTERVAL; i++) {
+        if((readl(port_base, reg) & mask) == val) {
+            return true;
+        }
+
+        udelay(AHCI_POLL_INTERVAL);
+    }
+
+    return (readl(port_base, reg) & mask) == val;
+}
+
+//These return false if the HBA (or the drive) did not respond in time.
+
+static bool port_start(ahci_port_t *port) {
+    void *port_base = port_to_base(port);
+
+    if(!port_wait(port_base, PORT_REG_PxCMD, PORT_CMD_CR, 0)
+        || !port_wait(port_base, PORT_REG_PxTFD, PORT_TFD_BSY | PORT_TFD_DRQ, 0)) {
+        return false;
+    }
+
+    writel(port_base, PORT_REG_PxCMD, readl(port_base, PORT_REG_PxCMD) | PORT_CMD_FRE);
+    writel(port_base, PORT_REG_PxCMD, readl(port_base, PORT_REG_PxCMD) | PORT_CMD_ST);
+
+    return true;
+}
+
+static bool port_stop(ahci_port_t *port) {
     void *port_base = port_to_base(port);
 
-    memset((void *) port->cmdlist, 0, sizeof(ahci_cmdlist_t));
-    port->cmdlist->fis_length = sizeof(ahci_cmd_fis_t) / sizeof(uint32_t);
-    port->cmdlist->cmdtable_addr_low = port->cmdtable_phys;
-    port->cmdlist->cmdtable_addr_high = 0;
+    writel(port_base, PORT_REG_PxCMD, readl(port_base, PORT_REG_PxCMD) & ~PORT_CMD_ST);
+    if(!port_wait(port_base, PORT_REG_PxCMD, PORT_CMD_CR, 0)) {
+        return false;
+    }
 
-    memset((void *) &port->cmdtable->fis, 0, sizeof(ahci_cmd_fis_t));
-    port->cmdtable->fis.type = FIS_TYPE_H2D;
-    port->cmdtable->fis.is_command = true;
-    port->cmdtable->fis.command = write ? ATA_CMD_DMA_WRITE_EXT : ATA_CMD_DMA_READ_EXT;
+    writel(port_base, PORT_REG_PxCMD, readl(port_base, PORT_REG_PxCMD) & ~PORT_CMD_FRE);
+    return port_wait(port_base, PORT_REG_PxCMD, PORT_CMD_FR, 0);
+}
 
-    port->cmdtable->fis.lba0 = (lba >> 0) & 0xFF;
-	port->cmdtable->fis.lba1 = (lba >> 8) & 0xFF;
-	port->cmdtable->fis.lba2 = (lba >> 16) & 0xFF;
-	port->cmdtable->fis.lba3 = (lba >> 24) & 0xFF;
-	port->cmdtable->fis.lba4 = /*(lba >> 32) & 0xFF*/ 0;
-	port->cmdtable->fis.lba5 = /*(lba >> 40) & 0xFF*/ 0;
+//Resets the link (a COMRESET), which brings back a drive which is stuck busy,
+//and can free up a port which will not stop.
+static bool port_reset(ahci_port_t *port) {
+    void *port_base = port_to_base(port);
 
-	port->cmdtable->fis.device = 1 << 6;
+    uint32_t sctl = readl(port_base, PORT_REG_PxSCTL) & ~PORT_SCTL_DET_MASK;
+    writel(port_base, PORT_REG_PxSCTL, sctl | PORT_SCTL_DET_RESET);
+    udelay(1000);
+    writel(port_base, PORT_REG_PxSCTL, sctl);
 
-	port->cmdtable->fis.count_low = count & 0xFF;
-	port->cmdtable->fis.count_high = (count >> 8) & 0xFF;
+    bool ok = port_wait(port_base, PORT_REG_PxSSTS, 0x0F, PORT_STATUS_DET_PRESENT);
+    writel(port_base, PORT_REG_PxSERR, readl(port_base, PORT_REG_PxSERR));
 
-    uint32_t addr = (uint32_t) virt_to_phys(buff);
-    uint32_t i;
-    for(i = 0; i < AHCI_NUM_PRDT_ENTRIES - 1 && count >= 16; i++) {
-        memset((void *) &port->cmdtable->prdt[i], 0, sizeof(prd_t));
-		port->cmdtable->prdt[i].addr_low = addr;
-		port->cmdtable->prdt[i].bytes = 16 * ATA_SECTOR_SIZE;
+    return ok;
+}
 
-		addr += 16 * ATA_SECTOR_SIZE;
-		count -= 16;
-	}
+//Stops and starts the port, which aborts every command outstanding, resetting
+//the link if that does not work.
+static bool port_restart(ahci_port_t *port) {
+    void *port_base = port_to_base(port);
 
-	if(count) {
-        memset((void *) &port->cmdtable->prdt[i], 0, sizeof(prd_t));
-	    port->cmdtable->prdt[i].addr_low = addr;
-	    port->cmdtable->prdt[i].bytes = count * ATA_SECTOR_SIZE;
+    if(!port_stop(port) && (!port_reset(port) || !port_stop(port))) {
+        return false;
+    }
 
-        port->cmdlist->prdt_length = i + 1;
-	} else {
-        port->cmdlist->prdt_length = i;
-	}
+    writel(port_base, PORT_REG_PxSERR, readl(port_base, PORT_REG_PxSERR));
+    writel(port_base, PORT_REG_PxIS, readl(port_base, PORT_REG_PxIS));
 
-    writel(port->cont->base, PORT_REG_PxIS, 0);
+    if(port_start(port)) {
+        return true;
+    }
 
-    uint32_t tmp = readl(port_base, PORT_REG_PxCMD);
-    tmp |= PORT_CMD_ST;
-    tmp |= PORT_CMD_FR;
-    writel(port_base, PORT_REG_PxCMD, tmp);
+    //The drive is stuck busy.
+    if(!port_stop(port) || !port_reset(port)) {
+        return false;
+    }
 
-    writel(port_base, PORT_REG_PxCI, 1);
-    while(readl(port_base, PORT_REG_PxCI));
+    writel(port_base, PORT_REG_PxIS, readl(port_base, PORT_REG_PxIS));
 
-    tmp = readl(port_base, PORT_REG_PxCMD);
-    tmp &= ~PORT_CMD_ST;
-    tmp &= ~PORT_CMD_FR;
-    writel(port_base, PORT_REG_PxCMD, tmp);
+    return port_start(port);
+}
 
-    return 1;
+//Fills in the header and table of slot, save for the FIS command and count,
+//and returns the FIS.
+static volatile ahci_cmd_fis_t * port_setup_slot(ahci_port_t *port,
+    uint32_t slot, bool write, uint64_t lba) {
+    volatile ahci_cmd_fis_t *fis = &port->cmdtable[slot].fis;
+
+    memset((void *) &port->cmdlist[slot], 0, sizeof(ahci_cmdlist_t));
+    port->cmdlist[slot].fis_length = sizeof(ahci_cmd_fis_t) / sizeof(uint32_t);
+    port->cmdlist[slot].write = write;
+    port->cmdlist[slot].cmdtable_addr_low = port->cmdtable_phys + (slot * sizeof(ahci_cmdtable_t));
+    port->cmdlist[slot].cmdtable_addr_high = 0;
+
+    memset((void *) fis, 0, sizeof(ahci_cmd_fis_t));
+    fis->type = FIS_TYPE_H2D;
+    fis->is_command = true;
+    fis->device = 1 << 6;
+
+    fis->lba0 = (lba >> 0) & 0xFF;
+    fis->lba1 = (lba >> 8) & 0xFF;
+    fis->lba2 = (lba >> 16) & 0xFF;
+    fis->lba3 = (lba >> 24) & 0xFF;
+    fis->lba4 = (lba >> 32) & 0xFF;
+    fis->lba5 = (lba >> 40) & 0xFF;
+
+    return fis;
 }
 
-static ssize_t ahci_read(block_device_t *device, void *buff, size_t start, size_t blocks) {
-    ahci_port_t *port = device->private;
-    if(port->type == PORT_TYPE_SATA) {
-        return sata_access(false, port, buff, start, blocks);
-    } else if(port->type == PORT_TYPE_SATAPI) {
-        //TODO implement SATAPI
-        return -1;
+//Invoked under port->lock.
+static void sata_issue(ahci_port_t *port, uint32_t slot, request_t *req) {
+    bool write = req->dir == BIO_WRITE;
+    volatile ahci_cmd_fis_t *fis = port_setup_slot(port, slot, write, req->block);
+
+    if(port->ncq) {
+        //NCQ commands take the count in the features field, and the tag in
+        //the count field.
+        fis->command = write ? ATA_CMD_FPDMA_WRITE : ATA_CMD_FPDMA_READ;
+        fis->feature_low = req->count & 0xFF;
+        fis->feature_high = (req->count >> 8) & 0xFF;
+        fis->count_low = slot << 3;
+    } else {
+        fis->command = write ? ATA_CMD_DMA_WRITE_EXT : ATA_CMD_DMA_READ_EXT;
+        fis->count_low = req->count & 0xFF;
+        fis->count_high = (req->count >> 8) & 0xFF;
     }
 
-    return -1;
+    //Pieces which happen to be physically contiguous share an entry.
+    volatile prd_t *prdt = port->cmdtable[slot].prdt;
+    uint32_t num = 0;
+    uint32_t end = 0;
+
+    bio_t *bio;
+    bio_vec_t *vec;
+    REQUEST_FOR_EACH_VEC(req, bio, vec) {
+        uint32_t addr = ((uint32_t) page_to_phys(vec->page)) + vec->offset;
+
+        if(num && end == addr) {
+            prdt[num - 1].bytes += vec->len;
+        } else {
+            BUG_ON(num == AHCI_NUM_PRDT_ENTRIES);
+
+            memset((void *) &prdt[num], 0, sizeof(prd_t));
+            prdt[num].addr_low = addr;
+            prdt[num].bytes = vec->len - 1;
+            num++;
+        }
+
+        end = addr + vec->len;
+    }
+
+    port->cmdlist[slot].prdt_length = num;
+
+    void *port_base = port_to_base(port);
+    if(port->ncq) {
+        writel(port_base, PORT_REG_PxSACT, 1 << slot);
+    }
+    writel(port_base, PORT_REG_PxCI, 1 << slot);
+}
+
+//Issues the command set up in slot 0, which reads a single sector into buff,
+//and polls for it to finish. Returns false if it failed or did not finish in
+//time.
+static bool port_exec_polled(ahci_port_t *port, void *buff) {
+    void *port_base = port_to_base(port);
+
+    memset((void *) &port->cmdtable[0].prdt[0], 0, sizeof(prd_t));
+    port->cmdtable[0].prdt[0].addr_low = (uint32_t) virt_to_phys(buff);
+    port->cmdtable[0].prdt[0].bytes = ATA_SECTOR_SIZE - 1;
+    port->cmdlist[0].prdt_length = 1;
+
+    writel(port_base, PORT_REG_PxCI, 1);
+
+    for(uint32_t i = 0; i < (AHCI_PORT_TIMEOUT * MICROS_PER_MILLI) / AHCI_POLL_INTERVAL; i++) {
+        if(readl(port_base, PORT_REG_PxIS) & PORT_INT_TFES) {
+            return false;
+        }
+
+        if(!(readl(port_base, PORT_REG_PxCI) & 1)) {
+            return true;
+        }
+
+        udelay(AHCI_POLL_INTERVAL);
+    }
+
+    return false;
 }
 
-static ssize_t ahci_write(block_device_t *device, void *buff, size_t start, size_t blocks) {
+static void ahci_submit(block_device_t *device, request_t *req) {
     ahci_port_t *port = device->private;
-    if(port->type == PORT_TYPE_SATA) {
-        return sata_access(true, port, buff, start, blocks);
-    } else if(port->type == PORT_TYPE_SATAPI) {
-        //TODO implement SATAPI
-        return -1;
+
+    uint32_t flags;
+    spin_lock_irqsave(&port->lock, &flags);
+
+    if(port->dead) {
+        spin_unlock_irqstore(&port->lock, flags);
+
+        request_complete(req, -EIO);
+        return;
     }
 
-    return -1;
+    //The queue never gives us more requests than there are slots.
+    BUG_ON(port->active == ~((uint32_t) 0));
+    uint32_t slot = __builtin_ctz(~port->active);
+    BUG_ON(slot >= device->queue_depth);
+
+    port->active |= 1 << slot;
+    port->slots[slot] = req;
+
+    sata_issue(port, slot, req);
+
+    spin_unlock_irqstore(&port->lock, flags);
 }
 
 static block_device_ops_t ahci_device_ops = {
-    .read = ahci_read,
-    .write = ahci_write,
+    .submit = ahci_submit,
 };
 
-static void sata_identify(ahci_port_t *port) {
-    port->type = PORT_TYPE_SATA;
+//Invoked under port->lock. After an error on an NCQ command the drive refuses
+//any more of them until its NCQ Command Error log has been read, which also
+//tells us which command failed. Returns false if the log could not be read.
+static bool port_read_ncq_log(ahci_port_t *port) {
+    void *port_base = port_to_base(port);
+
+    //The port interrupt must not see this command complete.
+    writel(port_base, PORT_REG_PxIE, 0);
+
+    volatile ahci_cmd_fis_t *fis = port_setup_slot(port, 0, false, ATA_LOG_NCQ_ERROR);
+    fis->command = ATA_CMD_READ_LOG_EXT;
+    fis->count_low = 1;
+
+    bool ok = port_exec_polled(port, port->ncq_log);
+
+    writel(port_base, PORT_REG_PxIS, readl(port_base, PORT_REG_PxIS));
+    writel(port_base, PORT_REG_PxIE, PORT_INT_ENABLED);
+
+    if(ok && !(port->ncq_log[0] & ATA_NCQ_LOG_NQ)) {
+        kprintf("ahci - port %u NCQ error on tag %u", port->num,
+            port->ncq_log[0] & ATA_NCQ_LOG_TAG_MASK);
+    }
+
+    return ok;
+}
+
+//Invoked under port->lock.
+static void port_kill(ahci_port_t *port) {
+    kprintf("ahci - port %u not responding, giving up on it", port->num);
+
+    port->dead = true;
+    writel(port_to_base(port), PORT_REG_PxIE, 0);
+}
 
+//Invoked under port->lock. Restarting the port aborts every command which was
+//outstanding, so once it is running again we reissue all of them but the one
+//which failed. Returns the slots of outstanding whose requests have failed. If
+//the port cannot be restarted it is given up on, rather than left to hang
+//whoever touches it next.
+static uint32_t port_recover(ahci_port_t *port, uint32_t outstanding) {
     void *port_base = port_to_base(port);
-    uint8_t *buff = kmalloc(ATA_SECTOR_SIZE);
 
-    memset((void *) port->cmdlist, 0, sizeof(ahci_cmdlist_t));
-    port->cmdlist->fis_length = sizeof(ahci_cmd_fis_t) / sizeof(uint32_t);
-    port->cmdlist->prdt_length = 1;
-    port->cmdlist->cmdtable_addr_low = port->cmdtable_phys;
-    port->cmdlist->cmdtable_addr_high = 0;
+    kprintf("ahci - port %u error (TFD 0x%X, SERR 0x%X)", port->num,
+        readl(port_base, PORT_REG_PxTFD), readl(port_base, PORT_REG_PxSERR));
 
-    memset((void *) &port->cmdtable->fis, 0, sizeof(ahci_cmd_fis_t));
-    port->cmdtable->fis.type = FIS_TYPE_H2D;
-    port->cmdtable->fis.is_command = true;
-    port->cmdtable->fis.command = ATA_CMD_IDENTIFY;
+    if(!port_restart(port)) {
+        port_kill(port);
+        return outstanding;
+    }
+
+    //Without NCQ only one command can have been outstanding, and it failed.
+    uint32_t failed = outstanding;
+
+    if(port->ncq) {
+        if(port_read_ncq_log(port)) {
+            //Unless the log blames a non-queued command, in which case we do
+            //not know which of ours failed, it names the one which did.
+            if(!(port->ncq_log[0] & ATA_NCQ_LOG_NQ)) {
+                failed &= 1 << (port->ncq_log[0] & ATA_NCQ_LOG_TAG_MASK);
+            }
+        } else {
+            //If the log cannot be read the drive will go on refusing NCQ
+            //commands, so carry on without them, one request at a time.
+            kprintf("ahci - port %u falling back from NCQ", port->num);
+
+            port->ncq = false;
+            port->blockdev->queue_depth = 1;
+
+            if(!port_restart(port)) {
+                port_kill(port);
+            }
+
+            return outstanding;
+        }
+    }
 
-    memset((void *) &port->cmdtable->prdt[0], 0, sizeof(prd_t));
-    port->cmdtable->prdt[0].addr_low = (uint32_t) virt_to_phys(buff);
-    port->cmdtable->prdt[0].bytes = ATA_SECTOR_SIZE - 1;
+    uint32_t retry = outstanding & ~failed;
+    while(retry) {
+        uint32_t slot = __builtin_ctz(retry);
+        retry &= ~(1 << slot);
 
-    writel(port->cont->base, PORT_REG_PxIS, 0);
+        sata_issue(port, slot, port->slots[slot]);
+    }
 
-    uint32_t tmp = readl(port_base, PORT_REG_PxCMD);
-    tmp |= PORT_CMD_ST;
-    tmp |= PORT_CMD_FR;
-    writel(port_base, PORT_REG_PxCMD, tmp);
+    return failed;
+}
 
-    writel(port_base, PORT_REG_PxCI, 1);
-    while(readl(port_base, PORT_REG_PxCI));
+//Invoked under port->lock. Returns the slots the drive has not yet completed.
+static uint32_t port_busy(ahci_port_t *port) {
+    void *port_base = port_to_base(port);
+
+    uint32_t busy = readl(port_base, PORT_REG_PxCI);
+    if(port->ncq) {
+        busy |= readl(port_base, PORT_REG_PxSACT);
+    }
+
+    return busy;
+}
+
+static void port_interrupt(ahci_port_t *port) {
+    void *port_base = port_to_base(port);
+
+    uint32_t status = readl(port_base, PORT_REG_PxIS);
+    writel(port_base, PORT_REG_PxIS, status);
+
+    request_t *done[AHCI_NUM_SLOTS];
+    int32_t errors[AHCI_NUM_SLOTS];
+    uint32_t num = 0;
+
+    spin_lock(&port->lock);
+
+    //Commands which the drive completed before any error succeeded.
+    uint32_t busy = port_busy(port);
+    uint32_t finished = port->active & ~busy;
+    uint32_t failed = 0;
+
+    if(status & PORT_INT_ERROR) {
+        failed = port_recover(port, port->active & busy);
+        finished |= failed;
+    }
+
+    port->active &= ~finished;
+    while(finished) {
+        uint32_t slot = __builtin_ctz(finished);
+        finished &= ~(1 << slot);
+
+        done[num] = port->slots[slot];
+        errors[num] = (failed & (1 << slot)) ? -EIO : 0;
+        num++;
+
+        port->slots[slot] = NULL;
+    }
+
+    spin_unlock(&port->lock);
+
+    for(uint32_t i = 0; i < num; i++) {
+        request_complete(done[i], errors[i]);
+    }
+}
+
+static void handle_ahci_irq(interrupt_t UNUSED(*interrupt), void *data) {
+    ahci_controller_t *cont = data;
+
+    uint32_t pending = readl(cont->base, AHCI_ABAR_IS);
+    if(!pending) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < AHCI_NUM_PORTS; i++) {
+        if((pending & (1 << i)) && cont->ports[i]) {
+            port_interrupt(cont->ports[i]);
+        }
+    }
+
+    writel(cont->base, AHCI_ABAR_IS, pending);
+}
 
-    tmp = readl(port_base, PORT_REG_PxCMD);
-    tmp &= ~PORT_CMD_ST;
-    tmp &= ~PORT_CMD_FR;
-    writel(port_base, PORT_REG_PxCMD, tmp);
+static void sata_identify(ahci_port_t *port) {
+    port->type = PORT_TYPE_SATA;
+
+    void *port_base = port_to_base(port);
+    uint8_t *buff = kmalloc(ATA_SECTOR_SIZE);
+
+    //The port interrupts are not enabled yet, so this is polled.
+    volatile ahci_cmd_fis_t *fis = port_setup_slot(port, 0, false, 0);
+    fis->command = ATA_CMD_IDENTIFY;
+    fis->device = 0;
+
+    if(!port_exec_polled(port, buff)) {
+        kprintf("ahci - port %u IDENTIFY failed", port->num);
+        kfree(buff);
+        return;
+    }
 
     char model[ATA_MODEL_LENGTH + 1];
     for(uint8_t k = 0; k < ATA_MODEL_LENGTH; k += 2) {
@@ -292,14 +627,34 @@ static void sata_identify(ahci_port_t *port) {
     }
     model[ATA_MODEL_LENGTH] = 0;
 
-    uint32_t size = *((uint32_t *) (buff + ATA_IDENT_MAX_LBA_EXT));
+    //Block numbers are only 32 bits wide, so anything past that is unusable.
+    uint64_t sectors = *((uint64_t *) (buff + ATA_IDENT_MAX_LBA_EXT));
+    size_t size = sectors > SIZE_MAX ? SIZE_MAX : sectors;
+
+    uint32_t cap = readl(port->cont->base, AHCI_ABAR_CAP);
+    uint16_t sata_caps = *((uint16_t *) (buff + ATA_IDENT_SATA_CAPS));
+    uint32_t depth = (*((uint16_t *) (buff + ATA_IDENT_QUEUE_DEPTH)) & 0x1F) + 1;
 
-    kprintf("ahci - SATA   %s %7uMB", model, size / 1024 / 2);
+    port->ncq = (cap & AHCI_CAP_SNCQ) && (sata_caps & ATA_SATA_CAP_NCQ);
+    depth = port->ncq ? MIN(depth, AHCI_CAP_NCS(cap)) : 1;
+
+    if(port->ncq) {
+        port->ncq_log = buff;
+    } else {
+        kfree(buff);
+    }
+
+    kprintf("ahci - SATA   %s %7uMB (queue depth %u)", model, size / 1024 / 2, depth);
+
+    writel(port_base, PORT_REG_PxIS, readl(port_base, PORT_REG_PxIS));
+    writel(port_base, PORT_REG_PxIE, PORT_INT_ENABLED);
 
     port->blockdev = block_device_alloc();
     port->blockdev->ops = &ahci_device_ops;
-    port->blockdev->size = DIV_UP(size, ATA_SECTOR_SIZE);
+    port->blockdev->size = size;
     port->blockdev->block_size = ATA_SECTOR_SIZE;
+    port->blockdev->queue_depth = depth;
+    port->blockdev->max_segments = AHCI_NUM_PRDT_ENTRIES;
     port->blockdev->private = port;
 
     static uint32_t count = 0;
@@ -326,17 +681,22 @@ static bool ahci_probe(device_t *device) {
     if(!pci_device->bar[5]) return false;
 
     ahci_controller_t *cont = device->private = kmalloc(sizeof(ahci_controller_t));
+    memset(cont->ports, 0, sizeof(cont->ports));
+
+    cont->base = map_pages(BAR_ADDR_32(pci_device->bar[5]), DIV_UP(AHCI_ABAR_SIZE, PAGE_SIZE));
+    register_isr(pci_device->interrupt, CPL_KRNL, handle_ahci_irq, cont);
 
-    cont->base = map_page(pci_device->bar[5]);
+    pci_writel(pci_device->loc, PCI_FULL_CMDSTA, pci_readl(pci_device->loc, PCI_FULL_CMDSTA) | PCI_CMD_MAE | PCI_CMD_BME);
 
     return true;
 }
 
-/*
-static void handle_ahci_irq(interrupt_t *interrupt, ahci_controller_t *cont) {
-
+static void port_free(ahci_port_t *port) {
+    free_pages(virt_to_page((void *) port->cmdlist), DIV_UP(AHCI_NUM_SLOTS * sizeof(ahci_cmdlist_t), PAGE_SIZE));
+    free_page(virt_to_page(port->recvfis));
+    free_pages(virt_to_page((void *) port->cmdtable), DIV_UP(AHCI_NUM_SLOTS * sizeof(ahci_cmdtable_t), PAGE_SIZE));
+    kfree(port);
 }
-*/
 
 static void port_init(ahci_controller_t *cont, uint32_t num) {
     ahci_port_t *port = kmalloc(sizeof(ahci_port_t));
@@ -344,7 +704,23 @@ static void port_init(ahci_controller_t *cont, uint32_t num) {
     port->num = num;
     port->type = PORT_TYPE_NONE;
 
-    page_t *page = alloc_pages(DIV_UP(sizeof(ahci_cmdlist_t), PAGE_SIZE), 0);
+    void *port_base = port_to_base(port);
+
+    writel(port_base, PORT_REG_PxIE, 0);
+
+    //Is the port unused?
+    if ((readl(port_base, PORT_REG_PxSSTS) & 0x0F) != PORT_STATUS_DET_PRESENT) {
+        kfree(port);
+        return;
+    }
+
+    //Is the port powered down?
+    if (((readl(port_base, PORT_REG_PxSSTS) >> 8) & 0x0F) != PORT_STATUS_IPM_ACTIVE) {
+        kfree(port);
+        return;
+    }
+
+    page_t *page = alloc_pages(DIV_UP(AHCI_NUM_SLOTS * sizeof(ahci_cmdlist_t), PAGE_SIZE), 0);
     port->cmdlist = (ahci_cmdlist_t *) page_to_virt(page);
     port->cmdlist_phys = (uint32_t) page_to_phys(page);
 
@@ -352,28 +728,37 @@ static void port_init(ahci_controller_t *cont, uint32_t num) {
     port->recvfis = (uint8_t *) page_to_virt(page);
     port->recvfis_phys = (uint32_t) page_to_phys(page);
 
-    page = alloc_pages(DIV_UP(sizeof(ahci_cmdtable_t), PAGE_SIZE), 0);
+    page = alloc_pages(DIV_UP(AHCI_NUM_SLOTS * sizeof(ahci_cmdtable_t), PAGE_SIZE), 0);
     port->cmdtable = (ahci_cmdtable_t *) page_to_virt(page);
     port->cmdtable_phys = (uint32_t) page_to_phys(page);
 
-    void *port_base = port_to_base(port);
+    port->ncq = false;
+    port->ncq_log = NULL;
+    spinlock_init(&port->lock);
+    port->dead = false;
+    port->active = 0;
+
+    //The firmware may have left the port running.
+    if(!port_stop(port) && (!port_reset(port) || !port_stop(port))) {
+        kprintf("ahci - port %u will not stop", num);
+        port_free(port);
+        return;
+    }
 
     writel(port_base, PORT_REG_PxCLB , port->cmdlist_phys);
     writel(port_base, PORT_REG_PxCLBU, 0);
     writel(port_base, PORT_REG_PxFB  , port->recvfis_phys);
     writel(port_base, PORT_REG_PxFBU , 0);
-    writel(port_base, PORT_REG_PxIS  , 0);
-    writel(port_base, PORT_REG_PxIE  , 0);
+    writel(port_base, PORT_REG_PxSERR, readl(port_base, PORT_REG_PxSERR));
+    writel(port_base, PORT_REG_PxIS  , readl(port_base, PORT_REG_PxIS));
 
-    //Is the port unused?
-    if ((readl(port_base, PORT_REG_PxSSTS) & 0x0F) != PORT_STATUS_DET_PRESENT) {
+    if(!port_start(port)) {
+        kprintf("ahci - port %u will not start", num);
+        port_free(port);
         return;
     }
 
-    //Is the port powered down?
-    if (((readl(port_base, PORT_REG_PxSSTS) >> 8) & 0x0F) != PORT_STATUS_IPM_ACTIVE) {
-        return;
-    }
+    cont->ports[num] = port;
 
     switch (readl(port_base, PORT_REG_PxSIG)) {
         case PORT_SIG_SATAPI:
@@ -394,6 +779,10 @@ static void port_init(ahci_controller_t *cont, uint32_t num) {
 static void ahci_enable(device_t *device) {
     ahci_controller_t *cont = device->private;
 
+    writel(cont->base, AHCI_ABAR_GHC, readl(cont->base, AHCI_ABAR_GHC) | AHCI_GHC_AE);
+    writel(cont->base, AHCI_ABAR_IS, readl(cont->base, AHCI_ABAR_IS));
+    writel(cont->base, AHCI_ABAR_GHC, readl(cont->base, AHCI_ABAR_GHC) | AHCI_GHC_IE);
+
     uint32_t ports_impl = readl(cont->base, AHCI_ABAR_PORTS_IMPL);
     for(uint32_t i = 0; i < AHCI_NUM_PORTS; i++) {
         if(ports_impl & 1) {
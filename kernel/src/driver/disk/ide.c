@@ -10,8 +10,11 @@
 #include "arch/idt.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
-#include "time/clock.h" //FIXME sleep(1) should be microseconds not hundredths of a second
+#include "time/clock.h"
+#include "sync/spinlock.h"
+#include "sync/mutex.h"
 #include "fs/block.h"
+#include "fs/bio.h"
 #include "fs/disk.h"
 #include "device/device.h"
 #include "driver/bus/pci.h"
@@ -107,17 +110,30 @@
 
 #define MAX_PRD_ENTRIES         PAGE_SIZE / 8
 #define PRD(address, count)     ((((((uint64_t) (count)) & 0xFFFE) << 32) | (((uint32_t) (address)) & 0xFFFFFFFE)))
+#define PRD_EOT                 (1ULL << 63)
+
+//PCI Command Register bits
+#define PCI_CMD_BME     (1 << 2)  //Bus Mastering Enable
+
+typedef struct ide_device ide_device_t;
 
 typedef struct ide_channel {
     uint16_t      base;   // I/O Base.
     uint16_t      ctrl;   // Control Base
     uint16_t      bmide;  // Bus Master IDE
     page_t        *prdt;
-    volatile bool irq;
     uint8_t       nIEN;   // nIEN (No Interrupt);
+    bool          dma;    // Transfers use bus-master DMA
+    mutex_t       lock;   // Held across each PIO command
+
+    ide_device_t  *drives[2];  // Indexed by ATA_MASTER/ATA_SLAVE
+
+    spinlock_t    queue_lock;  // Protects active, turn and drive->waiting
+    request_t     *active;     // The DMA request in progress
+    uint8_t       turn;        // The drive whose request was started last
 } ide_channel_t;
 
-typedef struct ide_device {
+struct ide_device {
     bool        present;       // 0 (Empty) or 1 (This Drive really exists).
     uint8_t     channel;       // 0 (Primary Channel) or 1 (Secondary Channel).
     uint8_t     drive;        // 0 (Master Drive) or 1 (Slave Drive).
@@ -130,8 +146,10 @@ typedef struct ide_device {
     char        model[41];     // Model in string.
     uint32_t    num;
 
+    request_t   *waiting;      // Waiting for the channel to become free.
+
     block_device_t device;
-} ide_device_t;
+};
 
 static ide_channel_t channels[2];
 static ide_device_t ide_devices[4];
@@ -272,51 +290,143 @@ uint8_t ide_print_error(uint32_t drive, uint8_t err) {
     return err;
 }
 
-static void handle_irq_primary(interrupt_t *interrupt, void *data) {
-    uint8_t status = ide_mmio_read(ATA_PRIMARY, ATA_REG_BMSTATUS);
+//Channels whose drives all support it use bus-master DMA. The two drives on a
+//channel cannot both be busy, so requests are issued one at a time per channel
+//and completed from the channel interrupt, while whoever submitted them
+//sleeps. Each drive has at most one request waiting for the channel, since its
+//queue depth is 1.
+
+//Invoked under queue_lock of the channel.
+static void ide_dma_start(uint8_t channel, request_t *req) {
+    ide_channel_t *chan = &channels[channel];
+    ide_device_t *device = containerof(req->device, ide_device_t, device);
+    bool write = req->dir == BIO_WRITE;
+    uint32_t lba = req->block;
+    uint32_t count = req->count;
+
+    chan->active = req;
+
+    //A piece never crosses a page, and so never a 64KB boundary either.
+    uint64_t *prdt = (uint64_t *) page_to_virt(chan->prdt);
+    uint32_t num = 0;
+
+    bio_t *bio;
+    bio_vec_t *vec;
+    REQUEST_FOR_EACH_VEC(req, bio, vec) {
+        BUG_ON(num == MAX_PRD_ENTRIES);
+        prdt[num++] = PRD(((uint32_t) page_to_phys(vec->page)) + vec->offset, vec->len);
+    }
+    prdt[num - 1] |= PRD_EOT;
 
-    if(status & ATA_BMSTATUS_ERROR) panic("IDE - Primary Channel Data Transfer Error");
+    ide_mmio_write_long(channel, ATA_REG_PRDTABLE, (uint32_t) page_to_phys(chan->prdt));
+    ide_mmio_write(channel, ATA_REG_BMSTATUS, ATA_BMSTATUS_ERROR | ATA_BMSTATUS_INTERRUPT);
+    ide_mmio_write(channel, ATA_REG_BMCOMMAND, write ? ATA_BMCMD_WRITE : ATA_BMCMD_READ);
 
-    if(status & ATA_BMSTATUS_INTERRUPT) {
-        ide_mmio_write(ATA_PRIMARY, ATA_REG_BMSTATUS, ATA_BMSTATUS_INTERRUPT);
+    ide_wait_ready(channel);
 
-        if(status & ATA_BMSTATUS_ACTIVE) {
-            panic("IDE - Primary Channel Interrupt with Active Flag Set");
-        } else {
-            ide_mmio_write(ATA_PRIMARY, ATA_REG_BMCOMMAND, 0);
-            channels[ATA_PRIMARY].irq = true;
-        }
+    bool lba48 = lba + count > 0x10000000;
+    if (lba48) {
+        ide_mmio_write(channel, ATA_REG_HDDEVSEL, ATA_MODE_LBA | (((uint32_t) device->drive) << 4));
+        ide_mmio_write(channel, ATA_REG_SECdevice1, (count >> 8) & 0xFF);
+        ide_mmio_write(channel, ATA_REG_LBA3, (lba >> 24) & 0xFF);
+        ide_mmio_write(channel, ATA_REG_LBA4, 0);
+        ide_mmio_write(channel, ATA_REG_LBA5, 0);
     } else {
-        panic("IDE - Primary Channel IRQ Conflict");
+        ide_mmio_write(channel, ATA_REG_HDDEVSEL, ATA_MODE_LBA | (((uint32_t) device->drive) << 4) | ((lba >> 24) & 0x0F));
     }
-}
 
-static void handle_irq_secondary(interrupt_t *interrupt, void *data) {
-    uint8_t status = ide_mmio_read(ATA_SECONDARY, ATA_REG_BMSTATUS);
+    ide_mmio_write(channel, ATA_REG_SECdevice0, count & 0xFF);
+    ide_mmio_write(channel, ATA_REG_LBA0, (lba >> 0) & 0xFF);
+    ide_mmio_write(channel, ATA_REG_LBA1, (lba >> 8) & 0xFF);
+    ide_mmio_write(channel, ATA_REG_LBA2, (lba >> 16) & 0xFF);
 
-    if(status & ATA_BMSTATUS_ERROR) panic("IDE - Secondary Channel Data Transfer Error");
+    if (lba48) {
+        ide_mmio_write(channel, ATA_REG_COMMAND, write ? ATA_CMD_DMA_WRITE_EXT : ATA_CMD_DMA_READ_EXT);
+    } else {
+        ide_mmio_write(channel, ATA_REG_COMMAND, write ? ATA_CMD_DMA_WRITE : ATA_CMD_DMA_READ);
+    }
+
+    ide_mmio_write(channel, ATA_REG_BMCOMMAND, ATA_BMCMD_START | (write ? ATA_BMCMD_WRITE : ATA_BMCMD_READ));
+}
+
+//Invoked under queue_lock of the channel. Starts the next waiting request,
+//taking the drives in turn.
+static void ide_dma_next(uint8_t channel) {
+    ide_channel_t *chan = &channels[channel];
 
-    if(status & ATA_BMSTATUS_INTERRUPT) {
-        ide_mmio_write(ATA_SECONDARY, ATA_REG_BMSTATUS, ATA_BMSTATUS_INTERRUPT);
+    for(uint8_t i = 1; i <= 2; i++) {
+        ide_device_t *device = chan->drives[(chan->turn + i) % 2];
+        if(device && device->waiting) {
+            request_t *req = device->waiting;
+            device->waiting = NULL;
+            chan->turn = device->drive;
 
-        if(status & ATA_BMSTATUS_ACTIVE) {
-            panic("IDE - Secondary Channel Interrupt with Active Flag Set");
-        } else {
-            ide_mmio_write(ATA_SECONDARY, ATA_REG_BMCOMMAND, 0);
-            channels[ATA_SECONDARY].irq = true;
+            ide_dma_start(channel, req);
+            return;
         }
-    } else {
-        panic("IDE - Secondary Channel IRQ Conflict");
     }
 }
 
-static void irq_wait(uint8_t channel) {
-    while(!channels[channel].irq) hlt();
-    channels[channel].irq = false;
+static void ide_submit(block_device_t *block, request_t *req) {
+    ide_device_t *device = containerof(block, ide_device_t, device);
+    ide_channel_t *chan = &channels[device->channel];
+
+    if (device->type != TYPE_PATA) {
+        //TODO implement ATAPI
+        request_complete(req, -EIO);
+        return;
+    }
+
+    uint32_t flags;
+    spin_lock_irqsave(&chan->queue_lock, &flags);
+
+    BUG_ON(device->waiting);
+    device->waiting = req;
+
+    if(!chan->active) {
+        ide_dma_next(device->channel);
+    }
+
+    spin_unlock_irqstore(&chan->queue_lock, flags);
+}
+
+static void handle_channel_irq(uint8_t channel) {
+    ide_channel_t *chan = &channels[channel];
+
+    uint8_t bmstatus = ide_mmio_read(channel, ATA_REG_BMSTATUS);
+    if(!(bmstatus & ATA_BMSTATUS_INTERRUPT)) {
+        return;
+    }
+
+    ide_mmio_write(channel, ATA_REG_BMCOMMAND, 0);
+    //Reading the status register acknowledges the interrupt.
+    uint8_t status = ide_mmio_read(channel, ATA_REG_STATUS);
+    ide_mmio_write(channel, ATA_REG_BMSTATUS, ATA_BMSTATUS_ERROR | ATA_BMSTATUS_INTERRUPT);
+
+    spin_lock(&chan->queue_lock);
+
+    request_t *req = chan->active;
+    chan->active = NULL;
+    ide_dma_next(channel);
+
+    spin_unlock(&chan->queue_lock);
+
+    if(req) {
+        bool failed = (bmstatus & ATA_BMSTATUS_ERROR) || (status & (ATA_SR_ERR | ATA_SR_DF));
+        request_complete(req, failed ? -EIO : 0);
+    }
+}
+
+static void handle_irq_primary(interrupt_t UNUSED(*interrupt), void UNUSED(*data)) {
+    handle_channel_irq(ATA_PRIMARY);
+}
+
+static void handle_irq_secondary(interrupt_t UNUSED(*interrupt), void UNUSED(*data)) {
+    handle_channel_irq(ATA_SECONDARY);
 }
 
 static int32_t pata_access(bool write, bool same, ide_device_t *device, uint64_t numsects, uint32_t lba, void *edi) {
-    uint8_t lba_mode /* 0: CHS, 1:LBA28,ide_buf 2: LBA48 */, dma /* 0: No DMA, 1: DMA */;
+    uint8_t lba_mode /* 0: CHS, 1:LBA28, 2: LBA48 */;
     uint8_t lba_io[6];
     uint32_t channel = device->channel; // Read the Channel.
     uint32_t sector_size = 512; // Almost every ATA drive has a sector-size of 512-byte. //FIXME figure this out dynamically
@@ -362,37 +472,8 @@ static int32_t pata_access(bool write, bool same, ide_device_t *device, uint64_t
         head        = (lba + 1  - sect) % (16 * 63) / (63); // Head number is written to HDDEVSEL lower 4-bits.
     }
 
-    // (II) See if drive supports DMA or not;
-    dma = false;
-
-    if (lba_mode > 0 /* There is no CHS (lba_mode == 0) for DMA */ && device->features & ATA_FEATURE_DMA) {
-        dma = true;
-
-        phys_addr_t phys = virt_to_phys(edi); //Translate to physical address
-
-        ide_mmio_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = ATA_IRQ_ON);
-        ide_mmio_write_long(channel, ATA_REG_PRDTABLE, (uint32_t) page_to_phys(channels[channel].prdt)); //store the address of the PRDT
-
-        uint64_t *prdt = (uint64_t *) page_to_virt(channels[channel].prdt);
-        uint64_t bytes = sector_size * (numsects == 0 ? 512 : numsects);
-        uint64_t i;
-        for (i = 0; i < MAX_PRD_ENTRIES && bytes > (64 * 1024); i++) {
-            *prdt++ = PRD(phys + (same ? 0 : ((64 * 1024) * i)), 0 /* 64kb */);
-            transfered += 64 * 1024;//FIXME increment and return this after the operation completes WITHOUT AN ERROR
-            bytes -= (64 * 1024);
-        }
-
-        if (bytes > 0 && i < MAX_PRD_ENTRIES) {
-            bytes = MIN(bytes, 64 * 1024);
-            transfered += bytes;
-
-            *prdt++ = PRD(phys + (same ? 0 : ((64 * 1024) * i)), bytes == (64 * 1024) ? 0 : bytes);
-        }
-
-        *(prdt - 1) |= 0x8000000000000000; // mark last PRD entry as EOT
-    } else {
-        ide_mmio_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = ATA_IRQ_OFF);
-    }
+    // (II) PIO transfers are polled, so keep the interrupt off;
+    ide_mmio_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = ATA_IRQ_OFF);
 
     // (III) Wait if the drive is busy;
     ide_wait_ready(channel);
@@ -414,36 +495,18 @@ static int32_t pata_access(bool write, bool same, ide_device_t *device, uint64_t
     ide_mmio_write(channel, ATA_REG_LBA2,    lba_io[2]);
 
     // (VI) Select the command and send it;
-    // Routine that is followed:
-    // If ( DMA & LBA48)    DO_DMA_EXT;
-    // If ( DMA & LBA28)    DO_DMA_LBA;
-    // If ( DMA & LBA28)    DO_PIO_CHS; - There is no DMA for CHS
-    // If (!DMA & LBA48)    DO_PIO_EXT;
-    // If (!DMA & LBA28)    DO_PIO_LBA;
-    // If (!DMA & !LBA#)    DO_PIO_CHS;
-
-    if (lba_mode == 0 && !dma && !write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_READ);
-    if (lba_mode == 1 && !dma && !write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_READ);
-    if (lba_mode == 2 && !dma && !write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_READ_EXT);
-    if (lba_mode == 0 &&  dma && !write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_DMA_READ);
-    if (lba_mode == 1 &&  dma && !write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_DMA_READ);
-    if (lba_mode == 2 &&  dma && !write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_DMA_READ_EXT);
-    if (lba_mode == 0 && !dma &&  write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_WRITE);
-    if (lba_mode == 1 && !dma &&  write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_WRITE);
-    if (lba_mode == 2 && !dma &&  write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_WRITE_EXT);
-    if (lba_mode == 0 &&  dma &&  write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_DMA_WRITE);
-    if (lba_mode == 1 &&  dma &&  write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_DMA_WRITE);
-    if (lba_mode == 2 &&  dma &&  write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_DMA_WRITE_EXT);
-
-    if (dma) {
-        ide_mmio_write(channel, ATA_REG_BMCOMMAND, ATA_BMCMD_START | (write ? ATA_BMCMD_WRITE : ATA_BMCMD_READ));
-        irq_wait(channel);
-    } else {
-        if (numsects > 255) {
-            numsects = 0; // restrict the size of PIO read/writes to 256 sectors at a time, for performance.
-        }
+    if (lba_mode == 0 && !write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_READ);
+    if (lba_mode == 1 && !write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_READ);
+    if (lba_mode == 2 && !write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_READ_EXT);
+    if (lba_mode == 0 &&  write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_WRITE);
+    if (lba_mode == 1 &&  write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_WRITE);
+    if (lba_mode == 2 &&  write) ide_mmio_write(channel, ATA_REG_COMMAND, ATA_CMD_PIO_WRITE_EXT);
+
+    if (numsects > 255) {
+        numsects = 0; // restrict the size of PIO read/writes to 256 sectors at a time, for performance.
+    }
 
-        if (!write) {
+    if (!write) {
         for (i = 0; i < (numsects == 0 ? 256 : numsects); i++) {
             if ((err = ide_poll(channel, 1))) {
                 return err; // Polling, set error and exit if there is. FIXME Make errors negative
@@ -453,7 +516,7 @@ static int32_t pata_access(bool write, bool same, ide_device_t *device, uint64_t
             transfered +=  sector_size;
             edi += sector_size;
         }
-        } else {
+    } else {
         // PIO Write.
         for (i = 0; i < (numsects == 0 ? 256 : numsects); i++) {
             ide_poll(channel, 0); // Polling.
@@ -465,7 +528,6 @@ static int32_t pata_access(bool write, bool same, ide_device_t *device, uint64_t
 
         ide_mmio_write(channel, ATA_REG_COMMAND, lba_mode == 2 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
         ide_poll(channel, 0); // Polling. FIXME Detect and report error
-        }
     }
 
     return transfered / sector_size;
@@ -475,7 +537,11 @@ static int32_t ide_read_sectors(ide_device_t *device, uint64_t numsects, uint32_
     if((lba + numsects) > device->size) return 0;
 
     if (device->type == TYPE_PATA) {
-        return pata_access(ATA_READ, false, device, numsects, lba, edi);
+        mutex_lock(&channels[device->channel].lock);
+        int32_t ret = pata_access(ATA_READ, false, device, numsects, lba, edi);
+        mutex_unlock(&channels[device->channel].lock);
+
+        return ret;
     } else if (device->type == TYPE_PATAPI) {
         //TODO implement ATAPI
         return 0;
@@ -488,7 +554,11 @@ static int32_t ide_write_sectors(ide_device_t *device, uint64_t numsects, uint32
     if((lba + numsects) > device->size) return 0;
 
     if (device->type == TYPE_PATA) {
-        return pata_access(ATA_WRITE, false, device, numsects, lba, edi);
+        mutex_lock(&channels[device->channel].lock);
+        int32_t ret = pata_access(ATA_WRITE, false, device, numsects, lba, edi);
+        mutex_unlock(&channels[device->channel].lock);
+
+        return ret;
     } else if (device->type == TYPE_PATAPI) {
         //TODO implement PATAPI
         return 0;
@@ -505,11 +575,15 @@ static ssize_t ide_write(block_device_t *device, void *buff, size_t start, size_
     return ide_write_sectors(containerof(device, ide_device_t, device), blocks, start, buff);
 }
 
-static block_device_ops_t ide_device_ops = {
+static block_device_ops_t ide_pio_ops = {
     .read = ide_read,
     .write = ide_write,
 };
 
+static block_device_ops_t ide_dma_ops = {
+    .submit = ide_submit,
+};
+
 static char * ide_controller_name(device_t UNUSED(*device)) {
     static int next_id = 0;
     char *name = kmalloc(STRLEN(IDE_DEVICE_PREFIX) + STRLEN(XSTR(MAX_UINT)) + 1);
@@ -538,11 +612,15 @@ static void ide_enable(device_t *device) {
     channels[ATA_PRIMARY  ].ctrl  = (BAR_ADDR_32(pci_device->bar[1])) + 0x3F4 * (!pci_device->bar[1]);
     channels[ATA_PRIMARY  ].bmide = BAR_ADDR_32((pci_device->bar[4])) + 0; // Bus Master IDE
     channels[ATA_PRIMARY  ].prdt  = alloc_page(0); //FIXME? page is never freed, reserves entire page for PRDT
+    mutex_init(&channels[ATA_PRIMARY].lock);
+    spinlock_init(&channels[ATA_PRIMARY].queue_lock);
 
     channels[ATA_SECONDARY].base  = BAR_ADDR_32(pci_device->bar[2]) + 0x170 * (!pci_device->bar[2]);
     channels[ATA_SECONDARY].ctrl  = BAR_ADDR_32(pci_device->bar[3]) + 0x374 * (!pci_device->bar[3]);
     channels[ATA_SECONDARY].bmide = BAR_ADDR_32(pci_device->bar[4]) + 8; // Bus Master IDE
     channels[ATA_SECONDARY].prdt  = alloc_page(0); //FIXME? page is never freed, reserves entire page for PRDT
+    mutex_init(&channels[ATA_SECONDARY].lock);
+    spinlock_init(&channels[ATA_SECONDARY].queue_lock);
 
     // 2- Disable IRQs:
     ide_mmio_write(ATA_PRIMARY  , ATA_REG_CONTROL, ATA_IRQ_OFF);
@@ -557,12 +635,11 @@ static void ide_enable(device_t *device) {
 
             // (I) Select Drive:
             ide_mmio_write(i, ATA_REG_HDDEVSEL, 0xA0 | (j << 4)); // Select Drive.
-            sleep(1); // Wait 1ms for drive select to work.
+            udelay(1000); // Wait 1ms for drive select to work.
 
             // (II) Send ATA Identify Command:
             ide_mmio_write(i, ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
-            sleep(1); // This function should be implemented in your OS. which waits for 1 ms.
-                     // it is based on System Timer Device Driver.
+            udelay(1000); // Wait 1ms for the command to be accepted.
 
             // (III) Polling:
             if (ide_mmio_read(i, ATA_REG_STATUS) == 0) continue; // If Status = 0, No Device.
@@ -586,7 +663,7 @@ static void ide_enable(device_t *device) {
                     continue; // Unknown Type (may not be a device).
 
                 ide_mmio_write(i, ATA_REG_COMMAND, ATA_CMD_IDENTIFY_PACKET);
-                sleep(1);
+                udelay(1000);
             }
 
             // (V) Read Identification Space of the Device:
@@ -675,23 +752,54 @@ static void ide_enable(device_t *device) {
             ide_devices[d].num = d;
             ide_devices[d].model[40] = 0; // Terminate String.
 
-            ide_devices[d].device.ops = &ide_device_ops;
-            ide_devices[d].device.size = ide_devices[d].size / 512;
-            ide_devices[d].device.block_size = 512;
+            ide_devices[d].dma = (ide_devices[d].features & ATA_FEATURE_DMA) && (ide_devices[d].features & ATA_FEATURE_LBA);
+            channels[i].drives[j] = &ide_devices[d];
 
-            kprintf("ide - %s %s %7uMB", (const char *[]){"PATA  ", "PATAPI"}[ide_devices[i].type], ide_devices[d].model, ide_devices[i].size / 1024 / 2);
+            d++;
+        }
+    }
 
-            char *name = kmalloc(STRLEN(IDE_DEVICE_PREFIX) + 2);
-            memcpy(name, IDE_DEVICE_PREFIX, STRLEN(IDE_DEVICE_PREFIX));
-            name[STRLEN(IDE_DEVICE_PREFIX)] = 'a' + d;
-            name[STRLEN(IDE_DEVICE_PREFIX) + 1] = '\0';
+    // 4- Use DMA on the channels where every drive supports it:
+    bool bus_master = pci_device->bar[4];
+    if (bus_master) {
+        pci_writel(pci_device->loc, PCI_FULL_CMDSTA, pci_readl(pci_device->loc, PCI_FULL_CMDSTA) | PCI_CMD_BME);
+    }
 
-            register_block_device(&ide_devices[d].device, name);
-            register_disk(&ide_devices[d].device, name);
+    for (uint8_t i = 0; i < 2; i++) {
+        channels[i].dma = bus_master;
+        for (uint8_t j = 0; j < 2; j++) {
+            ide_device_t *drive = channels[i].drives[j];
+            if (drive && drive->type == TYPE_PATA && !drive->dma) {
+                channels[i].dma = false;
+            }
+        }
 
-            d++;
+        if (channels[i].dma) {
+            ide_mmio_write(i, ATA_REG_CONTROL, channels[i].nIEN = ATA_IRQ_ON);
         }
     }
+
+    // 5- Register the Devices:
+    for (int k = 0; k < d; k++) {
+        ide_device_t *drive = &ide_devices[k];
+        bool dma = channels[drive->channel].dma;
+
+        drive->device.ops = dma ? &ide_dma_ops : &ide_pio_ops;
+        drive->device.size = drive->size;
+        drive->device.block_size = 512;
+        drive->device.queue_depth = 1;
+        drive->device.max_segments = dma ? MAX_PRD_ENTRIES : 0;
+
+        kprintf("ide - %s %s %7uMB%s", (const char *[]){"PATA  ", "PATAPI"}[drive->type], drive->model, drive->size / 1024 / 2, dma ? " (DMA)" : "");
+
+        char *name = kmalloc(STRLEN(IDE_DEVICE_PREFIX) + 2);
+        memcpy(name, IDE_DEVICE_PREFIX, STRLEN(IDE_DEVICE_PREFIX));
+        name[STRLEN(IDE_DEVICE_PREFIX)] = 'a' + k;
+        name[STRLEN(IDE_DEVICE_PREFIX) + 1] = '\0';
+
+        register_block_device(&drive->device, name);
+        register_disk(&drive->device, name);
+    }
 }
 
 static void ide_disable(device_t UNUSED(*device)) {
@@ -0,0 +1,537 @@
+#include "init/initcall.h"
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/asm.h"
+#include "common/math.h"
+#include "lib/string.h"
+#include "lib/printf.h"
+#include "bug/debug.h"
+#include "arch/gdt.h"
+#include "arch/idt.h"
+#include "arch/proc.h"
+#include "sync/spinlock.h"
+#include "mm/mm.h"
+#include "sched/proc.h"
+#include "fs/disk.h"
+#include "fs/bio.h"
+#include "device/device.h"
+#include "driver/bus/pci.h"
+#include "log/log.h"
+
+//A driver for virtio block devices, as presented by QEMU/KVM, over the legacy
+//(I/O port) virtio PCI interface.
+//
+//Each request becomes one descriptor chain on a virtqueue: a header for the
+//device to read, the pieces of memory of the request, and a status byte for
+//the device to write. When the device supports indirect descriptors the chain
+//lives in a table of its own, so that every request takes a single slot of
+//the ring. Requests go on the virtqueue of the processor submitting them (if
+//the device has more than one), so that processors do not fight over the
+//queue locks, and are completed from the device interrupt.
+
+#define VIRTIO_BLK_DEVICE_PREFIX "vd"
+
+#define VIRTIO_VENDOR_ID    0x1AF4
+#define VIRTIO_BLK_LEGACY_ID 0x1001
+
+#define VIRTIO_BLK_MAX_QUEUES   4
+#define VIRTIO_BLK_MAX_SEGMENTS 64
+//without indirect descriptors, so that a few requests fit on each ring
+#define VIRTIO_BLK_MAX_DIRECT_SEGMENTS 14
+
+#define VIRTIO_SECTOR_SIZE 512
+
+//PCI Command Register bits
+#define PCI_CMD_IOE     (1 << 0)  //I/O Access Enable
+#define PCI_CMD_BME     (1 << 2)  //Bus Mastering Enable
+
+//Legacy virtio PCI registers
+#define VIRTIO_REG_HOST_FEATURES  0x00
+#define VIRTIO_REG_GUEST_FEATURES 0x04
+#define VIRTIO_REG_QUEUE_PFN      0x08
+#define VIRTIO_REG_QUEUE_SIZE     0x0C
+#define VIRTIO_REG_QUEUE_SELECT   0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY   0x10
+#define VIRTIO_REG_STATUS         0x12
+#define VIRTIO_REG_ISR            0x13
+#define VIRTIO_REG_CONFIG         0x14
+
+#define VIRTIO_STATUS_ACKNOWLEDGE (1 << 0)
+#define VIRTIO_STATUS_DRIVER      (1 << 1)
+#define VIRTIO_STATUS_DRIVER_OK   (1 << 2)
+#define VIRTIO_STATUS_FAILED      (1 << 7)
+
+#define VIRTIO_ISR_QUEUE (1 << 0)
+
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)
+#define VIRTIO_BLK_F_RO      (1 << 5)
+#define VIRTIO_BLK_F_MQ      (1 << 12)
+#define VIRTIO_F_INDIRECT_DESC (1 << 28)
+
+#define VIRTIO_BLK_FEATURES (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO \
+    | VIRTIO_BLK_F_MQ | VIRTIO_F_INDIRECT_DESC)
+
+//offsets into the device configuration
+#define VIRTIO_BLK_CFG_CAPACITY   0x00
+#define VIRTIO_BLK_CFG_SEG_MAX    0x0C
+#define VIRTIO_BLK_CFG_NUM_QUEUES 0x22
+
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+
+#define VIRTIO_BLK_S_OK 0
+
+#define VRING_DESC_F_NEXT     (1 << 0)
+#define VRING_DESC_F_WRITE    (1 << 1)
+#define VRING_DESC_F_INDIRECT (1 << 2)
+
+#define VRING_USED_F_NO_NOTIFY (1 << 0)
+
+#define VRING_ALIGN PAGE_SIZE
+
+typedef struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} PACKED vring_desc_t;
+
+typedef struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} PACKED vring_avail_t;
+
+typedef struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+} PACKED vring_used_elem_t;
+
+typedef struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    vring_used_elem_t ring[];
+} PACKED vring_used_t;
+
+typedef struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+} PACKED virtio_blk_outhdr_t;
+
+typedef struct virtio_blk_req virtio_blk_req_t;
+
+struct virtio_blk_req {
+    virtio_blk_outhdr_t hdr;
+    volatile uint8_t status;
+
+    request_t *req;
+    //NULL unless the request uses an indirect descriptor table
+    vring_desc_t *table;
+
+    virtio_blk_req_t *next;
+};
+
+typedef struct virtqueue {
+    uint16_t index;
+    uint16_t size;
+
+    volatile vring_desc_t *desc;
+    volatile vring_avail_t *avail;
+    volatile vring_used_t *used;
+
+    //protects everything below, and the rings
+    spinlock_t lock;
+    //the unused descriptors are chained together through next
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t last_used;
+    //the request whose chain starts at each descriptor
+    virtio_blk_req_t **reqs;
+} virtqueue_t;
+
+typedef struct virtio_blk {
+    uint16_t iobase;
+    bool indirect;
+    bool read_only;
+
+    uint32_t num_queues;
+    virtqueue_t queues[VIRTIO_BLK_MAX_QUEUES];
+
+    block_device_t *blockdev;
+} virtio_blk_t;
+
+static inline uint32_t vring_size(uint16_t size) {
+    uint32_t first = (sizeof(vring_desc_t) * size) + (sizeof(uint16_t) * (3 + size));
+    uint32_t second = (sizeof(uint16_t) * 3) + (sizeof(vring_used_elem_t) * size);
+
+    return (DIV_UP(first, VRING_ALIGN) * VRING_ALIGN) + (DIV_UP(second, VRING_ALIGN) * VRING_ALIGN);
+}
+
+//Invoked under vq->lock.
+static void vq_free_chain(virtqueue_t *vq, uint16_t head) {
+    uint16_t last = head;
+    uint16_t num = 1;
+    while(vq->desc[last].flags & VRING_DESC_F_NEXT) {
+        last = vq->desc[last].next;
+        num++;
+    }
+
+    vq->desc[last].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += num;
+}
+
+static inline uint32_t vreq_num_descs(request_t *req) {
+    return req->segments + 2;
+}
+
+//Fills in the chain of descriptors for vreq, taking each descriptor after
+//the first from next_desc().
+#define VREQ_FILL_CHAIN(vreq, desc, first, next_desc) do {                    \
+    request_t *__req = (vreq)->req;                                           \
+    uint16_t __write = __req->dir == BIO_READ ? VRING_DESC_F_WRITE : 0;       \
+    uint16_t __i = (first);                                                   \
+                                                                              \
+    (desc)[__i].addr = virt_to_phys(&(vreq)->hdr);                            \
+    (desc)[__i].len = sizeof(virtio_blk_outhdr_t);                            \
+    (desc)[__i].flags = VRING_DESC_F_NEXT;                                    \
+                                                                              \
+    bio_t *__bio;                                                             \
+    bio_vec_t *__vec;                                                         \
+    REQUEST_FOR_EACH_VEC(__req, __bio, __vec) {                               \
+        uint16_t __n = (next_desc);                                           \
+        (desc)[__i].next = __n;                                               \
+        __i = __n;                                                            \
+                                                                              \
+        (desc)[__i].addr = page_to_phys(__vec->page) + __vec->offset;         \
+        (desc)[__i].len = __vec->len;                                         \
+        (desc)[__i].flags = VRING_DESC_F_NEXT | __write;                      \
+    }                                                                         \
+                                                                              \
+    uint16_t __n = (next_desc);                                               \
+    (desc)[__i].next = __n;                                                   \
+    __i = __n;                                                                \
+                                                                              \
+    (desc)[__i].addr = virt_to_phys((void *) &(vreq)->status);                \
+    (desc)[__i].len = sizeof(uint8_t);                                        \
+    (desc)[__i].flags = VRING_DESC_F_WRITE;                                   \
+} while(0)
+
+static inline uint16_t vq_take_desc(virtqueue_t *vq) {
+    uint16_t desc = vq->free_head;
+    vq->free_head = vq->desc[desc].next;
+    vq->num_free--;
+
+    return desc;
+}
+
+//Invoked under vq->lock. Puts vreq on the available ring, returning false if
+//there are not enough free descriptors.
+static bool vq_add(virtqueue_t *vq, virtio_blk_req_t *vreq) {
+    uint16_t head;
+
+    if(vreq->table) {
+        if(!vq->num_free) {
+            return false;
+        }
+
+        head = vq_take_desc(vq);
+        vq->desc[head].addr = virt_to_phys(vreq->table);
+        vq->desc[head].len = vreq_num_descs(vreq->req) * sizeof(vring_desc_t);
+        vq->desc[head].flags = VRING_DESC_F_INDIRECT;
+    } else {
+        if(vq->num_free < vreq_num_descs(vreq->req)) {
+            return false;
+        }
+
+        head = vq_take_desc(vq);
+        VREQ_FILL_CHAIN(vreq, vq->desc, head, vq_take_desc(vq));
+    }
+
+    vq->reqs[head] = vreq;
+
+    vq->avail->ring[vq->avail->idx % vq->size] = head;
+    //The device must see the descriptors before the new index.
+    barrier();
+    vq->avail->idx++;
+
+    return true;
+}
+
+static void virtio_blk_submit(block_device_t *device, request_t *req) {
+    virtio_blk_t *blk = device->private;
+
+    if(req->dir == BIO_WRITE && blk->read_only) {
+        request_complete(req, -EIO);
+        return;
+    }
+
+    virtio_blk_req_t *vreq = kmalloc(sizeof(virtio_blk_req_t));
+    vreq->hdr.type = req->dir == BIO_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    vreq->hdr.ioprio = 0;
+    vreq->hdr.sector = req->block;
+    vreq->status = ~VIRTIO_BLK_S_OK;
+    vreq->req = req;
+    vreq->table = NULL;
+
+    if(blk->indirect) {
+        //A table of at most VIRTIO_BLK_MAX_SEGMENTS + 2 entries is small
+        //enough to come from a slab, and so lies within one page.
+        vreq->table = kmalloc(vreq_num_descs(req) * sizeof(vring_desc_t));
+
+        uint16_t next = 0;
+        VREQ_FILL_CHAIN(vreq, vreq->table, 0, ++next);
+    }
+
+    //A stale processor number only means that we use another queue.
+    uint32_t cpu = percpu_up ? get_percpu_unsafe(this_proc)->num : BSP_ID;
+
+    //The request queue never gives us more requests than all of the
+    //virtqueues can hold, so one of them must have room.
+    for(uint32_t i = 0; i < blk->num_queues; i++) {
+        virtqueue_t *vq = &blk->queues[(cpu + i) % blk->num_queues];
+
+        uint32_t flags;
+        spin_lock_irqsave(&vq->lock, &flags);
+
+        bool added = vq_add(vq, vreq);
+        //The device must see the new index before we look at whether it wants
+        //to be notified.
+        __sync_synchronize();
+        bool notify = added && !(vq->used->flags & VRING_USED_F_NO_NOTIFY);
+
+        spin_unlock_irqstore(&vq->lock, flags);
+
+        if(notify) {
+            outw(blk->iobase + VIRTIO_REG_QUEUE_NOTIFY, vq->index);
+        }
+
+        if(added) {
+            return;
+        }
+    }
+
+    BUG();
+}
+
+static block_device_ops_t virtio_blk_ops = {
+    .submit = virtio_blk_submit,
+};
+
+//Returns the requests which the device has finished with, chained through
+//next.
+static virtio_blk_req_t * vq_harvest(virtqueue_t *vq) {
+    virtio_blk_req_t *done = NULL;
+
+    spin_lock(&vq->lock);
+
+    while(vq->last_used != vq->used->idx) {
+        uint16_t head = vq->used->ring[vq->last_used % vq->size].id;
+        vq->last_used++;
+
+        virtio_blk_req_t *vreq = vq->reqs[head];
+        vq->reqs[head] = NULL;
+        vq_free_chain(vq, head);
+
+        vreq->next = done;
+        done = vreq;
+    }
+
+    spin_unlock(&vq->lock);
+
+    return done;
+}
+
+static void handle_virtio_blk_irq(interrupt_t UNUSED(*interrupt), void *data) {
+    virtio_blk_t *blk = data;
+
+    //Reading the ISR acknowledges the interrupt.
+    if(!(inb(blk->iobase + VIRTIO_REG_ISR) & VIRTIO_ISR_QUEUE)) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < blk->num_queues; i++) {
+        virtio_blk_req_t *vreq = vq_harvest(&blk->queues[i]);
+        while(vreq) {
+            virtio_blk_req_t *next = vreq->next;
+
+            request_complete(vreq->req, vreq->status == VIRTIO_BLK_S_OK ? 0 : -EIO);
+
+            if(vreq->table) {
+                kfree(vreq->table);
+            }
+            kfree(vreq);
+
+            vreq = next;
+        }
+    }
+}
+
+//Sets up virtqueue index, returning how many requests it can hold, or 0 if the
+//device does not have it.
+static uint32_t vq_init(virtio_blk_t *blk, uint16_t index, uint32_t max_segments) {
+    virtqueue_t *vq = &blk->queues[index];
+
+    outw(blk->iobase + VIRTIO_REG_QUEUE_SELECT, index);
+    uint16_t size = inw(blk->iobase + VIRTIO_REG_QUEUE_SIZE);
+    if(!size) {
+        return 0;
+    }
+
+    page_t *page = alloc_pages(DIV_UP(vring_size(size), PAGE_SIZE), ALLOC_ZERO);
+    void *base = page_to_virt(page);
+
+    vq->index = index;
+    vq->size = size;
+    vq->desc = base;
+    vq->avail = base + (sizeof(vring_desc_t) * size);
+    vq->used = base + (DIV_UP((sizeof(vring_desc_t) * size) + (sizeof(uint16_t) * (3 + size)), VRING_ALIGN) * VRING_ALIGN);
+
+    spinlock_init(&vq->lock);
+    vq->free_head = 0;
+    vq->num_free = size;
+    vq->last_used = 0;
+    vq->reqs = kmalloc(sizeof(virtio_blk_req_t *) * size);
+
+    for(uint16_t i = 0; i < size - 1; i++) {
+        vq->desc[i].next = i + 1;
+    }
+
+    outl(blk->iobase + VIRTIO_REG_QUEUE_PFN, page_to_phys(page) / PAGE_SIZE);
+
+    return blk->indirect ? size : size / (max_segments + 2);
+}
+
+static char * virtio_blk_name(device_t UNUSED(*device)) {
+    static int next_id = 0;
+
+    char *name = kmalloc(STRLEN(VIRTIO_BLK_DEVICE_PREFIX) + STRLEN(XSTR(MAX_UINT)) + 1);
+    sprintf(name, "%s%u", VIRTIO_BLK_DEVICE_PREFIX, next_id++);
+
+    return name;
+}
+
+static bool virtio_blk_probe(device_t *device) {
+    pci_device_t *pci_device = containerof(device, pci_device_t, device);
+    if(!(pci_device->bar[0] & 1)) return false;
+
+    virtio_blk_t *blk = device->private = kmalloc(sizeof(virtio_blk_t));
+    blk->iobase = BAR_ADDR_32(pci_device->bar[0]);
+
+    pci_writel(pci_device->loc, PCI_FULL_CMDSTA, pci_readl(pci_device->loc, PCI_FULL_CMDSTA) | PCI_CMD_IOE | PCI_CMD_BME);
+    register_isr(pci_device->interrupt, CPL_KRNL, handle_virtio_blk_irq, blk);
+
+    return true;
+}
+
+static void virtio_blk_enable(device_t *device) {
+    virtio_blk_t *blk = device->private;
+    uint16_t iobase = blk->iobase;
+
+    outb(iobase + VIRTIO_REG_STATUS, 0);
+    outb(iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    uint32_t features = inl(iobase + VIRTIO_REG_HOST_FEATURES) & VIRTIO_BLK_FEATURES;
+    outl(iobase + VIRTIO_REG_GUEST_FEATURES, features);
+
+    blk->indirect = features & VIRTIO_F_INDIRECT_DESC;
+    blk->read_only = features & VIRTIO_BLK_F_RO;
+
+    uint32_t max_segments = blk->indirect ? VIRTIO_BLK_MAX_SEGMENTS : VIRTIO_BLK_MAX_DIRECT_SEGMENTS;
+    if(features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = inl(iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_SEG_MAX);
+        if(seg_max) {
+            max_segments = MIN(max_segments, seg_max);
+        }
+    }
+
+    uint32_t num_queues = 1;
+    if(features & VIRTIO_BLK_F_MQ) {
+        num_queues = inw(iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_NUM_QUEUES);
+        num_queues = MIN(num_queues, VIRTIO_BLK_MAX_QUEUES);
+    }
+
+    uint32_t depth = 0;
+    for(blk->num_queues = 0; blk->num_queues < num_queues; blk->num_queues++) {
+        uint32_t room = vq_init(blk, blk->num_queues, max_segments);
+        if(!room) {
+            break;
+        }
+
+        depth += room;
+    }
+
+    if(!depth) {
+        kprintf("virtio-blk - no usable virtqueues");
+        outb(iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+
+    outb(iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    uint64_t sectors = (((uint64_t) inl(iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4)) << 32)
+        | inl(iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY);
+    size_t size = sectors > SIZE_MAX ? SIZE_MAX : sectors;
+
+    kprintf("virtio-blk - %7uMB (%u queues, depth %u%s)", size / 1024 / 2,
+        blk->num_queues, depth, blk->indirect ? ", indirect" : "");
+
+    blk->blockdev = block_device_alloc();
+    blk->blockdev->ops = &virtio_blk_ops;
+    blk->blockdev->size = size;
+    blk->blockdev->block_size = VIRTIO_SECTOR_SIZE;
+    blk->blockdev->queue_depth = depth;
+    blk->blockdev->max_segments = max_segments;
+    blk->blockdev->private = blk;
+
+    static uint32_t count = 0;
+    char *name = kmalloc(STRLEN(VIRTIO_BLK_DEVICE_PREFIX) + 2);
+    memcpy(name, VIRTIO_BLK_DEVICE_PREFIX, STRLEN(VIRTIO_BLK_DEVICE_PREFIX));
+    name[STRLEN(VIRTIO_BLK_DEVICE_PREFIX)] = 'a' + count++;
+    name[STRLEN(VIRTIO_BLK_DEVICE_PREFIX) + 1] = '\0';
+
+    register_block_device(blk->blockdev, name);
+    register_disk(blk->blockdev, name);
+}
+
+static void virtio_blk_disable(device_t UNUSED(*device)) {
+    //FIXME stub
+}
+
+static void virtio_blk_destroy(device_t UNUSED(*device)) {
+    //FIXME stub
+}
+
+static pci_ident_t virtio_blk_idents[] = {
+    {
+        .vendor =     VIRTIO_VENDOR_ID,
+        .device =     VIRTIO_BLK_LEGACY_ID,
+        .class  =     0,
+        .class_mask = 0,
+    }
+};
+
+static pci_driver_t virtio_blk_driver = {
+    .driver = {
+        .bus = &pci_bus,
+
+        .name = virtio_blk_name,
+        .probe = virtio_blk_probe,
+
+        .enable = virtio_blk_enable,
+        .disable = virtio_blk_disable,
+        .destroy = virtio_blk_destroy
+    },
+
+    .supported = virtio_blk_idents,
+    .supported_len = sizeof(virtio_blk_idents) / sizeof(pci_ident_t),
+};
+
+static INITCALL virtio_blk_init() {
+    register_driver(&virtio_blk_driver.driver);
+    return 0;
+}
+
+postcore_initcall(virtio_blk_init);
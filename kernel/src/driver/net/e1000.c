@@ -7,11 +7,12 @@
 #include "init/initcall.h"
 #include "common/asm.h"
 #include "sync/spinlock.h"
+#include "sched/softirq.h"
 #include "arch/gdt.h"
 #include "arch/idt.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
-#include "time/clock.h" //FIXME sleep(1) should be microseconds not hundredths of a second
+#include "time/clock.h"
 #include "device/device.h"
 #include "driver/bus/pci.h"
 #include "net/packet.h"
@@ -167,6 +168,7 @@ typedef struct net_825xx {
     tx_desc_t *tx_desc;
 
     spinlock_t state_lock;
+    tasklet_t rx_tasklet;
 
     net_interface_t interface;
 } PACKED net_825xx_t;
@@ -186,7 +188,7 @@ static uint16_t net_eeprom_read(net_825xx_t *net_device, uint8_t addr) {
 
     uint32_t tmp = 0;
     while(!((tmp = mmio_read(net_device, REG_EERD)) & EERD_DONE))
-        sleep(1);
+        udelay(1);
 
     return (uint16_t) ((tmp >> 16) & 0xFFFF);
 }
@@ -229,12 +231,18 @@ static void handle_network(interrupt_t *interrupt, void *data) {
             spin_unlock_irqstore(&net_device->state_lock, flags);
         }
 
+        //The receive path goes all the way up the network stack, so do it
+        //with interrupts enabled.
         if(icr & ICR_RXT) {
-            net_825xx_poll(&net_device->interface);
+            tasklet_schedule(&net_device->rx_tasklet);
         }
     }
 }
 
+static void rx_tasklet_run(net_825xx_t *net_device) {
+    net_825xx_poll(&net_device->interface);
+}
+
 int32_t net_825xx_send(packet_t *packet) {
     net_825xx_t *net_device = containerof(packet->interface, net_825xx_t, interface);
 
@@ -247,7 +255,7 @@ int32_t net_825xx_send(packet_t *packet) {
     mmio_write(net_device, REG_TDT, net_device->tx_front);
 
     while(!(desc->sta & 0xF))
-        sleep(1);
+        udelay(1);
 
     packet_destroy(packet);
 
@@ -275,6 +283,7 @@ static bool net_825xx_probe(device_t *device) {
     net_825xx_t *net_device = pci_device->device.private = kmalloc(sizeof(net_825xx_t));
 
     spinlock_init(&net_device->state_lock);
+    tasklet_init(&net_device->rx_tasklet, (void (*)(void *)) rx_tasklet_run, net_device);
 
     net_device->mmio = (uint32_t) map_pages(BAR_ADDR_32(pci_device->bar[0]), DIV_UP(REG_LAST, PAGE_SIZE));
     register_isr(pci_device->interrupt, CPL_KRNL, handle_network, NULL);
@@ -289,7 +298,7 @@ static bool net_825xx_probe(device_t *device) {
         mmio_write(net_device, REG_CTRL, mmio_read(net_device, REG_CTRL) | CTRL_SLU);
     }
 
-    sleep(1);
+    udelay(1000);
 
     for(uint16_t i = 0; i < 128; i++) {
         mmio_write(net_device, REG_MTA + (i * 4), 0);
@@ -128,6 +128,10 @@ static int32_t load_elf(binary_t *binary) {
             case PT_LOAD: {
                 kprintf("binfmt_elf - LOAD (%X, %X) @ %X -> %X - %X", phdr[i].p_filesz, phdr[i].p_memsz, phdr[i].p_offset, phdr[i].p_vaddr, phdr[i].p_vaddr + phdr[i].p_memsz);
 
+                if(!user_map_range_valid(phdr[i].p_vaddr, phdr[i].p_memsz)) {
+                    goto fail_not_elf;
+                }
+
                 void *addr = (void *) phdr[i].p_vaddr;
                 if(vfs_seek(binary->file, phdr[i].p_offset, SEEK_SET)
                     != phdr[i].p_offset) {
@@ -170,6 +174,9 @@ static int32_t load_elf(binary_t *binary) {
 
     kprintf("binfmt_elf - entry: %X", ehdr->e_entry);
 
+    //There is no going back now.
+    ufdt_close_on_exec();
+
     irqdisable();
 
     thread_t *me = current;
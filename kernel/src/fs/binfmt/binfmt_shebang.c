@@ -69,13 +69,16 @@ static int32_t load_shebang(binary_t *binary) {
     }
     *interp_end = '\0';
 
-    path_t path;
-    ret = vfs_lookup(&obtain_fs_context(current)->pwd, interp, &path);
+    path_t pwd, path;
+    get_fs_pwd(current, &pwd);
+    ret = vfs_lookup(&pwd, interp, &path);
+    path_put(&pwd);
     if(ret) {
         return ret;
     }
 
     file_t *f = vfs_open_file(&path);
+    path_put(&path);
     if(!f) {
         return -EIO;
     }
@@ -0,0 +1,504 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/list.h"
+#include "common/math.h"
+#include "common/asm.h"
+#include "lib/string.h"
+#include "init/initcall.h"
+#include "bug/debug.h"
+#include "sync/spinlock.h"
+#include "sync/semaphore.h"
+#include "mm/mm.h"
+#include "mm/cache.h"
+#include "time/clock.h"
+#include "sched/sched.h"
+#include "fs/block.h"
+#include "fs/bio.h"
+
+//Each block device has a request queue, which turns the bios submitted to it
+//into requests for the driver. A bio which continues (or is continued by) a
+//pending request in the same direction is merged into it, so that a run of
+//small transfers reaches the device as one.
+//
+//Pending requests are dispatched according to a deadline policy. Normally the
+//queue sweeps upwards through the disk from where the last request ended, and
+//wraps around to the lowest pending block once it passes the last (C-SCAN),
+//but a request which has waited longer than its deadline is dispatched first,
+//reads before writes, so that nothing starves.
+//
+//There is no dedicated thread. Whoever submits a bio to an idle queue
+//dispatches it (and anything else queued meanwhile) themselves, which is also
+//what lets the disk label probes run before the workqueues have any workers.
+//Once the driver has as many requests as it can take the dispatcher gives up,
+//and the next completion dispatches in its place, from the interrupt which
+//completed the request. This must not be left to a work item: the bios might
+//have been submitted from one, and it could be waiting on this very queue.
+//
+//Drivers which implement block_device_ops_t.submit() are handed requests to
+//complete asynchronously. For the others, the queue performs each request
+//with read() or write(), copying through a bounce buffer when it is made of
+//more than one piece of memory.
+
+//in milliseconds
+#define READ_EXPIRE  500
+#define WRITE_EXPIRE 5000
+
+#define MAX_REQUEST_BLOCKS 128
+
+struct request_queue {
+    spinlock_t lock;
+    block_device_t *device;
+
+    //pending requests, in order of block
+    list_head_t sorted;
+    //pending requests of each direction, in order of submission
+    list_head_t fifo[2];
+
+    //where the last request dispatched ended
+    size_t head_pos;
+
+    uint32_t in_flight;
+    uint32_t plugged;
+    bool dispatching;
+};
+
+typedef struct bio_waiter {
+    semaphore_t sem;
+    volatile bool done;
+} bio_waiter_t;
+
+static const uint32_t expire[2] = {
+    [BIO_READ]  = READ_EXPIRE,
+    [BIO_WRITE] = WRITE_EXPIRE,
+};
+
+static cache_t *request_cache;
+
+bio_t * bio_alloc(block_device_t *device, size_t block, uint8_t dir,
+    uint32_t max_vecs) {
+    bio_t *bio = kmalloc(sizeof(bio_t) + (max_vecs * sizeof(bio_vec_t)));
+    bio->device = device;
+    bio->block = block;
+    bio->dir = dir;
+    bio->size = 0;
+    bio->num_vecs = 0;
+    bio->max_vecs = max_vecs;
+    bio->vecs = (bio_vec_t *) (bio + 1);
+    bio->error = 0;
+    bio->end_io = NULL;
+    bio->private = NULL;
+    bio->next = NULL;
+
+    return bio;
+}
+
+void bio_free(bio_t *bio) {
+    kfree(bio);
+}
+
+bool bio_add_page(bio_t *bio, page_t *page, uint32_t offset, uint32_t len) {
+    BUG_ON(offset + len > PAGE_SIZE);
+
+    if(bio->num_vecs) {
+        bio_vec_t *last = &bio->vecs[bio->num_vecs - 1];
+        if(last->page == page && last->offset + last->len == offset) {
+            last->len += len;
+            bio->size += len;
+            return true;
+        }
+    }
+
+    if(bio->num_vecs == bio->max_vecs) {
+        return false;
+    }
+
+    bio_vec_t *vec = &bio->vecs[bio->num_vecs++];
+    vec->page = page;
+    vec->offset = offset;
+    vec->len = len;
+    bio->size += len;
+
+    return true;
+}
+
+bool bio_add_buff(bio_t *bio, void *buff, uint32_t len) {
+    uint32_t first = ((uint32_t) buff) / PAGE_SIZE;
+    uint32_t last = (((uint32_t) buff) + len - 1) / PAGE_SIZE;
+    if(bio->num_vecs + (last - first) + 1 > bio->max_vecs) {
+        return false;
+    }
+
+    while(len) {
+        uint32_t offset = ((uint32_t) buff) % PAGE_SIZE;
+        uint32_t chunk = MIN(len, PAGE_SIZE - offset);
+
+        BUG_ON(!bio_add_page(bio, virt_to_page(buff), offset, chunk));
+
+        buff += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+static inline void * vec_to_virt(bio_vec_t *vec) {
+    return page_to_virt(vec->page) + vec->offset;
+}
+
+//Invoked under q->lock.
+static void __queue_insert_sorted(request_queue_t *q, request_t *req) {
+    request_t *pos;
+    LIST_FOR_EACH_ENTRY(pos, &q->sorted, sorted) {
+        if(pos->block > req->block) {
+            list_add_before(&req->sorted, &pos->sorted);
+            return;
+        }
+    }
+
+    list_add_before(&req->sorted, &q->sorted);
+}
+
+static inline bool segments_fit(block_device_t *device, uint32_t segments) {
+    return !device->max_segments || segments <= device->max_segments;
+}
+
+//Invoked under q->lock. Returns true if the bio could be merged into a
+//pending request.
+static bool __queue_merge(request_queue_t *q, bio_t *bio, size_t block,
+    size_t count) {
+    request_t *req;
+    LIST_FOR_EACH_ENTRY(req, &q->sorted, sorted) {
+        if(req->dir != bio->dir || req->count + count > MAX_REQUEST_BLOCKS
+            || !segments_fit(q->device, req->segments + bio->num_vecs)) {
+            continue;
+        }
+
+        if(req->block + req->count == block) {
+            req->last->next = bio;
+            req->last = bio;
+            req->count += count;
+            req->segments += bio->num_vecs;
+            return true;
+        }
+
+        if(block + count == req->block) {
+            bio->next = req->first;
+            req->first = bio;
+            req->block = block;
+            req->count += count;
+            req->segments += bio->num_vecs;
+
+            list_rm(&req->sorted);
+            __queue_insert_sorted(q, req);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//Invoked under q->lock. Takes the next request to dispatch off the queue.
+static request_t * __queue_next(request_queue_t *q) {
+    if(list_empty(&q->sorted)) {
+        return NULL;
+    }
+
+    request_t *req = NULL;
+
+    uint64_t now = uptime_us();
+    for(uint32_t dir = BIO_READ; dir <= BIO_WRITE; dir++) {
+        if(!list_empty(&q->fifo[dir])) {
+            request_t *oldest = list_first(&q->fifo[dir], request_t, fifo);
+            if(oldest->deadline <= now) {
+                req = oldest;
+                break;
+            }
+        }
+    }
+
+    if(!req) {
+        request_t *pos;
+        LIST_FOR_EACH_ENTRY(pos, &q->sorted, sorted) {
+            if(pos->block >= q->head_pos) {
+                req = pos;
+                break;
+            }
+        }
+    }
+
+    if(!req) {
+        req = list_first(&q->sorted, request_t, sorted);
+    }
+
+    list_rm(&req->sorted);
+    list_rm(&req->fifo);
+
+    q->head_pos = req->block + req->count;
+
+    return req;
+}
+
+//Performs the request with the synchronous read() and write() operations,
+//returning 0 or a negative errno.
+static int32_t request_run_sync(block_device_t *device, request_t *req) {
+    ssize_t (*op)(block_device_t *, void *, size_t, size_t) =
+        req->dir == BIO_WRITE ? device->ops->write : device->ops->read;
+
+    bio_t *bio;
+    bio_vec_t *vec;
+
+    if(!req->first->next && req->first->num_vecs == 1) {
+        void *buff = vec_to_virt(req->first->vecs);
+        return op(device, buff, req->block, req->count) == (ssize_t) req->count
+            ? 0 : -EIO;
+    }
+
+    void *bounce = kmalloc(req->count * device->block_size);
+
+    void *pos = bounce;
+    if(req->dir == BIO_WRITE) {
+        REQUEST_FOR_EACH_VEC(req, bio, vec) {
+            memcpy(pos, vec_to_virt(vec), vec->len);
+            pos += vec->len;
+        }
+    }
+
+    int32_t ret = op(device, bounce, req->block, req->count)
+        == (ssize_t) req->count ? 0 : -EIO;
+
+    pos = bounce;
+    if(!ret && req->dir == BIO_READ) {
+        REQUEST_FOR_EACH_VEC(req, bio, vec) {
+            memcpy(vec_to_virt(vec), pos, vec->len);
+            pos += vec->len;
+        }
+    }
+
+    kfree(bounce);
+
+    return ret;
+}
+
+static inline uint32_t queue_depth(block_device_t *device) {
+    return device->queue_depth ? device->queue_depth : 1;
+}
+
+//Dispatches requests until the queue is empty or plugged, or the driver has
+//all it can take. Must be invoked having set q->dispatching.
+static void queue_run(request_queue_t *q) {
+    block_device_t *device = q->device;
+
+    uint32_t flags;
+    spin_lock_irqsave(&q->lock, &flags);
+
+    BUG_ON(!q->dispatching);
+
+    while(!q->plugged && q->in_flight < queue_depth(device)) {
+        request_t *req = __queue_next(q);
+        if(!req) {
+            break;
+        }
+
+        q->in_flight++;
+
+        spin_unlock_irqstore(&q->lock, flags);
+
+        if(device->ops->submit) {
+            device->ops->submit(device, req);
+        } else {
+            request_complete(req, request_run_sync(device, req));
+        }
+
+        spin_lock_irqsave(&q->lock, &flags);
+    }
+
+    q->dispatching = false;
+
+    spin_unlock_irqstore(&q->lock, flags);
+}
+
+//Invoked under q->lock. Returns true if the caller should now run the queue.
+static bool __queue_claim(request_queue_t *q) {
+    if(q->dispatching || q->plugged || list_empty(&q->sorted)
+        || q->in_flight >= queue_depth(q->device)) {
+        return false;
+    }
+
+    q->dispatching = true;
+    return true;
+}
+
+void request_complete(request_t *req, int32_t error) {
+    request_queue_t *q = req->device->queue;
+
+    bio_t *bio = req->first;
+    while(bio) {
+        bio_t *next = bio->next;
+
+        bio->next = NULL;
+        bio->error = error;
+        if(bio->end_io) {
+            bio->end_io(bio);
+        }
+
+        bio = next;
+    }
+
+    cache_free(request_cache, req);
+
+    uint32_t flags;
+    spin_lock_irqsave(&q->lock, &flags);
+
+    q->in_flight--;
+    bool kick = __queue_claim(q);
+
+    spin_unlock_irqstore(&q->lock, flags);
+
+    if(kick) {
+        queue_run(q);
+    }
+}
+
+//Finds the device which block of device actually lies on.
+static block_device_t * resolve_device(block_device_t *device, size_t *block) {
+    while(device->parent) {
+        *block += device->start;
+        device = device->parent;
+    }
+
+    return device;
+}
+
+void bio_submit(bio_t *bio) {
+    BUG_ON(!bio->size || bio->size % bio->device->block_size);
+
+    size_t count = bio->size / bio->device->block_size;
+    size_t block = bio->block;
+    block_device_t *device = resolve_device(bio->device, &block);
+    request_queue_t *q = device->queue;
+
+    if(bio->block + count > bio->device->size
+        || !segments_fit(device, bio->num_vecs)) {
+        bio->error = bio->block + count > bio->device->size ? -EIO : -EINVAL;
+        if(bio->end_io) {
+            bio->end_io(bio);
+        }
+
+        return;
+    }
+
+    //Allocate outside of the lock, on the assumption that merges are rare.
+    request_t *req = cache_alloc(request_cache);
+
+    uint32_t flags;
+    spin_lock_irqsave(&q->lock, &flags);
+
+    bool merged = __queue_merge(q, bio, block, count);
+    if(!merged) {
+        req->device = device;
+        req->block = block;
+        req->count = count;
+        req->dir = bio->dir;
+        req->first = bio;
+        req->last = bio;
+        req->segments = bio->num_vecs;
+        req->private = NULL;
+        req->deadline = uptime_us()
+            + (((uint64_t) expire[bio->dir]) * MICROS_PER_MILLI);
+
+        __queue_insert_sorted(q, req);
+        list_add_before(&req->fifo, &q->fifo[bio->dir]);
+    }
+
+    bool run = __queue_claim(q);
+
+    spin_unlock_irqstore(&q->lock, flags);
+
+    if(merged) {
+        cache_free(request_cache, req);
+    }
+
+    if(run) {
+        queue_run(q);
+    }
+}
+
+static void bio_wait_end_io(bio_t *bio) {
+    bio_waiter_t *waiter = bio->private;
+
+    waiter->done = true;
+    semaphore_up(&waiter->sem);
+}
+
+int32_t bio_submit_wait(bio_t *bio) {
+    bio_waiter_t waiter;
+    semaphore_init(&waiter.sem, 0);
+    waiter.done = false;
+
+    bio->end_io = bio_wait_end_io;
+    bio->private = &waiter;
+
+    bio_submit(bio);
+
+    //The disks are probed before there is anything to switch to, so until
+    //then just wait for the interrupt which completes the bio.
+    if(tasking_up) {
+        semaphore_down(&waiter.sem);
+    } else {
+        while(!waiter.done) {
+            hlt();
+        }
+    }
+
+    return bio->error;
+}
+
+void block_plug(block_device_t *device) {
+    size_t block = 0;
+    request_queue_t *q = resolve_device(device, &block)->queue;
+
+    uint32_t flags;
+    spin_lock_irqsave(&q->lock, &flags);
+    q->plugged++;
+    spin_unlock_irqstore(&q->lock, flags);
+}
+
+void block_unplug(block_device_t *device) {
+    size_t block = 0;
+    request_queue_t *q = resolve_device(device, &block)->queue;
+
+    uint32_t flags;
+    spin_lock_irqsave(&q->lock, &flags);
+
+    BUG_ON(!q->plugged);
+    q->plugged--;
+    bool run = __queue_claim(q);
+
+    spin_unlock_irqstore(&q->lock, flags);
+
+    if(run) {
+        queue_run(q);
+    }
+}
+
+request_queue_t * request_queue_create(block_device_t *device) {
+    request_queue_t *q = kmalloc(sizeof(request_queue_t));
+    spinlock_init(&q->lock);
+    q->device = device;
+    list_init(&q->sorted);
+    list_init(&q->fifo[BIO_READ]);
+    list_init(&q->fifo[BIO_WRITE]);
+    q->head_pos = 0;
+    q->in_flight = 0;
+    q->plugged = 0;
+    q->dispatching = false;
+
+    return q;
+}
+
+static INITCALL bio_init() {
+    request_cache = cache_create(sizeof(request_t));
+    return 0;
+}
+
+core_initcall(bio_init);
@@ -2,17 +2,24 @@
 #include "init/initcall.h"
 #include "mm/cache.h"
 #include "fs/block.h"
+#include "fs/bio.h"
 #include "fs/type/devfs.h"
 
 static cache_t *block_device_cache;
 
 block_device_t * block_device_alloc() {
     block_device_t *dev = cache_alloc(block_device_cache);
+    dev->parent = NULL;
+    dev->start = 0;
+    dev->queue = NULL;
+    dev->queue_depth = 1;
+    dev->max_segments = 0;
     spinlock_init(&dev->lock);
     return dev;
 }
 
 void register_block_device(block_device_t *device, char *name) {
+    device->queue = request_queue_create(device);
     devfs_add_blockdev(device, name);
 }
 
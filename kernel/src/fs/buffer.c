@@ -0,0 +1,507 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/list.h"
+#include "common/hashtable.h"
+#include "lib/string.h"
+#include "init/initcall.h"
+#include "arch/atomic.h"
+#include "bug/debug.h"
+#include "sync/spinlock.h"
+#include "sync/mutex.h"
+#include "sync/semaphore.h"
+#include "mm/mm.h"
+#include "mm/cache.h"
+#include "mm/reclaim.h"
+#include "sched/workqueue.h"
+#include "fs/block.h"
+#include "fs/buffer.h"
+#include "fs/bio.h"
+#include "log/log.h"
+
+//The buffer cache holds copies of recently used blocks, keyed by device and
+//block number, so that block_read() and block_write() only go to the device
+//when they have to.
+//
+//Writes are written back by a work item BUFFER_WRITEBACK_DELAY after a buffer
+//is first dirtied, or when someone calls block_sync(). Buffers which nobody
+//holds a reference to go to the front of the LRU, and once more than
+//BUFFER_MAX_CACHED buffers are cached clean ones are evicted from the back.
+//Dirty buffers are never evicted, so this is a soft limit.
+//
+//Reads are clustered: when a block must be read in, so are as many of the
+//uncached blocks following it as fit in BUFFER_CLUSTER, in one bio. Writeback
+//submits up to BUFFER_SYNC_BATCH buffers of a device with it plugged, so that
+//the request queue can merge neighbouring blocks into one request.
+
+#define BUFFER_HASH_BITS 10
+#define BUFFER_MAX_CACHED 2048
+#define BUFFER_CLUSTER 8
+#define BUFFER_SYNC_BATCH 64
+//in milliseconds
+#define BUFFER_WRITEBACK_DELAY 5000
+
+static cache_t *buffer_cache;
+
+static DEFINE_SPINLOCK(buffer_lock);
+static DEFINE_HASHTABLE(buffer_table, BUFFER_HASH_BITS);
+static DEFINE_LIST(buffer_lru);
+static DEFINE_LIST(buffer_dirty);
+static uint32_t buffers_cached = 0;
+
+static delayed_work_t writeback_work;
+
+static inline uint32_t buffer_key(block_device_t *device, size_t block) {
+    return ((uint32_t) device) + block;
+}
+
+static buffer_t * buffer_alloc(block_device_t *device, size_t block) {
+    buffer_t *buffer = cache_alloc(buffer_cache);
+    buffer->device = device;
+    buffer->block = block;
+    buffer->flags = 0;
+    mutex_init(&buffer->lock);
+    buffer->data = kmalloc(device->block_size);
+    buffer->refs = 1;
+    list_init(&buffer->lru);
+    list_init(&buffer->dirty);
+
+    return buffer;
+}
+
+static void buffer_free(buffer_t *buffer) {
+    kfree(buffer->data);
+    cache_free(buffer_cache, buffer);
+}
+
+//Invoked under buffer_lock.
+static buffer_t * __buffer_find(block_device_t *device, size_t block) {
+    buffer_t *buffer;
+    HASHTABLE_FOR_EACH_COLLISION(buffer_key(device, block), buffer, buffer_table, node) {
+        if(buffer->device == device && buffer->block == block) {
+            return buffer;
+        }
+    }
+
+    return NULL;
+}
+
+//Invoked under buffer_lock.
+static void __buffer_get(buffer_t *buffer) {
+    if(!buffer->refs++) {
+        list_rm(&buffer->lru);
+        list_init(&buffer->lru);
+    }
+}
+
+//Invoked under buffer_lock. Evicts up to nr clean unused buffers, starting
+//with the least recently used, and returns how many were evicted.
+static uint32_t __buffer_shrink(uint32_t nr) {
+    uint32_t freed = 0;
+
+    list_head_t *pos = buffer_lru.prev;
+    while(freed < nr && pos != &buffer_lru) {
+        buffer_t *buffer = list_entry(pos, buffer_t, lru);
+        pos = pos->prev;
+
+        if(!list_empty(&buffer->dirty)) {
+            continue;
+        }
+
+        BUG_ON(buffer->refs);
+
+        list_rm(&buffer->lru);
+        hashtable_rm(&buffer->node);
+        buffers_cached--;
+
+        buffer_free(buffer);
+        freed++;
+    }
+
+    return freed;
+}
+
+static uint32_t buffer_shrink(uint32_t nr) {
+    uint32_t flags;
+    spin_lock_irqsave(&buffer_lock, &flags);
+    uint32_t freed = __buffer_shrink(nr);
+    spin_unlock_irqstore(&buffer_lock, flags);
+
+    return freed;
+}
+
+//Returns a reference to the buffer for block, which need not be up to date.
+static buffer_t * buffer_get(block_device_t *device, size_t block) {
+    uint32_t flags;
+    spin_lock_irqsave(&buffer_lock, &flags);
+
+    buffer_t *buffer = __buffer_find(device, block);
+    if(buffer) {
+        __buffer_get(buffer);
+        spin_unlock_irqstore(&buffer_lock, flags);
+
+        return buffer;
+    }
+
+    spin_unlock_irqstore(&buffer_lock, flags);
+
+    buffer_t *new = buffer_alloc(device, block);
+
+    spin_lock_irqsave(&buffer_lock, &flags);
+
+    //someone may have beaten us to it
+    buffer = __buffer_find(device, block);
+    if(buffer) {
+        __buffer_get(buffer);
+    } else {
+        hashtable_add(buffer_key(device, block), &new->node, buffer_table);
+        buffers_cached++;
+
+        if(buffers_cached > BUFFER_MAX_CACHED) {
+            __buffer_shrink(buffers_cached - BUFFER_MAX_CACHED);
+        }
+
+        buffer = new;
+        new = NULL;
+    }
+
+    spin_unlock_irqstore(&buffer_lock, flags);
+
+    if(new) {
+        buffer_free(new);
+    }
+
+    return buffer;
+}
+
+void buffer_put(buffer_t *buffer) {
+    uint32_t flags;
+    spin_lock_irqsave(&buffer_lock, &flags);
+
+    BUG_ON(!buffer->refs);
+    if(!--buffer->refs) {
+        list_add(&buffer->lru, &buffer_lru);
+    }
+
+    spin_unlock_irqstore(&buffer_lock, flags);
+}
+
+//Invoked with first->lock held. Reads first in, along with as many of the
+//blocks following it as are not up to date, up to BUFFER_CLUSTER in total.
+static int32_t buffer_fill(buffer_t *first) {
+    block_device_t *device = first->device;
+
+    buffer_t *cluster[BUFFER_CLUSTER];
+    cluster[0] = first;
+
+    uint32_t num = 1;
+    while(num < BUFFER_CLUSTER && first->block + num < device->size) {
+        buffer_t *buffer = buffer_get(device, first->block + num);
+
+        //Stop at the first block which is cached, or which someone else is
+        //already busy with (taking the lock outright could deadlock).
+        if(!mutex_trylock(&buffer->lock)) {
+            buffer_put(buffer);
+            break;
+        }
+
+        if(test_bit(&buffer->flags, BUFFER_UPTODATE)) {
+            mutex_unlock(&buffer->lock);
+            buffer_put(buffer);
+            break;
+        }
+
+        cluster[num++] = buffer;
+    }
+
+    size_t block_size = device->block_size;
+
+    bio_t *bio = bio_alloc(device, first->block, BIO_READ,
+        num * bio_max_vecs(block_size));
+    for(uint32_t i = 0; i < num; i++) {
+        BUG_ON(!bio_add_buff(bio, cluster[i]->data, block_size));
+    }
+
+    int32_t ret = bio_submit_wait(bio);
+    bio_free(bio);
+
+    for(uint32_t i = 0; i < num; i++) {
+        buffer_t *buffer = cluster[i];
+
+        if(!ret) {
+            set_bit(&buffer->flags, BUFFER_UPTODATE);
+        }
+
+        if(i) {
+            mutex_unlock(&buffer->lock);
+            buffer_put(buffer);
+        }
+    }
+
+    return ret;
+}
+
+//Finds the device which block of device is actually cached as part of.
+static block_device_t * resolve_device(block_device_t *device, size_t *block) {
+    while(device->parent) {
+        *block += device->start;
+        device = device->parent;
+    }
+
+    return device;
+}
+
+buffer_t * buffer_read(block_device_t *device, size_t block) {
+    if(block >= device->size) {
+        return NULL;
+    }
+
+    device = resolve_device(device, &block);
+
+    buffer_t *buffer = buffer_get(device, block);
+
+    mutex_lock(&buffer->lock);
+
+    if(!test_bit(&buffer->flags, BUFFER_UPTODATE) && buffer_fill(buffer)) {
+        mutex_unlock(&buffer->lock);
+        buffer_put(buffer);
+
+        return NULL;
+    }
+
+    mutex_unlock(&buffer->lock);
+
+    return buffer;
+}
+
+void buffer_mark_dirty(buffer_t *buffer) {
+    set_bit(&buffer->flags, BUFFER_DIRTY);
+
+    uint32_t flags;
+    spin_lock_irqsave(&buffer_lock, &flags);
+
+    if(list_empty(&buffer->dirty)) {
+        list_add_before(&buffer->dirty, &buffer_dirty);
+    }
+
+    spin_unlock_irqstore(&buffer_lock, flags);
+
+    queue_delayed_work(&writeback_work, BUFFER_WRITEBACK_DELAY);
+}
+
+ssize_t block_read(block_device_t *device, void *buff, size_t block, size_t count) {
+    size_t done;
+    for(done = 0; done < count; done++) {
+        buffer_t *buffer = buffer_read(device, block + done);
+        if(!buffer) {
+            break;
+        }
+
+        mutex_lock(&buffer->lock);
+        memcpy(buff + (done * device->block_size), buffer->data, device->block_size);
+        mutex_unlock(&buffer->lock);
+
+        buffer_put(buffer);
+    }
+
+    return done ? (ssize_t) done : -1;
+}
+
+ssize_t block_write(block_device_t *device, const void *buff, size_t block, size_t count) {
+    size_t done;
+    for(done = 0; done < count && block + done < device->size; done++) {
+        size_t real_block = block + done;
+        block_device_t *real = resolve_device(device, &real_block);
+
+        //The whole block is being overwritten, so there is no need to read it.
+        buffer_t *buffer = buffer_get(real, real_block);
+
+        mutex_lock(&buffer->lock);
+
+        memcpy(buffer->data, buff + (done * device->block_size), device->block_size);
+        set_bit(&buffer->flags, BUFFER_UPTODATE);
+        buffer_mark_dirty(buffer);
+
+        mutex_unlock(&buffer->lock);
+
+        buffer_put(buffer);
+    }
+
+    return done ? (ssize_t) done : -1;
+}
+
+//Returns a reference to the first buffer of device waiting to be written
+//back, having taken it off the dirty list, or NULL if there are none.
+static buffer_t * buffer_next_dirty(block_device_t *device) {
+    uint32_t flags;
+    spin_lock_irqsave(&buffer_lock, &flags);
+
+    buffer_t *buffer;
+    LIST_FOR_EACH_ENTRY(buffer, &buffer_dirty, dirty) {
+        if(!device || buffer->device == device) {
+            list_rm(&buffer->dirty);
+            list_init(&buffer->dirty);
+            __buffer_get(buffer);
+
+            spin_unlock_irqstore(&buffer_lock, flags);
+
+            return buffer;
+        }
+    }
+
+    spin_unlock_irqstore(&buffer_lock, flags);
+
+    return NULL;
+}
+
+//Puts a buffer which buffer_next_dirty() returned back on the dirty list.
+static void buffer_requeue(buffer_t *buffer) {
+    uint32_t flags;
+    spin_lock_irqsave(&buffer_lock, &flags);
+
+    if(list_empty(&buffer->dirty)) {
+        list_add_before(&buffer->dirty, &buffer_dirty);
+    }
+
+    spin_unlock_irqstore(&buffer_lock, flags);
+
+    buffer_put(buffer);
+}
+
+static void writeback_end_io(bio_t *bio) {
+    semaphore_up(bio->private);
+}
+
+//Writes back first, along with as many of the other dirty buffers of its
+//device as fit in BUFFER_SYNC_BATCH, with the device plugged while they are
+//submitted. Consumes the reference to first. Buffers which fail to write back
+//are dirtied again and put on failed, for the caller to requeue.
+static int32_t writeback_batch(buffer_t *first, list_head_t *failed) {
+    block_device_t *device = first->device;
+
+    buffer_t *batch[BUFFER_SYNC_BATCH];
+    bio_t *bios[BUFFER_SYNC_BATCH];
+    uint32_t num = 0;
+
+    buffer_t *buffer = first;
+    mutex_lock(&buffer->lock);
+
+    while(true) {
+        //It may have been written back since it was last dirtied.
+        if(test_bit(&buffer->flags, BUFFER_DIRTY)) {
+            clear_bit(&buffer->flags, BUFFER_DIRTY);
+            batch[num++] = buffer;
+        } else {
+            mutex_unlock(&buffer->lock);
+            buffer_put(buffer);
+        }
+
+        if(num == BUFFER_SYNC_BATCH || !(buffer = buffer_next_dirty(device))) {
+            break;
+        }
+
+        //We already hold some buffer locks, so waiting for this one could
+        //deadlock against another writer. It can wait for the next batch.
+        if(!mutex_trylock(&buffer->lock)) {
+            buffer_requeue(buffer);
+            break;
+        }
+    }
+
+    semaphore_t done;
+    semaphore_init(&done, 0);
+
+    block_plug(device);
+
+    for(uint32_t i = 0; i < num; i++) {
+        bio_t *bio = bios[i] = bio_alloc(device, batch[i]->block, BIO_WRITE,
+            bio_max_vecs(device->block_size));
+        BUG_ON(!bio_add_buff(bio, batch[i]->data, device->block_size));
+        bio->end_io = writeback_end_io;
+        bio->private = &done;
+
+        bio_submit(bio);
+    }
+
+    block_unplug(device);
+
+    int32_t ret = 0;
+    for(uint32_t i = 0; i < num; i++) {
+        semaphore_down(&done);
+    }
+
+    for(uint32_t i = 0; i < num; i++) {
+        if(bios[i]->error) {
+            kprintf("buffer - write back of block %u failed", batch[i]->block);
+            ret = -EIO;
+
+            set_bit(&batch[i]->flags, BUFFER_DIRTY);
+
+            uint32_t flags;
+            spin_lock_irqsave(&buffer_lock, &flags);
+
+            if(list_empty(&batch[i]->dirty)) {
+                list_add_before(&batch[i]->dirty, failed);
+            }
+
+            spin_unlock_irqstore(&buffer_lock, flags);
+        }
+
+        bio_free(bios[i]);
+
+        mutex_unlock(&batch[i]->lock);
+        buffer_put(batch[i]);
+    }
+
+    return ret;
+}
+
+int32_t block_sync(block_device_t *device) {
+    if(device) {
+        size_t start = 0;
+        device = resolve_device(device, &start);
+    }
+
+    int32_t ret = 0;
+
+    //Buffers which failed are kept off the dirty list until we are done, so
+    //that we do not retry them forever, and are left for the next sync.
+    list_head_t failed;
+    list_init(&failed);
+
+    buffer_t *buffer;
+    while((buffer = buffer_next_dirty(device))) {
+        if(writeback_batch(buffer, &failed)) {
+            ret = -EIO;
+        }
+    }
+
+    uint32_t flags;
+    spin_lock_irqsave(&buffer_lock, &flags);
+
+    while(!list_empty(&failed)) {
+        list_move_before(failed.next, &buffer_dirty);
+    }
+
+    spin_unlock_irqstore(&buffer_lock, flags);
+
+    return ret;
+}
+
+static void writeback_run(void *UNUSED(arg)) {
+    block_sync(NULL);
+}
+
+static shrinker_t buffer_shrinker = {
+    .shrink = buffer_shrink,
+};
+
+static INITCALL buffer_init() {
+    buffer_cache = cache_create(sizeof(buffer_t));
+    delayed_work_init(&writeback_work, writeback_run, NULL);
+
+    register_shrinker(&buffer_shrinker);
+
+    return 0;
+}
+
+core_initcall(buffer_init);
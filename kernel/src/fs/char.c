@@ -9,6 +9,7 @@ static cache_t *char_device_cache;
 char_device_t * char_device_alloc() {
     char_device_t *dev = cache_alloc(char_device_cache);
     spinlock_init(&dev->lock);
+    poll_head_init(&dev->poll_head);
     return dev;
 }
 
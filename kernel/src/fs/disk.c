@@ -1,7 +1,7 @@
 #include "common/types.h"
 #include "lib/printf.h"
 #include "common/list.h"
-#include "sync/spinlock.h"
+#include "sync/mutex.h"
 #include "mm/mm.h"
 #include "fs/block.h"
 #include "fs/subblock.h"
@@ -10,21 +10,17 @@
 #include "log/log.h"
 
 static DEFINE_LIST(disk_labels);
-static DEFINE_SPINLOCK(disk_label_lock);
+//Probes read from the disk, so they may sleep.
+static DEFINE_MUTEX(disk_label_lock);
 
 void register_disk_label(disk_label_t *disk_label) {
-    uint32_t flags;
-    spin_lock_irqsave(&disk_label_lock, &flags);
-
+    mutex_lock(&disk_label_lock);
     list_add(&disk_label->list, &disk_labels);
-
-    spin_unlock_irqstore(&disk_label_lock, flags);
+    mutex_unlock(&disk_label_lock);
 }
 
 void register_disk(block_device_t *device, char *name) {
-    //FIXME after implementing an IO scheduler
-    //uint32_t flags;
-    //spin_lock_irqsave(&disk_label_lock, &flags);
+    mutex_lock(&disk_label_lock);
 
     disk_label_t *disk_label;
     LIST_FOR_EACH_ENTRY(disk_label, &disk_labels, list) {
@@ -33,7 +29,7 @@ void register_disk(block_device_t *device, char *name) {
         }
     }
 
-    //spin_unlock_irqstore(&disk_label_lock, flags);
+    mutex_unlock(&disk_label_lock);
 }
 
 static uint8_t num_digits(uint8_t number) {
@@ -0,0 +1,434 @@
+#include "common/types.h"
+#include "common/list.h"
+#include "common/hashtable.h"
+#include "sync/spinlock.h"
+#include "sync/mutex.h"
+#include "mm/mm.h"
+#include "time/clock.h"
+#include "time/hrtimer.h"
+#include "sched/sched.h"
+#include "sched/task.h"
+#include "fs/vfs.h"
+#include "fs/poll.h"
+#include "fs/epoll.h"
+
+//Each watched file has an epitem_t, whose poll_entry_t hangs off the poll_head_t
+//of the file. When the file notifies us that its readiness may have changed,
+//the item is pushed onto the ready list of its epoll instance, so epoll_wait()
+//only ever has to poll the files which might actually be ready.
+//
+//Level-triggered items which are still ready after being reported go back on
+//the ready list, while edge-triggered ones wait for the next notification.
+//Files which have no poll_head_t would never notify us, and so cannot be
+//watched at all.
+//
+//Locks nest in the order: epoll_lock, ep->mtx, poll_head_t lock, ep->lock.
+
+#define EPOLL_HASH_BITS 6
+
+//the events which userspace can ask to be told about
+#define EPOLL_EVENTS (EPOLLIN | EPOLLOUT | EPOLLERR)
+
+typedef struct eventpoll {
+    //serialises changes to the items, and the harvesting of the ready list
+    mutex_t mtx;
+
+    //taken by the poll callbacks, and protects ready and waiters
+    spinlock_t lock;
+    list_head_t ready;
+    list_head_t waiters;
+
+    list_head_t items;
+    DECLARE_HASHTABLE(item_table, EPOLL_HASH_BITS);
+} eventpoll_t;
+
+typedef struct epitem {
+    eventpoll_t *ep;
+    file_t *file;
+
+    //modified under both ep->mtx and ep->lock
+    uint32_t events;
+    epoll_data_t data;
+
+    poll_entry_t entry;
+    //empty unless the item is on the ready list
+    list_head_t ready_list;
+
+    list_head_t list;
+    hashtable_node_t node;
+    //protected by epoll_lock
+    list_head_t file_list;
+} epitem_t;
+
+typedef struct ep_waiter {
+    list_head_t list;
+    thread_t *thread;
+} ep_waiter_t;
+
+//Protects the epitems list of every file, so that a file which is going away
+//can be removed from each instance watching it.
+static DEFINE_MUTEX(epoll_lock);
+
+static file_ops_t epoll_ops;
+
+//Invoked under ep->lock.
+static void ep_queue(eventpoll_t *ep, epitem_t *item) {
+    if(!list_empty(&item->ready_list) || !(item->events & EPOLL_EVENTS)) {
+        return;
+    }
+
+    list_add_before(&item->ready_list, &ep->ready);
+
+    ep_waiter_t *waiter;
+    LIST_FOR_EACH_ENTRY(waiter, &ep->waiters, list) {
+        thread_wake(waiter->thread);
+    }
+}
+
+static void ep_poll_callback(poll_entry_t *entry) {
+    epitem_t *item = containerof(entry, epitem_t, entry);
+    eventpoll_t *ep = item->ep;
+
+    spin_lock(&ep->lock);
+    ep_queue(ep, item);
+    spin_unlock(&ep->lock);
+}
+
+static uint32_t ep_item_poll(epitem_t *item) {
+    fpoll_data_t fp;
+    if(vfs_poll(item->file, &fp)) {
+        return EPOLLERR;
+    }
+
+    return (fp.readable ? EPOLLIN : 0)
+        | (fp.writable ? EPOLLOUT : 0)
+        | (fp.errored ? EPOLLERR : 0);
+}
+
+//Invoked under ep->mtx.
+static void ep_check_ready(eventpoll_t *ep, epitem_t *item) {
+    if(!(ep_item_poll(item) & (item->events | EPOLLERR))) {
+        return;
+    }
+
+    uint32_t flags;
+    spin_lock_irqsave(&ep->lock, &flags);
+    ep_queue(ep, item);
+    spin_unlock_irqstore(&ep->lock, flags);
+}
+
+//Invoked under ep->mtx.
+static epitem_t * ep_find(eventpoll_t *ep, file_t *file) {
+    epitem_t *item;
+    HASHTABLE_FOR_EACH_COLLISION((uint32_t) file, item, ep->item_table, node) {
+        if(item->file == file) {
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
+//Invoked under epoll_lock and ep->mtx.
+static void ep_remove(eventpoll_t *ep, epitem_t *item) {
+    //Once this returns the callback cannot be running.
+    poll_rm(&item->entry);
+
+    uint32_t flags;
+    spin_lock_irqsave(&ep->lock, &flags);
+
+    if(!list_empty(&item->ready_list)) {
+        list_rm(&item->ready_list);
+    }
+
+    spin_unlock_irqstore(&ep->lock, flags);
+
+    list_rm(&item->list);
+    hashtable_rm(&item->node);
+    list_rm(&item->file_list);
+
+    kfree(item);
+}
+
+//Invoked under epoll_lock and ep->mtx.
+static int32_t ep_insert(eventpoll_t *ep, file_t *file,
+    struct epoll_event *event) {
+    epitem_t *item = kmalloc(sizeof(epitem_t));
+    item->ep = ep;
+    item->file = file;
+    item->events = event->events;
+    item->data = event->data;
+    list_init(&item->ready_list);
+
+    list_add(&item->list, &ep->items);
+    hashtable_add((uint32_t) file, &item->node, ep->item_table);
+    list_add(&item->file_list, &file->epitems);
+
+    poll_add(vfs_poll_head(file), &item->entry, ep_poll_callback);
+
+    //The file may have become ready before we started listening.
+    ep_check_ready(ep, item);
+
+    return 0;
+}
+
+//Invoked under ep->mtx.
+static int32_t ep_modify(eventpoll_t *ep, epitem_t *item,
+    struct epoll_event *event) {
+    uint32_t flags;
+    spin_lock_irqsave(&ep->lock, &flags);
+
+    item->events = event->events;
+    item->data = event->data;
+
+    spin_unlock_irqstore(&ep->lock, flags);
+
+    ep_check_ready(ep, item);
+
+    return 0;
+}
+
+//Invoked under ep->mtx. Reports up to maxevents of the ready items.
+static int32_t ep_harvest(eventpoll_t *ep, struct epoll_event *events,
+    int32_t maxevents) {
+    //Items which become ready while we are looking at the others are
+    //queued on ep->ready again, and wait for the next epoll_wait().
+    list_head_t txlist;
+
+    uint32_t flags;
+    spin_lock_irqsave(&ep->lock, &flags);
+
+    if(list_empty(&ep->ready)) {
+        spin_unlock_irqstore(&ep->lock, flags);
+        return 0;
+    }
+
+    list_replace(&ep->ready, &txlist);
+    list_init(&ep->ready);
+
+    spin_unlock_irqstore(&ep->lock, flags);
+
+    int32_t num = 0;
+    while(num < maxevents) {
+        spin_lock_irqsave(&ep->lock, &flags);
+
+        if(list_empty(&txlist)) {
+            spin_unlock_irqstore(&ep->lock, flags);
+            break;
+        }
+
+        epitem_t *item = list_first(&txlist, epitem_t, ready_list);
+        list_rm(&item->ready_list);
+        list_init(&item->ready_list);
+
+        spin_unlock_irqstore(&ep->lock, flags);
+
+        uint32_t revents = ep_item_poll(item) & (item->events | EPOLLERR);
+        if(!revents || !(item->events & EPOLL_EVENTS)) {
+            continue;
+        }
+
+        events[num].events = revents;
+        events[num].data = item->data;
+        num++;
+
+        spin_lock_irqsave(&ep->lock, &flags);
+
+        if(item->events & EPOLLONESHOT) {
+            item->events &= ~EPOLL_EVENTS;
+        } else if(!(item->events & EPOLLET)) {
+            ep_queue(ep, item);
+        }
+
+        spin_unlock_irqstore(&ep->lock, flags);
+    }
+
+    //Put back whatever we did not have room to report.
+    spin_lock_irqsave(&ep->lock, &flags);
+
+    while(!list_empty(&txlist)) {
+        list_move(txlist.prev, &ep->ready);
+    }
+
+    spin_unlock_irqstore(&ep->lock, flags);
+
+    return num;
+}
+
+static void epoll_close(file_t *file) {
+    eventpoll_t *ep = file->private;
+
+    mutex_lock(&epoll_lock);
+    mutex_lock(&ep->mtx);
+
+    while(!list_empty(&ep->items)) {
+        ep_remove(ep, list_first(&ep->items, epitem_t, list));
+    }
+
+    mutex_unlock(&ep->mtx);
+    mutex_unlock(&epoll_lock);
+
+    kfree(ep);
+}
+
+static file_ops_t epoll_ops = {
+    .close = epoll_close,
+};
+
+file_t * epoll_create() {
+    file_t *file = file_alloc(&epoll_ops);
+    if(!file) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    eventpoll_t *ep = kmalloc(sizeof(eventpoll_t));
+    mutex_init(&ep->mtx);
+    spinlock_init(&ep->lock);
+    list_init(&ep->ready);
+    list_init(&ep->waiters);
+    list_init(&ep->items);
+    hashtable_init(ep->item_table);
+
+    file->private = ep;
+
+    return file;
+}
+
+int32_t epoll_ctl(file_t *ep_file, int op, file_t *file,
+    struct epoll_event *event) {
+    if(ep_file->ops != &epoll_ops) {
+        return -EINVAL;
+    }
+
+    //Watching another epoll instance (or ourselves) is not supported, and
+    //neither is watching a file which cannot tell us when it becomes ready.
+    if(!file->ops->poll || !file->ops->poll_head) {
+        return -EPERM;
+    }
+
+    eventpoll_t *ep = ep_file->private;
+
+    int32_t ret;
+    bool global = op != EPOLL_CTL_MOD;
+
+    if(global) {
+        mutex_lock(&epoll_lock);
+    }
+    mutex_lock(&ep->mtx);
+
+    epitem_t *item = ep_find(ep, file);
+
+    switch(op) {
+        case EPOLL_CTL_ADD: {
+            ret = item ? -EEXIST : ep_insert(ep, file, event);
+            break;
+        }
+        case EPOLL_CTL_DEL: {
+            ret = item ? 0 : -ENOENT;
+            if(item) {
+                ep_remove(ep, item);
+            }
+            break;
+        }
+        case EPOLL_CTL_MOD: {
+            ret = item ? ep_modify(ep, item, event) : -ENOENT;
+            break;
+        }
+        default: {
+            ret = -EINVAL;
+            break;
+        }
+    }
+
+    mutex_unlock(&ep->mtx);
+    if(global) {
+        mutex_unlock(&epoll_lock);
+    }
+
+    return ret;
+}
+
+static void timeout_callback(thread_t *thread) {
+    thread_poke(thread);
+}
+
+int32_t epoll_wait(file_t *ep_file, struct epoll_event *events,
+    int32_t maxevents, int32_t timeout) {
+    if(ep_file->ops != &epoll_ops || maxevents <= 0) {
+        return -EINVAL;
+    }
+
+    eventpoll_t *ep = ep_file->private;
+
+    uint64_t until = timeout > 0
+        ? uptime_us() + (((uint64_t) timeout) * MICROS_PER_MILLI) : 0;
+
+    hrtimer_t timer;
+    hrtimer_init(&timer, (timer_callback_t) timeout_callback, current);
+
+    ep_waiter_t waiter;
+    waiter.thread = current;
+
+    int32_t ret;
+    while(true) {
+        mutex_lock(&ep->mtx);
+        ret = ep_harvest(ep, events, maxevents);
+        mutex_unlock(&ep->mtx);
+
+        if(ret) {
+            break;
+        }
+
+        uint64_t now = uptime_us();
+        if(timeout == 0 || (timeout > 0 && now >= until)) {
+            break;
+        }
+
+        uint32_t flags;
+        spin_lock_irqsave(&ep->lock, &flags);
+
+        if(are_signals_pending(current)) {
+            spin_unlock_irqstore(&ep->lock, flags);
+
+            ret = -EINTR;
+            break;
+        }
+
+        //Anything which becomes ready from now on will wake us.
+        if(list_empty(&ep->ready)) {
+            list_add_before(&waiter.list, &ep->waiters);
+
+            thread_sleep_prepare();
+            if(timeout > 0) {
+                hrtimer_start(&timer, until - now);
+            }
+
+            spin_unlock_irqstore(&ep->lock, flags);
+            sched_switch();
+            spin_lock_irqsave(&ep->lock, &flags);
+
+            list_rm(&waiter.list);
+        }
+
+        spin_unlock_irqstore(&ep->lock, flags);
+    }
+
+    hrtimer_cancel(&timer);
+
+    return ret;
+}
+
+void epoll_release(file_t *file) {
+    mutex_lock(&epoll_lock);
+
+    while(!list_empty(&file->epitems)) {
+        epitem_t *item = list_first(&file->epitems, epitem_t, file_list);
+        eventpoll_t *ep = item->ep;
+
+        mutex_lock(&ep->mtx);
+        ep_remove(ep, item);
+        mutex_unlock(&ep->mtx);
+    }
+
+    mutex_unlock(&epoll_lock);
+}
@@ -6,6 +6,7 @@
 
 bool execute_path(path_t *path, char **raw_argv, char **raw_envp) {
     file_t *f = vfs_open_file(path);
+    path_put(path);
     if(!f) {
         return false;
     }
@@ -1,59 +1,70 @@
 #include "init/initcall.h"
-#include "sync/spinlock.h"
+#include "sync/atomic.h"
+#include "sync/rcu.h"
 #include "bug/debug.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
 #include "fs/fd.h"
+#include "fs/epoll.h"
 #include "log/log.h"
 #include "misc/stats.h"
 
 static cache_t *file_cache;
-static DEFINE_SPINLOCK(gfdt_lock);
 
 file_t * gfdt_obtain() {
-    uint32_t flags;
-    spin_lock_irqsave(&gfdt_lock, &flags);
-
-    gfdt_entries_in_use++;
+    atomic_inc(&gfdt_entries_in_use);
 
     file_t *f = cache_alloc(file_cache);
-
-    spin_unlock_irqstore(&gfdt_lock, flags);
-
-    f->refs = 0;
+    atomic_set(&f->refs, 0);
 
     return f;
 }
 
 void gfdt_get(file_t *f) {
-    uint32_t flags;
-    spin_lock_irqsave(&gfdt_lock, &flags);
+    atomic_inc(&f->refs);
+}
 
-    f->refs++;
+//Files are looked up locklessly (see ufdt_get()), so may be seen after their
+//last ref has been dropped. Those must be left alone.
+bool gfdt_tryget(file_t *f) {
+    int32_t refs = atomic_read(&f->refs);
+    while(refs) {
+        int32_t old = atomic_cmpxchg(&f->refs, refs, refs + 1);
+        if(old == refs) {
+            return true;
+        }
+
+        refs = old;
+    }
+
+    return false;
+}
 
-    spin_unlock_irqstore(&gfdt_lock, flags);
+static void gfdt_free_rcu(rcu_head_t *head) {
+    cache_free(file_cache, containerof(head, file_t, rcu));
 }
 
 static void gfdt_free(file_t *f) {
+    //No one can start watching a file without holding a ref to it.
+    if(!list_empty(&f->epitems)) {
+        epoll_release(f);
+    }
+
     f->ops->close(f);
-    cache_free(file_cache, f);
+    if(f->path.dentry) {
+        path_put(&f->path);
+    }
 
-    gfdt_entries_in_use--;
+    call_rcu(&f->rcu, gfdt_free_rcu);
+
+    atomic_dec(&gfdt_entries_in_use);
 }
 
+//A file which was never installed anywhere has no refs, and is just freed.
 void gfdt_put(file_t *f) {
-    uint32_t flags;
-    spin_lock_irqsave(&gfdt_lock, &flags);
-
-    if(f->refs) {
-        f->refs--;
-    }
-
-    if(!f->refs) {
+    if(!atomic_read(&f->refs) || atomic_dec_and_test(&f->refs)) {
         gfdt_free(f);
     }
-
-    spin_unlock_irqstore(&gfdt_lock, flags);
 }
 
 static INITCALL gfdt_init() {
@@ -80,7 +80,7 @@ static bool gpt_probe(block_device_t *device, char *name) {
     }
 
     gpt_header_t *gpt = kmalloc(device->block_size);
-    if(device->ops->read(device, gpt, GPT_HEADER_SECTOR, 1) != 1) {
+    if(block_read(device, gpt, GPT_HEADER_SECTOR, 1) != 1) {
         goto probe_header_fail;
     }
 
@@ -92,7 +92,7 @@ static bool gpt_probe(block_device_t *device, char *name) {
     uint32_t pages = DIV_UP(sectors * device->block_size, PAGE_SIZE);
     page_t *start = alloc_pages(pages, 0);
     gpt_part_t *part = page_to_virt(start);
-    if(device->ops->read(device, part, gpt->part_lba, sectors) != sectors) {
+    if(block_read(device, part, gpt->part_lba, sectors) != sectors) {
         goto probe_table_fail;
     }
 
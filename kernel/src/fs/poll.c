@@ -0,0 +1,39 @@
+#include "common/types.h"
+#include "common/list.h"
+#include "sync/spinlock.h"
+#include "fs/poll.h"
+
+void poll_add(poll_head_t *head, poll_entry_t *entry, poll_callback_t callback) {
+    entry->head = head;
+    entry->callback = callback;
+
+    uint32_t flags;
+    spin_lock_irqsave(&head->lock, &flags);
+
+    list_add(&entry->list, &head->entries);
+
+    spin_unlock_irqstore(&head->lock, flags);
+}
+
+void poll_rm(poll_entry_t *entry) {
+    poll_head_t *head = entry->head;
+
+    uint32_t flags;
+    spin_lock_irqsave(&head->lock, &flags);
+
+    list_rm(&entry->list);
+
+    spin_unlock_irqstore(&head->lock, flags);
+}
+
+void poll_notify(poll_head_t *head) {
+    uint32_t flags;
+    spin_lock_irqsave(&head->lock, &flags);
+
+    poll_entry_t *entry;
+    LIST_FOR_EACH_ENTRY(entry, &head->entries, list) {
+        entry->callback(entry);
+    }
+
+    spin_unlock_irqstore(&head->lock, flags);
+}
@@ -48,6 +48,7 @@ static uint32_t entry_reconstruct(entry_t *e, const path_t *root) {
                 if(ret < 0 && ret != -EEXIST) {
                     panicf("rootramfs - vfs_create() failed: %d", ret);
                 }
+                path_put(&path);
 
                 part[0] = '/';
                 part++;
@@ -71,6 +72,7 @@ static uint32_t entry_reconstruct(entry_t *e, const path_t *root) {
             frecord_t *fr = ((void *) e) + sizeof(entry_t) + e->name_len;
 
             file_t *f = vfs_open_file(&path);
+            path_put(&path);
             vfs_write(f, fr->data, fr->len);
 
             return sizeof(entry_t) + e->name_len + sizeof(frecord_t) + fr->len;
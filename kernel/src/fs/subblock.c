@@ -41,6 +41,8 @@ block_device_t * subblock_device_open(block_device_t *parent, uint32_t start,  u
     sub->ops = &subblock_ops;
     sub->size = size;
     sub->block_size = parent->block_size;
+    sub->parent = parent;
+    sub->start = start;
 
     return sub;
 }
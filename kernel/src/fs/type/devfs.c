@@ -1,11 +1,14 @@
 #include "init/initcall.h"
 #include "init/param.h"
 #include "common/list.h"
+#include "common/math.h"
+#include "lib/string.h"
 #include "sync/spinlock.h"
 #include "mm/cache.h"
 #include "sched/sched.h"
 #include "sched/ktaskd.h"
 #include "fs/vfs.h"
+#include "fs/buffer.h"
 #include "fs/type/devfs.h"
 #include "log/log.h"
 
@@ -46,6 +49,11 @@ static int32_t char_file_poll(file_t *file, fpoll_data_t *fd) {
     return cdev->ops->poll(cdev, fd);
 }
 
+static poll_head_t * char_file_poll_head(file_t *file) {
+    devfs_device_t *device = file->private;
+    return &device->chardev->poll_head;
+}
+
 static void char_file_close(file_t *file) {
 }
 
@@ -56,6 +64,7 @@ static file_ops_t char_file_ops = {
     .read = char_file_read,
     .write = char_file_write,
     .poll = char_file_poll,
+    .poll_head = char_file_poll_head,
 };
 
 static inode_ops_t char_inode_ops = {
@@ -68,17 +77,93 @@ static void block_file_open(file_t *file, inode_t *inode) {
 }
 
 static off_t block_file_seek(file_t *file, off_t off, int whence) {
-    return 0;
+    block_device_t *bdev = devfs_get_blockdev(file);
+    //The device may well be larger than an off_t can address, in which case
+    //only its start can be reached.
+    uint64_t size = ((uint64_t) bdev->size) * bdev->block_size;
+    off_t end = size > (off_t) -1 ? (off_t) -1 : size;
+
+    switch(whence) {
+        case SEEK_SET: {
+            break;
+        }
+        case SEEK_CUR: {
+            off += file->offset;
+            break;
+        }
+        case SEEK_END: {
+            off += end;
+            break;
+        }
+        default: {
+            return -EINVAL;
+        }
+    }
+
+    if(off > end) {
+        return -EINVAL;
+    }
+
+    file->offset = off;
+    return off;
 }
 
+//Block files are accessed a block at a time through the buffer cache, so
+//that reads and writes need not be aligned to blocks.
 static ssize_t block_file_read(file_t *file, char *buff, size_t bytes) {
-    //TODO implement buffered IO scheduler for block abstracted reads
-    return -1;
+    block_device_t *bdev = devfs_get_blockdev(file);
+    size_t block_size = bdev->block_size;
+
+    size_t done = 0;
+    while(done < bytes) {
+        size_t off = file->offset % block_size;
+        size_t len = MIN(block_size - off, bytes - done);
+
+        buffer_t *buffer = buffer_read(bdev, file->offset / block_size);
+        if(!buffer) {
+            break;
+        }
+
+        mutex_lock(&buffer->lock);
+        memcpy(buff + done, buffer->data + off, len);
+        mutex_unlock(&buffer->lock);
+
+        buffer_put(buffer);
+
+        done += len;
+        file->offset += len;
+    }
+
+    return done;
 }
 
 static ssize_t block_file_write(file_t *file, const char *buff, size_t bytes) {
-    //TODO implement buffered IO scheduler for block abstracted writes
-    return -1;
+    block_device_t *bdev = devfs_get_blockdev(file);
+    size_t block_size = bdev->block_size;
+
+    size_t done = 0;
+    while(done < bytes) {
+        size_t off = file->offset % block_size;
+        size_t len = MIN(block_size - off, bytes - done);
+
+        //Partial blocks have to be read in first, so just always do that.
+        buffer_t *buffer = buffer_read(bdev, file->offset / block_size);
+        if(!buffer) {
+            break;
+        }
+
+        mutex_lock(&buffer->lock);
+        memcpy(buffer->data + off, buff + done, len);
+        buffer_mark_dirty(buffer);
+        mutex_unlock(&buffer->lock);
+
+        buffer_put(buffer);
+
+        done += len;
+        file->offset += len;
+    }
+
+    return done;
 }
 
 static int32_t block_file_poll(file_t *file, fpoll_data_t *fd) {
@@ -340,10 +425,14 @@ static INITCALL devfs_mount() {
             kprintf("devfs - could not create path \"%s\"", mntpoint);
         } else if((ret = vfs_lookup(&wd, mntpoint, &target))) {
             kprintf("devfs - could not lookup \"%s\": %d", mntpoint, ret);
-        } else if(vfs_do_mount(devfs, &target)) {
-            kprintf("devfs - mounted at \"%s\"", mntpoint);
         } else {
-            kprintf("devfs - could not mount at \"%s\"", mntpoint);
+            if(vfs_do_mount(devfs, &target)) {
+                kprintf("devfs - mounted at \"%s\"", mntpoint);
+            } else {
+                kprintf("devfs - could not mount at \"%s\"", mntpoint);
+            }
+
+            path_put(&target);
         }
     }
 
@@ -167,11 +167,23 @@ static off_t ramfs_file_seek(file_t *file, off_t offset, int whence) {
 }
 
 static ssize_t ramfs_file_read(file_t *file, char *buff, size_t bytes) {
-    return record_read(file, buff, bytes, file->offset);
+    inode_t *inode = file->path.dentry->inode;
+
+    mutex_lock(&inode->lock);
+    ssize_t ret = record_read(file, buff, bytes, file->offset);
+    mutex_unlock(&inode->lock);
+
+    return ret;
 }
 
 static ssize_t ramfs_file_write(file_t *file, const char *buff, size_t bytes) {
-    return record_write(file, buff, bytes, file->offset);
+    inode_t *inode = file->path.dentry->inode;
+
+    mutex_lock(&inode->lock);
+    ssize_t ret = record_write(file, buff, bytes, file->offset);
+    mutex_unlock(&inode->lock);
+
+    return ret;
 }
 
 static int32_t ramfs_file_poll(file_t *file, fpoll_data_t *fp) {
@@ -9,12 +9,16 @@
 #include "bug/debug.h"
 #include "bug/panic.h"
 #include "sync/spinlock.h"
+#include "sync/rwlock.h"
+#include "sync/rcu.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
+#include "mm/reclaim.h"
 #include "sched/sched.h"
 #include "fs/fd.h"
 #include "fs/vfs.h"
 #include "log/log.h"
+#include "misc/stats.h"
 
 mount_t *root_mount;
 
@@ -26,12 +30,12 @@ static cache_t *fs_cache;
 static cache_t *mount_cache;
 
 static DEFINE_HASHTABLE(fs_types, 5);
-static DEFINE_SPINLOCK(fs_type_lock);
+static DEFINE_RWLOCK(fs_type_lock);
 
 static DEFINE_SPINLOCK(global_ino_lock);
 
 static DEFINE_HASHTABLE(mount_hashtable, log2(PAGE_SIZE / sizeof(hashtable_node_t)));
-static DEFINE_SPINLOCK(mount_hashtable_lock);
+static DEFINE_RWLOCK(mount_hashtable_lock);
 
 dentry_t * dentry_alloc(const char *name) {
     dentry_t *new = cache_alloc(dentry_cache);
@@ -39,8 +43,10 @@ dentry_t * dentry_alloc(const char *name) {
     new->inode = NULL;
     new->flags = 0;
     new->parent = 0;
+    atomic_set(&new->refs, 1);
     hashtable_init(new->children_tab);
     list_init(&new->children_list);
+    list_init(&new->lru);
 
     return new;
 }
@@ -57,6 +63,7 @@ inode_t * inode_alloc(fs_t *fs, inode_ops_t *ops) {
 
     new->fs = fs;
     new->ops = ops;
+    mutex_init(&new->lock);
 
     uint32_t flags;
     spin_lock_irqsave(&global_ino_lock, &flags);
@@ -66,11 +73,22 @@ inode_t * inode_alloc(fs_t *fs, inode_ops_t *ops) {
     return new;
 }
 
+void inode_free(inode_t *inode) {
+    if(inode->ops->release) {
+        inode->ops->release(inode);
+    }
+
+    cache_free(inode_cache, inode);
+}
+
 file_t * file_alloc(file_ops_t *ops) {
     file_t *new = gfdt_obtain();
     if(new) {
         new->offset = 0;
         new->ops = ops;
+        new->path.mount = NULL;
+        new->path.dentry = NULL;
+        list_init(&new->epitems);
     }
 
     return new;
@@ -92,29 +110,302 @@ static mount_t * mount_alloc(fs_t *fs) {
     return mount;
 }
 
+//The dcache. Every dentry hashed into the children_tab of its parent holds a
+//reference to the parent, and is one of:
+//
+//  * activated, which is how filesystems living in the dcache (like ramfs and
+//    devfs) add their contents. These keep their reference from
+//    dentry_alloc(), so are never reclaimed, and only these appear in
+//    children_list.
+//  * cached, after ->lookup() found an inode for it.
+//  * negative, after ->lookup() found nothing, so that repeated lookups of
+//    missing names (think PATH searches) fail without asking the fs.
+//
+//Once the last reference to a cached or negative dentry is dropped it goes to
+//the front of the LRU, and it is reclaimed from the back when there are more
+//than DCACHE_MAX_UNUSED there, or when memory runs low. Lookups walk
+//children_tab under RCU and then take a reference with dentry_tryget(), which
+//fails once the dentry has been marked DENTRY_DEAD for reclaim.
+//
+//dcache_lock protects the hash chains, children_list and the LRU, and a
+//reference count may only drop to zero under it.
+
+#define DCACHE_MAX_UNUSED 1024
+
+static DEFINE_SPINLOCK(dcache_lock);
+static DEFINE_LIST(dentry_lru);
+
+static bool dentry_tryget(dentry_t *dentry) {
+    int32_t refs = atomic_read(&dentry->refs);
+    while(refs != DENTRY_DEAD) {
+        int32_t old = atomic_cmpxchg(&dentry->refs, refs, refs + 1);
+        if(old == refs) {
+            return true;
+        }
+
+        refs = old;
+    }
+
+    return false;
+}
+
+static bool dentry_name_eq(dentry_t *dentry, const char *name, uint32_t len) {
+    return !memcmp(dentry->name, name, len) && !dentry->name[len];
+}
+
+static void dentry_free_rcu(rcu_head_t *head) {
+    dentry_free(containerof(head, dentry_t, rcu));
+}
+
+//Invoked under dcache_lock.
+static void __dentry_lru_del(dentry_t *dentry) {
+    if(!list_empty(&dentry->lru)) {
+        list_rm(&dentry->lru);
+        list_init(&dentry->lru);
+        dentries_unused--;
+    }
+}
+
+//Invoked under dcache_lock, once the refs of dentry are DENTRY_DEAD. Returns
+//the parent, whose reference the caller must drop.
+static dentry_t * __dentry_kill(dentry_t *dentry) {
+    if(!test_and_set_bit(&dentry->flags, DENTRY_UNHASHED)) {
+        hashtable_rm_rcu(&dentry->node);
+    }
+
+    __dentry_lru_del(dentry);
+
+    dentry_t *parent = dentry->parent;
+    call_rcu(&dentry->rcu, dentry_free_rcu);
+
+    return parent;
+}
+
+//Invoked under dcache_lock.
+static void __dput(dentry_t *dentry) {
+    while(dentry && atomic_dec_and_test(&dentry->refs)) {
+        if(!test_bit(&dentry->flags, DENTRY_UNHASHED)) {
+            if(list_empty(&dentry->lru)) {
+                dentries_unused++;
+            } else {
+                list_rm(&dentry->lru);
+            }
+            list_add(&dentry->lru, &dentry_lru);
+
+            break;
+        }
+
+        //No new lookup can find an unhashed dentry, but one which found it
+        //beforehand may still have taken a reference.
+        if(atomic_cmpxchg(&dentry->refs, 0, DENTRY_DEAD)) {
+            break;
+        }
+
+        dentry = __dentry_kill(dentry);
+    }
+}
+
+//Invoked under dcache_lock.
+static uint32_t __dcache_shrink(uint32_t nr) {
+    uint32_t freed = 0;
+    uint32_t scan = dentries_unused;
+
+    while(freed < nr && scan-- && !list_empty(&dentry_lru)) {
+        dentry_t *dentry = list_entry(dentry_lru.prev, dentry_t, lru);
+
+        //Give dentries which lookups have hit since we last came past another
+        //trip around the LRU.
+        if(test_bit(&dentry->flags, DENTRY_REFERENCED)) {
+            clear_bit(&dentry->flags, DENTRY_REFERENCED);
+            list_rm(&dentry->lru);
+            list_add(&dentry->lru, &dentry_lru);
+            continue;
+        }
+
+        __dentry_lru_del(dentry);
+
+        //If it is in use again it goes back on the LRU once it is put.
+        if(atomic_cmpxchg(&dentry->refs, 0, DENTRY_DEAD)) {
+            continue;
+        }
+
+        __dput(__dentry_kill(dentry));
+        freed++;
+    }
+
+    return freed;
+}
+
+//Invoked under dcache_lock.
+static void __dcache_trim() {
+    if(dentries_unused > DCACHE_MAX_UNUSED) {
+        __dcache_shrink(dentries_unused - DCACHE_MAX_UNUSED);
+    }
+}
+
+uint32_t dcache_shrink(uint32_t nr) {
+    uint32_t flags;
+    spin_lock_irqsave(&dcache_lock, &flags);
+    uint32_t freed = __dcache_shrink(nr);
+    spin_unlock_irqstore(&dcache_lock, flags);
+
+    return freed;
+}
+
+void dput(dentry_t *dentry) {
+    int32_t refs = atomic_read(&dentry->refs);
+    while(refs > 1) {
+        int32_t old = atomic_cmpxchg(&dentry->refs, refs, refs - 1);
+        if(old == refs) {
+            return;
+        }
+
+        refs = old;
+    }
+    BUG_ON(refs <= 0);
+
+    uint32_t flags;
+    spin_lock_irqsave(&dcache_lock, &flags);
+
+    __dput(dentry);
+    __dcache_trim();
+
+    spin_unlock_irqstore(&dcache_lock, flags);
+}
+
+//Invoked under dcache_lock.
+static dentry_t * __dentry_find(dentry_t *parent, const char *name,
+    uint32_t len) {
+    dentry_t *child;
+    HASHTABLE_FOR_EACH_COLLISION(str_to_key(name, len), child, parent->children_tab, node) {
+        if(dentry_name_eq(child, name, len)) {
+            return child;
+        }
+    }
+
+    return NULL;
+}
+
+//Invoked under dcache_lock.
+static void __dentry_hash(dentry_t *child, dentry_t *parent) {
+    child->parent = dget(parent);
+    hashtable_add_rcu(str_to_key(child->name, strlen(child->name)), &child->node, parent->children_tab);
+}
+
 void dentry_activate(dentry_t *child, dentry_t *parent) {
     child->parent = parent;
 
     if(parent) {
-        hashtable_add(str_to_key(child->name, strlen(child->name)), &child->node, parent->children_tab);
+        uint32_t flags;
+        spin_lock_irqsave(&dcache_lock, &flags);
+
+        //A lookup may have recorded that there was no such child.
+        dentry_t *old = __dentry_find(parent, child->name, strlen(child->name));
+        if(old) {
+            BUG_ON(old->inode);
+
+            hashtable_rm_rcu(&old->node);
+            set_bit(&old->flags, DENTRY_UNHASHED);
+
+            if(!atomic_cmpxchg(&old->refs, 0, DENTRY_DEAD)) {
+                __dput(__dentry_kill(old));
+            }
+        }
+
+        __dentry_hash(child, parent);
         list_add(&child->list, &parent->children_list);
+
+        spin_unlock_irqstore(&dcache_lock, flags);
     }
 }
 
+//Fills child with a reference to the named child of parent, asking the fs if
+//it is not cached, or returns -ENOENT if there is no such child. name must be
+//null-terminated after len characters.
+static int32_t dentry_lookup_child(dentry_t *parent, const char *name,
+    uint32_t len, dentry_t **child) {
+    dentry_t *d;
+
+    rcu_read_lock();
+    HASHTABLE_FOR_EACH_COLLISION_RCU(str_to_key(name, len), d, parent->children_tab, node) {
+        if(dentry_name_eq(d, name, len)) {
+            break;
+        }
+    }
+
+    //We need not hold a negative dentry to know what it says.
+    if(d && !d->inode) {
+        set_bit(&d->flags, DENTRY_REFERENCED);
+        rcu_read_unlock();
+
+        return -ENOENT;
+    }
+
+    if(d && dentry_tryget(d)) {
+        set_bit(&d->flags, DENTRY_REFERENCED);
+        rcu_read_unlock();
+
+        *child = d;
+        return 0;
+    }
+
+    rcu_read_unlock();
+
+    //The fs may sleep, so ask it before taking the lock, and then cache the
+    //answer unless someone else beat us to it.
+    dentry_t *new = dentry_alloc(strdup(name));
+    new->fs = parent->fs;
+    parent->inode->ops->lookup(parent->inode, new);
+
+    uint32_t flags;
+    spin_lock_irqsave(&dcache_lock, &flags);
+
+    d = __dentry_find(parent, name, len);
+    if(d) {
+        dget(d);
+    } else {
+        __dentry_hash(new, parent);
+        d = new;
+        new = NULL;
+    }
+
+    int32_t ret = 0;
+    if(d->inode) {
+        *child = d;
+    } else {
+        __dput(d);
+        __dcache_trim();
+
+        ret = -ENOENT;
+    }
+
+    spin_unlock_irqstore(&dcache_lock, flags);
+
+    //Nothing else has seen the inode the fs found for us, if it found one.
+    if(new) {
+        if(new->inode) {
+            inode_free(new->inode);
+        }
+        dentry_free(new);
+    }
+
+    return ret;
+}
+
 void register_fs_type(fs_type_t *fs_type) {
     list_init(&fs_type->instances);
 
     uint32_t flags;
-    spin_lock_irqsave(&fs_type_lock, &flags);
+    write_lock_irqsave(&fs_type_lock, &flags);
 
     hashtable_add(str_to_key(fs_type->name, strlen(fs_type->name)), &fs_type->node, fs_types);
 
-    spin_unlock_irqstore(&fs_type_lock, flags);
+    write_unlock_irqstore(&fs_type_lock, flags);
 }
 
 fs_type_t * find_fs_type(const char *name) {
     uint32_t flags;
-    spin_lock_irqsave(&fs_type_lock, &flags);
+    read_lock_irqsave(&fs_type_lock, &flags);
 
     fs_type_t *type;
     HASHTABLE_FOR_EACH_COLLISION(str_to_key(name, strlen(name)), type, fs_types, node) {
@@ -126,7 +417,7 @@ fs_type_t * find_fs_type(const char *name) {
     type = NULL;
 
 fs_found:
-    spin_unlock_irqstore(&fs_type_lock, flags);
+    read_unlock_irqstore(&fs_type_lock, flags);
 
     return type;
 }
@@ -137,7 +428,7 @@ static uint32_t hash_mount(mount_t *mount, dentry_t *mountpoint) {
 
 static mount_t * get_mount(path_t *mountpoint) {
     uint32_t flags;
-    spin_lock_irqsave(&mount_hashtable_lock, &flags);
+    read_lock_irqsave(&mount_hashtable_lock, &flags);
 
     mount_t *mount;
     HASHTABLE_FOR_EACH_COLLISION(hash_mount(mountpoint->mount, mountpoint->dentry), mount, mount_hashtable, node) {
@@ -149,7 +440,7 @@ static mount_t * get_mount(path_t *mountpoint) {
     mount = NULL;
 
 get_mount_out:
-    spin_unlock_irqstore(&mount_hashtable_lock, flags);
+    read_unlock_irqstore(&mount_hashtable_lock, flags);
 
     return mount;
 }
@@ -206,14 +497,14 @@ bool vfs_mount_add(mount_t *mount, path_t *mountpoint) {
     if(get_mount(mountpoint)) return false;
 
     mount->parent = mountpoint->mount;
-    mount->mountpoint = mountpoint->dentry;
+    mount->mountpoint = dget(mountpoint->dentry);
 
     uint32_t flags;
-    spin_lock_irqsave(&mount_hashtable_lock, &flags);
+    write_lock_irqsave(&mount_hashtable_lock, &flags);
 
     hashtable_add(hash_mount(mount->parent, mount->mountpoint), &mount->node, mount_hashtable);
 
-    spin_unlock_irqstore(&mount_hashtable_lock, flags);
+    write_unlock_irqstore(&mount_hashtable_lock, flags);
 
     mount->mountpoint->inode->flags |= INODE_FLAG_MOUNTPOINT;
 
@@ -234,11 +525,11 @@ bool vfs_umount(path_t *mountpoint) {
         BUG_ON(mount == root_mount);
 
         uint32_t flags;
-        spin_lock_irqsave(&mount_hashtable_lock, &flags);
+        write_lock_irqsave(&mount_hashtable_lock, &flags);
 
         hashtable_rm(&mount->node);
 
-        spin_unlock_irqstore(&mount_hashtable_lock, flags);
+        write_unlock_irqstore(&mount_hashtable_lock, flags);
 
         return true;
     } else {
@@ -275,6 +566,7 @@ static int32_t get_path_wd(const path_t *start, const char *orig_pathname, path_
         *wd = path;
     } else {
         *wd = *start;
+        path_get(wd);
     }
 
     *out_last = strdup(last);
@@ -299,23 +591,32 @@ int32_t vfs_create(const path_t *start, const char *pathname, uint32_t mode,
 
     path_t wd;
     char *last;
-    if((ret = get_path_wd(start, pathname, &wd, &last))) {
-        return ret;
-    }
     if(strlen(pathname) == 0) {
         return -ENOENT;
     }
+    if((ret = get_path_wd(start, pathname, &wd, &last))) {
+        return ret;
+    }
+
+    //Hold the directory so that no one else can create the same child between
+    //our lookup and create. This may take a while, and the fs may sleep.
+    inode_t *dir = wd.dentry->inode;
+    mutex_lock(&dir->lock);
 
     path_t f;
     ret = vfs_lookup(&wd, last, &f);
     if(!ret) {
         ret = -EEXIST;
-        if(path) *path = f;
+        if(path) {
+            *path = f;
+        } else {
+            path_put(&f);
+        }
 
-        //otherwise, do nothing?
+        kfree(last);
     } else if(ret == -ENOENT) {
         dentry_t *new = dentry_alloc(last);
-        ret = wd.dentry->inode->ops->create(wd.dentry->inode, new, mode);
+        ret = dir->ops->create(dir, new, mode);
         if(ret < 0)  {
             //FIXME dealloc new
             goto create_fail;
@@ -324,18 +625,31 @@ int32_t vfs_create(const path_t *start, const char *pathname, uint32_t mode,
         validate_inode(new);
         dentry_activate(new, wd.dentry);
         if(path) {
-            path->dentry = new;
+            path->dentry = dget(new);
             path->mount = wd.mount;
         }
     }
 
+    mutex_unlock(&dir->lock);
+    path_put(&wd);
+
     return ret;
 
 create_fail:
+    mutex_unlock(&dir->lock);
+    path_put(&wd);
+
     kfree(last);
     return ret;
 }
 
+//Moves cwd to next, which must not be reclaimed before we take our reference.
+static void path_step(path_t *cwd, path_t next) {
+    path_get(&next);
+    path_put(cwd);
+    *cwd = next;
+}
+
 int32_t vfs_lookup(const path_t *start, const char *orig_path, path_t *out) {
     char *path = strdup(orig_path);
     char *new_path = path;
@@ -352,14 +666,18 @@ int32_t vfs_lookup(const path_t *start, const char *orig_path, path_t *out) {
         cwd = MNT_ROOT(root_mount);
     }
 
+    //We hold a reference to cwd for the whole walk.
+    path_get(&cwd);
+
+    int32_t ret = 0;
     bool finished = false;
-    while(!finished && *path && cwd.dentry) {
+    while(!finished && *path) {
         char *next = path;
 
         BUG_ON(!cwd.dentry->inode);
 
         if(!(cwd.dentry->inode->flags & INODE_FLAG_DIRECTORY)) {
-            cwd.dentry = NULL;
+            ret = -ENOENT;
             break;
         }
 
@@ -367,7 +685,7 @@ int32_t vfs_lookup(const path_t *start, const char *orig_path, path_t *out) {
         if(cwd.dentry->inode->flags & INODE_FLAG_MOUNTPOINT) {
             mount_t *submount = get_mount(&cwd);
             BUG_ON(!submount);
-            cwd = MNT_ROOT(submount);
+            path_step(&cwd, MNT_ROOT(submount));
 
             goto lookup_next;
         }
@@ -399,69 +717,63 @@ int32_t vfs_lookup(const path_t *start, const char *orig_path, path_t *out) {
             }
             case 2: {
                 if(path[1] == '.') {
-                    while(!cwd.dentry->parent && cwd.mount != root_mount) {
-                        BUG_ON(!cwd.mount->parent);
-                        cwd.dentry = cwd.mount->mountpoint;
-                        cwd.mount = cwd.mount->parent;
-
-                        BUG_ON(!(cwd.dentry->inode->flags & INODE_FLAG_MOUNTPOINT));
+                    //Mountpoints are held by their mounts, and parents by
+                    //their children, so none of these can go away.
+                    path_t up = cwd;
+                    while(!up.dentry->parent && up.mount != root_mount) {
+                        BUG_ON(!up.mount->parent);
+                        up.dentry = up.mount->mountpoint;
+                        up.mount = up.mount->parent;
+
+                        BUG_ON(!(up.dentry->inode->flags & INODE_FLAG_MOUNTPOINT));
                     }
 
-                    if(cwd.dentry->parent) {
-                        cwd.dentry = cwd.dentry->parent;
+                    if(up.dentry->parent) {
+                        up.dentry = up.dentry->parent;
                     } else {
                         //do nothing if we are at the root
                     }
 
+                    path_step(&cwd, up);
+
                     goto lookup_next;
                 }
             }
         }
 
-        //have we cached this child?
         dentry_t *child;
-        HASHTABLE_FOR_EACH_COLLISION(str_to_key(path, len), child, cwd.dentry->children_tab, node) {
-            if(!memcmp(child->name, path, len)) {
-                cwd.dentry = child;
-                goto lookup_next;
-            }
-        }
-
-        //request the fs driver resolves the path segment into a new dentry
-        child = dentry_alloc(strdup(path));
-        cwd.dentry->inode->ops->lookup(cwd.dentry->inode, child);
-
-        //does the requested path segment resolve?
-        if(!child->inode) {
-            dentry_free(child);
-            cwd.dentry = NULL;
+        if((ret = dentry_lookup_child(cwd.dentry, path, len, &child))) {
             break;
         }
 
+        dput(cwd.dentry);
         cwd.dentry = child;
 
 lookup_next:
         path = next;
     }
 
-    if(cwd.dentry) {
+    if(!ret) {
         if(cwd.dentry->inode->flags & INODE_FLAG_MOUNTPOINT) {
             mount_t *submount = get_mount(&cwd);
             BUG_ON(!submount);
-            cwd = MNT_ROOT(submount);
+            path_step(&cwd, MNT_ROOT(submount));
         }
 
         *out = cwd;
+    } else {
+        path_put(&cwd);
     }
 
     kfree(new_path);
 
-    return cwd.dentry ? 0 : -ENOENT;
+    return ret;
 }
 
 file_t * vfs_open_file(path_t *path) {
     file_t *file = file_alloc(path->dentry->inode->ops->file_ops);
     if(file) {
+        path_get(path);
         file->path = *path;
         file->ops->open(file, path->dentry->inode);
     }
@@ -575,15 +887,27 @@ uint32_t vfs_iterate(file_t *file, dir_entry_dat_t *buff, uint32_t num) {
 }
 
 int32_t vfs_poll(file_t *file, fpoll_data_t *fp) {
+    if(!file->ops->poll) return -EINVAL;
     return file->ops->poll(file, fp);
 }
 
+poll_head_t * vfs_poll_head(file_t *file) {
+    if(!file->ops->poll_head) return NULL;
+    return file->ops->poll_head(file);
+}
+
+static shrinker_t dcache_shrinker = {
+    .shrink = dcache_shrink,
+};
+
 static INITCALL vfs_init() {
     dentry_cache = cache_create(sizeof(dentry_t));
     inode_cache = cache_create(sizeof(inode_t));
     fs_cache = cache_create(sizeof(fs_t));
     mount_cache = cache_create(sizeof(mount_t));
 
+    register_shrinker(&dcache_shrinker);
+
     return 0;
 }
 
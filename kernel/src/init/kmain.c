@@ -9,7 +9,9 @@
 #include "arch/proc.h"
 #include "sched/proc.h"
 #include "sched/sched.h"
-#include "sched/ktaskd.h"
+#include "sched/workqueue.h"
+#include "sched/softirq.h"
+#include "sync/lockbench.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
 #include "mm/module.h"
@@ -55,8 +57,16 @@ static bool try_load_init(char *path) {
 static void umain() {
     kprintf("init - process started");
 
-    ktaskd_init();
-    kprintf("init - ktaskd created");
+    workqueue_init();
+    kprintf("init - workers created");
+
+    reaperd_init();
+    kprintf("init - reaperd created");
+
+    ksoftirqd_init();
+    kprintf("init - ksoftirqd created");
+
+    lockbench_run();
 
     path_t out;
     int32_t ret = devfs_lookup(TTY_NAME, &out);
@@ -69,6 +79,7 @@ static void umain() {
     }
 
     file_t *tty_file = vfs_open_file(&out);
+    path_put(&out);
     ufdt_add(tty_file);
     ufdt_add(tty_file);
     ufdt_add(tty_file);
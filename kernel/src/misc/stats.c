@@ -2,6 +2,7 @@
 #include "misc/stats.h"
 
 uint32_t thread_count;
-uint32_t gfdt_entries_in_use;
+atomic_t gfdt_entries_in_use;
 uint32_t pages_in_use;
 uint32_t pages_avaliable;
+uint32_t dentries_unused;
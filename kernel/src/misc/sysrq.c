@@ -22,8 +22,9 @@ void sysrq_handle(uint16_t code) {
         case S_KEY: {
             kprintf("stats:");
             kprintf("%u tasks", thread_count);
-            kprintf("%u file descriptors in use", gfdt_entries_in_use);
+            kprintf("%u file descriptors in use", atomic_read(&gfdt_entries_in_use));
             kprintf("%u/%u pages allocated/avaliable", pages_in_use, pages_avaliable);
+            kprintf("%u unused dentries cached", dentries_unused);
             break;
         }
     }
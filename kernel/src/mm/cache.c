@@ -47,6 +47,7 @@ static cache_t meta_cache = {
 };
 
 static DEFINE_LIST(caches);
+static DEFINE_SPINLOCK(caches_lock);
 
 static void cache_alloc_page(cache_t *cache) {
     page_t *page = alloc_page(ALLOC_CACHE);
@@ -169,7 +170,6 @@ void cache_free(cache_t *cache, void *mem) {
 
 cache_t * cache_create(uint32_t size) {
     cache_t *new = (cache_t *) cache_alloc(&meta_cache);
-    list_add(&new->list, &caches);
 
     new->size = size;
     new->max = (PAGE_SIZE - sizeof(cache_page_t)) / (size + sizeof(uint32_t));
@@ -181,9 +181,38 @@ cache_t * cache_create(uint32_t size) {
     list_init(&new->partial);
     list_init(&new->full);
 
+    uint32_t flags;
+    spin_lock_irqsave(&caches_lock, &flags);
+    list_add(&new->list, &caches);
+    spin_unlock_irqstore(&caches_lock, flags);
+
     return new;
 }
 
+void cache_reap() {
+    uint32_t flags;
+    spin_lock_irqsave(&caches_lock, &flags);
+
+    cache_t *cache;
+    LIST_FOR_EACH_ENTRY(cache, &caches, list) {
+        if(cache->flags & CACHE_FLAG_PERM) {
+            continue;
+        }
+
+        spin_lock(&cache->lock);
+
+        while(!list_empty(&cache->empty)) {
+            cache_page_t *cache_page = list_first(&cache->empty, cache_page_t, list);
+            list_rm(&cache_page->list);
+            free_page(cache_page->page);
+        }
+
+        spin_unlock(&cache->lock);
+    }
+
+    spin_unlock_irqstore(&caches_lock, flags);
+}
+
 static cache_t *kalloc_cache[KALLOC_NUM_CACHES];
 
 static inline uint32_t kalloc_cache_index(uint32_t size) {
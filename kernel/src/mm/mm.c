@@ -11,6 +11,7 @@
 #include "mm/mm.h"
 #include "mm/cache.h"
 #include "mm/module.h"
+#include "mm/reclaim.h"
 #include "sched/task.h"
 #include "log/log.h"
 #include "misc/stats.h"
@@ -24,6 +25,9 @@
 
 #define PAGE_TABLE_EXTENT (PAGE_SIZE * NUM_ENTRIES)
 
+//reclaim is woken once fewer than 1/2^LOW_WATERMARK_SHIFT of the pages are free
+#define LOW_WATERMARK_SHIFT 4
+
 #define PAGE_FLAG_USED  (1 << 0)
 #define PAGE_FLAG_PERM  (1 << 1)
 #define PAGE_FLAG_USER  (1 << 2)
@@ -263,8 +267,15 @@ static page_t * _alloc_pages(uint32_t num, uint32_t flags) {
         memset(first, 0, num * PAGE_SIZE);
     }
 
+    bool low = pages_avaliable - pages_in_use
+        < (pages_avaliable >> LOW_WATERMARK_SHIFT);
+
     spin_unlock_irqstore(&alloc_lock, f);
 
+    if(low) {
+        reclaim_wakeup();
+    }
+
     return pages;
 }
 
@@ -0,0 +1,55 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/list.h"
+#include "init/initcall.h"
+#include "sync/mutex.h"
+#include "mm/mm.h"
+#include "mm/cache.h"
+#include "mm/reclaim.h"
+#include "sched/workqueue.h"
+
+//how many objects each shrinker is asked to free per wakeup
+#define SHRINK_BATCH 128
+
+static DEFINE_MUTEX(shrinker_lock);
+static DEFINE_LIST(shrinkers);
+
+static work_t reclaim_work;
+static volatile bool reclaim_ready = false;
+
+void register_shrinker(shrinker_t *shrinker) {
+    mutex_lock(&shrinker_lock);
+    list_add_before(&shrinker->list, &shrinkers);
+    mutex_unlock(&shrinker_lock);
+}
+
+//The allocator wakes us again on its next allocation if memory is still low,
+//so a single batch is enough here.
+static void reclaim_run(void *UNUSED(arg)) {
+    mutex_lock(&shrinker_lock);
+
+    shrinker_t *shrinker;
+    LIST_FOR_EACH_ENTRY(shrinker, &shrinkers, list) {
+        shrinker->shrink(SHRINK_BATCH);
+    }
+
+    mutex_unlock(&shrinker_lock);
+
+    //Hand the pages which the shrinkers emptied back to the allocator.
+    cache_reap();
+}
+
+void reclaim_wakeup() {
+    if(reclaim_ready) {
+        queue_work(&reclaim_work);
+    }
+}
+
+static INITCALL reclaim_init() {
+    work_init(&reclaim_work, reclaim_run, NULL);
+    reclaim_ready = true;
+
+    return 0;
+}
+
+core_initcall(reclaim_init);
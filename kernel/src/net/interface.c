@@ -1,17 +1,19 @@
 #include "common/types.h"
 #include "common/list.h"
 #include "common/listener.h"
+#include "sync/atomic.h"
 #include "sync/spinlock.h"
+#include "sync/rwlock.h"
 #include "net/packet.h"
 #include "net/interface.h"
 #include "log/log.h"
 
 static char *hostname = "K-OS"; //TODO touppercase this when it gets dynamically loaded
-static uint32_t hostname_handles;
+static atomic_t hostname_handles;
 
 static DEFINE_LIST(interfaces);
 static DEFINE_LISTENER_CHAIN(listeners);
-static DEFINE_SPINLOCK(interface_lock);
+static DEFINE_RWLOCK(interface_lock);
 static DEFINE_SPINLOCK(listener_lock);
 
 void register_net_interface(net_interface_t *interface) {
@@ -22,22 +24,22 @@ void register_net_interface(net_interface_t *interface) {
     interface->state = IF_INIT;
 
     uint32_t flags;
-    spin_lock_irqsave(&interface_lock, &flags);
+    write_lock_irqsave(&interface_lock, &flags);
 
     list_add(&interface->list, &interfaces);
 
-    spin_unlock_irqstore(&interface_lock, flags);
+    write_unlock_irqstore(&interface_lock, flags);
 
     net_set_state(interface, IF_DOWN);
 }
 
 void unregister_net_interface(net_interface_t *interface) {
     uint32_t flags;
-    spin_lock_irqsave(&interface_lock, &flags);
+    write_lock_irqsave(&interface_lock, &flags);
 
     list_rm(&interface->list);
 
-    spin_unlock_irqstore(&interface_lock, flags);
+    write_unlock_irqstore(&interface_lock, flags);
 }
 
 void register_net_state_listener(listener_t *listener) {
@@ -60,23 +62,18 @@ void unregister_net_state_listener(listener_t *listener) {
 
 const char * net_get_hostname() {
     uint32_t flags;
-    spin_lock_irqsave(&interface_lock, &flags);
+    read_lock_irqsave(&interface_lock, &flags);
 
-    hostname_handles++;
+    atomic_inc(&hostname_handles);
     char *local_name = ACCESS_ONCE(hostname);
 
-    spin_unlock_irqstore(&interface_lock, flags);
+    read_unlock_irqstore(&interface_lock, flags);
 
     return local_name;
 }
 
 void net_put_hostname() {
-    uint32_t flags;
-    spin_lock_irqsave(&interface_lock, &flags);
-
-    hostname_handles--;
-
-    spin_unlock_irqstore(&interface_lock, flags);
+    atomic_dec(&hostname_handles);
 }
 
 void net_recieve(net_interface_t *interface, void *raw, uint16_t len) {
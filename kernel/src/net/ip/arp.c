@@ -3,6 +3,7 @@
 #include "common/swap.h"
 #include "common/hashtable.h"
 #include "sync/spinlock.h"
+#include "sync/rwlock.h"
 #include "mm/mm.h"
 #include "time/timer.h"
 #include "net/packet.h"
@@ -36,7 +37,9 @@ typedef struct arp_cache_entry {
 } arp_cache_entry_t;
 
 static DEFINE_HASHTABLE(arp_cache, 5);
-static DEFINE_SPINLOCK(arp_cache_lock);
+//Taken for reading to look up an entry (each entry has its own lock), and for
+//writing to add or resolve one.
+static DEFINE_RWLOCK(arp_cache_lock);
 
 void arp_build(packet_t *packet, uint16_t op, mac_t sender_mac, mac_t target_mac, ip_t sender_ip, ip_t target_ip) {
     arp_header_t *hdr = kmalloc(sizeof(arp_header_t));
@@ -131,6 +134,27 @@ static void arp_cache_put_unresolved(net_interface_t *interface, ip_t ip, packet
     arp_watchdog(entry);
 }
 
+static void arp_resolve_entry(arp_cache_entry_t *entry, packet_t *packet) {
+    uint32_t flags;
+    spin_lock_irqsave(&entry->lock, &flags);
+
+    if(entry->state == CACHE_UNRESOLVED) {
+        list_add(&packet->list, &entry->pending);
+
+        spin_unlock_irqstore(&entry->lock, flags);
+
+        if(entry->retrys == -1) arp_watchdog(entry);
+    } else if(entry->state == CACHE_RESOLVED) {
+        spin_unlock_irqstore(&entry->lock, flags);
+
+        packet->route.dst.family = AF_LINK;
+        packet->route.dst.addr = &entry->mac;
+
+        packet->state = PSTATE_RESOLVED;
+        packet_send(packet);
+    }
+}
+
 void arp_resolve(packet_t *packet) {
     ip_t ip = *((ip_t *) packet->route.dst.addr);
 
@@ -144,40 +168,34 @@ void arp_resolve(packet_t *packet) {
         packet_send(packet);
     } else {
         uint32_t flags;
-        spin_lock_irqsave(&arp_cache_lock, &flags);
+        read_lock_irqsave(&arp_cache_lock, &flags);
 
         arp_cache_entry_t *entry = arp_cache_find(&ip);
-
         if(entry) {
-            uint32_t flags;
-            spin_lock_irqsave(&entry->lock, &flags);
-
-            if(entry->state == CACHE_UNRESOLVED) {
-                list_add(&packet->list, &entry->pending);
-
-                spin_unlock_irqstore(&entry->lock, flags);
+            arp_resolve_entry(entry, packet);
+        }
 
-                if(entry->retrys == -1) arp_watchdog(entry);
-            } else if(entry->state == CACHE_RESOLVED) {
-                spin_unlock_irqstore(&entry->lock, flags);
+        read_unlock_irqstore(&arp_cache_lock, flags);
 
-                packet->route.dst.family = AF_LINK;
-                packet->route.dst.addr = &entry->mac;
+        if(!entry) {
+            write_lock_irqsave(&arp_cache_lock, &flags);
 
-                packet->state = PSTATE_RESOLVED;
-                packet_send(packet);
+            //Someone may have beaten us to it.
+            entry = arp_cache_find(&ip);
+            if(entry) {
+                arp_resolve_entry(entry, packet);
+            } else {
+                arp_cache_put_unresolved(packet->interface, ip, packet);
             }
-        } else {
-            arp_cache_put_unresolved(packet->interface, ip, packet);
-        }
 
-        spin_unlock_irqstore(&arp_cache_lock, flags);
+            write_unlock_irqstore(&arp_cache_lock, flags);
+        }
     }
 }
 
 void arp_cache_store(net_interface_t *interface, mac_t *mac, ip_t *ip) {
     uint32_t flags;
-    spin_lock_irqsave(&arp_cache_lock, &flags);
+    write_lock_irqsave(&arp_cache_lock, &flags);
 
     arp_cache_entry_t *entry = arp_cache_find(ip);
     if(entry) {
@@ -203,7 +221,7 @@ void arp_cache_store(net_interface_t *interface, mac_t *mac, ip_t *ip) {
         arp_cache_put_resolved(interface, *ip, *mac);
     }
 
-    spin_unlock_irqstore(&arp_cache_lock, flags);
+    write_unlock_irqstore(&arp_cache_lock, flags);
 }
 
 void arp_handle(packet_t *packet, void *raw, uint16_t len) {
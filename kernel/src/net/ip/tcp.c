@@ -5,8 +5,11 @@
 #include "common/swap.h"
 #include "sync/spinlock.h"
 #include "sync/semaphore.h"
+#include "sync/mutex.h"
+#include "sync/rcu.h"
 #include "mm/mm.h"
 #include "time/timer.h"
+#include "fs/poll.h"
 #include "net/socket.h"
 #include "net/packet.h"
 #include "net/ip/af_inet.h"
@@ -62,6 +65,10 @@ typedef struct tcp_data_conn {
     semaphore_t recv_semaphore;
     semaphore_t established_semaphore;
 
+    //serialises readers, who may sleep waiting for data (lock is only held
+    //while touching the receive buffer)
+    mutex_t recv_mutex;
+
     list_head_t queue;
 } tcp_data_conn_t;
 
@@ -104,7 +111,7 @@ static uint16_t tcp_bind_port(sock_t *sock) {
     if(ephemeral_next != FREELIST_END) {
         port = ephemeral_next + EPHEMERAL_START;
 
-        ports_sock[ephemeral_next + EPHEMERAL_START] = sock;
+        rcu_assign_pointer(ports_sock[ephemeral_next + EPHEMERAL_START], sock);
         ephemeral_next = ephemeral_ports_next[ephemeral_next];
     }
 
@@ -119,7 +126,7 @@ static void tcp_unbind_port(uint16_t port) {
     uint32_t flags;
     spin_lock_irqsave(&port_lock, &flags);
 
-    ports_sock[port] = NULL;
+    rcu_assign_pointer(ports_sock[port], NULL);
     ephemeral_ports_prev[ephemeral_next] = port - EPHEMERAL_START;
     ephemeral_ports_next[port - EPHEMERAL_START] = ephemeral_next;
     ephemeral_next = port - EPHEMERAL_START;
@@ -184,6 +191,7 @@ static void tcp_callback(packet_t *packet, sock_t *sock) {
         data->state = TCP_CLOSED;
 
         semaphore_up(&data->established_semaphore);
+        poll_notify(&sock->poll_head);
     }
 
     spin_unlock_irqstore(&data->lock, flags);
@@ -398,6 +406,9 @@ static void tcp_sock_handle(sock_t *sock, tcp_header_t *tcp, void *raw, uint16_t
         }
         default: break;
     }
+
+    //Any of the above may have made the sock readable or writable.
+    poll_notify(&sock->poll_head);
 }
 
 void tcp_handle(packet_t *packet, void *raw, uint16_t len) {
@@ -406,12 +417,12 @@ void tcp_handle(packet_t *packet, void *raw, uint16_t len) {
     raw += sizeof(tcp_header_t);
     len = swap_uint16(ip_hdr(packet)->total_length) - ((IP_IHL(ip_hdr(packet)->version_ihl) * sizeof(uint32_t)) + (TCP_DATA_OFF(tcp->data_off_flags) * sizeof(uint32_t)));
 
-    uint32_t flags;
-    spin_lock_irqsave(&port_lock, &flags);
-
-    sock_t *sock = ports_sock[swap_uint16(tcp->dst_port)];
+    //ports_sock is read under RCU, so a sock (and its private data) which is
+    //unbound must not be freed until a grace period has elapsed.
+    rcu_read_lock();
 
-    spin_unlock_irqstore(&port_lock, flags);
+    uint32_t flags;
+    sock_t *sock = rcu_dereference(ports_sock[swap_uint16(tcp->dst_port)]);
 
     if(sock) {
         if(sock->flags & SOCK_FLAG_LISTENING) {
@@ -457,6 +468,7 @@ void tcp_handle(packet_t *packet, void *raw, uint16_t len) {
                     list_init(&child_data->queue);
                     spinlock_init(&child_data->lock);
                     semaphore_init(&child_data->recv_semaphore, 0);
+                    mutex_init(&child_data->recv_mutex);
                     //The below should never get touched.
                     semaphore_init(&child_data->established_semaphore, 0);
 
@@ -475,6 +487,7 @@ void tcp_handle(packet_t *packet, void *raw, uint16_t len) {
                     tcp_queue_add(child, TCP_FLAG_SYN | TCP_FLAG_ACK, 14600, 0, NULL, 0);
 
                     semaphore_up(&data->accept_semaphore);
+                    poll_notify(&sock->poll_head);
 
                     spin_unlock_irqstore(&child_data->lock, flags3);
                 }
@@ -497,6 +510,8 @@ void tcp_handle(packet_t *packet, void *raw, uint16_t len) {
         }
     }
 
+    rcu_read_unlock();
+
     if(unknown_peer) {
         if(tcp->data_off_flags & TCP_FLAG_FIN) {
             //we don't know who this is (no sock_t), but want to talk anwyay
@@ -571,8 +586,6 @@ static void tcp_close(sock_t *sock) {
             //kfree(sock->local.addr);
         }
     }
-
-    //kfree(sock->private);
 }
 
 static bool tcp_listen(sock_t *sock, uint32_t backlog) {
@@ -685,13 +698,13 @@ static bool tcp_bind(sock_t *sock, sock_addr_t *addr) {
             if(ephemeral_next == ephemeral_port_offset) {
                 tcp_bind_port(sock);
             } else {
-                ports_sock[port] = sock;
+                rcu_assign_pointer(ports_sock[port], sock);
 
                 ephemeral_ports_prev[ephemeral_ports_next[ephemeral_port_offset]] = ephemeral_ports_prev[ephemeral_port_offset];
                 ephemeral_ports_next[ephemeral_ports_prev[ephemeral_port_offset]] = ephemeral_ports_next[ephemeral_port_offset];
             }
         } else {
-            ports_sock[port] = sock;
+            rcu_assign_pointer(ports_sock[port], sock);
         }
 
         spin_unlock_irqstore(&port_lock, flags);
@@ -716,6 +729,7 @@ static bool tcp_connect(sock_t *sock, sock_addr_t *addr) {
         list_init(&data->queue);
         spinlock_init(&data->lock);
         semaphore_init(&data->recv_semaphore, 0);
+        mutex_init(&data->recv_mutex);
         semaphore_init(&data->established_semaphore, 0);
 
         uint32_t flags;
@@ -821,42 +835,41 @@ static uint32_t tcp_recv(sock_t *sock, void *buff, uint32_t len, uint32_t flags)
 
     tcp_data_conn_t *data = sock->private;
 
+    mutex_lock(&data->recv_mutex);
+
     uint32_t f;
     spin_lock_irqsave(&data->lock, &f);
 
     if(data->recv_buff_back + 1 == data->recv_buff_front && data->state == TCP_CLOSED) {
         spin_unlock_irqstore(&data->lock, f);
+        mutex_unlock(&data->recv_mutex);
 
         //FIXME errno = ECONNRESET
         return -1;
     }
 
-    for(uint32_t i = 0; i < len; i++) {
-retry:
-        if(data->recv_buff_back + 1 == data->recv_buff_front) {
-            if(sock->flags & SOCK_FLAG_SHUT_RD) {
-                len = i;
-                break;
-            }
-
-            spin_unlock_irqstore(&data->lock, f);
-            semaphore_down(&data->recv_semaphore);
-            spin_lock_irqsave(&data->lock, &f);
-
-            if(sock->flags & SOCK_FLAG_SHUT_RD) {
-                len = i;
-                break;
-            }
-
-            goto retry;
-        } else {
+    //Drain whatever has arrived each time around, only disabling interrupts
+    //while we touch the buffer.
+    uint32_t i = 0;
+    while(true) {
+        while(i < len && data->recv_buff_back + 1 != data->recv_buff_front) {
             data->recv_buff_back = (data->recv_buff_back + 1) % data->recv_buff_size;
 
-            ((uint8_t *) buff)[i] = data->recv_buff[data->recv_buff_back];
+            ((uint8_t *) buff)[i++] = data->recv_buff[data->recv_buff_back];
         }
+
+        if(i == len || sock->flags & SOCK_FLAG_SHUT_RD) {
+            len = i;
+            break;
+        }
+
+        spin_unlock_irqstore(&data->lock, f);
+        semaphore_down(&data->recv_semaphore);
+        spin_lock_irqsave(&data->lock, &f);
     }
 
     spin_unlock_irqstore(&data->lock, f);
+    mutex_unlock(&data->recv_mutex);
 
         //kprintf("%d",len);
     if(len == (uint32_t)-1) {
@@ -866,6 +879,40 @@ retry:
     return len;
 }
 
+static void tcp_poll(sock_t *sock, fpoll_data_t *fp) {
+    fp->readable = false;
+    fp->writable = false;
+    fp->errored = false;
+
+    uint32_t flags;
+    if(sock->flags & SOCK_FLAG_LISTENING) {
+        tcp_data_listen_t *data = sock->private;
+        if(!data) {
+            return;
+        }
+
+        spin_lock_irqsave(&data->lock, &flags);
+
+        fp->readable = !list_empty(&data->children);
+
+        spin_unlock_irqstore(&data->lock, flags);
+    } else if(sock->private) {
+        tcp_data_conn_t *data = sock->private;
+
+        spin_lock_irqsave(&data->lock, &flags);
+
+        //A recv will not block if there is data waiting, or if there never
+        //will be any.
+        fp->readable = data->recv_buff_back + 1 != data->recv_buff_front
+            || (sock->flags & SOCK_FLAG_SHUT_RD) || data->state == TCP_CLOSED;
+        fp->writable = data->state == TCP_ESTABLISHED
+            && !(sock->flags & SOCK_FLAG_SHUT_WR);
+        fp->errored = data->state == TCP_CLOSED;
+
+        spin_unlock_irqstore(&data->lock, flags);
+    }
+}
+
 sock_protocol_t tcp_protocol = {
     .type     = SOCK_STREAM,
 
@@ -878,6 +925,7 @@ sock_protocol_t tcp_protocol = {
     .shutdown = tcp_shutdown,
     .send     = tcp_send,
     .recv     = tcp_recv,
+    .poll     = tcp_poll,
 };
 
 static INITCALL ephemeral_init() {
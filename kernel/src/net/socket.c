@@ -2,6 +2,7 @@
 #include "lib/string.h"
 #include "bug/panic.h"
 #include "sync/spinlock.h"
+#include "sync/rwlock.h"
 #include "mm/mm.h"
 #include "net/socket.h"
 #include "fs/fd.h"
@@ -10,43 +11,54 @@
 #define ISCONNECTIONLESS(sock) (sock->proto->type == SOCK_DGRAM || sock->proto->type == SOCK_RAW)
 
 static sock_family_t *families[AF_MAX];
-static DEFINE_SPINLOCK(family_lock);
+static DEFINE_RWLOCK(family_lock);
 
 void register_sock_family(sock_family_t *family) {
     uint32_t flags;
-    spin_lock_irqsave(&family_lock, &flags);
+    write_lock_irqsave(&family_lock, &flags);
 
     if(families[family->family]) panicf("Socket family %u already registered!", family->family);
     families[family->family] = family;
 
-    spin_unlock_irqstore(&family_lock, flags);
+    write_unlock_irqstore(&family_lock, flags);
 }
 
 static sock_t * sock_alloc() {
     sock_t *alloc = kmalloc(sizeof(sock_t));
     memset(alloc, 0, sizeof(sock_t));
+    poll_head_init(&alloc->poll_head);
 
     return alloc;
 }
 
-static void sock_free(sock_t *sock) {
+static void sock_free_rcu(rcu_head_t *head) {
+    sock_t *sock = containerof(head, sock_t, rcu);
+
+    kfree(sock->private);
     kfree(sock);
 }
 
+//Frees sock along with its private data, which the protocol leaves alone
+//once closed.
+static void sock_free(sock_t *sock) {
+    call_rcu(&sock->rcu, sock_free_rcu);
+}
+
 sock_t * sock_create(uint32_t family, uint32_t type, uint32_t protocol) {
     sock_family_t *family_ptr;
     sock_t *sock = NULL;
 
     uint32_t flags;
-    spin_lock_irqsave(&family_lock, &flags);
+    read_lock_irqsave(&family_lock, &flags);
 
     if(!(family_ptr = families[family])) {
+        read_unlock_irqstore(&family_lock, flags);
         return NULL;
     }
 
     sock_protocol_t *proto = family_ptr->find(type, protocol);
 
-    spin_unlock_irqstore(&family_lock, flags);
+    read_unlock_irqstore(&family_lock, flags);
 
     if(proto) {
         sock = sock_open(family_ptr, proto);
@@ -57,14 +69,14 @@ sock_t * sock_create(uint32_t family, uint32_t type, uint32_t protocol) {
 
 sock_t * sock_open(sock_family_t *family, sock_protocol_t *proto) {
     uint32_t flags;
-    spin_lock_irqsave(&family_lock, &flags);
+    read_lock_irqsave(&family_lock, &flags);
 
     sock_t *sock = sock_alloc();
     sock->family = family;
     sock->proto = proto;
     proto->open(sock);
 
-    spin_unlock_irqstore(&family_lock, flags);
+    read_unlock_irqstore(&family_lock, flags);
 
     return sock;
 }
@@ -201,8 +213,29 @@ static void sock_close_fd(file_t *file) {
     sock_close(file->private);
 }
 
+static int32_t sock_poll_fd(file_t *file, fpoll_data_t *fp) {
+    sock_t *sock = file->private;
+
+    if(sock->proto->poll) {
+        sock->proto->poll(sock, fp);
+    } else {
+        fp->readable = false;
+        fp->writable = (sock->flags & SOCK_FLAG_CONNECTED)
+            && !(sock->flags & SOCK_FLAG_SHUT_WR);
+        fp->errored = false;
+    }
+
+    return 0;
+}
+
+static poll_head_t * sock_poll_head_fd(file_t *file) {
+    return &((sock_t *) file->private)->poll_head;
+}
+
 static file_ops_t sock_ops = {
     .close = sock_close_fd,
+    .poll = sock_poll_fd,
+    .poll_head = sock_poll_head_fd,
 };
 
 file_t * sock_create_fd(sock_t *sock) {
@@ -5,15 +5,22 @@
 #include "arch/proc.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
+#include "sync/rcu.h"
 #include "sched/proc.h"
 #include "sched/sched.h"
 #include "log/log.h"
 
 processor_t *bsp;
+volatile cpu_mask_t procs_online = CPU_MASK_NONE;
 static DEFINE_LIST(procs);
+static processor_t *proc_table[MAX_NUM_PROCS];
 DEFINE_PER_CPU(processor_t *, this_proc);
 
 processor_t * register_proc(uint32_t num) {
+    if(num >= MAX_NUM_PROCS) {
+        panicf("proc - too many processors (%u)", num + 1);
+    }
+
     processor_t *proc = kmalloc(sizeof(processor_t));
     proc->num = num;
     proc->percpu_data = num ? map_page(page_to_phys(alloc_pages(DIV_UP(((uint32_t) &percpu_data_end) - ((uint32_t) &percpu_data_start), PAGE_SIZE), 0))) : &percpu_data_start;
@@ -23,15 +30,26 @@ processor_t * register_proc(uint32_t num) {
 
     get_percpu(this_proc) = proc;
 
+    proc_table[num] = proc;
+    procs_online |= cpu_mask_of(num);
+
     return proc;
 }
 
+processor_t * proc_get(uint32_t num) {
+    return num < MAX_NUM_PROCS ? proc_table[num] : NULL;
+}
+
+//Also serves as the reschedule IPI: an idle processor which receives it will
+//pick up newly queued threads on the way out of interrupt_dispatch().
 static void management_interrupt(interrupt_t *interrupt, void *data) {
     check_irqs_disabled();
 
     if(panic_in_progress) {
         die();
     }
+
+    rcu_check_callbacks();
 }
 
 void dispatch_management_interrupts() {
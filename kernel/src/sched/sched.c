@@ -8,15 +8,19 @@
 #include "bug/debug.h"
 #include "bug/panic.h"
 #include "sync/spinlock.h"
+#include "sync/semaphore.h"
+#include "sync/rcu.h"
 #include "arch/gdt.h"
 #include "arch/idt.h"
 #include "arch/pl.h"
+#include "arch/fpu.h"
 #include "mm/mm.h"
 #include "mm/cache.h"
 #include "time/clock.h"
 #include "sched/sched.h"
 #include "sched/proc.h"
 #include "sched/task.h"
+#include "sched/softirq.h"
 #include "log/log.h"
 #include "misc/stats.h"
 
@@ -24,8 +28,10 @@
 
 #define SWITCH_INT 0x81
 
-#define UFD_INVALID ((ufd_idx_t) -1)
-#define MAX_NUM_FDS MIN(((ufd_idx_t) (PAGE_SIZE / sizeof(ufd_t))), UFD_INVALID)
+//ufd tables start out this big, and double in size as needed (these must both
+//be powers of two, and multiples of 32)
+#define MIN_NUM_FDS 32
+#define MAX_NUM_FDS (1 << 16)
 
 static pid_t pid = 0;
 
@@ -50,6 +56,19 @@ static DEFINE_SPINLOCK(pgroup_lock);
 
 static DEFINE_PER_CPU(thread_t *, idle_task);
 static DEFINE_PER_CPU(uint64_t, switch_time);
+static DEFINE_PER_CPU(cpu_mask_t, pending_kicks);
+//Threads which exited on this processor, and whose stacks we might still have
+//been running on at the time. These are handed to reaperd once we have
+//switched away.
+static DEFINE_PER_CPU(list_head_t, dead_threads);
+
+static DEFINE_SPINLOCK(reap_lock);
+static DEFINE_LIST(reap_list);
+static DEFINE_SEMAPHORE(reap_semaphore, 0);
+
+//Processors which are currently running their idle thread. Must be modified
+//under sched_lock.
+static cpu_mask_t idle_procs = CPU_MASK_NONE;
 
 #define SD_NONE 0
 
@@ -67,7 +86,7 @@ typedef struct sig_descriptor {
 static struct sigaction default_sigactions[NSIG];
 static sig_descriptor_t signals[NSIG];
 
-static bool __ufdt_is_present(ufd_context_t *ufds, ufd_idx_t ufd);
+static ufd_table_t * ufd_table_alloc(uint32_t size);
 
 void sched_switch() {
     uint32_t flags;
@@ -100,48 +119,47 @@ static inline bool task_node_ensure_not_exiting(task_node_t *node) {
 
 static inline ufd_context_t * ufd_context_build() {
     ufd_context_t *ufd = kmalloc(sizeof(ufd_context_t));
-    ufd->refs = 1;
-    ufd->table = kmalloc(UFDT_PAGES * PAGE_SIZE);
-    spinlock_init(&ufd->lock);
-
-    for(ufd_idx_t i = 0; i < MAX_NUM_FDS - 1; i++) {
-        ufd->table[i].gfd = NULL;
-        ufd->table[i].flags = 0;
-    }
+    atomic_set(&ufd->refs, 1);
+    ufd->table = ufd_table_alloc(MIN_NUM_FDS);
+    ufd->next_fd = 0;
+    mutex_init(&ufd->lock);
 
     return ufd;
 }
 
+//No one else can be looking at the table by now, so it is freed immediately.
 static inline void ufd_context_destroy(ufd_context_t *ufd) {
-    for(uint32_t i = 0; i < MAX_NUM_FDS; i++) {
-        if(__ufdt_is_present(ufd, i)) {
-            gfdt_put(ufd->table[i].gfd);
+    ufd_table_t *table = ufd->table;
+    for(uint32_t i = 0; i < table->size; i++) {
+        if(table->fds[i].gfd) {
+            gfdt_put(table->fds[i].gfd);
         }
     }
 
-    kfree(ufd->table);
+    kfree(table);
     kfree(ufd);
 }
 
 static inline ufd_context_t * ufd_context_dup(ufd_context_t *src) {
     ufd_context_t *dst = kmalloc(sizeof(ufd_context_t));
-    dst->refs = 1;
-    dst->table = kmalloc(UFDT_PAGES * PAGE_SIZE);
-    spinlock_init(&dst->lock);
+    atomic_set(&dst->refs, 1);
+    mutex_init(&dst->lock);
 
-    uint32_t flags;
-    spin_lock_irqsave(&src->lock, &flags);
+    mutex_lock(&src->lock);
 
-    for(ufd_idx_t i = 0; i < MAX_NUM_FDS - 1; i++) {
-        if(__ufdt_is_present(src, i)) {
-            gfdt_get(src->table[i].gfd);
-        }
+    ufd_table_t *table = dst->table = ufd_table_alloc(src->table->size);
+    memcpy(table->fds, src->table->fds, table->size * sizeof(ufd_t));
+    memcpy(table->open_bits, src->table->open_bits, (table->size / 32) * sizeof(uint32_t));
+    memcpy(table->full_bits, src->table->full_bits, DIV_UP(table->size / 32, 32) * sizeof(uint32_t));
+    dst->next_fd = src->next_fd;
 
-        dst->table[i].gfd = src->table[i].gfd;
-        dst->table[i].flags = src->table[i].flags;
+    for(ufd_idx_t i = 0; i < table->size; i++) {
+        if(table->fds[i].gfd) {
+            gfdt_get(table->fds[i].gfd);
+        }
     }
 
-    spin_unlock_irqstore(&src->lock, flags);
+    mutex_unlock(&src->lock);
 
     return dst;
 }
@@ -151,6 +169,8 @@ static inline fs_context_t * fs_context_build() {
     fs->refs = 1;
     fs->root = MNT_ROOT(root_mount);
     fs->pwd = MNT_ROOT(root_mount);
+    path_get(&fs->root);
+    path_get(&fs->pwd);
     spinlock_init(&fs->lock);
 
     return fs;
@@ -166,6 +186,8 @@ static inline fs_context_t * fs_context_dup(fs_context_t *src) {
 
     dst->root = src->root;
     dst->pwd = src->pwd;
+    path_get(&dst->root);
+    path_get(&dst->pwd);
 
     spin_unlock_irqstore(&src->lock, flags);
 
@@ -173,6 +195,8 @@ static inline fs_context_t * fs_context_dup(fs_context_t *src) {
 }
 
 static inline void fs_context_destroy(fs_context_t *fs) {
+    path_put(&fs->root);
+    path_put(&fs->pwd);
     kfree(fs);
 }
 
@@ -195,31 +219,33 @@ static inline void put_fs_context(thread_t *t) {
     }
 }
 
+//The tasks list is walked under RCU, since pids never change.
 task_node_t * task_node_find(pid_t pid) {
-    uint32_t flags;
-    spin_lock_irqsave(&sched_lock, &flags);
+    task_node_t *found = NULL;
+
+    rcu_read_lock();
 
-    bool found = false;
     task_node_t *t;
-    LIST_FOR_EACH_ENTRY(t, &tasks, list) {
-        spin_lock(&t->lock);
+    LIST_FOR_EACH_ENTRY_RCU(t, &tasks, list) {
         if(t->pid == pid) {
-            found = true;
-        }
-        spin_unlock(&t->lock);
-
-        if(found) break;
-    }
+            uint32_t flags;
+            spin_lock_irqsave(&t->lock, &flags);
 
-    task_node_get(t);
+            //If the last ref has already been dropped, t is on its way out.
+            if(t->refs) {
+                t->refs++;
+                found = t;
+            }
 
-    spin_unlock_irqstore(&sched_lock, flags);
+            spin_unlock_irqstore(&t->lock, flags);
 
-    if(!found) {
-        return NULL;
+            break;
+        }
     }
 
-    return t;
+    rcu_read_unlock();
+
+    return found;
 }
 
 void session_create(task_node_t *t) {
@@ -373,7 +399,7 @@ static inline task_node_t * task_node_build(task_node_t *parent, char **argv,
         pgroup_create(node);
     }
 
-    list_add(&node->list, &tasks);
+    list_add_rcu(&node->list, &tasks);
 
     spin_unlock_irqstore(&sched_lock, flags);
 
@@ -457,13 +483,9 @@ static inline ufd_context_t * obtain_ufds(thread_t *t) {
 
 static inline ufd_context_t * get_ufds(thread_t *t) {
     ufd_context_t *ufd = obtain_ufds(t);
-
-    uint32_t flags;
-    spin_lock_irqsave(&ufd->lock, &flags);
     if(ufd) {
-        ufd->refs++;
+        atomic_inc(&ufd->refs);
     }
-    spin_unlock_irqstore(&ufd->lock, flags);
 
     return ufd;
 }
@@ -475,15 +497,8 @@ static inline void put_ufds(thread_t *t) {
     t->ufd = NULL;
     spin_unlock_irqstore(&t->lock, flags);
 
-    if(ufd) {
-        uint32_t flags;
-        spin_lock_irqsave(&ufd->lock, &flags);
-        uint32_t newrefs = ufd->refs--;
-        spin_unlock_irqstore(&ufd->lock, flags);
-
-        if(!newrefs) {
-            ufd_context_destroy(ufd);
-        }
+    if(ufd && atomic_dec_and_test(&ufd->refs)) {
+        ufd_context_destroy(ufd);
     }
 }
 
@@ -513,12 +528,14 @@ static inline thread_t * thread_build(task_node_t *node, ufd_context_t *ufd,
     thread_t *thread = cache_alloc(thread_cache);
     thread->state = THREAD_BUILDING;
     thread->should_die = false;
+    thread->rcu_read_depth = 0;
     sigemptyset(&thread->sig_pending);
 
     thread->node = node;
     thread->ufd = ufd;
     thread->fs = fs;
     thread->flags = THREAD_FLAG_KERNEL; //every thread starts of in kernel land
+    thread->affinity = CPU_MASK_ALL;
     thread->active = false;
     thread->kernel_stack_top = kmalloc(KERNEL_STACK_LEN);
     thread->kernel_stack_bottom = thread->kernel_stack_top + KERNEL_STACK_LEN;
@@ -532,7 +549,8 @@ static inline thread_t * thread_build(task_node_t *node, ufd_context_t *ufd,
 }
 
 void spawn_kernel_task(char *name, void (*main)(void *arg), void *arg) {
-    thread_t *child = thread_fork(current, 0, main, arg);
+    //Don't inherit the pinning of whichever kernel task asked for us.
+    thread_t *child = thread_fork(current, FORK_FLAG_ANY_PROC, main, arg);
     char **argv = kmalloc(2 * sizeof(char *));
     argv[0] = kmalloc(strlen(name) + 1);
     strcpy(argv[0], name);
@@ -548,9 +566,11 @@ thread_t * thread_fork(thread_t *t, uint32_t flags, void (*setup)(void *arg),
 
     thread_t *child = thread_build(node, ufd, fs);
     child->flags |= THREAD_FLAG_FORKED;
+    child->affinity = flags & FORK_FLAG_ANY_PROC ? CPU_MASK_ALL : t->affinity;
     pl_setup_thread(child, setup, arg);
 
     copy_mem(child, t);
+    fpu_fork(child, t);
 
     thread_schedule(child);
 
@@ -572,154 +592,287 @@ void __init root_task_init(void *umain) {
 }
 
 static void idle_loop(void *UNUSED(arg)) {
-    irqenable();
-
-    while(true) hlt();
+    while(true) {
+        //We may be hlt-ed for a long time, so report the quiescent state and
+        //run anything it raised now rather than on the next interrupt.
+        irqdisable();
+        rcu_note_qs();
+        do_softirq();
+        irqenable();
+
+        hlt();
+    }
 }
 
 thread_t * create_idle_task() {
     thread_t *idler = thread_build(idle_node, NULL, NULL);
     pl_setup_thread(idler, idle_loop, NULL);
     idler->state = THREAD_IDLE;
+    idler->affinity = cpu_mask_of(get_percpu(this_proc)->num);
     return idler;
 }
 
-//FIXME XXX we need to be getting and putting the underlying file in all of the
-//ufdt_*() functions below.
+static ufd_table_t * ufd_table_alloc(uint32_t size) {
+    uint32_t words = size / 32;
+    uint32_t full_words = DIV_UP(words, 32);
+
+    ufd_table_t *table = kmalloc(sizeof(ufd_table_t) + (size * sizeof(ufd_t))
+        + ((words + full_words) * sizeof(uint32_t)));
+    table->size = size;
+    table->fds = (void *) (table + 1);
+    table->open_bits = (void *) (table->fds + size);
+    table->full_bits = table->open_bits + words;
+
+    memset(table->fds, 0, size * sizeof(ufd_t));
+    memset(table->open_bits, 0, (words + full_words) * sizeof(uint32_t));
+
+    return table;
+}
+
+//The ufdt_*() functions which modify the table do so under ufds->lock, while
+//ufdt_get() and ufdt_valid() read it under RCU alone. A file always has a ref
+//held on it by each table it is open in, and ufdt_get() takes another.
 
-static bool __ufdt_is_present(ufd_context_t *ufds, ufd_idx_t ufd) {
-    return ufd < MAX_NUM_FDS && ufds->table[ufd].gfd;
+static inline bool __ufdt_is_present(ufd_table_t *table, ufd_idx_t ufd) {
+    return ufd < table->size && table->fds[ufd].gfd;
 }
 
-static ufd_idx_t __ufdt_find_next(ufd_context_t *ufds) {
-    for(uint32_t idx = 0; idx < MAX_NUM_FDS; idx++) {
-        if(!__ufdt_is_present(ufds, idx)) {
-            return idx;
+static inline void __ufdt_set_open(ufd_table_t *table, ufd_idx_t ufd) {
+    uint32_t word = ufd / 32;
+    table->open_bits[word] |= 1 << (ufd % 32);
+    if(table->open_bits[word] == ~0U) {
+        table->full_bits[word / 32] |= 1 << (word % 32);
+    }
+}
+
+static inline void __ufdt_clear_open(ufd_table_t *table, ufd_idx_t ufd) {
+    uint32_t word = ufd / 32;
+    table->open_bits[word] &= ~(1 << (ufd % 32));
+    table->full_bits[word / 32] &= ~(1 << (word % 32));
+}
+
+//Returns the lowest free fd at least start, or table->size if there is none.
+static ufd_idx_t __ufdt_find_next(ufd_table_t *table, ufd_idx_t start) {
+    uint32_t words = table->size / 32;
+    uint32_t word = start / 32;
+    if(word >= words) {
+        return table->size;
+    }
+
+    uint32_t free = ~table->open_bits[word] & (~0U << (start % 32));
+    if(free) {
+        return (word * 32) + __builtin_ctz(free);
+    }
+
+    //Skip over the full words of open_bits a whole word of full_bits at a time.
+    for(word++; word < words; word++) {
+        uint32_t not_full = ~table->full_bits[word / 32] & (~0U << (word % 32));
+        if(!not_full) {
+            word |= 31;
+            continue;
+        }
+
+        word = ((word / 32) * 32) + __builtin_ctz(not_full);
+        if(word >= words) {
+            break;
         }
+
+        return (word * 32) + __builtin_ctz(~table->open_bits[word]);
     }
-    return UFD_INVALID;
+
+    return table->size;
 }
 
-static int32_t __ufdt_install(ufd_context_t *ufds, ufd_idx_t idx, file_t *gfd) {
+//Grows the table until it can hold ufd, returning false if it cannot.
+static bool __ufdt_expand(ufd_context_t *ufds, ufd_idx_t ufd) {
+    ufd_table_t *old = ufds->table;
+    if(ufd < old->size) {
+        return true;
+    }
+
+    if(ufd >= MAX_NUM_FDS) {
+        return false;
+    }
+
+    uint32_t size = old->size;
+    while(size <= ufd) {
+        size *= 2;
+    }
+
+    ufd_table_t *new = ufd_table_alloc(size);
+    memcpy(new->fds, old->fds, old->size * sizeof(ufd_t));
+
+    uint32_t words = old->size / 32;
+    memcpy(new->open_bits, old->open_bits, words * sizeof(uint32_t));
+    memcpy(new->full_bits, old->full_bits, DIV_UP(words, 32) * sizeof(uint32_t));
+
+    rcu_assign_pointer(ufds->table, new);
+    kfree_rcu(old, rcu);
+
+    return true;
+}
+
+static void __ufdt_install(ufd_context_t *ufds, ufd_idx_t ufd, file_t *gfd,
+    uint32_t flags) {
+    ufd_table_t *table = ufds->table;
+
     gfdt_get(gfd);
-    ufds->table[idx].gfd = gfd;
-    ufds->table[idx].flags = 0;
+    table->fds[ufd].flags = flags;
+    rcu_assign_pointer(table->fds[ufd].gfd, gfd);
+    __ufdt_set_open(table, ufd);
+}
 
-    return 0;
+//Returns the file which was open, whose ref must be dropped once ufds->lock has
+//been released.
+static file_t * __ufdt_remove(ufd_context_t *ufds, ufd_idx_t ufd) {
+    ufd_table_t *table = ufds->table;
+    file_t *gfd = table->fds[ufd].gfd;
+
+    rcu_assign_pointer(table->fds[ufd].gfd, NULL);
+    table->fds[ufd].flags = 0;
+    __ufdt_clear_open(table, ufd);
+
+    if(ufd < ufds->next_fd) {
+        ufds->next_fd = ufd;
+    }
+
+    return gfd;
 }
 
 ufd_idx_t ufdt_add(file_t *gfd) {
+    return ufdt_add_flags(gfd, 0);
+}
+
+ufd_idx_t ufdt_add_flags(file_t *gfd, uint32_t flags) {
     ufd_context_t *ufds = obtain_ufds(current);
 
-    uint32_t f;
-    spin_lock_irqsave(&ufds->lock, &f);
+    mutex_lock(&ufds->lock);
 
-    ufd_idx_t added = __ufdt_find_next(ufds);
-    if(added != UFD_INVALID) {
-        __ufdt_install(ufds, added, gfd);
+    ufd_idx_t added = __ufdt_find_next(ufds->table, ufds->next_fd);
+    if(!__ufdt_expand(ufds, added)) {
+        added = UFD_INVALID;
+        goto out;
     }
 
-    spin_unlock_irqstore(&ufds->lock, f);
+    __ufdt_install(ufds, added, gfd, flags);
+    ufds->next_fd = added + 1;
 
-    return added;
-}
-
-static int32_t __ufdt_close(ufd_context_t *ufds, ufd_idx_t ufd) {
-    gfdt_put(ufds->table[ufd].gfd);
-    ufds->table[ufd].gfd = NULL;
-    ufds->table[ufd].flags = 0;
+out:
+    mutex_unlock(&ufds->lock);
 
-    return 0;
+    return added;
 }
 
 int32_t ufdt_close(ufd_idx_t ufd) {
-    int32_t ret = 0;
     ufd_context_t *ufds = obtain_ufds(current);
+    file_t *gfd = NULL;
 
-    uint32_t flags;
-    spin_lock_irqsave(&ufds->lock, &flags);
+    mutex_lock(&ufds->lock);
 
-    if(!__ufdt_is_present(ufds, ufd)) {
-        ret = -EBADF;
-        goto out;
+    if(__ufdt_is_present(ufds->table, ufd)) {
+        gfd = __ufdt_remove(ufds, ufd);
     }
-    ret = __ufdt_close(ufds, ufd);
 
-out:
-    spin_unlock_irqstore(&ufds->lock, flags);
-    return ret;
+    mutex_unlock(&ufds->lock);
+
+    if(!gfd) {
+        return -EBADF;
+    }
+
+    gfdt_put(gfd);
+
+    return 0;
 }
 
 //close if open, then install
 int32_t ufdt_replace(ufd_idx_t ufd, file_t *fd) {
-    int32_t ret;
+    int32_t ret = 0;
     ufd_context_t *ufds = obtain_ufds(current);
+    file_t *old = NULL;
 
-    uint32_t f;
-    spin_lock_irqsave(&ufds->lock, &f);
+    mutex_lock(&ufds->lock);
 
-    if(__ufdt_is_present(ufds, ufd)) {
-        ret = __ufdt_close(ufds, ufd);
-        if(ret) {
-            goto out;
-        }
+    if(!__ufdt_expand(ufds, ufd)) {
+        ret = -EBADF;
+        goto out;
+    }
+
+    if(__ufdt_is_present(ufds->table, ufd)) {
+        old = __ufdt_remove(ufds, ufd);
     }
 
-    ret = __ufdt_install(ufds, ufd, fd);
+    __ufdt_install(ufds, ufd, fd, 0);
 
 out:
-    spin_unlock_irqstore(&ufds->lock, f);
-    return ret;
-}
+    mutex_unlock(&ufds->lock);
 
-//FIXME this function _is_ a race!!
-bool ufdt_valid(ufd_idx_t ufd) {
-    if(ufd >= MAX_NUM_FDS) {
-        return false;
+    if(old) {
+        gfdt_put(old);
     }
 
-    ufd_context_t *ufds = obtain_ufds(current);
+    return ret;
+}
 
-    bool response;
+//Of course, ufd may be closed (or opened) as soon as this returns.
+bool ufdt_valid(ufd_idx_t ufd) {
+    ufd_context_t *ufds = current->ufd;
 
-    uint32_t flags;
-    spin_lock_irqsave(&ufds->lock, &flags);
+    rcu_read_lock();
 
-    response = !!ufds->table[ufd].gfd;
+    ufd_table_t *table = rcu_dereference(ufds->table);
+    bool response = ufd < table->size && rcu_dereference(table->fds[ufd].gfd);
 
-    spin_unlock_irqstore(&ufds->lock, flags);
+    rcu_read_unlock();
 
     return response;
 }
 
 file_t * ufdt_get(ufd_idx_t ufd) {
-    ufd_context_t *ufds = obtain_ufds(current);
-
+    //Only we ever change our own ufd, so there is no need to take our lock.
+    ufd_context_t *ufds = current->ufd;
     file_t *gfd = NULL;
 
-    uint32_t flags;
-    spin_lock_irqsave(&ufds->lock, &flags);
+    rcu_read_lock();
 
-    if(__ufdt_is_present(ufds, ufd)) {
-        gfd = ufds->table[ufd].gfd;
+    ufd_table_t *table = rcu_dereference(ufds->table);
+    if(ufd < table->size) {
+        gfd = rcu_dereference(table->fds[ufd].gfd);
 
-        //inc gfd refcnt
+        //The file may be on its way to being freed if it was closed after we
+        //found it, in which case it is as though we never did.
+        if(gfd && !gfdt_tryget(gfd)) {
+            gfd = NULL;
+        }
     }
 
-    spin_unlock_irqstore(&ufds->lock, flags);
+    rcu_read_unlock();
 
     return gfd;
 }
 
-void ufdt_put(ufd_idx_t ufd) {
+void ufdt_put(file_t *gfd) {
+    gfdt_put(gfd);
+}
+
+void ufdt_close_on_exec() {
     ufd_context_t *ufds = obtain_ufds(current);
 
-    uint32_t flags;
-    spin_lock_irqsave(&ufds->lock, &flags);
+    mutex_lock(&ufds->lock);
 
-    //FIXME dec the count of the underlying file
+    for(ufd_idx_t ufd = 0; ufd < ufds->table->size; ufd++) {
+        if(__ufdt_is_present(ufds->table, ufd)
+            && (ufds->table->fds[ufd].flags & UFD_FLAG_CLOEXEC)) {
+            file_t *gfd = __ufdt_remove(ufds, ufd);
 
-    spin_unlock_irqstore(&ufds->lock, flags);
+            //ufds->table is reread each time around, in case it grew while
+            //the lock was dropped.
+            mutex_unlock(&ufds->lock);
+            gfdt_put(gfd);
+            mutex_lock(&ufds->lock);
+        }
+    }
+
+    mutex_unlock(&ufds->lock);
 }
 
 void thread_sleep_prepare() {
@@ -736,7 +889,41 @@ void thread_sleep_prepare() {
     spin_unlock(&me->lock);
 }
 
-static void do_wake(thread_t *t) {
+//Returns the processors which must be sent a reschedule IPI once sched_lock has
+//been released. We pick at most one idle processor which t may run on, and
+//remove it from idle_procs so that a burst of wakeups does not IPI the same
+//processor over and over. If we are idle and can run t ourselves, nothing needs
+//to be sent since we will reschedule on the way out of the current interrupt.
+//Invoked under sched_lock.
+static cpu_mask_t claim_idle_proc(thread_t *t) {
+    if(!tasking_up) {
+        return CPU_MASK_NONE;
+    }
+
+    cpu_mask_t candidates = idle_procs & t->affinity;
+    if(!candidates || (candidates & cpu_mask_of(get_percpu(this_proc)->num))) {
+        return CPU_MASK_NONE;
+    }
+
+    cpu_mask_t target = candidates & -candidates;
+    idle_procs &= ~target;
+    return target;
+}
+
+static void kick_procs(cpu_mask_t mask) {
+    while(mask) {
+        uint32_t num = __builtin_ctz(mask);
+        mask &= ~cpu_mask_of(num);
+
+        send_management_interrupt(proc_get(num));
+    }
+}
+
+//Returns a mask of processors which should be passed to kick_procs() after
+//sched_lock is released.
+static cpu_mask_t do_wake(thread_t *t) {
+    cpu_mask_t kick = CPU_MASK_NONE;
+
     spin_lock(&t->lock);
 
     // XXX don't freak out if the thread is already running. For example,
@@ -752,30 +939,43 @@ static void do_wake(thread_t *t) {
 
         if(!t->active) {
             list_add(&t->queue_list, &queued_threads);
+            kick = claim_idle_proc(t);
         }
     }
 
     spin_unlock(&t->lock);
+
+    return kick;
 }
 
 void thread_wake(thread_t *t) {
     uint32_t flags;
     spin_lock_irqsave(&sched_lock, &flags);
 
-    do_wake(t);
+    cpu_mask_t kick = do_wake(t);
 
-    spin_unlock_irqstore(&sched_lock, flags);
+    spin_unlock(&sched_lock);
+
+    kick_procs(kick);
+
+    irqstore(flags);
 }
 
 void thread_poke(thread_t *t) {
+    cpu_mask_t kick = CPU_MASK_NONE;
+
     uint32_t flags;
     spin_lock_irqsave(&sched_lock, &flags);
 
     if(t->state == THREAD_SLEEPING) {
-        do_wake(t);
+        kick = do_wake(t);
     }
 
-    spin_unlock_irqstore(&sched_lock, flags);
+    spin_unlock(&sched_lock);
+
+    kick_procs(kick);
+
+    irqstore(flags);
 }
 
 void thread_schedule(thread_t *t) {
@@ -787,9 +987,83 @@ void thread_schedule(thread_t *t) {
 
     //Pretend it was sleeping
     t->state = THREAD_SLEEPING;
-    do_wake(t);
+    cpu_mask_t kick = do_wake(t);
+
+    spin_unlock(&sched_lock);
+
+    kick_procs(kick);
+
+    irqstore(flags);
+}
+
+int32_t task_node_set_affinity(task_node_t *node, cpu_mask_t mask) {
+    mask &= procs_online;
+    if(!mask) {
+        return -EINVAL;
+    }
+
+    cpu_mask_t kick = CPU_MASK_NONE;
+
+    uint32_t flags;
+    spin_lock_irqsave(&sched_lock, &flags);
+    spin_lock(&node->lock);
+
+    //Threads which are currently running somewhere they are no longer allowed
+    //to be are migrated by sched_try_resched(), while queued threads are just
+    //skipped over by processors outside of the new mask.
+    thread_t *t;
+    LIST_FOR_EACH_ENTRY(t, &node->threads, thread_list) {
+        spin_lock(&t->lock);
+
+        t->affinity = mask;
+        if(!t->active && t->state == THREAD_AWAKE) {
+            kick |= claim_idle_proc(t);
+        }
+
+        spin_unlock(&t->lock);
+    }
+
+    spin_unlock(&node->lock);
+    spin_unlock(&sched_lock);
+
+    kick_procs(kick);
 
+    irqstore(flags);
+
+    return 0;
+}
+
+//Restricts the current task to processor num, and doesn't return until we are
+//running on it.
+void sched_pin_current(uint32_t num) {
+    BUG_ON(task_node_set_affinity(current->node, cpu_mask_of(num)));
+
+    uint32_t flags;
+    irqsave(&flags);
+
+    while(get_percpu(this_proc)->num != num) {
+        sched_switch();
+    }
+
+    irqstore(flags);
+}
+
+cpu_mask_t task_node_get_affinity(task_node_t *node) {
+    cpu_mask_t mask = CPU_MASK_NONE;
+
+    uint32_t flags;
+    spin_lock_irqsave(&sched_lock, &flags);
+    spin_lock(&node->lock);
+
+    thread_t *t;
+    LIST_FOR_EACH_ENTRY(t, &node->threads, thread_list) {
+        mask |= t->affinity;
+    }
+
+    spin_unlock(&node->lock);
     spin_unlock_irqstore(&sched_lock, flags);
+
+    return mask & procs_online;
 }
 
 //Final thread cleanup will occur in the scheduler running on another stack,
@@ -879,8 +1153,24 @@ void sched_try_resched(bool is_user) {
         return;
     }
 
+    //We are nested inside a softirq which is running on this thread's stack,
+    //so we can't go anywhere until it finishes.
+    if(in_softirq()) {
+        return;
+    }
+
     thread_t *me = current;
 
+    //We cannot be switched away from inside an RCU read section.
+    if(me && me->rcu_read_depth) {
+        return;
+    }
+
+    //Being interrupted in usermode means we can't be inside a read section.
+    if(is_user) {
+        rcu_note_qs();
+    }
+
     //This is how threads get removed from circulation. Here we make sure we
     //aren't about to kill interrupted kernel code, instead of usermode code.
     //FIXME currently, this prevents kernel-mode tasks from ever exiting.
@@ -891,7 +1181,8 @@ void sched_try_resched(bool is_user) {
     }
 
     if(!me || get_percpu(switch_time) <= uptime()
-        || me->state != THREAD_AWAKE) {
+        || me->state != THREAD_AWAKE
+        || !(me->affinity & cpu_mask_of(get_percpu(this_proc)->num))) {
         sched_switch();
     }
 }
@@ -922,6 +1213,8 @@ void sched_suspend_pending_interrupt() {
 void sched_interrupt_notify() {
     check_irqs_disabled();
 
+    cpu_mask_t kick = CPU_MASK_NONE;
+
     spin_lock(&sched_lock);
 
     thread_t *t;
@@ -930,7 +1223,7 @@ void sched_interrupt_notify() {
         // by some other mechanism. do_wake gracefully deals with this case,
         // by doing nothing.
         suspended_threads--;
-        do_wake(t);
+        kick |= do_wake(t);
     }
 
     if(suspended_threads) {
@@ -940,6 +1233,8 @@ void sched_interrupt_notify() {
     list_init(&poll_threads);
 
     spin_unlock(&sched_lock);
+
+    kick_procs(kick);
 }
 
 static bool do_invoke_sigaction(cpu_state_t *state, sig_descriptor_t *sig) {
@@ -1055,8 +1350,91 @@ bool should_abort_slow_io() {
     return are_signals_pending(current);
 }
 
-void thread_destroy(thread_t *t) {
-    kfree(t);
+static void thread_free(rcu_head_t *head) {
+    cache_free(thread_cache, containerof(head, thread_t, rcu));
+}
+
+static void thread_destroy(thread_t *t) {
+    arch_thread_destroy(t);
+
+    kfree(t->kernel_stack_top);
+    call_rcu(&t->rcu, thread_free);
+}
+
+//Invoked by reaperd, in process context and with no locks held, on a thread
+//which is no longer on any processor's stack.
+static void thread_reap(thread_t *t) {
+    task_node_t *node = obtain_task_node(t);
+
+    put_fs_context(t);
+    put_ufds(t);
+    put_task_node(t);
+
+    if(t->flags & THREAD_FLAG_LAST) {
+        uint32_t flags;
+        irqsave(&flags);
+        task_node_zombify(node);
+        irqstore(flags);
+    }
+
+    thread_destroy(t);
+}
+
+static void reaperd_run(void *UNUSED(arg)) {
+    irqenable();
+
+    //Do setpgrp()
+    pgroup_rm(current->node);
+    pgroup_create(current->node);
+
+    while(true) {
+        semaphore_down(&reap_semaphore);
+
+        while(true) {
+            thread_t *t = NULL;
+
+            uint32_t flags;
+            spin_lock_irqsave(&reap_lock, &flags);
+
+            if(!list_empty(&reap_list)) {
+                t = list_first(&reap_list, thread_t, queue_list);
+                list_rm(&t->queue_list);
+            }
+
+            spin_unlock_irqstore(&reap_lock, flags);
+
+            if(!t) {
+                break;
+            }
+
+            thread_reap(t);
+        }
+    }
+}
+
+void reaperd_init() {
+    spawn_kernel_task("reaperd", reaperd_run, NULL);
+}
+
+//Hand this processor's dead threads over to reaperd. Invoked after the switch
+//away from any of them has completed, with no locks held.
+static void flush_dead_threads() {
+    check_irqs_disabled();
+
+    list_head_t *dead = &get_percpu(dead_threads);
+    if(list_empty(dead)) {
+        return;
+    }
+
+    spin_lock(&reap_lock);
+
+    while(!list_empty(dead)) {
+        list_move(dead->next, &reap_list);
+    }
+
+    spin_unlock(&reap_lock);
+
+    semaphore_up(&reap_semaphore);
 }
 
 static volatile uint32_t tasks_going = 0;
@@ -1073,6 +1451,12 @@ static void deactivate_thread(thread_t *t) {
             BUG_ON(!t->active);
             list_add(&t->queue_list, &queued_threads);
 
+            //If we are being migrated away from this processor, wake up an
+            //idle one which is allowed to run us.
+            if(!(t->affinity & cpu_mask_of(get_percpu(this_proc)->num))) {
+                get_percpu(pending_kicks) |= claim_idle_proc(t);
+            }
+
             FALLTHROUGH;
         }
         case THREAD_SLEEPING: {
@@ -1081,28 +1465,17 @@ static void deactivate_thread(thread_t *t) {
             break;
         }
         case THREAD_EXITED: {
-            //FIXME this is garbage
-
             list_rm(&t->list);
             list_rm(&t->thread_list);
+            thread_count--;
 
-            spin_unlock(&t->lock);
-            spin_lock(&t->lock);
-            spin_unlock(&t->lock);
-
-            put_fs_context(t);
-            put_ufds(t);
-            put_task_node(t);
-
+            //We are still running on t's stack, so the rest of the teardown
+            //is deferred until reaperd gets to it (see flush_dead_threads()).
             if(list_empty(&t->node->threads)) {
-                task_node_zombify(t->node);
+                t->flags |= THREAD_FLAG_LAST;
             }
 
-            spin_lock(&t->lock);
-
-            //FIXME queue the arch-(i.e. stack) desctruction of this thread
-            //processed at next sched iteration. (i.e. not on our stack which
-            //will have to be freed)
+            list_add(&t->queue_list, &get_percpu(dead_threads));
 
             break;
         }
@@ -1116,22 +1489,30 @@ static void deactivate_thread(thread_t *t) {
 
 //lock is already held for old
 static inline thread_t * lock_next_current(thread_t *old) {
+    cpu_mask_t me = cpu_mask_of(get_percpu(this_proc)->num);
+
     thread_t *t;
-    while(tasking_up && !list_empty(&queued_threads)) {
-        t = list_first(&queued_threads, thread_t, queue_list);
-        if(t != old) {
-            spin_lock(&t->lock);
-        }
-        list_rm(&t->queue_list);
+    if(tasking_up) {
+        LIST_FOR_EACH_ENTRY(t, &queued_threads, queue_list) {
+            //t->affinity is only modified under sched_lock, which we hold.
+            if(!(t->affinity & me)) {
+                continue;
+            }
 
-        switch(t->state) {
-            case THREAD_AWAKE: {
-                ACCESS_ONCE(tasks_going)++;
-                //found it (lock remains held)
-                return t;
+            if(t != old) {
+                spin_lock(&t->lock);
             }
-            default: {
-                panicf("illegal state %u", t->state);
+            list_rm(&t->queue_list);
+
+            switch(t->state) {
+                case THREAD_AWAKE: {
+                    ACCESS_ONCE(tasks_going)++;
+                    //found it (lock remains held)
+                    return t;
+                }
+                default: {
+                    panicf("illegal state %u", t->state);
+                }
             }
         }
     }
@@ -1149,6 +1530,8 @@ static void finish_sched_switch(thread_t *old, thread_t *next) {
 
     current = next;
 
+    fpu_switch(old, next);
+
     BUG_ON(old != next && next->active);
     check_on_correct_stack();
 
@@ -1157,12 +1540,27 @@ static void finish_sched_switch(thread_t *old, thread_t *next) {
 
     BUG_ON(next->state != THREAD_IDLE && next->state != THREAD_AWAKE);
 
+    cpu_mask_t me = cpu_mask_of(get_percpu(this_proc)->num);
+    if(next->state == THREAD_IDLE) {
+        idle_procs |= me;
+    } else {
+        idle_procs &= ~me;
+    }
+
     spin_unlock(&old->lock);
     if(old != next) {
         spin_unlock(&next->lock);
     }
     spin_unlock(&sched_lock);
 
+    rcu_note_qs();
+
+    cpu_mask_t kick = get_percpu(pending_kicks);
+    get_percpu(pending_kicks) = CPU_MASK_NONE;
+    kick_procs(kick);
+
+    flush_dead_threads();
+
     get_percpu(switch_time) = uptime() + QUANTUM;
 
     check_no_locks_held();
@@ -1182,6 +1580,7 @@ static void __noreturn do_sched_switch() {
 
     thread_t *old = current;
     BUG_ON(!old);
+    BUG_ON(old->rcu_read_depth);
 
     spin_lock(&old->lock);
     deactivate_thread(old);
@@ -1199,6 +1598,15 @@ void __noreturn sched_loop() {
     get_percpu(locks_held) = 0;
     list_init(&get_percpu(lock_list));
     get_percpu(switch_time) = 0;
+    get_percpu(pending_kicks) = CPU_MASK_NONE;
+    list_init(&get_percpu(dead_threads));
+
+    //The BSP may already have tasklets queued from the initcalls, and its
+    //percpu area is statically initialised anyway.
+    if(get_percpu(this_proc)->num != BSP_ID) {
+        softirq_proc_init();
+        rcu_proc_init();
+    }
 
     thread_t *idle = create_idle_task();
     get_percpu(idle_task) = idle;
@@ -0,0 +1,172 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "init/initcall.h"
+#include "bug/debug.h"
+#include "arch/proc.h"
+#include "arch/atomic.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "sched/task.h"
+#include "sched/softirq.h"
+#include "log/log.h"
+
+//Number of times we will go back and service softirqs which were raised while
+//we were running the previous batch before handing over to ksoftirqd.
+#define MAX_SOFTIRQ_RESTART 8
+
+static void (*softirq_handlers[NUM_SOFTIRQS])();
+
+static DEFINE_PER_CPU(uint32_t, softirq_pending);
+static DEFINE_PER_CPU(bool, softirq_active);
+static DEFINE_PER_CPU(tasklet_t *, tasklet_head);
+static DEFINE_PER_CPU(thread_t *, ksoftirqd);
+
+void register_softirq(uint32_t nr, void (*handler)()) {
+    BUG_ON(nr >= NUM_SOFTIRQS);
+    BUG_ON(softirq_handlers[nr]);
+
+    softirq_handlers[nr] = handler;
+}
+
+//Must be invoked with interrupts disabled.
+void raise_softirq(uint32_t nr) {
+    get_percpu(softirq_pending) |= (1 << nr);
+}
+
+bool in_softirq() {
+    return get_percpu(softirq_active);
+}
+
+void tasklet_schedule(tasklet_t *t) {
+    if(test_and_set_bit(&t->state, TASKLET_SCHEDULED)) {
+        return;
+    }
+
+    uint32_t flags;
+    irqsave(&flags);
+
+    t->next = get_percpu(tasklet_head);
+    get_percpu(tasklet_head) = t;
+    raise_softirq(SOFTIRQ_TASKLET);
+
+    irqstore(flags);
+}
+
+static void tasklet_action() {
+    irqdisable();
+    tasklet_t *list = get_percpu(tasklet_head);
+    get_percpu(tasklet_head) = NULL;
+    irqenable();
+
+    while(list) {
+        tasklet_t *t = list;
+        list = list->next;
+
+        //If t is running on another processor, put it back and try again later.
+        if(test_and_set_bit(&t->state, TASKLET_RUNNING)) {
+            irqdisable();
+            t->next = get_percpu(tasklet_head);
+            get_percpu(tasklet_head) = t;
+            raise_softirq(SOFTIRQ_TASKLET);
+            irqenable();
+
+            continue;
+        }
+
+        clear_bit(&t->state, TASKLET_SCHEDULED);
+        t->func(t->arg);
+        clear_bit(&t->state, TASKLET_RUNNING);
+    }
+}
+
+//Returns with interrupts disabled, and true if there is still work pending.
+static bool __do_softirq(uint32_t max_restart) {
+    check_irqs_disabled();
+
+    get_percpu(softirq_active) = true;
+
+    uint32_t pending;
+    while((pending = get_percpu(softirq_pending)) && max_restart--) {
+        get_percpu(softirq_pending) = 0;
+
+        irqenable();
+
+        for(uint32_t nr = 0; pending; nr++, pending >>= 1) {
+            if(pending & 1) {
+                softirq_handlers[nr]();
+            }
+        }
+
+        irqdisable();
+    }
+
+    get_percpu(softirq_active) = false;
+
+    return get_percpu(softirq_pending);
+}
+
+//Invoked with interrupts disabled and no locks held on interrupt exit.
+void do_softirq() {
+    check_irqs_disabled();
+
+    if(!get_percpu(softirq_pending) || get_percpu(softirq_active)) {
+        return;
+    }
+
+    if(__do_softirq(MAX_SOFTIRQ_RESTART)) {
+        thread_t *d = get_percpu(ksoftirqd);
+        if(d) {
+            thread_poke(d);
+        }
+    }
+}
+
+static void ksoftirqd_run(void *arg) {
+    uint32_t num = (uint32_t) arg;
+
+    //Do setpgrp()
+    pgroup_rm(current->node);
+    pgroup_create(current->node);
+
+    sched_pin_current(num);
+
+    irqdisable();
+
+    get_percpu(ksoftirqd) = current;
+
+    while(true) {
+        if(!get_percpu(softirq_pending)) {
+            thread_sleep_prepare();
+            sched_switch();
+            continue;
+        }
+
+        //Give everyone else a go between batches if we are being flooded.
+        if(__do_softirq(1)) {
+            sched_switch();
+        }
+    }
+}
+
+void softirq_proc_init() {
+    get_percpu(softirq_pending) = 0;
+    get_percpu(softirq_active) = false;
+    get_percpu(tasklet_head) = NULL;
+    get_percpu(ksoftirqd) = NULL;
+}
+
+void ksoftirqd_init() {
+    for(uint32_t num = 0; num < MAX_NUM_PROCS; num++) {
+        if(procs_online & cpu_mask_of(num)) {
+            spawn_kernel_task("ksoftirqd", ksoftirqd_run, (void *) num);
+        }
+    }
+}
+
+static INITCALL softirq_init() {
+    register_softirq(SOFTIRQ_TASKLET, tasklet_action);
+
+    return 0;
+}
+
+core_initcall(softirq_init);
@@ -1,6 +1,7 @@
 #include "common/types.h"
 #include "lib/string.h"
 #include "common/asm.h"
+#include "common/math.h"
 #include "arch/gdt.h"
 #include "arch/idt.h"
 #include "arch/pl.h"
@@ -9,13 +10,16 @@
 #include "mm/cache.h"
 #include "time/timer.h"
 #include "time/clock.h"
+#include "time/hrtimer.h"
 #include "sync/atomic.h"
 #include "sched/task.h"
 #include "sched/sched.h"
 #include "sched/syscall.h"
+#include "sched/uring.h"
 #include "net/socket.h"
 #include "fs/vfs.h"
 #include "fs/exec.h"
+#include "fs/epoll.h"
 #include "driver/console/tty.h"
 #include "log/log.h"
 #include "user/select.h"
@@ -75,6 +79,17 @@ DEFINE_SYSCALL(uptime)  {
     return uptime();
 }
 
+//Looks up pathname relative to the working directory of the caller.
+static int32_t lookup_user_path(const char *pathname, path_t *path) {
+    path_t pwd;
+    get_fs_pwd(current, &pwd);
+
+    int32_t ret = vfs_lookup(&pwd, pathname, path);
+    path_put(&pwd);
+
+    return ret;
+}
+
 DEFINE_SYSCALL(open, const char *pathname, uint32_t flags, uint32_t mode) {
     int32_t ret = 0;
 
@@ -87,20 +102,24 @@ DEFINE_SYSCALL(open, const char *pathname, uint32_t flags, uint32_t mode) {
 
     //TODO verify that path is a pointer to a valid path string, and that flags are valid flags
 
-    path_t *pwd = &obtain_fs_context(current)->pwd;
+    path_t pwd;
+    get_fs_pwd(current, &pwd);
 
     path_t path;
     if(flags & O_CREAT) {
-        ret = vfs_create(pwd, pathname, S_IFREG | mode, &path);
+        ret = vfs_create(&pwd, pathname, S_IFREG | mode, &path);
         if(ret == -EEXIST && !(flags & O_EXCL)) {
             ret = 0;
         }
     } else {
-        ret = vfs_lookup(pwd, pathname, &path);
+        ret = vfs_lookup(&pwd, pathname, &path);
     }
 
+    path_put(&pwd);
+
     if(!ret) {
         file_t *file = vfs_open_file(&path);
+        path_put(&path);
         if(!file) {
             BUG();
         }
@@ -116,7 +135,7 @@ DEFINE_SYSCALL(close, ufd_idx_t ufd) {
     file_t *file = ufdt_get(ufd);
     if(file) {
         ufdt_close(ufd);
-        ufdt_put(ufd);
+        ufdt_put(file);
 
         return 0;
     }
@@ -128,7 +147,7 @@ static void read_in_fdset(fd_set *kern, fd_set *user) {
     if(user) {
         *kern = *((fd_set *) user);
     } else {
-        FD_ZERO(&kern);
+        FD_ZERO(kern);
     }
 }
 
@@ -149,30 +168,47 @@ DEFINE_SYSCALL(select, int nfds, void *rfds, void *wfds, void *efds, struct time
     FD_ZERO(&wfds_out);
     FD_ZERO(&efds_out);
 
+    if(nfds < 0) {
+        return -EINVAL;
+    }
+
+    if(nfds > FD_SETSIZE) {
+        nfds = FD_SETSIZE;
+    }
+
     uint32_t num = 0;
     while(!num) {
-        for(uint32_t i = 0; i < (nfds < 0 ? 0 : nfds); i++) {
+        for(uint32_t i = 0; i < (uint32_t) nfds; i++) {
+            if(!FD_ISSET(i, &rfds_in) && !FD_ISSET(i, &wfds_in)
+                && !FD_ISSET(i, &efds_in)) {
+                continue;
+            }
+
             file_t *fd = ufdt_get(i);
-            if(!fd) continue;
+            if(!fd) {
+                return -EBADF;
+            }
 
             fpoll_data_t fp;
             int32_t ret = vfs_poll(fd, &fp);
+            ufdt_put(fd);
+
             if(ret < 0) {
-                panicf("poll failure! %d", ret);
+                return ret;
             }
 
             if(FD_ISSET(i, &rfds_in) && fp.readable) {
-                FD_ISSET(i, &rfds_out);
+                FD_SET(i, &rfds_out);
                 num++;
             }
 
             if(FD_ISSET(i, &wfds_in) && fp.writable) {
-                FD_ISSET(i, &wfds_out);
+                FD_SET(i, &wfds_out);
                 num++;
             }
 
             if(FD_ISSET(i, &efds_in) && fp.errored) {
-                FD_ISSET(i, &efds_out);
+                FD_SET(i, &efds_out);
                 num++;
             }
         }
@@ -194,7 +230,7 @@ DEFINE_SYSCALL(select, int nfds, void *rfds, void *wfds, void *efds, struct time
     if(wfds) *((fd_set *) wfds) = wfds_out;
     if(efds) *((fd_set *) efds) = efds_out;
 
-    return -1;
+    return num;
 }
 
 DEFINE_SYSCALL(socket, uint32_t family, uint32_t type, uint32_t protocol) {
@@ -220,9 +256,9 @@ DEFINE_SYSCALL(listen, ufd_idx_t ufd, uint32_t backlog) {
     file_t *fd = ufdt_get(ufd);
     if(fd) {
         ret = sock_listen(gfd_to_sock(fd), backlog) ? 0 : -1;
-    }
 
-    ufdt_put(ufd);
+        ufdt_put(fd);
+    }
 
     return ret;
 }
@@ -248,6 +284,8 @@ DEFINE_SYSCALL(accept, ufd_idx_t ufd, struct sockaddr *user_addr, socklen_t *len
                 *len = child->family->addr_len;
             }
         }
+
+        ufdt_put(fd);
     }
 
     return ret;
@@ -277,7 +315,7 @@ DEFINE_SYSCALL(bind, ufd_idx_t ufd, const struct sockaddr *user_addr, socklen_t
             ret = sock_bind(sock, &addr) ? 0 : -1;
         }
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -314,7 +352,7 @@ DEFINE_SYSCALL(connect, ufd_idx_t ufd, const struct sockaddr *user_addr, socklen
             }
         }
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -327,7 +365,7 @@ DEFINE_SYSCALL(shutdown, ufd_idx_t ufd, int how) {
     if(fd) {
         ret = sock_shutdown(gfd_to_sock(fd), how);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -346,7 +384,7 @@ DEFINE_SYSCALL(send, ufd_idx_t ufd, const void *user_buff, uint32_t buffsize, ui
 
         ret = sock_send(gfd_to_sock(fd), buff, buffsize, flags);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -361,13 +399,17 @@ DEFINE_SYSCALL(recv, ufd_idx_t ufd, void *user_buff, uint32_t buffsize, uint32_t
 
         ret = sock_recv(gfd_to_sock(fd), user_buff, buffsize, flags);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
 }
 
 DEFINE_SYSCALL(alloc_page, uint32_t pidx)  {
+    if(pidx >= USER_MAP_END / PAGE_SIZE) {
+        return -EINVAL;
+    }
+
     page_t *page = alloc_page(0);
     user_map_page(current, (void *) (pidx * PAGE_SIZE), page_to_phys(page));
     return 0;
@@ -404,7 +446,7 @@ DEFINE_SYSCALL(getdents, ufd_idx_t ufd, struct dirent *user_buff, uint32_t buffs
         }
         kfree(buff);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
 
         return num * sizeof(struct dirent);
     }
@@ -418,9 +460,10 @@ DEFINE_SYSCALL(stat, const char *pathname, void *buff) {
     //TODO verify that path is a pointer to a valid path string, etc.
 
     path_t path;
-    int32_t ret = vfs_lookup(&obtain_fs_context(current)->pwd, pathname, &path);
+    int32_t ret = lookup_user_path(pathname, &path);
     if(!ret) {
         vfs_getattr(path.dentry, buff);
+        path_put(&path);
     }
 
     return ret;
@@ -430,9 +473,10 @@ DEFINE_SYSCALL(lstat, const char *pathname, void *buff)  {
     //TODO verify that path is a pointer to a valid path string, etc.
 
     path_t path;
-    int32_t ret = vfs_lookup(&obtain_fs_context(current)->pwd, pathname, &path);
+    int32_t ret = lookup_user_path(pathname, &path);
     if(!ret) {
         vfs_getattr(path.dentry, buff);
+        path_put(&path);
     }
 
     return ret;
@@ -448,7 +492,7 @@ DEFINE_SYSCALL(fstat, ufd_idx_t ufd, void *buff) {
         vfs_getattr(fd->path.dentry, buff);
         ret = 0;
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -463,7 +507,7 @@ DEFINE_SYSCALL(read, ufd_idx_t ufd, void *user_buff, uint32_t len) {
 
         ret = vfs_read(fd, user_buff, len);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -478,7 +522,99 @@ DEFINE_SYSCALL(write, ufd_idx_t ufd, const void *buff, uint32_t len) {
 
         ret = vfs_write(fd, buff, len);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
+    }
+
+    return ret;
+}
+
+DEFINE_SYSCALL(ring_setup, struct uring_params *params) {
+    //FIXME sanitize params ptr
+    if(!params) {
+        return -EFAULT;
+    }
+
+    file_t *file = uring_create(params);
+    if(IS_ERR(file)) {
+        return PTR_ERR(file);
+    }
+
+    //The ring points into this image's memory, so must not outlive an exec.
+    ufd_idx_t ufd = ufdt_add_flags(file, UFD_FLAG_CLOEXEC);
+    if(ufd == UFD_INVALID) {
+        gfdt_put(file);
+        return -EMFILE;
+    }
+
+    return ufd;
+}
+
+DEFINE_SYSCALL(ring_enter, ufd_idx_t ufd, uint32_t to_submit,
+    uint32_t min_complete, uint32_t flags) {
+    int32_t ret = -EBADF;
+
+    file_t *fd = ufdt_get(ufd);
+    if(fd) {
+        ret = uring_enter(state, fd, to_submit, min_complete, flags);
+
+        ufdt_put(fd);
+    }
+
+    return ret;
+}
+
+DEFINE_SYSCALL(epoll_create, int size) {
+    //size is only a hint, and is ignored
+    if(size <= 0) {
+        return -EINVAL;
+    }
+
+    file_t *file = epoll_create();
+    if(IS_ERR(file)) {
+        return PTR_ERR(file);
+    }
+
+    ufd_idx_t ufd = ufdt_add(file);
+    if(ufd == UFD_INVALID) {
+        gfdt_put(file);
+        return -EMFILE;
+    }
+
+    return ufd;
+}
+
+DEFINE_SYSCALL(epoll_ctl, ufd_idx_t epfd, int op, ufd_idx_t ufd, struct epoll_event *event) {
+    //FIXME sanitize event ptr
+    if(op != EPOLL_CTL_DEL && !event) {
+        return -EFAULT;
+    }
+
+    int32_t ret = -EBADF;
+
+    file_t *ep = ufdt_get(epfd);
+    if(ep) {
+        file_t *fd = ufdt_get(ufd);
+        if(fd) {
+            ret = epoll_ctl(ep, op, fd, event);
+
+            ufdt_put(fd);
+        }
+
+        ufdt_put(ep);
+    }
+
+    return ret;
+}
+
+DEFINE_SYSCALL(epoll_wait, ufd_idx_t epfd, struct epoll_event *events, int maxevents, int timeout) {
+    //FIXME sanitize events ptr
+    int32_t ret = -EBADF;
+
+    file_t *ep = ufdt_get(epfd);
+    if(ep) {
+        ret = epoll_wait(ep, events, maxevents, timeout);
+
+        ufdt_put(ep);
     }
 
     return ret;
@@ -501,7 +637,7 @@ static int32_t do_execve(path_t *path, char *const user_argv[],
 DEFINE_SYSCALL(execve, const char *pathname, char *const user_argv[], char *const user_envp[]) {
     //FIXME sanitize pathname...
     path_t path;
-    int32_t ret = vfs_lookup(&obtain_fs_context(current)->pwd, pathname, &path);
+    int32_t ret = lookup_user_path(pathname, &path);
     if(ret) {
         return ret;
     }
@@ -514,8 +650,12 @@ DEFINE_SYSCALL(fexecve, ufd_idx_t ufd, char *const user_argv[], char *const user
 
     file_t *fd = ufdt_get(ufd);
     if(fd) {
-        ret = do_execve(&fd->path, user_argv, user_envp);
-        ufdt_put(ufd);
+        //If the exec succeeds it never returns, so drop our ref first.
+        path_t path = fd->path;
+        path_get(&path);
+        ufdt_put(fd);
+
+        ret = do_execve(&path, user_argv, user_envp);
     }
 
     return ret;
@@ -603,7 +743,8 @@ DEFINE_SYSCALL(waitpid, pid_t pid, int *stat_loc, int options) {
 }
 
 DEFINE_SYSCALL(getcwd, char *buff, size_t size) {
-    path_t pwd = obtain_fs_context(current)->pwd;
+    path_t pwd;
+    get_fs_pwd(current, &pwd);
     uint32_t path_len = 0;
 
     path_t cur = pwd;
@@ -626,6 +767,7 @@ DEFINE_SYSCALL(getcwd, char *buff, size_t size) {
 
     // + 1 for null byte
     if(size < path_len + 1) {
+        path_put(&pwd);
         return -EINVAL;
     }
     buff[path_len] = 0;
@@ -648,16 +790,28 @@ DEFINE_SYSCALL(getcwd, char *buff, size_t size) {
 
     BUG_ON(pos != 0);
 
+    path_put(&pwd);
+
     return (uint32_t) buff;
 }
 
+//Consumes the caller's reference to path.
 static int32_t do_chdir(path_t *path) {
     if(!S_ISDIR(path->dentry->inode->mode)) {
+        path_put(path);
         return -ENOTDIR;
     }
 
-    //FIXME this desperately needs to be locked
-    obtain_fs_context(current)->pwd = *path;
+    fs_context_t *fs = obtain_fs_context(current);
+
+    uint32_t flags;
+    spin_lock_irqsave(&fs->lock, &flags);
+    path_t old = fs->pwd;
+    fs->pwd = *path;
+    spin_unlock_irqstore(&fs->lock, flags);
+
+    path_put(&old);
+
     return 0;
 }
 
@@ -667,7 +821,7 @@ DEFINE_SYSCALL(chdir, const char *pathname) {
     }
 
     path_t path;
-    int32_t ret = vfs_lookup(&obtain_fs_context(current)->pwd, pathname, &path);
+    int32_t ret = lookup_user_path(pathname, &path);
     if(ret) {
         return ret;
     }
@@ -681,7 +835,11 @@ DEFINE_SYSCALL(fchdir, ufd_idx_t ufd) {
         return -EBADF;
     }
 
-    return do_chdir(&fd->path);
+    path_get(&fd->path);
+    int32_t ret = do_chdir(&fd->path);
+    ufdt_put(fd);
+
+    return ret;
 }
 
 static int32_t do_chown(path_t *path, uid_t owner, gid_t group) {
@@ -700,12 +858,15 @@ DEFINE_SYSCALL(chown, const char *pathname, uid_t owner, gid_t group) {
     }
 
     path_t path;
-    int32_t ret = vfs_lookup(&obtain_fs_context(current)->pwd, pathname, &path);
+    int32_t ret = lookup_user_path(pathname, &path);
     if(ret) {
         return ret;
     }
 
-    return do_chown(&path, owner, group);
+    ret = do_chown(&path, owner, group);
+    path_put(&path);
+
+    return ret;
 }
 
 DEFINE_SYSCALL(fchown, ufd_idx_t ufd, uid_t owner, gid_t group) {
@@ -714,7 +875,10 @@ DEFINE_SYSCALL(fchown, ufd_idx_t ufd, uid_t owner, gid_t group) {
         return -EBADF;
     }
 
-    return do_chown(&fd->path, owner, group);
+    int32_t ret = do_chown(&fd->path, owner, group);
+    ufdt_put(fd);
+
+    return ret;
 }
 
 DEFINE_SYSCALL(seek, ufd_idx_t ufd, off_t off, int whence) {
@@ -730,7 +894,7 @@ DEFINE_SYSCALL(seek, ufd_idx_t ufd, off_t off, int whence) {
 
         ret = vfs_seek(fd, off, whence);
 
-        ufdt_put(ufd);
+        ufdt_put(fd);
     }
 
     return ret;
@@ -861,6 +1025,61 @@ DEFINE_SYSCALL(setpgid, pid_t pid, pid_t pgid) {
     return 0;
 }
 
+static task_node_t * affinity_node_get(pid_t pid) {
+    if(pid == 0 || pid == current->node->pid) {
+        return NULL;
+    }
+
+    task_node_t *node = task_node_find(pid);
+    if(!node) {
+        return ERR_PTR(-ESRCH);
+    }
+
+    return node;
+}
+
+DEFINE_SYSCALL(sched_setaffinity, pid_t pid, uint32_t len, void *mask) {
+    //FIXME sanitize mask ptr
+    if(len < sizeof(cpu_mask_t)) {
+        return -EINVAL;
+    }
+
+    task_node_t *node = affinity_node_get(pid);
+    if(IS_ERR(node)) {
+        return PTR_ERR(node);
+    }
+
+    int32_t ret = task_node_set_affinity(node ? node : current->node,
+        *((cpu_mask_t *) mask));
+
+    if(node) {
+        task_node_put(node);
+    }
+
+    return ret;
+}
+
+DEFINE_SYSCALL(sched_getaffinity, pid_t pid, uint32_t len, void *mask) {
+    //FIXME sanitize mask ptr
+    if(len < sizeof(cpu_mask_t)) {
+        return -EINVAL;
+    }
+
+    task_node_t *node = affinity_node_get(pid);
+    if(IS_ERR(node)) {
+        return PTR_ERR(node);
+    }
+
+    memset(mask, 0, len);
+    *((cpu_mask_t *) mask) = task_node_get_affinity(node ? node : current->node);
+
+    if(node) {
+        task_node_put(node);
+    }
+
+    return sizeof(cpu_mask_t);
+}
+
 DEFINE_SYSCALL(tcgetpgrp, ufd_idx_t ufd) {
     //FIXME CHECK THIS IS A TTY!
 
@@ -869,7 +1088,10 @@ DEFINE_SYSCALL(tcgetpgrp, ufd_idx_t ufd) {
         return -EBADF;
     }
 
-    return tty_get_pgroup(fd)->leader->pid;
+    pid_t ret = tty_get_pgroup(fd)->leader->pid;
+    ufdt_put(fd);
+
+    return ret;
 }
 
 DEFINE_SYSCALL(tcsetpgrp, ufd_idx_t ufd, pid_t pgid) {
@@ -880,14 +1102,17 @@ DEFINE_SYSCALL(tcsetpgrp, ufd_idx_t ufd, pid_t pgid) {
         return -EBADF;
     }
 
+    int32_t ret = -EPERM;
+
     pgroup_t *pg = pgroup_find(pgid);
-    if(!pg) {
-        return -EPERM;
+    if(pg) {
+        tty_set_pgroup(fd, pg);
+        ret = 0;
     }
 
-    tty_set_pgroup(fd, pg);
+    ufdt_put(fd);
 
-    return 0;
+    return ret;
 }
 
 DEFINE_SYSCALL(dup, ufd_idx_t ufd) {
@@ -896,7 +1121,10 @@ DEFINE_SYSCALL(dup, ufd_idx_t ufd) {
         return -EBADF;
     }
 
-    return ufdt_add(fd);
+    int32_t ret = ufdt_add(fd);
+    ufdt_put(fd);
+
+    return ret;
 }
 
 DEFINE_SYSCALL(dup2, ufd_idx_t ufd, ufd_idx_t ufd2) {
@@ -905,21 +1133,47 @@ DEFINE_SYSCALL(dup2, ufd_idx_t ufd, ufd_idx_t ufd2) {
         return -EBADF;
     }
 
+    int32_t ret = ufd2;
     if(ufd != ufd2) {
-        ufdt_replace(ufd2, fd);
+        ret = ufdt_replace(ufd2, fd);
+        if(!ret) {
+            ret = ufd2;
+        }
     }
 
-    return ufd2;
+    ufdt_put(fd);
+
+    return ret;
 }
 
 DEFINE_SYSCALL(gettimeofday, struct timeval *tv) {
     //FIXME sanitize tv ptr
-    uint64_t now = uptime();
-    tv->tv_sec = now / MILLIS_PER_SEC;
-    tv->tv_usec = (now % MILLIS_PER_SEC) * MICROS_PER_MILLI;
+    uint64_t now = uptime_us();
+    tv->tv_sec = now / MICROS_PER_SEC;
+    tv->tv_usec = now % MICROS_PER_SEC;
     return 0;
 }
 
+DEFINE_SYSCALL(nanosleep, const struct timespec *req, struct timespec *rem) {
+    //FIXME sanitize req/rem ptrs
+    if(req->tv_nsec < 0 || req->tv_nsec >= NANOS_PER_MICRO * MICROS_PER_SEC) {
+        return -EINVAL;
+    }
+
+    //Round up, so that we never sleep for less than was asked.
+    uint64_t micros = req->tv_sec * MICROS_PER_SEC
+        + DIV_UP(req->tv_nsec, NANOS_PER_MICRO);
+
+    uint64_t remaining;
+    int32_t ret = usleep_interruptible(micros, &remaining);
+    if(ret && rem) {
+        rem->tv_sec = remaining / MICROS_PER_SEC;
+        rem->tv_nsec = (remaining % MICROS_PER_SEC) * NANOS_PER_MICRO;
+    }
+
+    return ret;
+}
+
 DEFINE_SYSCALL(unimplemented, char *msg, bool fatal) {
     if(fatal) {
         panicf("syscall - unimplemented: %s", msg);
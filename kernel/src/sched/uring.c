@@ -0,0 +1,260 @@
+#include "common/types.h"
+#include "common/asm.h"
+#include "common/list.h"
+#include "mm/mm.h"
+#include "sync/semaphore.h"
+#include "sched/task.h"
+#include "sched/sched.h"
+#include "sched/syscall.h"
+#include "sched/uring.h"
+#include "fs/vfs.h"
+
+//Userspace queues operations in a submission ring, and a single
+//sys_ring_enter() consumes them in a batch, posting each result to the
+//completion ring. The rings themselves live in the process' memory, so they
+//are only ever touched from a syscall made by that process.
+//
+//Operations are performed in order, and those which block (e.g. a recv on an
+//empty socket) hold up the rest of the batch. Userspace can avoid this by
+//first queueing a URING_OP_POLL, which never blocks: if the fd is not yet
+//ready the poll stays pending, and completes during a later sys_ring_enter()
+//(which can also wait for it using URING_ENTER_GETEVENTS).
+
+typedef struct uring {
+    //held for the duration of sys_ring_enter(), which may sleep
+    semaphore_t lock;
+
+    struct uring_params p;
+
+    list_head_t polls;
+} uring_t;
+
+typedef struct uring_poll {
+    list_head_t list;
+
+    ufd_idx_t fd;
+    uint32_t mask;
+    uint64_t user_data;
+} uring_poll_t;
+
+static void uring_close(file_t *file) {
+    uring_t *ring = file->private;
+
+    while(!list_empty(&ring->polls)) {
+        uring_poll_t *poll = list_first(&ring->polls, uring_poll_t, list);
+        list_rm(&poll->list);
+        kfree(poll);
+    }
+
+    kfree(ring);
+}
+
+static file_ops_t uring_ops = {
+    .close = uring_close,
+};
+
+static inline bool is_pow2(uint32_t x) {
+    return x && !(x & (x - 1));
+}
+
+file_t * uring_create(struct uring_params *params) {
+    if(!is_pow2(params->sq_entries) || params->sq_entries > URING_MAX_ENTRIES
+        || !is_pow2(params->cq_entries) || params->cq_entries > URING_MAX_ENTRIES
+        || params->cq_entries < params->sq_entries) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    //FIXME sanitize these
+    if(!params->ctrl || !params->sqes || !params->cqes) {
+        return ERR_PTR(-EFAULT);
+    }
+
+    file_t *file = file_alloc(&uring_ops);
+    if(!file) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    uring_t *ring = kmalloc(sizeof(uring_t));
+    semaphore_init(&ring->lock, 1);
+    ring->p = *params;
+    list_init(&ring->polls);
+
+    uring_ctrl_t *ctrl = ring->p.ctrl;
+    ctrl->sq_head = 0;
+    ctrl->sq_tail = 0;
+    ctrl->cq_head = 0;
+    ctrl->cq_tail = 0;
+    ctrl->cq_overflow = 0;
+
+    file->private = ring;
+
+    return file;
+}
+
+static void post_cqe(uring_t *ring, uint64_t user_data, int32_t res) {
+    uring_ctrl_t *ctrl = ring->p.ctrl;
+
+    uint32_t tail = ctrl->cq_tail;
+    if(tail - ctrl->cq_head >= ring->p.cq_entries) {
+        ctrl->cq_overflow++;
+        return;
+    }
+
+    uring_cqe_t *cqe = &ring->p.cqes[tail & (ring->p.cq_entries - 1)];
+    cqe->user_data = user_data;
+    cqe->res = res;
+    cqe->flags = 0;
+
+    //The cqe must be visible before the new tail is.
+    barrier();
+    ctrl->cq_tail = tail + 1;
+}
+
+//Returns the subset of mask which is ready, or a negative error.
+static int32_t poll_ready(ufd_idx_t ufd, uint32_t mask) {
+    file_t *file = ufdt_get(ufd);
+    if(!file) {
+        return -EBADF;
+    }
+
+    int32_t ret = -EINVAL;
+    if(file->ops->poll) {
+        fpoll_data_t fp;
+        ret = vfs_poll(file, &fp);
+        if(!ret) {
+            ret = (fp.readable ? URING_POLL_IN : 0)
+                | (fp.writable ? URING_POLL_OUT : 0)
+                | (fp.errored ? URING_POLL_ERR : 0);
+            ret &= mask | URING_POLL_ERR;
+        }
+    }
+
+    ufdt_put(file);
+
+    return ret;
+}
+
+//Returns the number of polls which completed.
+static uint32_t reap_polls(uring_t *ring) {
+    uint32_t num = 0;
+
+    list_head_t *pos = ring->polls.next;
+    while(pos != &ring->polls) {
+        uring_poll_t *poll = list_entry(pos, uring_poll_t, list);
+        pos = pos->next;
+
+        int32_t res = poll_ready(poll->fd, poll->mask);
+        if(res) {
+            post_cqe(ring, poll->user_data, res);
+            num++;
+
+            list_rm(&poll->list);
+            kfree(poll);
+        }
+    }
+
+    return num;
+}
+
+static void submit_sqe(cpu_state_t *state, uring_t *ring, uring_sqe_t *sqe) {
+    int32_t res;
+    switch(sqe->op) {
+        case URING_OP_NOP: {
+            res = 0;
+            break;
+        }
+        case URING_OP_READ: {
+            res = SYSCALL(read)(state, sqe->fd, (void *) sqe->addr, sqe->len);
+            break;
+        }
+        case URING_OP_WRITE: {
+            res = SYSCALL(write)(state, sqe->fd, (const void *) sqe->addr,
+                sqe->len);
+            break;
+        }
+        case URING_OP_SEND: {
+            res = SYSCALL(send)(state, sqe->fd, (const void *) sqe->addr,
+                sqe->len, sqe->flags);
+            break;
+        }
+        case URING_OP_RECV: {
+            res = SYSCALL(recv)(state, sqe->fd, (void *) sqe->addr, sqe->len,
+                sqe->flags);
+            break;
+        }
+        case URING_OP_ACCEPT: {
+            res = SYSCALL(accept)(state, sqe->fd, (struct sockaddr *) sqe->addr,
+                (socklen_t *) sqe->len);
+            break;
+        }
+        case URING_OP_POLL: {
+            res = poll_ready(sqe->fd, sqe->len);
+            if(!res) {
+                uring_poll_t *poll = kmalloc(sizeof(uring_poll_t));
+                poll->fd = sqe->fd;
+                poll->mask = sqe->len;
+                poll->user_data = sqe->user_data;
+                list_add_before(&poll->list, &ring->polls);
+                return;
+            }
+            break;
+        }
+        default: {
+            res = -EINVAL;
+            break;
+        }
+    }
+
+    post_cqe(ring, sqe->user_data, res);
+}
+
+int32_t uring_enter(cpu_state_t *state, file_t *file, uint32_t to_submit,
+    uint32_t min_complete, uint32_t flags) {
+    if(file->ops != &uring_ops) {
+        return -EINVAL;
+    }
+
+    uring_t *ring = file->private;
+    uring_ctrl_t *ctrl = ring->p.ctrl;
+
+    semaphore_down(&ring->lock);
+
+    int32_t ret = 0;
+    while(ret < (int32_t) to_submit) {
+        uint32_t head = ctrl->sq_head;
+        if(head == ctrl->sq_tail) {
+            break;
+        }
+
+        //Don't read the sqe until we have seen the tail which covers it, and
+        //copy it out before handing the slot back to userspace.
+        barrier();
+        uring_sqe_t sqe = ring->p.sqes[head & (ring->p.sq_entries - 1)];
+        barrier();
+        ctrl->sq_head = head + 1;
+
+        submit_sqe(state, ring, &sqe);
+        ret++;
+    }
+
+    reap_polls(ring);
+
+    if(flags & URING_ENTER_GETEVENTS) {
+        //Only pending polls can still complete, so don't wait if there are
+        //none of them.
+        while(ctrl->cq_tail - ctrl->cq_head < min_complete
+            && !list_empty(&ring->polls)) {
+            if(are_signals_pending(current)) {
+                if(!ret) ret = -EINTR;
+                break;
+            }
+
+            sched_suspend_pending_interrupt();
+            reap_polls(ring);
+        }
+    }
+
+    semaphore_up(&ring->lock);
+
+    return ret;
+}
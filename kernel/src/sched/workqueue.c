@@ -0,0 +1,281 @@
+#include "common/types.h"
+#include "common/list.h"
+#include "common/compiler.h"
+#include "init/initcall.h"
+#include "bug/debug.h"
+#include "arch/proc.h"
+#include "arch/atomic.h"
+#include "mm/cache.h"
+#include "sync/spinlock.h"
+#include "sync/semaphore.h"
+#include "time/timer.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "sched/task.h"
+#include "sched/workqueue.h"
+#include "log/log.h"
+
+struct worker_pool {
+    spinlock_t lock;
+    list_head_t queue;
+    //counts (at least) the number of items in queue
+    semaphore_t sem;
+
+    uint32_t cpu;
+    work_t *running;
+};
+
+typedef struct work_barrier {
+    work_t work;
+    semaphore_t done;
+} work_barrier_t;
+
+static worker_pool_t pools[MAX_NUM_PROCS];
+
+//Must be invoked with interrupts disabled.
+static uint32_t this_cpu() {
+    //Work can be queued from the initcalls, before we have a processor.
+    return percpu_up ? get_percpu(this_proc)->num : BSP_ID;
+}
+
+//Must be invoked with interrupts disabled, and with WORK_PENDING set by us.
+static void insert_work(worker_pool_t *pool, work_t *work, list_head_t *pos) {
+    spin_lock(&pool->lock);
+
+    work->pool = pool;
+    list_add_before(&work->list, pos);
+
+    spin_unlock(&pool->lock);
+
+    semaphore_up(&pool->sem);
+}
+
+static bool __queue_work(uint32_t cpu, work_t *work) {
+    BUG_ON(cpu >= MAX_NUM_PROCS);
+
+    if(test_and_set_bit(&work->state, WORK_PENDING)) {
+        return false;
+    }
+
+    insert_work(&pools[cpu], work, &pools[cpu].queue);
+
+    return true;
+}
+
+bool queue_work_on(uint32_t cpu, work_t *work) {
+    uint32_t flags;
+    irqsave(&flags);
+
+    bool ret = __queue_work(cpu, work);
+
+    irqstore(flags);
+
+    return ret;
+}
+
+bool queue_work(work_t *work) {
+    uint32_t flags;
+    irqsave(&flags);
+
+    bool ret = __queue_work(this_cpu(), work);
+
+    irqstore(flags);
+
+    return ret;
+}
+
+//Invoked from the timer interrupt.
+static void delayed_work_timer(delayed_work_t *dwork) {
+    worker_pool_t *pool = &pools[this_cpu()];
+    insert_work(pool, &dwork->work, &pool->queue);
+}
+
+bool queue_delayed_work(delayed_work_t *dwork, uint32_t millis) {
+    if(!millis) {
+        return queue_work(&dwork->work);
+    }
+
+    if(test_and_set_bit(&dwork->work.state, WORK_PENDING)) {
+        return false;
+    }
+
+    dwork->timer.callback = (timer_callback_t) delayed_work_timer;
+    timer_add(&dwork->timer, millis);
+
+    return true;
+}
+
+static void barrier_run(work_barrier_t *barrier) {
+    semaphore_up(&barrier->done);
+}
+
+void flush_work(work_t *work) {
+    work_barrier_t barrier;
+    work_init(&barrier.work, (void (*)(void *)) barrier_run, &barrier);
+    semaphore_init(&barrier.done, 0);
+
+    worker_pool_t *pool;
+    list_head_t *pos = NULL;
+
+    uint32_t flags;
+    irqsave(&flags);
+
+    while((pool = ACCESS_ONCE(work->pool))) {
+        spin_lock(&pool->lock);
+
+        //The work moved to another pool while we were acquiring the lock.
+        if(work->pool != pool) {
+            spin_unlock(&pool->lock);
+            continue;
+        }
+
+        //Each pool has a single worker, so the barrier runs only once
+        //everything in front of it has finished.
+        if(!list_empty(&work->list)) {
+            pos = work->list.next;
+        } else if(pool->running == work) {
+            pos = pool->queue.next;
+        }
+
+        if(pos) {
+            set_bit(&barrier.work.state, WORK_PENDING);
+            barrier.work.pool = pool;
+            list_add_before(&barrier.work.list, pos);
+        }
+
+        spin_unlock(&pool->lock);
+        break;
+    }
+
+    if(pos) {
+        semaphore_up(&pool->sem);
+    }
+
+    irqstore(flags);
+
+    if(pos) {
+        semaphore_down(&barrier.done);
+    }
+}
+
+bool cancel_work(work_t *work) {
+    bool ret = false;
+
+    worker_pool_t *pool;
+
+    uint32_t flags;
+    irqsave(&flags);
+
+    while((pool = ACCESS_ONCE(work->pool))) {
+        spin_lock(&pool->lock);
+
+        if(work->pool != pool) {
+            spin_unlock(&pool->lock);
+            continue;
+        }
+
+        if(!list_empty(&work->list)) {
+            list_rm(&work->list);
+            list_init(&work->list);
+            clear_bit(&work->state, WORK_PENDING);
+
+            ret = true;
+        }
+
+        spin_unlock(&pool->lock);
+        break;
+    }
+
+    irqstore(flags);
+
+    return ret;
+}
+
+bool cancel_work_sync(work_t *work) {
+    bool ret = cancel_work(work);
+    flush_work(work);
+    return ret;
+}
+
+bool cancel_delayed_work(delayed_work_t *dwork) {
+    //If the timer has already fired then wait for it to queue the work, so
+    //that we can dequeue it below.
+    if(timer_cancel_sync(&dwork->timer)) {
+        clear_bit(&dwork->work.state, WORK_PENDING);
+        return true;
+    }
+
+    return cancel_work(&dwork->work);
+}
+
+bool cancel_delayed_work_sync(delayed_work_t *dwork) {
+    bool ret = cancel_delayed_work(dwork);
+    flush_work(&dwork->work);
+    return ret;
+}
+
+static void worker_run(worker_pool_t *pool) {
+    //Do setpgrp()
+    pgroup_rm(current->node);
+    pgroup_create(current->node);
+
+    sched_pin_current(pool->cpu);
+
+    irqenable();
+
+    while(true) {
+        semaphore_down(&pool->sem);
+
+        work_t *work = NULL;
+
+        uint32_t flags;
+        spin_lock_irqsave(&pool->lock, &flags);
+
+        //The queue can be empty here if the work was cancelled.
+        if(!list_empty(&pool->queue)) {
+            work = list_first(&pool->queue, work_t, list);
+            list_rm(&work->list);
+            list_init(&work->list);
+
+            //The work may be requeued as soon as it starts running.
+            clear_bit(&work->state, WORK_PENDING);
+            pool->running = work;
+        }
+
+        spin_unlock_irqstore(&pool->lock, flags);
+
+        if(work) {
+            //Note that work may well be freed by func.
+            work->func(work->arg);
+
+            spin_lock_irqsave(&pool->lock, &flags);
+            pool->running = NULL;
+            spin_unlock_irqstore(&pool->lock, flags);
+        }
+    }
+}
+
+void workqueue_init() {
+    for(uint32_t num = 0; num < MAX_NUM_PROCS; num++) {
+        if(procs_online & cpu_mask_of(num)) {
+            spawn_kernel_task("kworker", (void (*)(void *)) worker_run,
+                &pools[num]);
+        }
+    }
+}
+
+static INITCALL pools_init() {
+    for(uint32_t num = 0; num < MAX_NUM_PROCS; num++) {
+        worker_pool_t *pool = &pools[num];
+
+        spinlock_init(&pool->lock);
+        list_init(&pool->queue);
+        semaphore_init(&pool->sem, 0);
+        pool->cpu = num;
+        pool->running = NULL;
+    }
+
+    return 0;
+}
+
+pure_initcall(pools_init);
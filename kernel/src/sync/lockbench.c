@@ -0,0 +1,123 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "init/param.h"
+#include "sync/atomic.h"
+#include "sync/spinlock.h"
+#include "sync/lockbench.h"
+#include "arch/proc.h"
+#include "arch/tsc.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "sched/task.h"
+#include "time/hrtimer.h"
+#include "log/log.h"
+
+#define ITERATIONS 100000
+
+static bool enabled = false;
+
+static bool lockbench_enable(char *yes) {
+    if(yes[0] == 'y' || yes[0] == 'Y') {
+        enabled = true;
+    }
+
+    return true;
+}
+
+cmdline_param("lockbench", lockbench_enable);
+
+static ticketlock_t ticket;
+static qspinlock_t queued;
+
+//the data the locks protect, which is bounced between processors too
+static volatile uint32_t shared_counter;
+
+static uint32_t num_workers;
+static atomic_t arrived;
+static volatile uint32_t finished;
+
+static uint64_t ticket_cycles;
+static uint64_t queued_cycles;
+
+//Every worker must call this the same number of times.
+static void rendezvous(uint32_t round) {
+    atomic_inc(&arrived);
+    while(((uint32_t) atomic_read(&arrived)) < round * num_workers) {
+        relax();
+    }
+}
+
+static void lockbench_worker(void *arg) {
+    uint32_t num = (uint32_t) arg;
+
+    sched_pin_current(num);
+
+    uint32_t flags;
+    irqsave(&flags);
+
+    rendezvous(1);
+
+    uint64_t start = rdtsc();
+    for(uint32_t i = 0; i < ITERATIONS; i++) {
+        ticket_spin_lock(&ticket);
+        shared_counter++;
+        ticket_spin_unlock(&ticket);
+    }
+    uint64_t ticket_time = rdtsc() - start;
+
+    rendezvous(2);
+
+    start = rdtsc();
+    for(uint32_t i = 0; i < ITERATIONS; i++) {
+        queued_spin_lock(&queued);
+        shared_counter++;
+        queued_spin_unlock(&queued);
+    }
+    uint64_t queued_time = rdtsc() - start;
+
+    //Nobody else is running the loops any more, so use the queued lock to
+    //guard the totals.
+    queued_spin_lock(&queued);
+    ticket_cycles += ticket_time;
+    queued_cycles += queued_time;
+    finished++;
+    queued_spin_unlock(&queued);
+
+    irqstore(flags);
+}
+
+void lockbench_run() {
+    if(!enabled) {
+        return;
+    }
+
+    atomic_set(&arrived, 0);
+
+    num_workers = 0;
+    for(uint32_t num = 0; num < MAX_NUM_PROCS; num++) {
+        if(procs_online & cpu_mask_of(num)) {
+            num_workers++;
+        }
+    }
+
+    kprintf("lockbench - %u processors, %u iterations each", num_workers,
+        ITERATIONS);
+
+    for(uint32_t num = 0; num < MAX_NUM_PROCS; num++) {
+        if(procs_online & cpu_mask_of(num)) {
+            spawn_kernel_task("lockbench", lockbench_worker, (void *) num);
+        }
+    }
+
+    while(ACCESS_ONCE(finished) < num_workers) {
+        usleep(10 * MICROS_PER_MILLI);
+    }
+
+    uint32_t total = num_workers * ITERATIONS;
+    kprintf("lockbench - ticket: %u cycles per acquisition",
+        (uint32_t) (ticket_cycles / total));
+    kprintf("lockbench - queued: %u cycles per acquisition",
+        (uint32_t) (queued_cycles / total));
+
+    BUG_ON(shared_counter != 2 * total);
+}
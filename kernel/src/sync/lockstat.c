@@ -0,0 +1,281 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "lib/string.h"
+#include "common/math.h"
+#include "lib/printf.h"
+#include "init/initcall.h"
+#include "sync/spinlock.h"
+#include "sync/lockstat.h"
+#include "arch/proc.h"
+#include "sched/proc.h"
+#include "fs/char.h"
+#include "bug/debug.h"
+
+#ifdef CONFIG_LOCKSTAT
+
+//Each processor records into its own table, so that recording needs no locks
+//or atomics (and so never recurses into the spinlocks it is measuring).
+//Readers merge the tables by call site, and tolerate a torn entry or two.
+
+#define TABLE_BITS 7
+#define TABLE_SIZE (1 << TABLE_BITS)
+
+//wide enough for the longest line we print
+#define LINE_LEN 128
+
+typedef struct lockstat_entry {
+    uint32_t site;
+    void *lock;
+
+    uint32_t acquisitions;
+    uint32_t contentions;
+    uint64_t wait_total;
+    uint64_t wait_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+} lockstat_entry_t;
+
+typedef struct lockstat_table {
+    //the table is stale (and must be cleared) if this is not generation
+    uint32_t generation;
+    //sites dropped because the table was full
+    uint32_t overflows;
+
+    lockstat_entry_t entries[TABLE_SIZE];
+} lockstat_table_t;
+
+static lockstat_table_t tables[MAX_NUM_PROCS];
+//Bumped to reset every table.
+static uint32_t generation = 1;
+
+static lockstat_entry_t * find_entry(lockstat_table_t *table, uint32_t site) {
+    uint32_t idx = (site * 2654435761U) >> (32 - TABLE_BITS);
+    for(uint32_t i = 0; i < TABLE_SIZE; i++) {
+        lockstat_entry_t *entry = &table->entries[(idx + i) % TABLE_SIZE];
+        if(entry->site == site) {
+            return entry;
+        }
+
+        if(!entry->site) {
+            entry->site = site;
+            return entry;
+        }
+    }
+
+    table->overflows++;
+    return NULL;
+}
+
+static lockstat_entry_t * this_entry(uint32_t site) {
+    lockstat_table_t *table = &tables[get_percpu(this_proc)->num];
+
+    uint32_t gen = ACCESS_ONCE(generation);
+    if(table->generation != gen) {
+        memset(table->entries, 0, sizeof(table->entries));
+        table->overflows = 0;
+        table->generation = gen;
+    }
+
+    return find_entry(table, site);
+}
+
+void lockstat_acquired(uint32_t site, void *lock, bool contended,
+        uint64_t waited) {
+    lockstat_entry_t *entry = this_entry(site);
+    if(!entry) {
+        return;
+    }
+
+    entry->lock = lock;
+    entry->acquisitions++;
+
+    if(contended) {
+        entry->contentions++;
+        entry->wait_total += waited;
+        if(waited > entry->wait_max) {
+            entry->wait_max = waited;
+        }
+    }
+}
+
+void lockstat_released(uint32_t site, uint64_t held) {
+    lockstat_entry_t *entry = this_entry(site);
+    if(!entry) {
+        return;
+    }
+
+    entry->hold_total += held;
+    if(held > entry->hold_max) {
+        entry->hold_max = held;
+    }
+}
+
+static DEFINE_SPINLOCK(snapshot_lock);
+
+//All guarded by snapshot_lock.
+static lockstat_table_t merged;
+static lockstat_entry_t *sorted[TABLE_SIZE];
+static char snapshot[(TABLE_SIZE + 2) * LINE_LEN];
+static uint32_t snapshot_len;
+static uint32_t snapshot_pos;
+static bool snapshot_valid;
+
+static uint32_t clamp32(uint64_t x) {
+    return x > 0xFFFFFFFF ? 0xFFFFFFFF : x;
+}
+
+static void merge_tables() {
+    memset(&merged, 0, sizeof(merged));
+
+    uint32_t gen = ACCESS_ONCE(generation);
+    for(uint32_t i = 0; i < MAX_NUM_PROCS; i++) {
+        lockstat_table_t *table = &tables[i];
+        if(ACCESS_ONCE(table->generation) != gen) {
+            continue;
+        }
+
+        merged.overflows += table->overflows;
+
+        for(uint32_t j = 0; j < TABLE_SIZE; j++) {
+            lockstat_entry_t e = table->entries[j];
+            if(!e.site) {
+                continue;
+            }
+
+            lockstat_entry_t *m = find_entry(&merged, e.site);
+            if(!m) {
+                continue;
+            }
+
+            m->lock = e.lock;
+            m->acquisitions += e.acquisitions;
+            m->contentions += e.contentions;
+            m->wait_total += e.wait_total;
+            m->wait_max = MAX(m->wait_max, e.wait_max);
+            m->hold_total += e.hold_total;
+            m->hold_max = MAX(m->hold_max, e.hold_max);
+        }
+    }
+}
+
+//Most time spent waiting first.
+static uint32_t sort_entries() {
+    uint32_t num = 0;
+    for(uint32_t i = 0; i < TABLE_SIZE; i++) {
+        lockstat_entry_t *e = &merged.entries[i];
+        if(!e->site) {
+            continue;
+        }
+
+        uint32_t j = num++;
+        while(j && sorted[j - 1]->wait_total < e->wait_total) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = e;
+    }
+
+    return num;
+}
+
+//Totals are in thousands of cycles, maxima in cycles.
+static void take_snapshot() {
+    merge_tables();
+    uint32_t num = sort_entries();
+
+    char *s = snapshot;
+    s += sprintf(s, "%-40s %-8s %10s %10s %10s %10s %10s %10s\n", "site", "lock",
+        "acq", "cont", "wait_kcyc", "wait_max", "hold_kcyc", "hold_max");
+
+    for(uint32_t i = 0; i < num; i++) {
+        lockstat_entry_t *e = sorted[i];
+
+        char name[41];
+        const elf_symbol_t *symbol = debug_lookup_symbol(e->site);
+        if(symbol) {
+            const char *sym = debug_symbol_name(symbol);
+            uint32_t len = MIN(strlen(sym), 28U);
+            memcpy(name, sym, len);
+            sprintf(name + len, "+0x%X", e->site - symbol->value);
+        } else {
+            sprintf(name, "0x%X", e->site);
+        }
+
+        s += sprintf(s, "%-40s %08X %10u %10u %10u %10u %10u %10u\n", name,
+            e->lock, e->acquisitions, e->contentions,
+            clamp32(e->wait_total / 1000), clamp32(e->wait_max),
+            clamp32(e->hold_total / 1000), clamp32(e->hold_max));
+    }
+
+    if(merged.overflows) {
+        s += sprintf(s, "(%u events at untracked sites)\n",
+            merged.overflows);
+    }
+
+    snapshot_len = s - snapshot;
+    snapshot_pos = 0;
+}
+
+//A read returns the statistics at the time of the first read, and then EOF,
+//after which the next read starts a new snapshot.
+static ssize_t lockstat_char_read(char_device_t UNUSED(*cdev), char *buff,
+        size_t len) {
+    uint32_t flags;
+    spin_lock_irqsave(&snapshot_lock, &flags);
+
+    if(!snapshot_valid) {
+        take_snapshot();
+        snapshot_valid = true;
+    } else if(snapshot_pos == snapshot_len) {
+        snapshot_valid = false;
+        len = 0;
+    }
+
+    len = MIN(len, snapshot_len - snapshot_pos);
+    memcpy(buff, snapshot + snapshot_pos, len);
+    snapshot_pos += len;
+
+    spin_unlock_irqstore(&snapshot_lock, flags);
+
+    return len;
+}
+
+//Any write resets the statistics.
+static ssize_t lockstat_char_write(char_device_t UNUSED(*cdev),
+        const char *buff, size_t len) {
+    uint32_t flags;
+    spin_lock_irqsave(&snapshot_lock, &flags);
+
+    ACCESS_ONCE(generation)++;
+    snapshot_valid = false;
+
+    spin_unlock_irqstore(&snapshot_lock, flags);
+
+    return len;
+}
+
+static ssize_t lockstat_char_poll(char_device_t *device, fpoll_data_t *fp) {
+    fp->readable = true;
+    fp->writable = true;
+    fp->errored = false;
+    return 0;
+}
+
+static char_device_ops_t lockstat_ops = {
+    .read = lockstat_char_read,
+    .write = lockstat_char_write,
+    .poll = lockstat_char_poll,
+};
+
+static INITCALL lockstat_register() {
+    char_device_t *cdev = char_device_alloc();
+    cdev->ops = &lockstat_ops;
+
+    register_char_device(cdev, "lockstat");
+
+    return 0;
+}
+
+device_initcall(lockstat_register);
+
+#endif
@@ -0,0 +1,123 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/asm.h"
+#include "common/list.h"
+#include "bug/debug.h"
+#include "arch/proc.h"
+#include "sync/atomic.h"
+#include "sync/spinlock.h"
+#include "sync/rcu.h"
+#include "sync/mutex.h"
+#include "sched/sched.h"
+#include "sched/task.h"
+
+typedef struct mutex_waiter {
+    list_head_t list;
+    thread_t *thread;
+} mutex_waiter_t;
+
+static inline void mutex_set_owner(mutex_t *lock) {
+    lock->owner = current;
+}
+
+//Spin while the owner is running on another processor, in the hope that it
+//releases the lock before we would have finished going to sleep. Returns true
+//if we managed to take the lock. We drop out of the read section between
+//checks, so that we may be preempted if this goes on for too long.
+static bool mutex_spin_on_owner(mutex_t *lock) {
+    while(true) {
+        if(atomic_cmpxchg(&lock->count, 1, 0) == 1) {
+            return true;
+        }
+
+        //thread_t structures are freed under RCU, so the owner cannot go
+        //away while we are looking at it.
+        rcu_read_lock();
+
+        thread_t *owner = lock->owner;
+        bool running = owner && ACCESS_ONCE(owner->active);
+
+        rcu_read_unlock();
+
+        //If there is no owner then either the lock was just released, in
+        //which case it has already been handed to a waiter if there were any,
+        //or the owner has not yet recorded itself. Either way, give up.
+        if(!running) {
+            return false;
+        }
+
+        relax();
+    }
+}
+
+void mutex_lock(mutex_t *lock) {
+    BUG_ON(lock->owner && lock->owner == current);
+
+    if(atomic_cmpxchg(&lock->count, 1, 0) == 1
+        || mutex_spin_on_owner(lock)) {
+        mutex_set_owner(lock);
+        return;
+    }
+
+    mutex_waiter_t waiter;
+    waiter.thread = current;
+
+    uint32_t flags;
+    spin_lock_irqsave(&lock->wait_lock, &flags);
+
+    list_add_before(&waiter.list, &lock->waiters);
+
+    //Marking the lock contended means that the owner will come and wake us,
+    //which it must do under wait_lock, so we cannot miss the wakeup.
+    while(atomic_xchg(&lock->count, -1) != 1) {
+        thread_sleep_prepare();
+
+        spin_unlock_irqstore(&lock->wait_lock, flags);
+        sched_switch();
+        spin_lock_irqsave(&lock->wait_lock, &flags);
+    }
+
+    list_rm(&waiter.list);
+
+    //We took the lock leaving it marked as contended, which is only still
+    //true if someone else is waiting.
+    if(list_empty(&lock->waiters)) {
+        atomic_set(&lock->count, 0);
+    }
+
+    mutex_set_owner(lock);
+
+    spin_unlock_irqstore(&lock->wait_lock, flags);
+}
+
+bool mutex_trylock(mutex_t *lock) {
+    if(atomic_cmpxchg(&lock->count, 1, 0) == 1) {
+        mutex_set_owner(lock);
+        return true;
+    }
+
+    return false;
+}
+
+void mutex_unlock(mutex_t *lock) {
+    BUG_ON(lock->owner != current);
+
+    lock->owner = NULL;
+
+    if(atomic_add_and_return(&lock->count, 1) == 1) {
+        return;
+    }
+
+    uint32_t flags;
+    spin_lock_irqsave(&lock->wait_lock, &flags);
+
+    //The lock may now be stolen by a spinner, but the waiter we wake will
+    //just go back to sleep if so.
+    atomic_set(&lock->count, 1);
+
+    if(!list_empty(&lock->waiters)) {
+        thread_wake(list_first(&lock->waiters, mutex_waiter_t, list)->thread);
+    }
+
+    spin_unlock_irqstore(&lock->wait_lock, flags);
+}
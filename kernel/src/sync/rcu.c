@@ -0,0 +1,230 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/asm.h"
+#include "init/initcall.h"
+#include "bug/debug.h"
+#include "arch/proc.h"
+#include "arch/atomic.h"
+#include "arch/interrupt.h"
+#include "mm/mm.h"
+#include "sync/spinlock.h"
+#include "sync/semaphore.h"
+#include "sync/rcu.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "sched/task.h"
+#include "sched/softirq.h"
+
+//Grace periods are numbered, and while one is in progress gp_completed trails
+//gp_seq by one. Both are only modified under rcu_lock.
+static DEFINE_SPINLOCK(rcu_lock);
+static volatile uint32_t gp_seq = 0;
+static volatile uint32_t gp_completed = 0;
+//the latest grace period which some processor has callbacks waiting for
+static uint32_t gp_wanted = 0;
+//processors which have callbacks waiting for a grace period to complete
+static cpu_mask_t cb_procs = CPU_MASK_NONE;
+
+//Processors which have not yet passed through a quiescent state during the
+//current grace period. Bits are cleared locklessly by their own processor.
+static volatile uint32_t qs_pending = CPU_MASK_NONE;
+
+//New callbacks are queued on cb_next, which is moved to cb_wait once the last
+//batch has been invoked, and then cb_wait is invoked once grace period
+//cb_wait_gp has completed.
+static DEFINE_PER_CPU(rcu_head_t *, cb_next);
+static DEFINE_PER_CPU(rcu_head_t *, cb_wait);
+static DEFINE_PER_CPU(uint32_t, cb_wait_gp);
+
+static inline bool gp_after_eq(uint32_t a, uint32_t b) {
+    return ((int32_t) (a - b)) >= 0;
+}
+
+void rcu_read_lock() {
+    thread_t *me = current;
+    if(me) {
+        me->rcu_read_depth++;
+    }
+
+    barrier();
+}
+
+void rcu_read_unlock() {
+    barrier();
+
+    thread_t *me = current;
+    if(me) {
+        BUG_ON(!me->rcu_read_depth);
+        me->rcu_read_depth--;
+    }
+}
+
+static void kick_procs(cpu_mask_t mask) {
+    if(!tasking_up) {
+        return;
+    }
+
+    mask &= ~cpu_mask_of(get_percpu(this_proc)->num);
+
+    while(mask) {
+        uint32_t num = __builtin_ctz(mask);
+        mask &= ~cpu_mask_of(num);
+
+        send_management_interrupt(proc_get(num));
+    }
+}
+
+//Invoked under rcu_lock, with no grace period in progress. Returns the
+//processors which should be kicked so that idle ones notice.
+static cpu_mask_t start_gp() {
+    gp_seq++;
+    qs_pending = procs_online;
+
+    return procs_online;
+}
+
+//Invoked under rcu_lock. Returns the grace period which must complete before
+//anyone who may be reading right now is guaranteed to have finished.
+static uint32_t request_gp(cpu_mask_t *kick) {
+    //If a grace period is already in progress some processors may have
+    //already passed through their quiescent states, so we need the next one.
+    uint32_t gp = gp_seq + 1;
+
+    if(gp_seq == gp_completed) {
+        *kick |= start_gp();
+    }
+
+    if(gp_after_eq(gp, gp_wanted)) {
+        gp_wanted = gp;
+    }
+
+    return gp;
+}
+
+static void rcu_invoke(rcu_head_t *head) {
+    uint32_t offset = (uint32_t) head->func;
+    if(offset < PAGE_SIZE) {
+        kfree(((void *) head) - offset);
+    } else {
+        head->func(head);
+    }
+}
+
+static void rcu_process() {
+    irqdisable();
+
+    cpu_mask_t me = cpu_mask_of(get_percpu(this_proc)->num);
+    cpu_mask_t kick = CPU_MASK_NONE;
+    rcu_head_t *done = NULL;
+
+    spin_lock(&rcu_lock);
+
+    //If we were the last processor to pass through a quiescent state, finish
+    //the grace period and let everyone waiting on it know.
+    if(gp_seq != gp_completed && !qs_pending) {
+        gp_completed = gp_seq;
+        kick |= cb_procs;
+
+        if(gp_after_eq(gp_wanted, gp_seq + 1)) {
+            kick |= start_gp();
+        }
+    }
+
+    if(get_percpu(cb_wait)
+        && gp_after_eq(gp_completed, get_percpu(cb_wait_gp))) {
+        done = get_percpu(cb_wait);
+        get_percpu(cb_wait) = NULL;
+        cb_procs &= ~me;
+    }
+
+    if(!get_percpu(cb_wait) && get_percpu(cb_next)) {
+        get_percpu(cb_wait) = get_percpu(cb_next);
+        get_percpu(cb_next) = NULL;
+        get_percpu(cb_wait_gp) = request_gp(&kick);
+        cb_procs |= me;
+    }
+
+    spin_unlock(&rcu_lock);
+
+    kick_procs(kick);
+
+    irqenable();
+
+    while(done) {
+        rcu_head_t *head = done;
+        done = head->next;
+
+        rcu_invoke(head);
+    }
+}
+
+void call_rcu(rcu_head_t *head, rcu_callback_t func) {
+    head->func = func;
+
+    uint32_t flags;
+    irqsave(&flags);
+
+    head->next = get_percpu(cb_next);
+    get_percpu(cb_next) = head;
+    raise_softirq(SOFTIRQ_RCU);
+
+    irqstore(flags);
+}
+
+typedef struct rcu_sync {
+    rcu_head_t head;
+    semaphore_t done;
+} rcu_sync_t;
+
+static void rcu_sync_callback(rcu_head_t *head) {
+    semaphore_up(&containerof(head, rcu_sync_t, head)->done);
+}
+
+void synchronize_rcu() {
+    rcu_sync_t sync;
+    semaphore_init(&sync.done, 0);
+
+    call_rcu(&sync.head, rcu_sync_callback);
+    semaphore_down(&sync.done);
+}
+
+void rcu_check_callbacks() {
+    check_irqs_disabled();
+
+    if(get_percpu(cb_wait)
+        ? gp_after_eq(ACCESS_ONCE(gp_completed), get_percpu(cb_wait_gp))
+        : !!get_percpu(cb_next)) {
+        raise_softirq(SOFTIRQ_RCU);
+    }
+}
+
+void rcu_note_qs() {
+    check_irqs_disabled();
+
+    uint32_t num = get_percpu(this_proc)->num;
+
+    if(ACCESS_ONCE(qs_pending) & cpu_mask_of(num)) {
+        clear_bit(&qs_pending, num);
+
+        //Someone has to finish off the grace period, and it might be us.
+        if(!ACCESS_ONCE(qs_pending)) {
+            raise_softirq(SOFTIRQ_RCU);
+        }
+    }
+
+    rcu_check_callbacks();
+}
+
+void rcu_proc_init() {
+    get_percpu(cb_next) = NULL;
+    get_percpu(cb_wait) = NULL;
+    get_percpu(cb_wait_gp) = 0;
+}
+
+static INITCALL rcu_init() {
+    register_softirq(SOFTIRQ_RCU, rcu_process);
+
+    return 0;
+}
+
+core_initcall(rcu_init);
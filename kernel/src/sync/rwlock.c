@@ -0,0 +1,87 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/asm.h"
+#include "bug/check.h"
+#include "sync/atomic.h"
+#include "sync/spinlock.h"
+#include "sync/rwlock.h"
+
+#define WRITER_LOCKED   0xFF
+#define WRITER_WAITING  0x100
+#define WRITER_MASK     (WRITER_LOCKED | WRITER_WAITING)
+#define READER_BIAS     0x200
+
+//A reader arriving while a writer holds or waits for the lock backs out, and
+//then waits its turn on wait_lock behind the writer.
+static void read_lock_slowpath(rwlock_t *lock) {
+    atomic_sub(&lock->cnts, READER_BIAS);
+
+    spin_lock(&lock->wait_lock);
+
+    //As the head of the queue only an active writer can be in our way, since
+    //a waiting writer would hold wait_lock.
+    atomic_add(&lock->cnts, READER_BIAS);
+    while(atomic_read(&lock->cnts) & WRITER_LOCKED) {
+        relax();
+    }
+
+    spin_unlock(&lock->wait_lock);
+}
+
+void read_lock(rwlock_t *lock) {
+    check_irqs_disabled();
+
+    int32_t cnts = atomic_add_and_return(&lock->cnts, READER_BIAS);
+    if(unlikely(cnts & WRITER_MASK)) {
+        read_lock_slowpath(lock);
+    }
+
+    barrier();
+}
+
+void read_unlock(rwlock_t *lock) {
+    check_irqs_disabled();
+
+    barrier();
+    atomic_sub(&lock->cnts, READER_BIAS);
+}
+
+static void write_lock_slowpath(rwlock_t *lock) {
+    spin_lock(&lock->wait_lock);
+
+    //Announce ourselves, which turns away any new readers.
+    while(true) {
+        int32_t cnts = atomic_read(&lock->cnts);
+        if(!(cnts & WRITER_MASK)
+            && atomic_cmpxchg(&lock->cnts, cnts, cnts | WRITER_WAITING) == cnts) {
+            break;
+        }
+
+        relax();
+    }
+
+    //Then wait for the readers which are already inside to leave.
+    while(atomic_cmpxchg(&lock->cnts, WRITER_WAITING, WRITER_LOCKED)
+        != WRITER_WAITING) {
+        relax();
+    }
+
+    spin_unlock(&lock->wait_lock);
+}
+
+void write_lock(rwlock_t *lock) {
+    check_irqs_disabled();
+
+    if(unlikely(atomic_cmpxchg(&lock->cnts, 0, WRITER_LOCKED))) {
+        write_lock_slowpath(lock);
+    }
+
+    barrier();
+}
+
+void write_unlock(rwlock_t *lock) {
+    check_irqs_disabled();
+
+    barrier();
+    atomic_sub(&lock->cnts, WRITER_LOCKED);
+}
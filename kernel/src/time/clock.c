@@ -4,11 +4,13 @@
 #include "bug/panic.h"
 #include "bug/debug.h"
 #include "time/clock.h"
+#include "time/vdso.h"
 #include "arch/idt.h"
 #include "log/log.h"
 #include "sync/spinlock.h"
+#include "sync/seqlock.h"
 
-static DEFINE_SPINLOCK(clock_lock);
+static DEFINE_SEQLOCK(clock_lock);
 static DEFINE_SPINLOCK(event_lock);
 
 static DEFINE_LIST(clocks);
@@ -17,6 +19,7 @@ static DEFINE_LIST(clock_event_listeners);
 
 static clock_t *active;
 static clock_event_source_t *active_event_source;
+static clock_event_device_t *active_event_device;
 
 static void handle_clock_event(clock_event_source_t *clock_event_source) {
     check_irqs_disabled();
@@ -37,15 +40,16 @@ static void handle_clock_nop(clock_event_source_t *clock_event_source) {
 
 void register_clock(clock_t *clock) {
     uint32_t flags;
-    spin_lock_irqsave(&clock_lock, &flags);
+    write_seqlock_irqsave(&clock_lock, &flags);
 
     if(!active || active->rating < clock->rating) {
         active = clock;
+        vdso_update_clock(active);
     }
 
     list_add(&clock->list, &clocks);
 
-    spin_unlock_irqstore(&clock_lock, flags);
+    write_sequnlock_irqstore(&clock_lock, flags);
 }
 
 void register_clock_event_source(clock_event_source_t *clock_event_source) {
@@ -62,57 +66,111 @@ void register_clock_event_source(clock_event_source_t *clock_event_source) {
     spin_unlock_irqstore(&event_lock, flags);
 }
 
-void register_clock_event_listener(clock_event_listener_t *clock_event_listener) {
+//Once there is a per-processor device, the hrtimers (and so the timer wheels)
+//are driven by it, and the shared event source and its lock fall idle.
+void register_clock_event_device(clock_event_device_t *clock_event_device) {
     uint32_t flags;
     spin_lock_irqsave(&event_lock, &flags);
 
-    list_add(&clock_event_listener->list, &clock_event_listeners);
+    if(!active_event_device
+        || active_event_device->rating < clock_event_device->rating) {
+        active_event_device = clock_event_device;
+
+        if(active_event_source) {
+            active_event_source->event = handle_clock_nop;
+        }
+
+        kprintf("clock - per-cpu events from %s", clock_event_device->name);
+    }
 
     spin_unlock_irqstore(&event_lock, flags);
 }
 
-static uint64_t _unsafe_uptime() {
-    if(active) {
-        return MILLIS_PER_SEC * active->read() / active->freq;
+bool clock_event_program(uint64_t micros) {
+    clock_event_device_t *device = ACCESS_ONCE(active_event_device);
+    if(!device) {
+        return false;
     }
 
-    return 0;
+    device->program(micros);
+
+    return true;
 }
 
-uint64_t uptime() {
+void register_clock_event_listener(clock_event_listener_t *clock_event_listener) {
     uint32_t flags;
-    spin_lock_irqsave(&clock_lock, &flags);
+    spin_lock_irqsave(&event_lock, &flags);
+
+    list_add(&clock_event_listener->list, &clock_event_listeners);
+
+    spin_unlock_irqstore(&event_lock, flags);
+}
 
-    uint64_t ret = _unsafe_uptime();
+//Readers never touch clock_lock's spinlock, and only retry in the rare event
+//that register_clock() changed the active clock underneath them. All of the
+//clock read() hooks are stateless, so it is fine to call them concurrently.
+static bool read_active(uint64_t *ticks, uint32_t *freq) {
+    uint64_t (*read)(void);
 
-    spin_unlock_irqstore(&clock_lock, flags);
+    uint32_t seq;
+    do {
+        seq = read_seqbegin(&clock_lock);
 
-    return ret;
+        clock_t *clock = ACCESS_ONCE(active);
+        if(!clock) return false;
+
+        read = clock->read;
+        *freq = clock->freq;
+    } while(read_seqretry(&clock_lock, seq));
+
+    *ticks = read();
+
+    return true;
 }
 
-void sleep(uint32_t milis) {
-    uint32_t flags;
-    spin_lock_irqsave(&clock_lock, &flags);
-
-    //fixme this sucks
-    uint64_t then = _unsafe_uptime();
-    uint64_t now = _unsafe_uptime();
-    while(now - then < milis) {
-        if(!active) {
-            panicf("sleep with active==NULL");
-        }
+static uint64_t ticks_to(uint64_t ticks, uint32_t freq, uint32_t per_sec) {
+    //Avoid overflowing ticks * per_sec.
+    return (ticks / freq) * per_sec + (ticks % freq) * per_sec / freq;
+}
+
+uint64_t uptime() {
+    uint64_t ticks;
+    uint32_t freq;
+    if(!read_active(&ticks, &freq)) {
+        return 0;
+    }
+
+    return ticks_to(ticks, freq, MILLIS_PER_SEC);
+}
 
-        now = _unsafe_uptime();
+uint64_t uptime_us() {
+    uint64_t ticks;
+    uint32_t freq;
+    if(!read_active(&ticks, &freq)) {
+        return 0;
     }
 
+    return ticks_to(ticks, freq, MICROS_PER_SEC);
+}
+
+//Calibrated against the active clock, which is the TSC whenever there is one.
+void udelay(uint32_t micros) {
+    if(!ACCESS_ONCE(active)) {
+        panicf("udelay with active==NULL");
+    }
 
-    spin_unlock_irqstore(&clock_lock, flags);
+    uint64_t then = uptime_us();
+    while(uptime_us() - then < micros) {
+        relax();
+    }
 }
 
 static INITCALL clock_init() {
     if(!active_event_source) panicf("no registered clock event source");
 
-    active_event_source->event = handle_clock_event;
+    if(!active_event_device) {
+        active_event_source->event = handle_clock_event;
+    }
 
     return 0;
 }
@@ -0,0 +1,231 @@
+#include "common/types.h"
+#include "common/list.h"
+#include "common/asm.h"
+#include "common/math.h"
+#include "bug/check.h"
+#include "init/initcall.h"
+#include "sync/spinlock.h"
+#include "arch/proc.h"
+#include "sched/proc.h"
+#include "sched/sched.h"
+#include "time/clock.h"
+#include "time/hrtimer.h"
+
+//Without anything pending we still take an interrupt this often, so that
+//each processor keeps rescheduling.
+#define IDLE_PERIOD MICROS_PER_SEC
+
+struct hrtimer_base {
+    spinlock_t lock;
+
+    //sorted by expiry
+    list_head_t timers;
+    hrtimer_t *running;
+};
+
+static hrtimer_base_t bases[MAX_NUM_PROCS];
+
+//Must be invoked with interrupts disabled.
+static hrtimer_base_t * this_base() {
+    return &bases[percpu_up ? get_percpu(this_proc)->num : BSP_ID];
+}
+
+//Must be invoked with the base lock held, on the processor owning base.
+static void reprogram(hrtimer_base_t *base) {
+    uint64_t delta = IDLE_PERIOD;
+    if(!list_empty(&base->timers)) {
+        uint64_t now = uptime_us();
+        uint64_t expires = list_first(&base->timers, hrtimer_t, list)->expires;
+        delta = expires <= now ? 1 : MIN(expires - now, IDLE_PERIOD);
+    }
+
+    clock_event_program(delta);
+}
+
+static hrtimer_base_t * lock_hrtimer_base(hrtimer_t *timer, uint32_t *flags) {
+    while(true) {
+        hrtimer_base_t *base = ACCESS_ONCE(timer->base);
+        if(!base) {
+            return NULL;
+        }
+
+        spin_lock_irqsave(&base->lock, flags);
+        if(base == timer->base) {
+            return base;
+        }
+        spin_unlock_irqstore(&base->lock, *flags);
+    }
+}
+
+static bool detach_hrtimer(hrtimer_t *timer) {
+    if(!hrtimer_pending(timer)) {
+        return false;
+    }
+
+    list_rm(&timer->list);
+    list_init(&timer->list);
+
+    return true;
+}
+
+void hrtimer_start(hrtimer_t *timer, uint64_t micros) {
+    uint32_t flags;
+    hrtimer_base_t *base = lock_hrtimer_base(timer, &flags);
+    if(base) {
+        detach_hrtimer(timer);
+        timer->base = NULL;
+        spin_unlock_irqstore(&base->lock, flags);
+    }
+
+    irqsave(&flags);
+    base = this_base();
+    spin_lock(&base->lock);
+
+    timer->base = base;
+    timer->expires = uptime_us() + micros;
+
+    list_head_t *pos = &base->timers;
+    hrtimer_t *other;
+    LIST_FOR_EACH_ENTRY(other, &base->timers, list) {
+        if(timer->expires < other->expires) {
+            pos = &other->list;
+            break;
+        }
+    }
+    list_add_before(&timer->list, pos);
+
+    if(base->timers.next == &timer->list) {
+        reprogram(base);
+    }
+
+    spin_unlock_irqstore(&base->lock, flags);
+}
+
+bool hrtimer_cancel(hrtimer_t *timer) {
+    while(true) {
+        uint32_t flags;
+        hrtimer_base_t *base = lock_hrtimer_base(timer, &flags);
+        if(!base) {
+            return false;
+        }
+
+        bool running = base->running == timer;
+        bool ret = detach_hrtimer(timer);
+
+        spin_unlock_irqstore(&base->lock, flags);
+
+        if(!running) {
+            return ret;
+        }
+
+        relax();
+    }
+}
+
+//Must be invoked with interrupts disabled.
+static void run_hrtimers(hrtimer_base_t *base) {
+    spin_lock(&base->lock);
+
+    uint64_t now = uptime_us();
+    while(!list_empty(&base->timers)) {
+        hrtimer_t *timer = list_first(&base->timers, hrtimer_t, list);
+        if(timer->expires > now) {
+            break;
+        }
+
+        detach_hrtimer(timer);
+
+        timer_callback_t callback = timer->callback;
+        void *data = timer->data;
+
+        base->running = timer;
+        spin_unlock(&base->lock);
+
+        callback(data);
+
+        spin_lock(&base->lock);
+        base->running = NULL;
+    }
+
+    spin_unlock(&base->lock);
+}
+
+void hrtimer_interrupt() {
+    check_irqs_disabled();
+
+    hrtimer_base_t *base = this_base();
+    run_hrtimers(base);
+
+    spin_lock(&base->lock);
+    reprogram(base);
+    spin_unlock(&base->lock);
+}
+
+//Without a per-processor clock event device, the shared periodic clock event
+//source expires everybody's timers instead, with 1ms resolution.
+static void hrtimer_tick(clock_event_source_t *source) {
+    for(uint32_t i = 0; i < MAX_NUM_PROCS; i++) {
+        run_hrtimers(&bases[i]);
+    }
+}
+
+static clock_event_listener_t clock_listener = {
+    .handle = hrtimer_tick
+};
+
+static void sleep_callback(thread_t *thread) {
+    thread_poke(thread);
+}
+
+int32_t usleep_interruptible(uint64_t micros, uint64_t *remaining) {
+    uint64_t until = uptime_us() + micros;
+
+    hrtimer_t timer;
+    hrtimer_init(&timer, (timer_callback_t) sleep_callback, current);
+
+    int32_t ret = 0;
+
+    uint32_t flags;
+    irqsave(&flags);
+
+    uint64_t now;
+    while((now = uptime_us()) < until) {
+        if(remaining && are_signals_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+
+        thread_sleep_prepare();
+        hrtimer_start(&timer, until - now);
+        sched_switch();
+    }
+
+    irqstore(flags);
+
+    hrtimer_cancel(&timer);
+
+    if(remaining) {
+        *remaining = now < until ? until - now : 0;
+    }
+
+    return ret;
+}
+
+void usleep(uint64_t micros) {
+    usleep_interruptible(micros, NULL);
+}
+
+static INITCALL hrtimer_init_bases() {
+    for(uint32_t i = 0; i < MAX_NUM_PROCS; i++) {
+        spinlock_init(&bases[i].lock);
+        list_init(&bases[i].timers);
+        bases[i].running = NULL;
+    }
+
+    register_clock_event_listener(&clock_listener);
+
+    return 0;
+}
+
+//timer_add() starts the wheel ticks, and may be called from core_initcalls.
+pure_initcall(hrtimer_init_bases);
@@ -1,102 +1,304 @@
 #include "common/list.h"
+#include "common/asm.h"
+#include "init/initcall.h"
 #include "sync/spinlock.h"
 #include "arch/cpu.h"
+#include "arch/proc.h"
+#include "sched/proc.h"
 #include "time/timer.h"
 #include "time/clock.h"
+#include "time/hrtimer.h"
 #include "mm/cache.h"
 
-typedef struct timer {
-    list_head_t list;
+//Each processor has a hierarchical timing wheel with a resolution of 1ms.
+//Timers due in the next TV1_SIZE milliseconds hash straight into the first
+//level, and later timers go into one of the coarser levels, whose slots are
+//cascaded down into the levels below each time the one below wraps. This
+//makes adding and cancelling a timer O(1), no matter how many are pending.
+
+#define TV1_BITS 8
+#define TVN_BITS 6
+#define TV1_SIZE (1 << TV1_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TV1_MASK (TV1_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+
+//Enough levels to cover all 32 bits of expires.
+#define NUM_TVN 4
+
+#define TVN_INDEX(clk, n) (((clk) >> (TV1_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+//timer was allocated by timer_create(), and is freed once it has fired
+#define TIMER_FLAG_ALLOCATED (1 << 0)
+
+struct timer_base {
+    spinlock_t lock;
 
-    uint32_t delta;
-    timer_callback_t callback;
-    void *data;
-} timer_t;
+    //the next millisecond to be processed
+    uint32_t clk;
+    uint32_t num_pending;
+    timer_t *running;
+
+    //Drives the wheel every millisecond while it has timers pending, from
+    //the owning processor's clock event device.
+    hrtimer_t tick;
+
+    list_head_t tv1[TV1_SIZE];
+    list_head_t tvn[NUM_TVN][TVN_SIZE];
+};
 
-static uint64_t last_now;
 static cache_t *timer_cache;
-static DEFINE_LIST(active_timers);
-static DEFINE_SPINLOCK(timer_lock);
+static timer_base_t bases[MAX_NUM_PROCS];
 
-void timer_create(uint32_t millis, timer_callback_t callback, void *data) {
-    timer_t *new = cache_alloc(timer_cache);
-    new->delta = millis;
-    new->callback = callback;
-    new->data = data;
+//Must be invoked with interrupts disabled.
+static timer_base_t * this_base() {
+    //Timers can be created from the initcalls, before we have a processor.
+    return &bases[percpu_up ? get_percpu(this_proc)->num : BSP_ID];
+}
 
-    uint32_t flags;
-    spin_lock_irqsave(&timer_lock, &flags);
+//Must be invoked with the base lock held.
+static void enqueue_timer(timer_base_t *base, timer_t *timer) {
+    uint32_t expires = timer->expires;
+    uint32_t idx = expires - base->clk;
 
-    if(list_empty(&active_timers)) {
-        list_add(&new->list, &active_timers);
+    list_head_t *vec;
+    if(((int32_t) idx) < 0) {
+        //Already due, so fire on the next tick.
+        vec = &base->tv1[base->clk & TV1_MASK];
+    } else if(idx < TV1_SIZE) {
+        vec = &base->tv1[expires & TV1_MASK];
     } else {
-        timer_t *timer;
-        LIST_FOR_EACH_ENTRY(timer, &active_timers, list) {
-            if(!new->delta || new->delta < timer->delta) {
-                timer->delta -= new->delta;
-                list_add_before(&new->list, &timer->list);
-                timer = NULL;
-                break;
-            }
+        uint32_t n = 0;
+        while(n < NUM_TVN - 1 && idx >= (1U << (TV1_BITS + (n + 1) * TVN_BITS))) {
+            n++;
+        }
+
+        vec = &base->tvn[n][TVN_INDEX(expires, n)];
+    }
 
-            new->delta -= timer->delta;
+    list_add_before(&timer->list, vec);
+}
+
+//Spins until the timer is on a stable base, and returns that base locked.
+static timer_base_t * lock_timer_base(timer_t *timer, uint32_t *flags) {
+    while(true) {
+        timer_base_t *base = ACCESS_ONCE(timer->base);
+        if(!base) {
+            return NULL;
         }
 
-        if(timer != NULL) {
-            list_add_before(&new->list, active_timers.prev);
+        spin_lock_irqsave(&base->lock, flags);
+        if(base == timer->base) {
+            return base;
         }
+        spin_unlock_irqstore(&base->lock, *flags);
     }
-
-    spin_unlock_irqstore(&timer_lock, flags);
 }
 
-static uint32_t decrement_timer(timer_t *timer, uint32_t ms) {
-    uint32_t diff = MIN(timer->delta, ms);
-    timer->delta -= diff;
-    return ms - diff;
+//Must be invoked with the base lock held.
+static bool detach_timer(timer_base_t *base, timer_t *timer) {
+    if(!timer_pending(timer)) {
+        return false;
+    }
+
+    list_rm(&timer->list);
+    list_init(&timer->list);
+    base->num_pending--;
+
+    return true;
 }
 
-static void time_tick(clock_event_source_t *source) {
+void timer_add(timer_t *timer, uint32_t millis) {
     uint32_t flags;
-    spin_lock_irqsave(&timer_lock, &flags);
+    timer_base_t *base = lock_timer_base(timer, &flags);
+    if(base) {
+        detach_timer(base, timer);
+
+        //Keep a running timer where it is, so that its callbacks never run
+        //concurrently on two processors.
+        if(base->running != timer) {
+            timer->base = NULL;
+            spin_unlock_irqstore(&base->lock, flags);
+            base = NULL;
+        }
+    }
+
+    if(!base) {
+        irqsave(&flags);
+        base = this_base();
+        spin_lock(&base->lock);
+        timer->base = base;
+    }
 
     uint32_t now = uptime();
-    uint32_t left = now - last_now;
-    last_now = now;
 
-    timer_t *timer;
-    LIST_FOR_EACH_ENTRY(timer, &active_timers, list) {
-        left = decrement_timer(timer, left);
-        if(timer->delta) {
-            break;
+    //An empty wheel is not ticked, so catch it up to the present first. The
+    //wheel may already have run past now, in which case it must be left where
+    //it is, or it would go back over slots it has already run.
+    if(!base->num_pending && ((int32_t) (now - base->clk)) > 0) {
+        base->clk = now;
+    }
+
+    timer->expires = now + millis;
+    enqueue_timer(base, timer);
+    base->num_pending++;
+
+    //The tick is only (re)armed under the base lock, so concurrent starts of
+    //it are serialized. If a timer is running the tick is about to rearm
+    //itself, on the processor which owns the base.
+    if(!hrtimer_pending(&base->tick) && !base->running) {
+        hrtimer_start(&base->tick, MICROS_PER_MILLI);
+    }
+
+    spin_unlock_irqstore(&base->lock, flags);
+}
+
+bool timer_cancel(timer_t *timer) {
+    uint32_t flags;
+    timer_base_t *base = lock_timer_base(timer, &flags);
+    if(!base) {
+        return false;
+    }
+
+    bool ret = detach_timer(base, timer);
+
+    spin_unlock_irqstore(&base->lock, flags);
+
+    return ret;
+}
+
+bool timer_cancel_sync(timer_t *timer) {
+    while(true) {
+        uint32_t flags;
+        timer_base_t *base = lock_timer_base(timer, &flags);
+        if(!base) {
+            return false;
         }
 
-        timer->callback(timer->data);
+        bool running = base->running == timer;
+        bool ret = detach_timer(base, timer);
+
+        spin_unlock_irqstore(&base->lock, flags);
 
-        cache_free(timer_cache, timer);
+        if(!running) {
+            return ret;
+        }
+
+        relax();
+    }
+}
+
+void timer_create(uint32_t millis, timer_callback_t callback, void *data) {
+    timer_t *new = cache_alloc(timer_cache);
+    timer_init(new, callback, data);
+    new->flags |= TIMER_FLAG_ALLOCATED;
+
+    timer_add(new, millis);
+}
+
+//Must be invoked with the base lock held.
+static void cascade(timer_base_t *base, uint32_t n, uint32_t idx) {
+    list_head_t *slot = &base->tvn[n][idx];
+    if(list_empty(slot)) {
+        return;
+    }
+
+    list_head_t list;
+    list_replace(slot, &list);
+    list_init(slot);
+
+    while(!list_empty(&list)) {
+        timer_t *timer = list_first(&list, timer_t, list);
+        list_rm(&timer->list);
+        enqueue_timer(base, timer);
     }
+}
+
+static void run_timers(timer_base_t *base, uint32_t now) {
+    spin_lock(&base->lock);
 
-    while(!list_empty(&active_timers)) {
-        timer = list_first(&active_timers, timer_t, list);
-        if(timer->delta) {
+    while(((int32_t) (now - base->clk)) >= 0) {
+        //Nothing to do, so skip straight to the present.
+        if(!base->num_pending) {
+            base->clk = now + 1;
             break;
         }
-        list_rm(&timer->list);
+
+        uint32_t idx = base->clk & TV1_MASK;
+        if(!idx) {
+            for(uint32_t n = 0; n < NUM_TVN; n++) {
+                uint32_t tvn_idx = TVN_INDEX(base->clk, n);
+                cascade(base, n, tvn_idx);
+                if(tvn_idx) {
+                    break;
+                }
+            }
+        }
+
+        base->clk++;
+
+        list_head_t *vec = &base->tv1[idx];
+        while(!list_empty(vec)) {
+            timer_t *timer = list_first(vec, timer_t, list);
+            detach_timer(base, timer);
+
+            timer_callback_t callback = timer->callback;
+            void *data = timer->data;
+            bool allocated = timer->flags & TIMER_FLAG_ALLOCATED;
+
+            base->running = timer;
+            spin_unlock(&base->lock);
+
+            callback(data);
+
+            if(allocated) {
+                cache_free(timer_cache, timer);
+            }
+
+            spin_lock(&base->lock);
+            base->running = NULL;
+        }
     }
 
-    spin_unlock_irqstore(&timer_lock, flags);
+    spin_unlock(&base->lock);
 }
 
-static clock_event_listener_t clock_listener = {
-    .handle = time_tick
-};
+static void wheel_tick(timer_base_t *base) {
+    run_timers(base, uptime());
 
-static INITCALL timer_init() {
+    spin_lock(&base->lock);
+
+    if(base->num_pending) {
+        hrtimer_start(&base->tick, MICROS_PER_MILLI);
+    }
+
+    spin_unlock(&base->lock);
+}
+
+static INITCALL timer_init_bases() {
     timer_cache = cache_create(sizeof(timer_t));
 
-    register_clock_event_listener(&clock_listener);
+    uint32_t now = uptime();
+    for(uint32_t i = 0; i < MAX_NUM_PROCS; i++) {
+        timer_base_t *base = &bases[i];
+        spinlock_init(&base->lock);
+        base->clk = now;
+        base->num_pending = 0;
+        base->running = NULL;
+        hrtimer_init(&base->tick, (timer_callback_t) wheel_tick, base);
+
+        for(uint32_t j = 0; j < TV1_SIZE; j++) {
+            list_init(&base->tv1[j]);
+        }
+
+        for(uint32_t n = 0; n < NUM_TVN; n++) {
+            for(uint32_t j = 0; j < TVN_SIZE; j++) {
+                list_init(&base->tvn[n][j]);
+            }
+        }
+    }
 
     return 0;
 }
 
-core_initcall(timer_init);
+core_initcall(timer_init_bases);
@@ -0,0 +1,36 @@
+#include "common/types.h"
+#include "common/compiler.h"
+#include "common/asm.h"
+#include "init/initcall.h"
+#include "arch/mmu.h"
+#include "time/clock.h"
+#include "time/vdso.h"
+
+//Occupies a whole page, so that nothing else is exposed to userspace.
+static union {
+    vdso_data_t data;
+    uint8_t raw[PAGE_SIZE];
+} vdso_page ALIGN(PAGE_SIZE);
+
+//Called with the clock_lock held, so there is only ever one writer.
+void vdso_update_clock(clock_t *clock) {
+    vdso_data_t *vdso = &vdso_page.data;
+
+    vdso->seq++;
+    barrier();
+
+    vdso->clock_mode = clock->vdso_mode;
+    vdso->clock_freq = clock->freq;
+    vdso->clock_offset = clock->vdso_offset;
+
+    barrier();
+    vdso->seq++;
+}
+
+static INITCALL vdso_init() {
+    map_vdso_page(&vdso_page);
+
+    return 0;
+}
+
+core_initcall(vdso_init);
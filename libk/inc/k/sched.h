@@ -0,0 +1,24 @@
+#ifndef LIBK_K_SCHED_H
+#define LIBK_K_SCHED_H
+
+#include <sys/types.h>
+#include <string.h>
+
+#include "k/types.h"
+
+#define CPU_SETSIZE 32
+
+typedef struct cpu_set {
+    uint32_t bits;
+} cpu_set_t;
+
+#define CPU_ZERO(set) memset((set), 0, sizeof(cpu_set_t))
+#define CPU_SET(cpu, set) ((set)->bits |= (1U << (cpu)))
+#define CPU_CLR(cpu, set) ((set)->bits &= ~(1U << (cpu)))
+#define CPU_ISSET(cpu, set) (!!((set)->bits & (1U << (cpu))))
+#define CPU_COUNT(set) __builtin_popcount((set)->bits)
+
+int sched_setaffinity(pid_t pid, size_t len, const cpu_set_t *mask);
+int sched_getaffinity(pid_t pid, size_t len, cpu_set_t *mask);
+
+#endif
@@ -10,5 +10,6 @@ extern void *_data_end;
 #include "syscall.h"
 
 void _msleep(uint32_t millis);
+uint64_t _uptime(); //In milliseconds
 
 #endif
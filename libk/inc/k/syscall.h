@@ -12,6 +12,8 @@
   #include <stdbool.h>
   #include "dirent.h"
   #include "sys/socket.h"
+  #include "k/uring.h"
+  #include "sys/epoll.h"
 
   #define SYSCALL_SIG(name) int32_t SYSCALL_NAME(name)
 
@@ -0,0 +1,86 @@
+#ifndef LIBK_K_URING_H
+#define LIBK_K_URING_H
+
+#include <sys/types.h>
+
+#include "k/compiler.h"
+#include "k/types.h"
+
+//Submission/completion rings, which must match the kernel's user/uring.h.
+
+#define URING_MAX_ENTRIES 4096
+
+#define URING_OP_NOP    0
+#define URING_OP_READ   1
+#define URING_OP_WRITE  2
+#define URING_OP_SEND   3
+#define URING_OP_RECV   4
+#define URING_OP_ACCEPT 5
+#define URING_OP_POLL   6
+
+#define URING_POLL_IN  (1 << 0)
+#define URING_POLL_OUT (1 << 1)
+#define URING_POLL_ERR (1 << 2)
+
+#define URING_ENTER_GETEVENTS (1 << 0)
+
+typedef struct uring_sqe {
+    uint8_t op;
+    uint8_t pad[3];
+
+    uint32_t fd;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t flags;
+
+    uint64_t user_data;
+} PACKED uring_sqe_t;
+
+typedef struct uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+} PACKED uring_cqe_t;
+
+typedef struct uring_ctrl {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    volatile uint32_t cq_overflow;
+} PACKED uring_ctrl_t;
+
+struct uring_params {
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+
+    uring_ctrl_t *ctrl;
+    uring_sqe_t *sqes;
+    uring_cqe_t *cqes;
+};
+
+typedef struct uring {
+    int fd;
+
+    struct uring_params p;
+
+    //sqes handed out by uring_get_sqe() but not yet submitted
+    uint32_t sq_queued;
+} uring_t;
+
+//entries must be a power of two, and the completion ring is made twice as
+//large as the submission ring.
+int uring_init(uring_t *ring, uint32_t entries);
+void uring_destroy(uring_t *ring);
+
+//Returns NULL if the submission ring is full.
+uring_sqe_t * uring_get_sqe(uring_t *ring);
+//Submits all queued sqes, waiting for at least wait_nr completions.
+int uring_submit(uring_t *ring, uint32_t wait_nr);
+
+//Returns NULL if there are no completions available. Each returned cqe must be
+//released with uring_cqe_seen().
+uring_cqe_t * uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+#endif
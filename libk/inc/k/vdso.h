@@ -0,0 +1,28 @@
+#ifndef LIBK_K_VDSO_H
+#define LIBK_K_VDSO_H
+
+#include <stdbool.h>
+#include "k/types.h"
+
+//The layout of the read-only page which the kernel maps at VDSO_ADDR in
+//every process, and which must match the kernel's time/vdso.h.
+
+#define VDSO_ADDR 0xBFFFF000
+
+#define VDSO_CLOCK_NONE 0
+#define VDSO_CLOCK_TSC  1
+
+typedef struct vdso_data {
+    //odd while the fields below are being updated
+    volatile uint32_t seq;
+
+    uint32_t clock_mode;
+    uint32_t clock_freq;
+    uint64_t clock_offset;
+} vdso_data_t;
+
+//Reads the kernel's clock without a syscall, returning false if the active
+//clock cannot be read from userspace.
+bool __k_vdso_clock(uint64_t *ticks, uint32_t *freq);
+
+#endif
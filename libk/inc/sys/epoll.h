@@ -0,0 +1,38 @@
+#ifndef LIBK_SYS_EPOLL_H
+#define LIBK_SYS_EPOLL_H
+
+#include <inttypes.h>
+
+#include "k/compiler.h"
+
+//These must match the kernel's user/epoll.h.
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLLIN      (1 << 0)
+#define EPOLLOUT     (1 << 2)
+#define EPOLLERR     (1 << 3)
+
+#define EPOLLONESHOT (1 << 30)
+#define EPOLLET      (1U << 31)
+
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+    uint32_t events;
+    epoll_data_t data;
+} PACKED;
+
+int epoll_create(int size);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+//timeout is in milliseconds, and if negative we wait indefinitely.
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+#endif
@@ -0,0 +1,14 @@
+#include <sys/epoll.h>
+#include <k/sys.h>
+
+int epoll_create(int size) {
+    return MAKE_SYSCALL(epoll_create, size);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    return MAKE_SYSCALL(epoll_ctl, epfd, op, fd, event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    return MAKE_SYSCALL(epoll_wait, epfd, events, maxevents, timeout);
+}
@@ -1,6 +1,15 @@
 #include <sys/time.h>
 #include <k/sys.h>
+#include <k/vdso.h>
 
 int gettimeofday(struct timeval *tv, void *tz) {
+    uint64_t ticks;
+    uint32_t freq;
+    if(__k_vdso_clock(&ticks, &freq)) {
+        tv->tv_sec = ticks / freq;
+        tv->tv_usec = (ticks % freq) * 1000000 / freq;
+        return 0;
+    }
+
     return MAKE_SYSCALL(gettimeofday, tv);
 }
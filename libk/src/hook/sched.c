@@ -0,0 +1,10 @@
+#include <k/sched.h>
+#include <k/sys.h>
+
+int sched_setaffinity(pid_t pid, size_t len, const cpu_set_t *mask) {
+    return MAKE_SYSCALL(sched_setaffinity, pid, len, (void *) mask);
+}
+
+int sched_getaffinity(pid_t pid, size_t len, cpu_set_t *mask) {
+    return MAKE_SYSCALL(sched_getaffinity, pid, len, mask);
+}
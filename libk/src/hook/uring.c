@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <k/uring.h>
+#include <k/sys.h>
+
+#define barrier() asm volatile("" ::: "memory")
+
+int uring_init(uring_t *ring, uint32_t entries) {
+    memset(ring, 0, sizeof(uring_t));
+
+    ring->p.sq_entries = entries;
+    ring->p.cq_entries = 2 * entries;
+    ring->p.ctrl = malloc(sizeof(uring_ctrl_t));
+    ring->p.sqes = malloc(ring->p.sq_entries * sizeof(uring_sqe_t));
+    ring->p.cqes = malloc(ring->p.cq_entries * sizeof(uring_cqe_t));
+
+    ring->fd = MAKE_SYSCALL(ring_setup, &ring->p);
+    if(ring->fd < 0) {
+        uring_destroy(ring);
+        return -1;
+    }
+
+    return 0;
+}
+
+void uring_destroy(uring_t *ring) {
+    if(ring->fd >= 0) {
+        close(ring->fd);
+    }
+
+    free(ring->p.ctrl);
+    free(ring->p.sqes);
+    free(ring->p.cqes);
+
+    ring->fd = -1;
+}
+
+uring_sqe_t * uring_get_sqe(uring_t *ring) {
+    uring_ctrl_t *ctrl = ring->p.ctrl;
+
+    uint32_t tail = ctrl->sq_tail + ring->sq_queued;
+    if(tail - ctrl->sq_head >= ring->p.sq_entries) {
+        return NULL;
+    }
+
+    ring->sq_queued++;
+
+    uring_sqe_t *sqe = &ring->p.sqes[tail & (ring->p.sq_entries - 1)];
+    memset(sqe, 0, sizeof(uring_sqe_t));
+    return sqe;
+}
+
+int uring_submit(uring_t *ring, uint32_t wait_nr) {
+    uint32_t queued = ring->sq_queued;
+
+    //The sqes must be visible before the new tail is.
+    barrier();
+    ring->p.ctrl->sq_tail += queued;
+    ring->sq_queued = 0;
+
+    return MAKE_SYSCALL(ring_enter, ring->fd, queued, wait_nr,
+        wait_nr ? URING_ENTER_GETEVENTS : 0);
+}
+
+uring_cqe_t * uring_peek_cqe(uring_t *ring) {
+    uring_ctrl_t *ctrl = ring->p.ctrl;
+
+    uint32_t head = ctrl->cq_head;
+    if(head == ctrl->cq_tail) {
+        return NULL;
+    }
+
+    barrier();
+    return &ring->p.cqes[head & (ring->p.cq_entries - 1)];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    barrier();
+    ring->p.ctrl->cq_head++;
+}
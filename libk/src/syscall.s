@@ -5,21 +5,46 @@
 .global perform_syscall_4
 .global perform_syscall_5
 
-perform_syscall_0:
+.extern __k_sysenter_ok
+
+# Enter the kernel through sysenter when the CPU supports it (see
+# sysenter.c), and otherwise through the slower interrupt gate.
+.macro do_syscall
+    cmpl $0, __k_sysenter_ok
+    je 1f
+
+    push %ebp
+    call __k_sysenter
+    pop %ebp
+    jmp 2f
+1:
     int $0x80
+2:
+.endm
+
+# The kernel returns to our return address, with %esp just above it, and
+# clobbers %ecx and %edx.
+.type __k_sysenter, @function
+__k_sysenter:
+    mov %esp, %ebp
+    sysenter
+.size __k_sysenter, .-__k_sysenter
+
+perform_syscall_0:
+    do_syscall
 
     ret
 
 perform_syscall_1:
     mov 4(%esp), %ecx
-    int $0x80
+    do_syscall
 
     ret
 
 perform_syscall_2:
     mov 4(%esp), %ecx
     mov 8(%esp), %edx
-    int $0x80
+    do_syscall
 
     ret
 
@@ -29,7 +54,7 @@ perform_syscall_3:
     mov 8(%esp), %ecx
     mov 12(%esp), %edx
     mov 16(%esp), %ebx
-    int $0x80
+    do_syscall
 
     pop %ebx
     ret
@@ -42,7 +67,7 @@ perform_syscall_4:
     mov 16(%esp), %edx
     mov 20(%esp), %ebx
     mov 24(%esp), %esi
-    int $0x80
+    do_syscall
 
     pop %esi
     pop %ebx
@@ -58,7 +83,7 @@ perform_syscall_5:
     mov 24(%esp), %ebx
     mov 28(%esp), %esi
     mov 32(%esp), %edi
-    int $0x80
+    do_syscall
 
     pop %edi
     pop %esi
@@ -0,0 +1,18 @@
+#include <k/sys.h>
+
+#define CPUID_EDX_SEP (1 << 11)
+
+int __k_sysenter_ok;
+
+void __k_sysenter_init() {
+    uint32_t a, b, c, d;
+    asm volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (1));
+
+    uint32_t family = (a >> 8) & 0xF;
+    uint32_t model = (a >> 4) & 0xF;
+    uint32_t stepping = a & 0xF;
+
+    //The Pentium Pro reports SEP, but doesn't actually support it.
+    __k_sysenter_ok = (d & CPUID_EDX_SEP)
+        && !(family == 6 && model < 3 && stepping < 3);
+}
@@ -1,11 +1,37 @@
+#include <time.h>
+#include <unistd.h>
 #include <k/sys.h>
+#include <k/vdso.h>
 
 void _msleep(uint32_t millis) {
     MAKE_SYSCALL(msleep, millis);
 }
 
+uint64_t _uptime() {
+    uint64_t ticks;
+    uint32_t freq;
+    if(__k_vdso_clock(&ticks, &freq)) {
+        return (ticks / freq) * 1000 + (ticks % freq) * 1000 / freq;
+    }
+
+    return (uint32_t) MAKE_SYSCALL(uptime);
+}
+
 unsigned int sleep(unsigned int seconds) {
     _msleep(seconds * 1000);
 
     return 0;
 }
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+    return MAKE_SYSCALL(nanosleep, req, rem);
+}
+
+int usleep(useconds_t micros) {
+    struct timespec req = {
+        .tv_sec = micros / 1000000,
+        .tv_nsec = (micros % 1000000) * 1000,
+    };
+
+    return nanosleep(&req, NULL);
+}
@@ -0,0 +1,30 @@
+#include <k/compiler.h>
+#include <k/vdso.h>
+
+#define barrier() asm volatile("" ::: "memory")
+
+static inline uint64_t rdtsc() {
+    uint64_t ret;
+    asm volatile("rdtsc" : "=A" (ret));
+    return ret;
+}
+
+bool __k_vdso_clock(uint64_t *ticks, uint32_t *freq) {
+    vdso_data_t *vdso = (void *) VDSO_ADDR;
+
+    uint32_t seq;
+    do {
+        seq = vdso->seq;
+        barrier();
+
+        if(seq & 1) continue;
+        if(vdso->clock_mode != VDSO_CLOCK_TSC) return false;
+
+        *ticks = rdtsc() - vdso->clock_offset;
+        *freq = vdso->clock_freq;
+
+        barrier();
+    } while((seq & 1) || seq != vdso->seq);
+
+    return true;
+}